@@ -0,0 +1,454 @@
+#pragma once
+
+#include "CrossText.hpp"
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BAKED_ATLAS_MAGIC 0x4b425458 // "XTBK" little endian
+#define BAKED_ATLAS_VERSION 1
+#define BAKED_ATLAS_ALIGNMENT 4096
+
+BEGIN_XT_NAMESPACE
+
+// File layout written by BakedAtlasWriter (usually via the xtbake tool):
+//
+//   BakedAtlasHeader
+//   BakedAtlasEntry[entryCount]   sorted by font, size and then text
+//   LineMetrics[lineCount]        referenced by entries
+//   char[]                        UTF-8 text of every entry
+//   RGBA pixels                   one texture after another, page aligned
+//
+// Every section is fixed size plain data so the file can be memory mapped
+// and used in place without parsing.
+
+struct BakedAtlasHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t textureWidth;
+	uint32_t textureHeight;
+	uint32_t textureCount;
+	uint32_t entryCount;
+	uint32_t lineCount;
+	uint32_t reserved;
+	uint64_t entriesOffset;
+	uint64_t linesOffset;
+	uint64_t textOffset;
+	uint64_t pixelsOffset;
+	uint64_t fileSize;
+};
+
+struct BakedAtlasEntry
+{
+	uint32_t font;
+	uint32_t size; // 26.6 fixed point
+	uint32_t textOffset;
+	uint32_t textLength;
+	uint32_t texture;
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+	uint32_t firstLine;
+	uint32_t lineCount;
+};
+
+struct BakedLookup
+{
+	bool isFound;
+	unsigned texture;
+	Rect rect;
+	const LineMetrics *lines;
+	unsigned lineCount;
+
+	static BakedLookup notFound()
+	{
+		return{ false, 0, { 0, 0, 0, 0 }, nullptr, 0 };
+	}
+};
+
+inline uint32_t bakedSize(float size)
+{
+	return static_cast<uint32_t>(size * 64.0f + 0.5f);
+}
+
+class BakedAtlasWriter
+{
+public:
+	BakedAtlasWriter(Size textureSize) : _textureSize(textureSize)
+	{ }
+
+	void add(
+		unsigned font,
+		float size,
+		std::string utf8Text,
+		unsigned texture,
+		Rect rect,
+		const TextBlockMetrics &metrics)
+	{
+		_entries.push_back({
+			font,
+			bakedSize(size),
+			std::move(utf8Text),
+			texture,
+			rect,
+			metrics.lines });
+	}
+
+	// Pixels are RGBA rows of the texture size, one pointer per texture.
+	bool write(std::string path, const std::vector<const uint8_t *> &textures)
+	{
+		std::stable_sort(
+			_entries.begin(),
+			_entries.end(),
+			[](const PendingEntry &a, const PendingEntry &b)
+			{
+				return compare(a.font, a.size, a.text, b) < 0;
+			});
+
+		std::vector<BakedAtlasEntry> entries;
+		std::vector<LineMetrics> lines;
+		std::string text;
+		for (unsigned i = 0; i < _entries.size(); i++)
+		{
+			auto &pending = _entries[i];
+			auto isDuplicate = i > 0 && compare(
+				pending.font,
+				pending.size,
+				pending.text,
+				_entries[i - 1]) == 0;
+			if (isDuplicate)
+			{
+				// keep the first of any duplicates
+				continue;
+			}
+
+			entries.push_back({
+				pending.font,
+				pending.size,
+				static_cast<uint32_t>(text.size()),
+				static_cast<uint32_t>(pending.text.size()),
+				pending.texture,
+				pending.rect.x,
+				pending.rect.y,
+				pending.rect.width,
+				pending.rect.height,
+				static_cast<uint32_t>(lines.size()),
+				static_cast<uint32_t>(pending.lines.size()) });
+			text += pending.text;
+			lines.insert(
+				lines.end(), pending.lines.begin(), pending.lines.end());
+		}
+
+		BakedAtlasHeader header{};
+		header.magic = BAKED_ATLAS_MAGIC;
+		header.version = BAKED_ATLAS_VERSION;
+		header.textureWidth = _textureSize.width;
+		header.textureHeight = _textureSize.height;
+		header.textureCount = static_cast<uint32_t>(textures.size());
+		header.entryCount = static_cast<uint32_t>(entries.size());
+		header.lineCount = static_cast<uint32_t>(lines.size());
+		header.entriesOffset = sizeof(BakedAtlasHeader);
+		header.linesOffset = header.entriesOffset
+			+ entries.size() * sizeof(BakedAtlasEntry);
+		header.textOffset = header.linesOffset
+			+ lines.size() * sizeof(LineMetrics);
+		header.pixelsOffset = align(header.textOffset + text.size());
+		header.fileSize = header.pixelsOffset
+			+ textures.size() * textureBytes();
+
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		if (!out)
+		{
+			std::cout << "failed to open '" << path << "'" << std::endl;
+			return false;
+		}
+
+		writeBinary(out, header);
+		out.write(
+			reinterpret_cast<const char *>(entries.data()),
+			entries.size() * sizeof(BakedAtlasEntry));
+		out.write(
+			reinterpret_cast<const char *>(lines.data()),
+			lines.size() * sizeof(LineMetrics));
+		out.write(text.data(), text.size());
+
+		std::vector<char> padding(
+			header.pixelsOffset - header.textOffset - text.size(), 0);
+		out.write(padding.data(), padding.size());
+
+		for (auto pixels : textures)
+		{
+			out.write(reinterpret_cast<const char *>(pixels), textureBytes());
+		}
+
+		return out.good();
+	}
+
+private:
+	struct PendingEntry
+	{
+		uint32_t font;
+		uint32_t size;
+		std::string text;
+		uint32_t texture;
+		Rect rect;
+		std::vector<LineMetrics> lines;
+	};
+
+	static int compare(
+		uint32_t font,
+		uint32_t size,
+		const std::string &text,
+		const PendingEntry &entry)
+	{
+		if (font != entry.font)
+			return font < entry.font ? -1 : 1;
+		if (size != entry.size)
+			return size < entry.size ? -1 : 1;
+		return text.compare(entry.text);
+	}
+
+	static uint64_t align(uint64_t offset)
+	{
+		return (offset + BAKED_ATLAS_ALIGNMENT - 1)
+			/ BAKED_ATLAS_ALIGNMENT * BAKED_ATLAS_ALIGNMENT;
+	}
+
+	size_t textureBytes() const
+	{
+		return static_cast<size_t>(_textureSize.width)
+			* _textureSize.height * 4;
+	}
+
+	Size _textureSize;
+	std::vector<PendingEntry> _entries;
+};
+
+// Read-only, memory mapped view of a baked atlas. Lookups are a binary
+// search over the entry table so nothing is loaded or parsed up front and
+// no font backend is needed at runtime.
+class BakedAtlas
+{
+public:
+	BakedAtlas(std::string path) :
+		_map(nullptr),
+		_mapLength(0),
+		_header(nullptr)
+	{
+		auto fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			std::cout << "failed to open '" << path << "'" << std::endl;
+			return;
+		}
+
+		struct stat info;
+		if (fstat(fd, &info) != 0
+			|| static_cast<size_t>(info.st_size) < sizeof(BakedAtlasHeader))
+		{
+			std::cout << "not a baked atlas '" << path << "'" << std::endl;
+			close(fd);
+			return;
+		}
+
+		auto length = static_cast<size_t>(info.st_size);
+		auto map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+		{
+			std::cout << "failed to map '" << path << "'" << std::endl;
+			return;
+		}
+
+		auto header = static_cast<const BakedAtlasHeader *>(map);
+		if (header->magic != BAKED_ATLAS_MAGIC
+			|| header->version != BAKED_ATLAS_VERSION
+			|| header->fileSize > length
+			|| !isValid(static_cast<const uint8_t *>(map), length))
+		{
+			std::cout << "not a baked atlas '" << path << "'" << std::endl;
+			munmap(map, length);
+			return;
+		}
+
+		_map = static_cast<const uint8_t *>(map);
+		_mapLength = length;
+		_header = header;
+	}
+
+	BakedAtlas(const BakedAtlas &) = delete;
+
+	BakedAtlas(BakedAtlas &&other) :
+		_map(other._map),
+		_mapLength(other._mapLength),
+		_header(other._header)
+	{
+		other._map = nullptr;
+		other._mapLength = 0;
+		other._header = nullptr;
+	}
+
+	~BakedAtlas()
+	{
+		if (_map)
+		{
+			munmap(const_cast<uint8_t *>(_map), _mapLength);
+		}
+	}
+
+	bool isOpen() const { return _map != nullptr; }
+
+	Size textureSize() const
+	{
+		return{ _header->textureWidth, _header->textureHeight };
+	}
+
+	unsigned textureCount() const { return _header->textureCount; }
+	unsigned entryCount() const { return _header->entryCount; }
+
+	// RGBA rows of textureSize().width pixels, tightly packed
+	const uint8_t *texturePixels(unsigned texture) const
+	{
+		auto size = textureSize();
+		return _map + _header->pixelsOffset
+			+ static_cast<size_t>(texture) * size.width * size.height * 4;
+	}
+
+	BakedLookup find(unsigned font, float size, const std::string &utf8Text)
+	{
+		return find(font, size, utf8Text.data(), utf8Text.size());
+	}
+
+	BakedLookup find(
+		unsigned font, float size, const char *utf8Text, size_t length)
+	{
+		if (!isOpen())
+		{
+			return BakedLookup::notFound();
+		}
+
+		auto fixedSize = bakedSize(size);
+		auto first = entries();
+		auto last = first + _header->entryCount;
+		auto it = std::lower_bound(
+			first,
+			last,
+			0,
+			[this, font, fixedSize, utf8Text, length](
+				const BakedAtlasEntry &entry, int)
+			{
+				return compare(entry, font, fixedSize, utf8Text, length) < 0;
+			});
+
+		if (it == last
+			|| compare(*it, font, fixedSize, utf8Text, length) != 0)
+		{
+			return BakedLookup::notFound();
+		}
+
+		return{
+			true,
+			it->texture,
+			{ it->x, it->y, it->width, it->height },
+			lines() + it->firstLine,
+			it->lineCount };
+	}
+
+private:
+	// Checks that every section is inside the file and every entry inside
+	// the sections, so lookups never read past the mapping
+	static bool isValid(const uint8_t *map, size_t length)
+	{
+		auto header = reinterpret_cast<const BakedAtlasHeader *>(map);
+		auto textureBytes = uint64_t{ header->textureWidth }
+			* header->textureHeight * 4;
+		auto textSize = header->pixelsOffset - header->textOffset;
+		if (!fits(header->entriesOffset, header->entryCount,
+				sizeof(BakedAtlasEntry), length)
+			|| !fits(header->linesOffset, header->lineCount,
+				sizeof(LineMetrics), length)
+			|| !fits(header->pixelsOffset, header->textureCount,
+				textureBytes, length)
+			|| header->entriesOffset < sizeof(BakedAtlasHeader)
+			|| header->entriesOffset % alignof(BakedAtlasEntry) != 0
+			|| header->linesOffset % alignof(LineMetrics) != 0
+			|| header->textOffset > header->pixelsOffset)
+		{
+			return false;
+		}
+
+		auto entries = reinterpret_cast<const BakedAtlasEntry *>(
+			map + header->entriesOffset);
+		for (uint32_t i = 0; i < header->entryCount; i++)
+		{
+			auto &entry = entries[i];
+			if (uint64_t{ entry.textOffset } + entry.textLength > textSize
+				|| uint64_t{ entry.firstLine } + entry.lineCount
+					> header->lineCount
+				|| entry.texture >= header->textureCount)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static bool fits(
+		uint64_t offset, uint64_t count, uint64_t itemSize, size_t length)
+	{
+		return offset <= length
+			&& (itemSize == 0 || count <= (length - offset) / itemSize);
+	}
+
+	const BakedAtlasEntry *entries() const
+	{
+		return reinterpret_cast<const BakedAtlasEntry *>(
+			_map + _header->entriesOffset);
+	}
+
+	const LineMetrics *lines() const
+	{
+		return reinterpret_cast<const LineMetrics *>(
+			_map + _header->linesOffset);
+	}
+
+	const char *text() const
+	{
+		return reinterpret_cast<const char *>(_map + _header->textOffset);
+	}
+
+	int compare(
+		const BakedAtlasEntry &entry,
+		uint32_t font,
+		uint32_t size,
+		const char *utf8Text,
+		size_t length) const
+	{
+		if (entry.font != font)
+			return entry.font < font ? -1 : 1;
+		if (entry.size != size)
+			return entry.size < size ? -1 : 1;
+
+		auto common = std::min<size_t>(entry.textLength, length);
+		auto result = std::memcmp(
+			text() + entry.textOffset, utf8Text, common);
+		if (result != 0)
+			return result;
+		if (entry.textLength != length)
+			return entry.textLength < length ? -1 : 1;
+		return 0;
+	}
+
+	const uint8_t *_map;
+	size_t _mapLength;
+	const BakedAtlasHeader *_header;
+};
+
+END_XT_NAMESPACE
@@ -1,5 +1,16 @@
 #include "CrossText.hpp"
+#include <cstring>
+#include <fstream>
 #include <numeric>
+#include <sstream>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XT_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define XT_X86_SIMD 0
+#endif
 
 BEGIN_XT_NAMESPACE
 
@@ -20,429 +31,3117 @@ std::ostream &operator<<(std::ostream &out, const Slot &slot)
 	return out;
 }
 
-// SpacialIndex
-
-SpacialIndex::SpacialIndex(Size size, Size blockSize) :
-	_blockSize(blockSize),
-	_xBlocks(calcBlockCount(size.width, blockSize.width)),
-	_yBlocks(calcBlockCount(size.height, blockSize.height)),
-	_data(_xBlocks * _yBlocks)
-{ }
-
-SpacialIndex::SpacialIndex(SpacialIndex &&other) :
-	_blockSize(other._blockSize),
-	_xBlocks(other._xBlocks),
-	_yBlocks(other._yBlocks),
-	_data(std::move(other._data))
-{ }
+// Binary state
 
-void SpacialIndex::add(Slot slot)
+void writeBinary(std::ostream &out, const Rect &rect)
 {
-	auto slotIndex = slot.index;
-	withNearBlocks(slot.rect, [slotIndex](std::vector<uint64_t> &slots)
-	{
-		slots.push_back(slotIndex);
-		return false;
-	});
+	writeBinary(out, static_cast<uint32_t>(rect.x));
+	writeBinary(out, static_cast<uint32_t>(rect.y));
+	writeBinary(out, static_cast<uint32_t>(rect.width));
+	writeBinary(out, static_cast<uint32_t>(rect.height));
 }
 
-void SpacialIndex::remove(Slot slot)
+bool readBinary(std::istream &in, Rect &rect)
 {
-	auto slotIndex = slot.index;
-	withNearBlocks(
-		slot.rect,
-		[this, slotIndex](std::vector<uint64_t> &slots)
+	uint32_t x, y, width, height;
+	if (!readBinary(in, x) || !readBinary(in, y)
+		|| !readBinary(in, width) || !readBinary(in, height))
 	{
-		slots.erase(std::remove(slots.begin(), slots.end(), slotIndex));
 		return false;
-	});
+	}
+	rect = { x, y, width, height };
+	return true;
 }
 
-bool SpacialIndex::withNearBlocks(
-	Rect rect, std::function<bool(std::vector<uint64_t> &)> action)
+template <typename T>
+static void writeArray(std::ostream &out, const std::vector<T> &values)
 {
-	auto leftColumn = rect.x / _blockSize.width;
-	auto rightColumn = rect.endX() / _blockSize.width;
-	auto topRow = rect.y / _blockSize.height;
-	auto bottomRow = rect.endY() / _blockSize.height;
-	return withBlocksInRange(
-		leftColumn, rightColumn, topRow, bottomRow, action);
+	out.write(
+		reinterpret_cast<const char *>(values.data()),
+		values.size() * sizeof(T));
 }
 
-bool SpacialIndex::withNearSlots(
-	Rect rect, std::function<bool(uint64_t)> action)
+// Grows the array as the values come in, so a count from a corrupt stream
+// runs out of stream before it runs out of memory
+template <typename T>
+static bool readArray(std::istream &in, std::vector<T> &values, size_t count)
 {
-	std::unordered_map<uint64_t, bool> usedSlots;
-	auto result = withNearBlocks(
-		rect,
-		[&usedSlots, &action](std::vector<uint64_t> &slots)
+	values.clear();
+	while (values.size() < count)
 	{
-		for (auto slotIndex : slots)
+		auto start = values.size();
+		auto chunk = std::min<size_t>(count - start, XT_STATE_READ_CHUNK);
+		values.resize(start + chunk);
+		in.read(
+			reinterpret_cast<char *>(values.data() + start),
+			chunk * sizeof(T));
+		if (!in.good())
 		{
-			if (usedSlots.find(slotIndex) == usedSlots.end())
-			{
-				usedSlots[slotIndex] = true;
-				if (action(slotIndex))
-				{
-					return true;
-				}
-			}
+			return false;
 		}
+	}
+	return in.good();
+}
 
-		return false;
-	});
-	return result;
+// Whether every index read from a stream points into something of the size
+static bool isEachBelow(const std::vector<uint32_t> &indexes, size_t size)
+{
+	for (auto index : indexes)
+	{
+		if (index >= size)
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
-bool SpacialIndex::withSlotsOnYLine(
-	unsigned y, std::function<bool(uint64_t)> action)
+void writeBinary(std::ostream &out, const std::string &str)
 {
-	return withNearSlots({ 0, y, _blockSize.width * _xBlocks, 1 }, action);
+	writeBinary(out, static_cast<uint32_t>(str.size()));
+	out.write(str.data(), str.size());
 }
 
-bool SpacialIndex::withSlotsInBlockRange(
-	unsigned leftColumn,
-	unsigned rightColumn,
-	unsigned topRow,
-	unsigned bottomRow,
-	std::function<bool(uint64_t)> action)
+bool readBinary(std::istream &in, std::string &str)
 {
-	for (auto col = leftColumn; col <= rightColumn; col++)
+	uint32_t length;
+	if (!readBinary(in, length) || length > XT_STATE_MAX_STRING)
 	{
-		for (auto row = topRow; row <= bottomRow; row++)
-		{
-			auto index = row * _xBlocks + col;
-			for (auto &slotIndex : _data[index])
-			{
-				if (action(slotIndex))
-				{
-					return true;
-				}
-			}
-		}
+		return false;
 	}
+	str.resize(length);
+	in.read(&str[0], length);
+	return in.good();
+}
 
-	return false;
+void writeBinary(std::ostream &out, const TextBlockMetrics &metrics)
+{
+	writeBinary(out, metrics.size);
+	writeBinary(out, static_cast<uint32_t>(metrics.lines.size()));
+	for (auto &line : metrics.lines)
+	{
+		writeBinary(out, line);
+	}
 }
 
-bool SpacialIndex::withBlocksInRange(
-	unsigned leftColumn,
-	unsigned rightColumn,
-	unsigned topRow,
-	unsigned bottomRow,
-	std::function<bool(std::vector<uint64_t> &)> action)
+bool readBinary(std::istream &in, TextBlockMetrics &metrics)
 {
-	for (auto col = leftColumn; col <= rightColumn; col++)
+	uint32_t lineCount;
+	if (!readBinary(in, metrics.size) || !readBinary(in, lineCount))
 	{
-		for (auto row = topRow; row <= bottomRow; row++)
+		return false;
+	}
+	metrics.lines.clear();
+	for (uint32_t i = 0; i < lineCount; i++)
+	{
+		LineMetrics line;
+		if (!readBinary(in, line))
 		{
-			auto index = row * _xBlocks + col;
-			if (action(_data[index]))
-			{
-				return true;
-			}
+			return false;
 		}
+		metrics.lines.push_back(line);
 	}
-
-	return false;
+	return true;
 }
 
-unsigned SpacialIndex::getBlockIndex(unsigned x, unsigned y)
+uint64_t hashBytes(const void *data, size_t length, uint64_t seed)
 {
-	auto xBlock = x / _blockSize.width;
-	auto yBlock = y / _blockSize.height;
-
-	return yBlock * _xBlocks + xBlock;
+	// FNV-1a
+	return continueHash(data, length, seed ^ 0xcbf29ce484222325ull);
 }
 
-unsigned SpacialIndex::calcBlockCount(
-	unsigned totalSize, unsigned blockSize)
+uint64_t continueHash(const void *data, size_t length, uint64_t hash)
 {
-	auto wholeBlocks = totalSize / blockSize;
-	auto bonusBlocks = (totalSize - (wholeBlocks * blockSize)) > 0 ? 1 : 0;
-	return wholeBlocks + bonusBlocks;
+	auto bytes = static_cast<const uint8_t *>(data);
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
 }
 
-// YCache
-
-YCache::YCache(unsigned height) :
-	_yCounts(height, 0)
+void tintCoverage(
+	const uint8_t *coverage,
+	size_t count,
+	Color color,
+	Color background,
+	uint8_t *rgba)
 {
-	// Give y=0 value a head start because it's the first place to check
-	// and we never want its count to reach zero.
-	increment(0);
+	// Packing through bytes keeps this independent of endianness, and the
+	// loop has no branches so the compiler can vectorize it
+	uint8_t colorBytes[4] = {
+		color.redByte(), color.greenByte(), color.blueByte(), 0 };
+	uint8_t backgroundBytes[4] = {
+		background.redByte(),
+		background.greenByte(),
+		background.blueByte(),
+		background.alphaByte() };
+	uint8_t alphaBytes[4] = { 0, 0, 0, 1 };
+	uint32_t colorPixel, backgroundPixel, alphaUnit;
+	std::memcpy(&colorPixel, colorBytes, 4);
+	std::memcpy(&backgroundPixel, backgroundBytes, 4);
+	std::memcpy(&alphaUnit, alphaBytes, 4);
+
+	auto alpha = static_cast<float>(color.alphaByte());
+	for (size_t i = 0; i < count; i++)
+	{
+		auto scaled = static_cast<uint32_t>(
+			static_cast<float>(coverage[i]) / 255.0f * alpha);
+		uint32_t covered = 0u - static_cast<uint32_t>(coverage[i] != 0);
+		uint32_t pixel = ((colorPixel | scaled * alphaUnit) & covered)
+			| (backgroundPixel & ~covered);
+		std::memcpy(rgba + i * 4, &pixel, 4);
+	}
 }
 
-YCache::YCache(YCache &&other) :
-	_yCounts(std::move(other._yCounts)),
-	_yCountPriority(std::move(other._yCountPriority))
-{ }
+// Text decoding
 
-void YCache::increment(unsigned y)
+namespace
 {
-	if (y >= _yCounts.size())
+	const char32_t replacementChar = 0xfffd;
+
+	// True when the next 16 bytes are all ASCII so they can be widened
+	// without any decoding.
+	inline bool isAsciiBlock(const char *text)
 	{
-		return;
+		uint64_t first, second;
+		std::memcpy(&first, text, 8);
+		std::memcpy(&second, text + 8, 8);
+		return ((first | second) & 0x8080808080808080ull) == 0;
 	}
 
-	auto countRef = &_yCounts[y];
-	auto count = *countRef;
-	if (count == 0)
+	// Decodes one code point and returns how many bytes it used. Malformed
+	// sequences decode to the replacement char one byte at a time.
+	inline size_t decodeUtf8(
+		const char *text, size_t remaining, char32_t &codePoint)
 	{
-		// Add as top priority
-		_yCountPriority.push_back({ y, countRef });
+		auto lead = static_cast<uint8_t>(text[0]);
+		if (lead < 0x80)
+		{
+			codePoint = lead;
+			return 1;
+		}
+
+		size_t length;
+		char32_t minimum;
+		if ((lead & 0xe0) == 0xc0)
+		{
+			length = 2;
+			minimum = 0x80;
+			codePoint = lead & 0x1f;
+		}
+		else if ((lead & 0xf0) == 0xe0)
+		{
+			length = 3;
+			minimum = 0x800;
+			codePoint = lead & 0x0f;
+		}
+		else if ((lead & 0xf8) == 0xf0)
+		{
+			length = 4;
+			minimum = 0x10000;
+			codePoint = lead & 0x07;
+		}
+		else
+		{
+			codePoint = replacementChar;
+			return 1;
+		}
+
+		if (length > remaining)
+		{
+			codePoint = replacementChar;
+			return 1;
+		}
+
+		for (size_t i = 1; i < length; i++)
+		{
+			auto continuation = static_cast<uint8_t>(text[i]);
+			if ((continuation & 0xc0) != 0x80)
+			{
+				codePoint = replacementChar;
+				return 1;
+			}
+			codePoint = (codePoint << 6) | (continuation & 0x3f);
+		}
+
+		if (codePoint < minimum
+			|| codePoint > 0x10ffff
+			|| (codePoint >= 0xd800 && codePoint <= 0xdfff))
+		{
+			codePoint = replacementChar;
+		}
+
+		return length;
 	}
-	else
+
+	inline size_t decodeUtf16(
+		const char16_t *text, size_t remaining, char32_t &codePoint)
 	{
-		for (unsigned i = 0; i < _yCountPriority.size(); i++)
+		char32_t first = text[0];
+		if (first < 0xd800 || first > 0xdfff)
 		{
-			auto yCount = _yCountPriority[i];
-			if (yCount.y == y)
+			codePoint = first;
+			return 1;
+		}
+
+		if (first <= 0xdbff && remaining > 1)
+		{
+			char32_t second = text[1];
+			if (second >= 0xdc00 && second <= 0xdfff)
 			{
-				// Promote to top priority
-				_yCountPriority.erase(_yCountPriority.begin() + i);
-				_yCountPriority.push_back(yCount);
-				break;
+				codePoint = 0x10000
+					+ ((first - 0xd800) << 10)
+					+ (second - 0xdc00);
+				return 2;
 			}
 		}
+
+		codePoint = replacementChar;
+		return 1;
+	}
+
+	// Chars a code point takes up as wchar_t: two where wchar_t is 16 bits
+	// and the code point is outside the basic plane, otherwise one
+	inline unsigned wideLength(char32_t codePoint)
+	{
+		return sizeof(wchar_t) == 2
+			&& codePoint > 0xffff
+			&& codePoint <= 0x10ffff ? 2 : 1;
+	}
+
+	// Appends a code point to a decode buffer, as a surrogate pair where
+	// wchar_t is 16 bits and it doesn't fit in one. When the buffer is full
+	// after the high half, the low half waits in pending for the next read.
+	inline void appendWide(
+		char32_t codePoint,
+		wchar_t *buffer,
+		size_t &count,
+		size_t max,
+		wchar_t &pending)
+	{
+		if (wideLength(codePoint) == 1)
+		{
+			buffer[count++] = static_cast<wchar_t>(
+				sizeof(wchar_t) == 2 && codePoint > 0xffff
+					? replacementChar : codePoint);
+			return;
+		}
+
+		codePoint -= 0x10000;
+		buffer[count++] = static_cast<wchar_t>(0xd800 + (codePoint >> 10));
+		auto low = static_cast<wchar_t>(0xdc00 + (codePoint & 0x3ff));
+		if (count < max)
+		{
+			buffer[count++] = low;
+		}
+		else
+		{
+			pending = low;
+		}
+	}
+
+	// Hands out the low half of a pair that didn't fit in the last read
+	inline size_t takePending(wchar_t *buffer, size_t max, wchar_t &pending)
+	{
+		if (!pending || max == 0)
+		{
+			return 0;
+		}
+
+		buffer[0] = pending;
+		pending = 0;
+		return 1;
 	}
-	(*countRef)++;
 }
 
-void YCache::decrement(unsigned y)
+Utf8Decoder::Utf8Decoder(Utf8View text) :
+	_text(text), _position(0), _pending(0)
+{ }
+
+unsigned Utf8Decoder::length() const
 {
-	if (y >= _yCounts.size())
+	unsigned count = 0;
+	size_t position = 0;
+	while (position < _text.size)
 	{
-		return;
-	}
+		if (_text.size - position >= 16
+			&& isAsciiBlock(_text.data + position))
+		{
+			position += 16;
+			count += 16;
+			continue;
+		}
 
-	auto countRef = &_yCounts[y];
-	auto count = *countRef;
+		char32_t codePoint;
+		position += decodeUtf8(
+			_text.data + position, _text.size - position, codePoint);
+		count += wideLength(codePoint);
+	}
+	return count;
+}
 
-	for (unsigned i = 0; i < _yCountPriority.size(); i++)
+size_t Utf8Decoder::read(size_t max, const wchar_t *&chars)
+{
+	max = std::min(max, static_cast<size_t>(XT_DECODE_BUFFER_SIZE));
+	auto count = takePending(_buffer, max, _pending);
+	while (count < max && _position < _text.size)
 	{
-		auto yCount = _yCountPriority[i];
-		if (yCount.y == y)
+		auto source = _text.data + _position;
+		if (max - count >= 16
+			&& _text.size - _position >= 16
+			&& isAsciiBlock(source))
 		{
-			if (count <= 1)
-			{
-				// There's nothing here anymore so remove it
-				_yCountPriority.erase(_yCountPriority.begin() + i);
-			}
-			else
+			for (unsigned i = 0; i < 16; i++)
 			{
-				// There's still stuff here to promote to top priority
-				_yCountPriority.erase(_yCountPriority.begin() + i);
-				_yCountPriority.push_back(yCount);
+				_buffer[count + i] = static_cast<wchar_t>(source[i]);
 			}
-			break;
+			count += 16;
+			_position += 16;
+			continue;
 		}
+
+		char32_t codePoint;
+		_position += decodeUtf8(source, _text.size - _position, codePoint);
+		appendWide(codePoint, _buffer, count, max, _pending);
 	}
 
-	(*countRef)--;
+	chars = _buffer;
+	return count;
 }
 
-void YCache::withYValuesInPriorityOrder(
-	std::function<bool(unsigned y)> callback)
+Utf16Decoder::Utf16Decoder(Utf16View text) :
+	_text(text), _position(0), _pending(0)
+{ }
+
+unsigned Utf16Decoder::length() const
 {
-	for (auto i = _yCountPriority.size(); i-- > 0;)
+	unsigned count = 0;
+	size_t position = 0;
+	while (position < _text.size)
+	{
+		char32_t codePoint;
+		position += decodeUtf16(
+			_text.data + position, _text.size - position, codePoint);
+		count += wideLength(codePoint);
+	}
+	return count;
+}
+
+size_t Utf16Decoder::read(size_t max, const wchar_t *&chars)
+{
+	max = std::min(max, static_cast<size_t>(XT_DECODE_BUFFER_SIZE));
+	auto count = takePending(_buffer, max, _pending);
+	while (count < max && _position < _text.size)
+	{
+		char32_t codePoint;
+		_position += decodeUtf16(
+			_text.data + _position, _text.size - _position, codePoint);
+		appendWide(codePoint, _buffer, count, max, _pending);
+	}
+
+	chars = _buffer;
+	return count;
+}
+
+Utf32Decoder::Utf32Decoder(Utf32View text) :
+	_text(text), _position(0), _pending(0)
+{ }
+
+unsigned Utf32Decoder::length() const
+{
+	if (sizeof(wchar_t) > 2)
+	{
+		return static_cast<unsigned>(_text.size);
+	}
+
+	unsigned count = 0;
+	for (size_t i = 0; i < _text.size; i++)
+	{
+		count += wideLength(_text.data[i]);
+	}
+	return count;
+}
+
+size_t Utf32Decoder::read(size_t max, const wchar_t *&chars)
+{
+	max = std::min(max, static_cast<size_t>(XT_DECODE_BUFFER_SIZE));
+	auto count = takePending(_buffer, max, _pending);
+	while (count < max && _position < _text.size)
+	{
+		appendWide(_text.data[_position++], _buffer, count, max, _pending);
+	}
+
+	chars = _buffer;
+	return count;
+}
+
+// Overlap kernels
+
+// Each kernel tests up to 16 rects starting at first against the rect and
+// sets bit i for rect first + i when they overlap. Rects that share an edge
+// don't overlap since right and bottom are the last column and row covered.
+using OverlapMaskFunction = uint32_t (*)(
+	const SpacialBlock &block, size_t first, size_t count, Rect rect);
+
+static uint32_t overlapMaskScalar(
+	const SpacialBlock &block, size_t first, size_t count, Rect rect)
+{
+	unsigned rectLeft = rect.x;
+	unsigned rectTop = rect.y;
+	unsigned rectRight = rect.endX();
+	unsigned rectBottom = rect.endY();
+
+	uint32_t mask = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		auto hit = (block.left[first + i] <= rectRight)
+			& (rectLeft <= block.right[first + i])
+			& (block.top[first + i] <= rectBottom)
+			& (rectTop <= block.bottom[first + i]);
+		mask |= static_cast<uint32_t>(hit) << i;
+	}
+	return mask;
+}
+
+#if XT_X86_SIMD
+
+// There's no unsigned 16 bit compare so a <= b is done as max(a, b) == b
+__attribute__((target("sse4.1")))
+static inline __m128i lessOrEqualSse41(__m128i a, __m128i b)
+{
+	return _mm_cmpeq_epi16(_mm_max_epu16(a, b), b);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i loadSse41(const std::vector<uint16_t> &edges, size_t at)
+{
+	return _mm_loadu_si128(
+		reinterpret_cast<const __m128i *>(edges.data() + at));
+}
+
+__attribute__((target("sse4.1")))
+static __m128i overlapLanesSse41(
+	const SpacialBlock &block,
+	size_t first,
+	__m128i rectLeft,
+	__m128i rectTop,
+	__m128i rectRight,
+	__m128i rectBottom)
+{
+	auto across = _mm_and_si128(
+		lessOrEqualSse41(loadSse41(block.left, first), rectRight),
+		lessOrEqualSse41(rectLeft, loadSse41(block.right, first)));
+	auto down = _mm_and_si128(
+		lessOrEqualSse41(loadSse41(block.top, first), rectBottom),
+		lessOrEqualSse41(rectTop, loadSse41(block.bottom, first)));
+	return _mm_and_si128(across, down);
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t overlapMaskSse41(
+	const SpacialBlock &block, size_t first, size_t count, Rect rect)
+{
+	if (count < 16)
+	{
+		return overlapMaskScalar(block, first, count, rect);
+	}
+
+	auto rectLeft = _mm_set1_epi16(static_cast<short>(rect.x));
+	auto rectTop = _mm_set1_epi16(static_cast<short>(rect.y));
+	auto rectRight = _mm_set1_epi16(static_cast<short>(rect.endX()));
+	auto rectBottom = _mm_set1_epi16(static_cast<short>(rect.endY()));
+	auto low = overlapLanesSse41(
+		block, first, rectLeft, rectTop, rectRight, rectBottom);
+	auto high = overlapLanesSse41(
+		block, first + 8, rectLeft, rectTop, rectRight, rectBottom);
+
+	// Lanes are all ones or all zeros so packing to bytes keeps them
+	return static_cast<uint32_t>(
+		_mm_movemask_epi8(_mm_packs_epi16(low, high)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lessOrEqualAvx2(__m256i a, __m256i b)
+{
+	return _mm256_cmpeq_epi16(_mm256_max_epu16(a, b), b);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i loadAvx2(const std::vector<uint16_t> &edges, size_t at)
+{
+	return _mm256_loadu_si256(
+		reinterpret_cast<const __m256i *>(edges.data() + at));
+}
+
+__attribute__((target("avx2")))
+static uint32_t overlapMaskAvx2(
+	const SpacialBlock &block, size_t first, size_t count, Rect rect)
+{
+	if (count < 16)
+	{
+		return overlapMaskScalar(block, first, count, rect);
+	}
+
+	auto rectLeft = _mm256_set1_epi16(static_cast<short>(rect.x));
+	auto rectTop = _mm256_set1_epi16(static_cast<short>(rect.y));
+	auto rectRight = _mm256_set1_epi16(static_cast<short>(rect.endX()));
+	auto rectBottom = _mm256_set1_epi16(static_cast<short>(rect.endY()));
+	auto across = _mm256_and_si256(
+		lessOrEqualAvx2(loadAvx2(block.left, first), rectRight),
+		lessOrEqualAvx2(rectLeft, loadAvx2(block.right, first)));
+	auto down = _mm256_and_si256(
+		lessOrEqualAvx2(loadAvx2(block.top, first), rectBottom),
+		lessOrEqualAvx2(rectTop, loadAvx2(block.bottom, first)));
+	auto hits = _mm256_and_si256(across, down);
+
+	auto packed = _mm_packs_epi16(
+		_mm256_castsi256_si128(hits), _mm256_extracti128_si256(hits, 1));
+	return static_cast<uint32_t>(_mm_movemask_epi8(packed));
+}
+
+#endif
+
+static bool hasOverlapKernel(OverlapKernel kernel)
+{
+#if XT_X86_SIMD
+	__builtin_cpu_init();
+#endif
+	switch (kernel)
+	{
+	case OverlapKernel::Scalar:
+		return true;
+#if XT_X86_SIMD
+	case OverlapKernel::Sse41:
+		return __builtin_cpu_supports("sse4.1");
+	case OverlapKernel::Avx2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+static OverlapKernel bestOverlapKernel()
+{
+	for (auto kernel : { OverlapKernel::Avx2, OverlapKernel::Sse41 })
+	{
+		if (hasOverlapKernel(kernel))
+		{
+			return kernel;
+		}
+	}
+	return OverlapKernel::Scalar;
+}
+
+static OverlapMaskFunction overlapMaskFunction(OverlapKernel kernel)
+{
+	switch (kernel)
+	{
+#if XT_X86_SIMD
+	case OverlapKernel::Sse41:
+		return overlapMaskSse41;
+	case OverlapKernel::Avx2:
+		return overlapMaskAvx2;
+#endif
+	default:
+		return overlapMaskScalar;
+	}
+}
+
+static std::atomic<OverlapKernel> &activeOverlapKernel()
+{
+	static std::atomic<OverlapKernel> kernel(bestOverlapKernel());
+	return kernel;
+}
+
+static std::atomic<OverlapMaskFunction> &activeOverlapMask()
+{
+	static std::atomic<OverlapMaskFunction> function(
+		overlapMaskFunction(activeOverlapKernel()));
+	return function;
+}
+
+uint32_t overlapMask(const SpacialBlock &block, size_t first, Rect rect)
+{
+	auto count = std::min<size_t>(block.size() - first, 16);
+	auto function = activeOverlapMask().load(std::memory_order_relaxed);
+	return function(block, first, count, rect);
+}
+
+bool useOverlapKernel(OverlapKernel kernel)
+{
+	if (!hasOverlapKernel(kernel))
+	{
+		return false;
+	}
+
+	activeOverlapKernel() = kernel;
+	activeOverlapMask() = overlapMaskFunction(kernel);
+	return true;
+}
+
+OverlapKernel overlapKernel()
+{
+	return activeOverlapKernel();
+}
+
+const char *overlapKernelName(OverlapKernel kernel)
+{
+	switch (kernel)
+	{
+	case OverlapKernel::Sse41:
+		return "sse4.1";
+	case OverlapKernel::Avx2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+// SpacialBlock
+
+void SpacialBlock::push(uint32_t place, Rect rect)
+{
+	places.push_back(place);
+	left.push_back(static_cast<uint16_t>(rect.x));
+	top.push_back(static_cast<uint16_t>(rect.y));
+	right.push_back(static_cast<uint16_t>(rect.endX()));
+	bottom.push_back(static_cast<uint16_t>(rect.endY()));
+}
+
+void SpacialBlock::erase(uint32_t place)
+{
+	// Keeps the order since it decides which x positions are tried first
+	auto i = static_cast<size_t>(
+		std::find(places.begin(), places.end(), place) - places.begin());
+	if (i == places.size())
+	{
+		return;
+	}
+
+	places.erase(places.begin() + i);
+	left.erase(left.begin() + i);
+	top.erase(top.begin() + i);
+	right.erase(right.begin() + i);
+	bottom.erase(bottom.begin() + i);
+}
+
+void SpacialBlock::clear()
+{
+	places.clear();
+	left.clear();
+	top.clear();
+	right.clear();
+	bottom.clear();
+}
+
+bool SpacialBlock::overlaps(Rect rect) const
+{
+	for (size_t first = 0; first < places.size(); first += 16)
+	{
+		if (overlapMask(*this, first, rect) != 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// SpacialIndex
+
+SpacialIndex::SpacialIndex(Size size, Size blockSize) :
+	_blockSize(blockSize),
+	_xBlocks(calcBlockCount(size.width, blockSize.width)),
+	_yBlocks(calcBlockCount(size.height, blockSize.height)),
+	_data(_xBlocks * _yBlocks)
+{ }
+
+SpacialIndex::SpacialIndex(SpacialIndex &&other) :
+	_blockSize(other._blockSize),
+	_xBlocks(other._xBlocks),
+	_yBlocks(other._yBlocks),
+	_data(std::move(other._data))
+{ }
+
+void SpacialIndex::add(uint32_t place, Rect rect)
+{
+	withNearBlocks(rect, [place, rect](SpacialBlock &block)
+	{
+		block.push(place, rect);
+		return false;
+	});
+}
+
+void SpacialIndex::remove(uint32_t place, Rect rect)
+{
+	withNearBlocks(rect, [place](SpacialBlock &block)
+	{
+		block.erase(place);
+		return false;
+	});
+}
+
+bool SpacialIndex::withNearBlocks(
+	Rect rect, std::function<bool(SpacialBlock &)> action)
+{
+	auto leftColumn = rect.x / _blockSize.width;
+	auto rightColumn = rect.endX() / _blockSize.width;
+	auto topRow = rect.y / _blockSize.height;
+	auto bottomRow = rect.endY() / _blockSize.height;
+	return withBlocksInRange(
+		leftColumn, rightColumn, topRow, bottomRow, action);
+}
+
+bool SpacialIndex::overlapsAny(Rect rect) const
+{
+	auto leftColumn = rect.x / _blockSize.width;
+	auto rightColumn = rect.endX() / _blockSize.width;
+	auto topRow = rect.y / _blockSize.height;
+	auto bottomRow = rect.endY() / _blockSize.height;
+	for (auto row = topRow; row <= bottomRow; row++)
+	{
+		for (auto col = leftColumn; col <= rightColumn; col++)
+		{
+			if (_data[row * _xBlocks + col].overlaps(rect))
+			{
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool SpacialIndex::withNearSlots(
+	Rect rect, std::function<bool(uint32_t)> action)
+{
+	std::unordered_map<uint32_t, bool> usedPlaces;
+	auto result = withNearBlocks(
+		rect,
+		[&usedPlaces, &action](SpacialBlock &block)
+	{
+		for (auto place : block.places)
+		{
+			if (usedPlaces.find(place) == usedPlaces.end())
+			{
+				usedPlaces[place] = true;
+				if (action(place))
+				{
+					return true;
+				}
+			}
+		}
+
+		return false;
+	});
+	return result;
+}
+
+bool SpacialIndex::withSlotsOnYLine(
+	unsigned y, std::function<bool(uint32_t)> action)
+{
+	return withNearSlots({ 0, y, _blockSize.width * _xBlocks, 1 }, action);
+}
+
+bool SpacialIndex::withSlotsInBlockRange(
+	unsigned leftColumn,
+	unsigned rightColumn,
+	unsigned topRow,
+	unsigned bottomRow,
+	std::function<bool(uint32_t)> action)
+{
+	for (auto col = leftColumn; col <= rightColumn; col++)
+	{
+		for (auto row = topRow; row <= bottomRow; row++)
+		{
+			auto index = row * _xBlocks + col;
+			for (auto &slotIndex : _data[index].places)
+			{
+				if (action(slotIndex))
+				{
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+bool SpacialIndex::withBlocksInRange(
+	unsigned leftColumn,
+	unsigned rightColumn,
+	unsigned topRow,
+	unsigned bottomRow,
+	std::function<bool(SpacialBlock &)> action)
+{
+	for (auto col = leftColumn; col <= rightColumn; col++)
+	{
+		for (auto row = topRow; row <= bottomRow; row++)
+		{
+			auto index = row * _xBlocks + col;
+			if (action(_data[index]))
+			{
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void SpacialIndex::clear()
+{
+	for (auto &block : _data)
+	{
+		block.clear();
+	}
+}
+
+void SpacialIndex::save(std::ostream &out) const
+{
+	writeBinary(out, static_cast<uint32_t>(_xBlocks));
+	writeBinary(out, static_cast<uint32_t>(_yBlocks));
+	for (auto &block : _data)
+	{
+		writeBinary(out, static_cast<uint32_t>(block.size()));
+		writeArray(out, block.places);
+		writeArray(out, block.left);
+		writeArray(out, block.top);
+		writeArray(out, block.right);
+		writeArray(out, block.bottom);
+	}
+}
+
+bool SpacialIndex::load(std::istream &in)
+{
+	uint32_t xBlocks, yBlocks;
+	if (!readBinary(in, xBlocks) || !readBinary(in, yBlocks)
+		|| xBlocks != _xBlocks || yBlocks != _yBlocks)
+	{
+		return false;
+	}
+
+	for (auto &block : _data)
+	{
+		uint32_t count;
+		if (!readBinary(in, count)
+			|| !readArray(in, block.places, count)
+			|| !readArray(in, block.left, count)
+			|| !readArray(in, block.top, count)
+			|| !readArray(in, block.right, count)
+			|| !readArray(in, block.bottom, count))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool SpacialIndex::verify(
+	const std::vector<SlabSlot> &slab,
+	std::ostream &out) const
+{
+	uint64_t expectedEntries = 0;
+	for (auto &slot : slab)
+	{
+		if (!slot.isClaimed)
+		{
+			continue;
+		}
+
+		auto rect = slot.rect;
+		auto columns = rect.endX() / _blockSize.width
+			- rect.x / _blockSize.width + 1;
+		auto rows = rect.endY() / _blockSize.height
+			- rect.y / _blockSize.height + 1;
+		expectedEntries += uint64_t{ columns } * rows;
+	}
+
+	// With no strays or repeats, the right total means nothing is missing
+	uint64_t entries = 0;
+	for (unsigned row = 0; row < _yBlocks; row++)
+	{
+		for (unsigned col = 0; col < _xBlocks; col++)
+		{
+			auto &block = _data[row * _xBlocks + col];
+			auto left = col * _blockSize.width;
+			auto top = row * _blockSize.height;
+			auto &places = block.places;
+			for (size_t i = 0; i < places.size(); i++)
+			{
+				auto place = places[i];
+				if (place >= slab.size() || !slab[place].isClaimed)
+				{
+					out << "block " << col << "," << row
+						<< " holds released slot " << place << std::endl;
+					return false;
+				}
+
+				auto rect = slab[place].rect;
+				if (block.left[i] != rect.x
+					|| block.top[i] != rect.y
+					|| block.right[i] != rect.endX()
+					|| block.bottom[i] != rect.endY())
+				{
+					out << "block " << col << "," << row
+						<< " has a stale copy of slot " << place << std::endl;
+					return false;
+				}
+
+				if (rect.endX() < left
+					|| rect.x >= left + _blockSize.width
+					|| rect.endY() < top
+					|| rect.y >= top + _blockSize.height)
+				{
+					out << "block " << col << "," << row
+						<< " holds slot " << place
+						<< " that doesn't touch it" << std::endl;
+					return false;
+				}
+
+				if (std::find(places.begin() + i + 1, places.end(), place)
+					!= places.end())
+				{
+					out << "block " << col << "," << row
+						<< " holds slot " << place << " twice" << std::endl;
+					return false;
+				}
+			}
+			entries += block.size();
+		}
+	}
+
+	if (entries != expectedEntries)
+	{
+		out << "spacial index has " << entries << " entries, expected "
+			<< expectedEntries << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+unsigned SpacialIndex::getBlockIndex(unsigned x, unsigned y)
+{
+	auto xBlock = x / _blockSize.width;
+	auto yBlock = y / _blockSize.height;
+
+	return yBlock * _xBlocks + xBlock;
+}
+
+unsigned SpacialIndex::calcBlockCount(
+	unsigned totalSize, unsigned blockSize)
+{
+	auto wholeBlocks = totalSize / blockSize;
+	auto bonusBlocks = (totalSize - (wholeBlocks * blockSize)) > 0 ? 1 : 0;
+	return wholeBlocks + bonusBlocks;
+}
+
+// YCache
+
+YCache::YCache(unsigned height) :
+	_yCounts(height, 0)
+{
+	// Give y=0 value a head start because it's the first place to check
+	// and we never want its count to reach zero.
+	increment(0);
+}
+
+YCache::YCache(YCache &&other) :
+	_yCounts(std::move(other._yCounts)),
+	_yCountPriority(std::move(other._yCountPriority))
+{ }
+
+void YCache::increment(unsigned y)
+{
+	if (y >= _yCounts.size())
+	{
+		return;
+	}
+
+	auto countRef = &_yCounts[y];
+	auto count = *countRef;
+	if (count == 0)
+	{
+		// Add as top priority
+		_yCountPriority.push_back({ y, countRef });
+	}
+	else
+	{
+		for (unsigned i = 0; i < _yCountPriority.size(); i++)
+		{
+			auto yCount = _yCountPriority[i];
+			if (yCount.y == y)
+			{
+				// Promote to top priority
+				_yCountPriority.erase(_yCountPriority.begin() + i);
+				_yCountPriority.push_back(yCount);
+				break;
+			}
+		}
+	}
+	(*countRef)++;
+}
+
+void YCache::decrement(unsigned y)
+{
+	if (y >= _yCounts.size())
+	{
+		return;
+	}
+
+	auto countRef = &_yCounts[y];
+	auto count = *countRef;
+
+	for (unsigned i = 0; i < _yCountPriority.size(); i++)
+	{
+		auto yCount = _yCountPriority[i];
+		if (yCount.y == y)
+		{
+			if (count <= 1)
+			{
+				// There's nothing here anymore so remove it
+				_yCountPriority.erase(_yCountPriority.begin() + i);
+			}
+			else
+			{
+				// There's still stuff here to promote to top priority
+				_yCountPriority.erase(_yCountPriority.begin() + i);
+				_yCountPriority.push_back(yCount);
+			}
+			break;
+		}
+	}
+
+	(*countRef)--;
+}
+
+void YCache::withYValuesInPriorityOrder(
+	std::function<bool(unsigned y)> callback)
+{
+	for (auto i = _yCountPriority.size(); i-- > 0;)
+	{
+		if (callback(_yCountPriority[i].y))
+		{
+			break;
+		}
+	}
+}
+
+void YCache::clear()
+{
+	std::fill(_yCounts.begin(), _yCounts.end(), 0);
+	_yCountPriority.clear();
+	increment(0);
+}
+
+void YCache::save(std::ostream &out) const
+{
+	writeBinary(out, static_cast<uint32_t>(_yCounts.size()));
+
+	// Counts are only non-zero for y values in the priority list so that is
+	// all that needs saving.
+	writeBinary(out, static_cast<uint32_t>(_yCountPriority.size()));
+	for (auto &yCount : _yCountPriority)
+	{
+		writeBinary(out, static_cast<uint32_t>(yCount.y));
+		writeBinary(out, static_cast<uint32_t>(*yCount.count));
+	}
+}
+
+bool YCache::load(std::istream &in)
+{
+	uint32_t height, priorityCount;
+	if (!readBinary(in, height) || height != _yCounts.size()
+		|| !readBinary(in, priorityCount))
+	{
+		return false;
+	}
+
+	std::fill(_yCounts.begin(), _yCounts.end(), 0);
+	_yCountPriority.clear();
+	for (uint32_t i = 0; i < priorityCount; i++)
+	{
+		uint32_t y, count;
+		if (!readBinary(in, y) || !readBinary(in, count) || y >= height)
+		{
+			return false;
+		}
+		_yCounts[y] = count;
+		_yCountPriority.push_back({ y, &_yCounts[y] });
+	}
+
+	return true;
+}
+
+bool YCache::verify(
+	const std::vector<SlabSlot> &slab,
+	std::ostream &out) const
+{
+	auto height = static_cast<unsigned>(_yCounts.size());
+	std::vector<unsigned> expected(height, 0);
+	expected[0]++;
+	for (auto &slot : slab)
+	{
+		if (!slot.isClaimed)
+		{
+			continue;
+		}
+
+		auto rect = slot.rect;
+		expected[rect.y]++;
+		if (rect.endY() + 1 < height)
+		{
+			expected[rect.endY() + 1]++;
+		}
+	}
+
+	unsigned nonZero = 0;
+	for (unsigned y = 0; y < height; y++)
+	{
+		if (_yCounts[y] != expected[y])
+		{
+			out << "y cache has " << _yCounts[y] << " at y " << y
+				<< ", expected " << expected[y] << std::endl;
+			return false;
+		}
+		nonZero += _yCounts[y] > 0;
+	}
+
+	std::vector<bool> listed(height, false);
+	for (auto &yCount : _yCountPriority)
+	{
+		if (yCount.y >= height
+			|| yCount.count != &_yCounts[yCount.y]
+			|| listed[yCount.y]
+			|| *yCount.count == 0)
+		{
+			out << "y cache priority entry for y " << yCount.y
+				<< " is wrong" << std::endl;
+			return false;
+		}
+		listed[yCount.y] = true;
+	}
+
+	if (_yCountPriority.size() != nonZero)
+	{
+		out << "y cache priority list has " << _yCountPriority.size()
+			<< " entries, expected " << nonZero << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// OrganizerStats
+
+unsigned OrganizerStats::sizeBucket(uint64_t area)
+{
+	unsigned bucket = 0;
+	while (area > 1 && bucket + 1 < XT_SLOT_SIZE_BUCKETS)
+	{
+		area >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+// BuddyOrganizer
+
+BuddyOrganizer::BuddyOrganizer(Size size) :
+	_size(size),
+	_rootSide(0),
+	_levels(0),
+	_stats{ 0, 0, 0, 0, 0, { 0, 0 }, {} }
+{
+	auto shortSide = std::min(size.width, size.height);
+	if (shortSide == 0)
+	{
+		return;
+	}
+
+	// A level for every block side down to the smallest, or just the roots
+	_rootSide = 1;
+	while (_rootSide * 2 <= shortSide)
+	{
+		_rootSide *= 2;
+	}
+	_levels = 1;
+	while ((_rootSide >> _levels) >= XT_BUDDY_MIN_SIZE)
+	{
+		_levels++;
+	}
+
+	addRoots({ 0, 0, size.width, size.height });
+	_freeNodes.resize(_levels);
+	clear();
+}
+
+// Strips too narrow for the smallest block are never handed out
+void BuddyOrganizer::addRoots(Rect area)
+{
+	unsigned level = 0;
+	auto side = _rootSide;
+	while (side > area.width || side > area.height)
+	{
+		side /= 2;
+		level++;
+	}
+	if (level >= _levels || side == 0)
+	{
+		return;
+	}
+
+	auto columns = area.width / side;
+	auto rows = area.height / side;
+	for (unsigned row = 0; row < rows; row++)
+	{
+		for (unsigned column = 0; column < columns; column++)
+		{
+			_roots.push_back({
+				area.x + column * side, area.y + row * side, side, side });
+			_nodes.push_back({ { 0, 0 }, 1, 0, 0,
+				static_cast<uint8_t>(level), Free });
+			_stats.totalArea += uint64_t{ side } * side;
+		}
+	}
+
+	// The strip at the right, then the one along the bottom
+	addRoots({
+		area.x + columns * side,
+		area.y,
+		area.width - columns * side,
+		rows * side });
+	addRoots({
+		area.x,
+		area.y + rows * side,
+		area.width,
+		area.height - rows * side });
+}
+
+Rect BuddyOrganizer::nodeRect(uint32_t node) const
+{
+	auto side = _rootSide >> _nodes[node].level;
+
+	// Each quadrant on the way up to the root adds twice what the last did
+	unsigned x = 0;
+	unsigned y = 0;
+	for (auto quarter = side; node >= _roots.size(); quarter *= 2)
+	{
+		auto quadrant = (node - _roots.size()) % 4;
+		x += quadrant & 1 ? quarter : 0;
+		y += quadrant & 2 ? quarter : 0;
+		node = _quadParents[quadOf(node)];
+	}
+
+	auto &root = _roots[node];
+	return { root.x + x, root.y + y, side, side };
+}
+
+// Hands the node a quad of quarters, reusing one that was joined up before
+// so its generations carry on. Returns the first quarter.
+uint32_t BuddyOrganizer::split(uint32_t node)
+{
+	uint32_t quad;
+	if (!_freeQuads.empty())
+	{
+		quad = _freeQuads.back();
+		_freeQuads.pop_back();
+	}
+	else
+	{
+		quad = static_cast<uint32_t>(_quadParents.size());
+		_quadParents.push_back(0);
+		_nodes.resize(_nodes.size() + 4, { { 0, 0 }, 1, 0, 0, 0, Unused });
+	}
+
+	auto first = firstOfQuad(quad);
+	_quadParents[quad] = node;
+	for (auto child = first; child < first + 4; child++)
+	{
+		_nodes[child].level = static_cast<uint8_t>(_nodes[node].level + 1);
+	}
+	_nodes[node].state = Split;
+	_nodes[node].children = first;
+	return first;
+}
+
+void BuddyOrganizer::pushFree(uint32_t node, unsigned level)
+{
+	auto &nodes = _freeNodes[level];
+	_nodes[node].state = Free;
+	_nodes[node].freePosition = static_cast<uint32_t>(nodes.size());
+	nodes.push_back(node);
+}
+
+void BuddyOrganizer::removeFree(uint32_t node, unsigned level)
+{
+	auto &nodes = _freeNodes[level];
+	auto position = _nodes[node].freePosition;
+	nodes[position] = nodes.back();
+	_nodes[nodes[position]].freePosition = position;
+	nodes.pop_back();
+}
+
+void BuddyOrganizer::countSlot(Size size, unsigned side, bool added)
+{
+	auto area = uint64_t{ size.width } * size.height;
+	auto reserved = uint64_t{ side } * side;
+	auto &bucket = _stats.slotSizes[OrganizerStats::sizeBucket(area)];
+	if (added)
+	{
+		_stats.usedArea += area;
+		_stats.reservedArea += reserved;
+		_stats.slotCount++;
+		bucket++;
+	}
+	else
+	{
+		_stats.usedArea -= area;
+		_stats.reservedArea -= reserved;
+		_stats.slotCount--;
+		bucket--;
+	}
+}
+
+// Like a search organizer's slab, the quads go and handles start over
+void BuddyOrganizer::clear()
+{
+	for (auto &nodes : _freeNodes)
+	{
+		nodes.clear();
+	}
+
+	_nodes.resize(_roots.size());
+	_quadParents.clear();
+	_freeQuads.clear();
+
+	// Roots go on last first so claims start from the top left
+	for (auto root = _roots.size(); root-- > 0; )
+	{
+		pushFree(static_cast<uint32_t>(root), _nodes[root].level);
+	}
+
+	_stats.usedArea = 0;
+	_stats.reservedArea = 0;
+	_stats.slotCount = 0;
+	_stats.slotSizes.fill(0);
+}
+
+SlotSearchResult BuddyOrganizer::tryClaimSlot(Size size)
+{
+	TraceScope trace(
+		"BuddyOrganizer::tryClaimSlot",
+		"width", size.width,
+		"height", size.height);
+
+	if (size.width == 0 || size.height == 0)
+	{
+		return SlotSearchResult::notFound();
+	}
+
+	auto longSide = std::max(size.width, size.height);
+	if (_levels == 0 || longSide > _rootSide)
+	{
+		_stats.failedClaims++;
+		return SlotSearchResult::notFound();
+	}
+
+	// The deepest level with blocks the rect fits in is its size class
+	auto level = _levels - 1;
+	while ((_rootSide >> level) < longSide)
+	{
+		level--;
+	}
+
+	// Split the smallest free block that's big enough down to that level
+	auto from = level + 1;
+	while (from > 0 && _freeNodes[from - 1].empty())
+	{
+		from--;
+	}
+	if (from == 0)
+	{
+		_stats.failedClaims++;
+		return SlotSearchResult::notFound();
+	}
+
+	from--;
+	auto node = _freeNodes[from].back();
+	removeFree(node, from);
+	for (; from < level; from++)
+	{
+		// Keep the top left quarter and free the rest, last first
+		auto first = split(node);
+		for (auto child = first + 3; child > first; child--)
+		{
+			pushFree(child, from + 1);
+		}
+		node = first;
+	}
+
+	auto &claimed = _nodes[node];
+	claimed.state = Claimed;
+	claimed.claimedSize = size;
+	countSlot(size, _rootSide >> level, true);
+
+	auto rect = nodeRect(node);
+	rect.width = size.width;
+	rect.height = size.height;
+	return SlotSearchResult::found({ rect, handle(node, claimed.generation) });
+}
+
+bool BuddyOrganizer::releaseSlot(uint64_t index)
+{
+	if (!isClaimed(index))
+	{
+		return false;
+	}
+
+	auto node = static_cast<uint32_t>(index);
+	unsigned level = _nodes[node].level;
+	countSlot(_nodes[node].claimedSize, _rootSide >> level, false);
+
+	// Generation 0 is skipped when it wraps so no handle is ever all zeros
+	auto &generation = _nodes[node].generation;
+	generation++;
+	if (generation == 0)
+	{
+		generation = 1;
+	}
+
+	// Join up with the buddies for as long as all four quarters are free
+	for (; node >= _roots.size(); level--)
+	{
+		auto quad = quadOf(node);
+		auto first = firstOfQuad(quad);
+		bool isJoined = true;
+		for (auto buddy = first; buddy < first + 4; buddy++)
+		{
+			isJoined = isJoined
+				&& (buddy == node || _nodes[buddy].state == Free);
+		}
+		if (!isJoined)
+		{
+			break;
+		}
+
+		for (auto buddy = first; buddy < first + 4; buddy++)
+		{
+			if (buddy != node)
+			{
+				removeFree(buddy, level);
+			}
+			_nodes[buddy].state = Unused;
+		}
+		_freeQuads.push_back(quad);
+		node = _quadParents[quad];
+	}
+
+	pushFree(node, level);
+	return true;
+}
+
+bool BuddyOrganizer::isClaimed(uint64_t index) const
+{
+	auto node = static_cast<uint32_t>(index);
+	return node < _nodes.size()
+		&& _nodes[node].state == Claimed
+		&& _nodes[node].generation == static_cast<uint32_t>(index >> 32);
+}
+
+bool BuddyOrganizer::isClaimed(const Slot &slot) const
+{
+	if (!isClaimed(slot.index))
+	{
+		return false;
+	}
+
+	auto node = static_cast<uint32_t>(slot.index);
+	auto rect = nodeRect(node);
+	rect.width = _nodes[node].claimedSize.width;
+	rect.height = _nodes[node].claimedSize.height;
+	auto expected = slot.rect;
+	return rect == expected;
+}
+
+OrganizerStats BuddyOrganizer::stats()
+{
+	_stats.largestFreeRect = { 0, 0 };
+	for (unsigned level = 0; level < _levels; level++)
+	{
+		if (!_freeNodes[level].empty())
+		{
+			auto side = _rootSide >> level;
+			_stats.largestFreeRect = { side, side };
+			break;
+		}
+	}
+
+	return _stats;
+}
+
+// Levels and children aren't written since the quad parents give them back
+void BuddyOrganizer::save(std::ostream &out) const
+{
+	writeBinary(out, _size);
+	writeBinary(out, static_cast<uint32_t>(_nodes.size()));
+	for (auto &node : _nodes)
+	{
+		writeBinary(out, node.state);
+		writeBinary(out, node.generation);
+		writeBinary(out, node.claimedSize);
+	}
+	writeArray(out, _quadParents);
+	writeBinary(out, static_cast<uint32_t>(_freeQuads.size()));
+	writeArray(out, _freeQuads);
+	for (auto &nodes : _freeNodes)
+	{
+		writeBinary(out, static_cast<uint32_t>(nodes.size()));
+		writeArray(out, nodes);
+	}
+}
+
+// Checked like a search organizer's load, since a quad hung off the wrong
+// block would only show later as two claims on the same pixels
+bool BuddyOrganizer::load(std::istream &in)
+{
+	std::ostringstream problems;
+	if (!loadNodes(in) || !verify(problems))
+	{
+		if (!problems.str().empty())
+		{
+			std::cout << "failed to load buddy organizer: "
+				<< problems.str();
+		}
+		clear();
+		return false;
+	}
+	return true;
+}
+
+bool BuddyOrganizer::loadNodes(std::istream &in)
+{
+	clear();
+
+	Size size;
+	uint32_t nodeCount;
+	if (!readBinary(in, size)
+		|| size.width != _size.width
+		|| size.height != _size.height
+		|| !readBinary(in, nodeCount)
+		|| nodeCount < _roots.size()
+		|| (nodeCount - _roots.size()) % 4 != 0)
+	{
+		return false;
+	}
+
+	// Grown as it's read so a corrupt count runs out of stream first
+	for (uint32_t i = 0; i < nodeCount; i++)
+	{
+		BuddyNode node{ { 0, 0 }, 0, 0, 0, 0, Unused };
+		if (!readBinary(in, node.state)
+			|| !readBinary(in, node.generation)
+			|| !readBinary(in, node.claimedSize)
+			|| node.state > Claimed
+			|| (i < _roots.size() && node.state == Unused))
+		{
+			return false;
+		}
+
+		if (i < _roots.size())
+		{
+			node.level = _nodes[i].level;
+			_nodes[i] = node;
+		}
+		else
+		{
+			_nodes.push_back(node);
+		}
+	}
+
+	auto quadCount = (nodeCount - _roots.size()) / 4;
+	uint32_t freeQuadCount;
+	if (!readArray(in, _quadParents, quadCount)
+		|| !isEachBelow(_quadParents, nodeCount)
+		|| !readBinary(in, freeQuadCount)
+		|| !readArray(in, _freeQuads, freeQuadCount)
+		|| !isEachBelow(_freeQuads, quadCount))
+	{
+		return false;
+	}
+
+	// Every quad that's in use hangs off a split node that has no other
+	for (uint32_t quad = 0; quad < quadCount; quad++)
+	{
+		auto first = firstOfQuad(quad);
+		if (_nodes[first].state == Unused)
+		{
+			continue;
+		}
+
+		auto &parent = _nodes[_quadParents[quad]];
+		if (parent.state != Split || parent.children != 0)
+		{
+			return false;
+		}
+		parent.children = first;
+	}
+
+	// Levels follow the tree down from the roots, which has to reach every
+	// split node since a split node with no quad was never split
+	std::vector<uint32_t> stack;
+	for (uint32_t root = 0; root < _roots.size(); root++)
+	{
+		stack.push_back(root);
+	}
+	while (!stack.empty())
+	{
+		auto &node = _nodes[stack.back()];
+		stack.pop_back();
+		if (node.state != Split)
+		{
+			continue;
+		}
+		if (node.children == 0 || node.level + 1u >= _levels)
+		{
+			return false;
+		}
+
+		for (auto child = node.children; child < node.children + 4; child++)
+		{
+			_nodes[child].level = static_cast<uint8_t>(node.level + 1);
+			stack.push_back(child);
+		}
+	}
+
+	for (unsigned level = 0; level < _levels; level++)
+	{
+		uint32_t count;
+		auto &nodes = _freeNodes[level];
+		if (!readBinary(in, count)
+			|| !readArray(in, nodes, count)
+			|| !isEachBelow(nodes, nodeCount))
+		{
+			return false;
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			_nodes[nodes[i]].freePosition = i;
+		}
+	}
+
+	for (uint32_t node = 0; node < nodeCount; node++)
+	{
+		if (_nodes[node].state == Claimed)
+		{
+			countSlot(
+				_nodes[node].claimedSize,
+				_rootSide >> _nodes[node].level,
+				true);
+		}
+	}
+
+	return true;
+}
+
+bool BuddyOrganizer::verify(std::ostream &out) const
+{
+	size_t freeCount = 0;
+	for (unsigned level = 0; level < _levels; level++)
+	{
+		auto &nodes = _freeNodes[level];
+		for (uint32_t i = 0; i < nodes.size(); i++)
+		{
+			auto node = nodes[i];
+			if (node >= _nodes.size()
+				|| _nodes[node].state != Free
+				|| _nodes[node].level != level
+				|| _nodes[node].freePosition != i)
+			{
+				out << "free list entry " << node << " on level " << level
+					<< " is wrong" << std::endl;
+				return false;
+			}
+		}
+		freeCount += nodes.size();
+	}
+
+	size_t nodeFreeCount = 0;
+	size_t unusedCount = 0;
+	for (auto &node : _nodes)
+	{
+		nodeFreeCount += node.state == Free;
+		unusedCount += node.state == Unused;
+	}
+	if (nodeFreeCount != freeCount)
+	{
+		out << "a free block isn't on its free list" << std::endl;
+		return false;
+	}
+
+	for (auto quad : _freeQuads)
+	{
+		if (quad >= _quadParents.size()
+			|| _nodes[firstOfQuad(quad)].state != Unused)
+		{
+			out << "quad " << quad << " is waiting to be split off but is "
+				<< "in use" << std::endl;
+			return false;
+		}
+	}
+
+	OrganizerStats counted{};
+	size_t quadCount = 0;
+	for (uint32_t root = 0; root < _roots.size(); root++)
+	{
+		if (!verifyNode(root, _nodes[root].level, counted, quadCount, out))
+		{
+			return false;
+		}
+	}
+
+	// Each quad is either in the tree or waiting, and only once
+	if (quadCount + _freeQuads.size() != _quadParents.size()
+		|| unusedCount != _freeQuads.size() * 4)
+	{
+		out << quadCount << " quads are in use and " << _freeQuads.size()
+			<< " are waiting to be split off, of " << _quadParents.size()
+			<< std::endl;
+		return false;
+	}
+
+	if (counted.slotCount != _stats.slotCount
+		|| counted.usedArea != _stats.usedArea
+		|| counted.reservedArea != _stats.reservedArea)
+	{
+		out << "blocks hold " << counted.slotCount << " slots using "
+			<< counted.usedArea << " of " << counted.reservedArea
+			<< ", stats count " << _stats.slotCount << " using "
+			<< _stats.usedArea << " of " << _stats.reservedArea << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool BuddyOrganizer::verifyNode(
+	uint32_t node,
+	unsigned level,
+	OrganizerStats &counted,
+	size_t &quadCount,
+	std::ostream &out) const
+{
+	auto &block = _nodes[node];
+	if (block.state == Unused || block.level != level)
+	{
+		out << "block " << node << " on level " << level << " is marked "
+			<< (block.state == Unused ? "unused" : "with the wrong level")
+			<< std::endl;
+		return false;
+	}
+
+	// A slot gets the smallest block it fits in
+	auto side = _rootSide >> level;
+	if (block.state == Claimed)
+	{
+		auto size = block.claimedSize;
+		auto longSide = std::max(size.width, size.height);
+		if (size.width == 0 || size.height == 0 || longSide > side
+			|| (level + 1 < _levels && longSide <= side / 2))
+		{
+			out << "slot " << size.width << "x" << size.height
+				<< " is in a block of side " << side << std::endl;
+			return false;
+		}
+
+		counted.slotCount++;
+		counted.usedArea += uint64_t{ size.width } * size.height;
+		counted.reservedArea += uint64_t{ side } * side;
+	}
+
+	if (block.state != Split)
+	{
+		return true;
+	}
+
+	auto first = block.children;
+	if (level + 1 >= _levels
+		|| first < _roots.size()
+		|| first + 3 >= _nodes.size()
+		|| (first - _roots.size()) % 4 != 0
+		|| _quadParents[quadOf(first)] != node)
+	{
+		out << "block " << nodeRect(node) << " is split into quarters that "
+			<< "don't belong to it" << std::endl;
+		return false;
+	}
+
+	if (_nodes[first].state == Free && _nodes[first + 1].state == Free
+		&& _nodes[first + 2].state == Free && _nodes[first + 3].state == Free)
+	{
+		out << "block " << nodeRect(node) << " wasn't joined up after its "
+			<< "quarters were freed" << std::endl;
+		return false;
+	}
+
+	quadCount++;
+	for (auto child = first; child < first + 4; child++)
+	{
+		if (!verifyNode(child, level + 1, counted, quadCount, out))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// RectangleOrganizer
+
+// Spacial index blocks keep slot edges as 16 bit values
+static Size organizerSize(Size size)
+{
+	Size limited{
+		std::min<unsigned>(size.width, XT_ORGANIZER_MAX_SIZE),
+		std::min<unsigned>(size.height, XT_ORGANIZER_MAX_SIZE) };
+	if (limited.width != size.width || limited.height != size.height)
+	{
+		std::cout << "organizer size " << size.width << "x" << size.height
+			<< " cut down to " << limited.width << "x" << limited.height
+			<< std::endl;
+	}
+	return limited;
+}
+
+RectangleOrganizer::RectangleOrganizer(Size size, OrganizerOptions options) :
+	_size(organizerSize(size)),
+	_options(options),
+	_spacialIndex(
+		_size, { SPACIAL_INDEX_BLOCK_WIDTH, SPACIAL_INDED_BLOCK_HEIGHT }),
+	_yCache(_size.height),
+	_stats{ uint64_t{ _size.width } * _size.height, 0, 0, 0, 0, _size, {} },
+	_freeRectStale(false),
+	_moved(false)
+{
+	_options.shelfHeightStep = std::max(1u, _options.shelfHeightStep);
+	if (_options.kind == OrganizerKind::Buddy)
+	{
+		_buddy.reset(new BuddyOrganizer(_size));
+	}
+}
+
+RectangleOrganizer::RectangleOrganizer(RectangleOrganizer &&other) :
+	_size(other._size),
+	_options(other._options),
+	_buddy(std::move(other._buddy)),
+	_slab(std::move(other._slab)),
+	_freePlaces(std::move(other._freePlaces)),
+	_spacialIndex(std::move(other._spacialIndex)),
+	_yCache(std::move(other._yCache)),
+	_shelves(std::move(other._shelves)),
+	_freeShelves(std::move(other._freeShelves)),
+	_openShelves(std::move(other._openShelves)),
+	_shelfItems(std::move(other._shelfItems)),
+	_freeShelfItems(std::move(other._freeShelfItems)),
+	_stats(other._stats),
+	_freeRectStale(other._freeRectStale),
+	_moved(false)
+{
+	other._moved = true;
+}
+
+Slot RectangleOrganizer::addSlot(Rect rect)
+{
+	// Reuse the most recently freed place, it's the likeliest to be cached
+	uint32_t place;
+	if (_freePlaces.empty())
+	{
+		place = static_cast<uint32_t>(_slab.size());
+		_slab.push_back({ rect, 1, true });
+	}
+	else
+	{
+		place = _freePlaces.back();
+		_freePlaces.pop_back();
+		_slab[place].rect = rect;
+		_slab[place].isClaimed = true;
+	}
+
+	_spacialIndex.add(place, rect);
+	_yCache.increment(rect.endY() + 1);
+	_yCache.increment(rect.y);
+	_freeRectStale = true;
+	return { rect, handle(place, _slab[place].generation) };
+}
+
+void RectangleOrganizer::removeSlot(uint32_t place)
+{
+	auto &slot = _slab[place];
+	_yCache.decrement(slot.rect.endY() + 1);
+	_yCache.decrement(slot.rect.y);
+	_spacialIndex.remove(place, slot.rect);
+	_freeRectStale = true;
+
+	// Generation 0 is skipped when it wraps so no handle is ever all zeros
+	slot.isClaimed = false;
+	slot.generation++;
+	if (slot.generation == 0)
+	{
+		slot.generation = 1;
+	}
+	_freePlaces.push_back(place);
+}
+
+void RectangleOrganizer::countSlot(Rect rect, bool added)
+{
+	auto area = uint64_t{ rect.width } * rect.height;
+	auto &bucket = _stats.slotSizes[OrganizerStats::sizeBucket(area)];
+	if (added)
+	{
+		_stats.usedArea += area;
+		_stats.reservedArea += area;
+		_stats.slotCount++;
+		bucket++;
+	}
+	else
+	{
+		_stats.usedArea -= area;
+		_stats.reservedArea -= area;
+		_stats.slotCount--;
+		bucket--;
+	}
+	_freeRectStale = true;
+}
+
+void RectangleOrganizer::clear()
+{
+	if (_buddy)
+	{
+		_buddy->clear();
+		return;
+	}
+
+	_slab.clear();
+	_freePlaces.clear();
+	_spacialIndex.clear();
+	_yCache.clear();
+	_shelves.clear();
+	_freeShelves.clear();
+	_openShelves.clear();
+	_shelfItems.clear();
+	_freeShelfItems.clear();
+
+	_stats.usedArea = 0;
+	_stats.reservedArea = 0;
+	_stats.slotCount = 0;
+	_stats.slotSizes.fill(0);
+	_stats.largestFreeRect = _size;
+	_freeRectStale = false;
+}
+
+OrganizerStats RectangleOrganizer::stats()
+{
+	if (_buddy)
+	{
+		return _buddy->stats();
+	}
+
+	if (_freeRectStale)
+	{
+		_stats.largestFreeRect = findLargestFreeRect();
+		_freeRectStale = false;
+	}
+
+	return _stats;
+}
+
+Size RectangleOrganizer::findLargestFreeRect()
+{
+	auto cellWidth = std::max(
+		1u, (_size.width + XT_FREE_RECT_GRID - 1) / XT_FREE_RECT_GRID);
+	auto cellHeight = std::max(
+		1u, (_size.height + XT_FREE_RECT_GRID - 1) / XT_FREE_RECT_GRID);
+	auto columns = _size.width / cellWidth;
+	auto rows = _size.height / cellHeight;
+	if (columns == 0 || rows == 0)
+	{
+		return { 0, 0 };
+	}
+
+	// A cell is only free if no slot touches any of it
+	std::vector<uint8_t> used(static_cast<size_t>(columns) * rows, 0);
+	for (auto &slot : _slab)
+	{
+		if (!slot.isClaimed)
+		{
+			continue;
+		}
+
+		auto rect = slot.rect;
+		auto right = std::min(rect.endX() / cellWidth, columns - 1);
+		auto bottom = std::min(rect.endY() / cellHeight, rows - 1);
+		for (auto y = rect.y / cellHeight; y <= bottom; y++)
+		{
+			for (auto x = rect.x / cellWidth; x <= right; x++)
+			{
+				used[static_cast<size_t>(y) * columns + x] = 1;
+			}
+		}
+	}
+
+	// Largest rectangle under the histogram of free cells above each row
+	std::vector<unsigned> heights(columns + 1, 0);
+	std::vector<unsigned> stack;
+	Size largest{ 0, 0 };
+	uint64_t largestArea = 0;
+	for (unsigned y = 0; y < rows; y++)
+	{
+		for (unsigned x = 0; x < columns; x++)
+		{
+			heights[x] = used[static_cast<size_t>(y) * columns + x]
+				? 0 : heights[x] + 1;
+		}
+
+		stack.clear();
+		for (unsigned x = 0; x <= columns; x++)
+		{
+			while (!stack.empty() && heights[stack.back()] >= heights[x])
+			{
+				auto height = heights[stack.back()];
+				stack.pop_back();
+				auto left = stack.empty() ? 0 : stack.back() + 1;
+				Size size{ (x - left) * cellWidth, height * cellHeight };
+				auto area = uint64_t{ size.width } * size.height;
+				if (area > largestArea)
+				{
+					largestArea = area;
+					largest = size;
+				}
+			}
+			stack.push_back(x);
+		}
+	}
+
+	return largest;
+}
+
+void RectangleOrganizer::save(std::ostream &out) const
+{
+	writeBinary(out, static_cast<uint8_t>(_options.kind));
+	if (_buddy)
+	{
+		_buddy->save(out);
+		return;
+	}
+
+	writeBinary(out, _size);
+	writeBinary(out, static_cast<uint32_t>(_slab.size()));
+	for (auto &slot : _slab)
+	{
+		writeBinary(out, slot.rect);
+		writeBinary(out, slot.generation);
+		writeBinary(out, static_cast<uint8_t>(slot.isClaimed));
+	}
+
+	writeBinary(out, static_cast<uint32_t>(_freePlaces.size()));
+	for (auto place : _freePlaces)
+	{
+		writeBinary(out, place);
+	}
+
+	_spacialIndex.save(out);
+	_yCache.save(out);
+	saveShelves(out);
+}
+
+bool RectangleOrganizer::load(std::istream &in)
+{
+	// A state can parse and still contradict itself, which would only show
+	// later as a claim or release going out of bounds
+	std::ostringstream problems;
+	if (!loadParts(in) || !verify(problems))
+	{
+		if (!problems.str().empty())
+		{
+			std::cout << "failed to load organizer: " << problems.str();
+		}
+		clear();
+		return false;
+	}
+	return true;
+}
+
+bool RectangleOrganizer::loadParts(std::istream &in)
+{
+	clear();
+
+	uint8_t kind;
+	if (!readBinary(in, kind) || kind != static_cast<uint8_t>(_options.kind))
+	{
+		return false;
+	}
+
+	if (_buddy)
+	{
+		return _buddy->load(in);
+	}
+
+	Size size;
+	uint32_t slabSize;
+	if (!readBinary(in, size)
+		|| size.width != _size.width
+		|| size.height != _size.height
+		|| !readBinary(in, slabSize))
+	{
+		return false;
+	}
+
+	// Slots are added as they're read, so a corrupt count runs out of
+	// stream before it runs out of memory
+	while (_slab.size() < slabSize)
+	{
+		SlabSlot slot;
+		uint8_t isClaimed;
+		if (!readBinary(in, slot.rect)
+			|| !readBinary(in, slot.generation)
+			|| !readBinary(in, isClaimed))
+		{
+			return false;
+		}
+
+		slot.isClaimed = isClaimed != 0;
+		if (slot.isClaimed)
+		{
+			countSlot(slot.rect, true);
+		}
+		_slab.push_back(slot);
+	}
+
+	uint32_t freeCount;
+	if (!readBinary(in, freeCount)
+		|| !readArray(in, _freePlaces, freeCount)
+		|| !isEachBelow(_freePlaces, _slab.size()))
+	{
+		return false;
+	}
+
+	return _spacialIndex.load(in) && _yCache.load(in) && loadShelves(in);
+}
+
+bool RectangleOrganizer::verify(std::ostream &out) const
+{
+	if (_buddy)
+	{
+		return _buddy->verify(out);
+	}
+
+	// Every free place is on the free list once and nothing else is
+	std::vector<bool> listed(_slab.size(), false);
+	for (auto place : _freePlaces)
+	{
+		if (place >= _slab.size() || _slab[place].isClaimed || listed[place])
+		{
+			out << "free list entry " << place
+				<< " is claimed or repeated" << std::endl;
+			return false;
+		}
+		listed[place] = true;
+	}
+
+	std::vector<Rect> rects;
+	rects.reserve(_slab.size());
+	for (uint32_t place = 0; place < _slab.size(); place++)
+	{
+		auto slot = _slab[place];
+		if (slot.generation == 0)
+		{
+			out << "slot " << place << " has generation 0" << std::endl;
+			return false;
+		}
+
+		if (!slot.isClaimed)
+		{
+			if (!listed[place])
+			{
+				out << "free slot " << place << " isn't on the free list"
+					<< std::endl;
+				return false;
+			}
+			continue;
+		}
+
+		if (slot.rect.width == 0 || slot.rect.height == 0
+			|| slot.rect.endX() >= _size.width
+			|| slot.rect.endY() >= _size.height)
+		{
+			out << "slot " << slot.rect << " is out of bounds" << std::endl;
+			return false;
+		}
+
+		rects.push_back(slot.rect);
+	}
+
+	// Shelves are slots in the slab but only their items are counted
+	if (!verifyShelves(out))
+	{
+		return false;
+	}
+
+	uint64_t slotCount = rects.size();
+	for (auto &shelf : _shelves)
+	{
+		slotCount -= shelf.isLive;
+	}
+	for (auto &item : _shelfItems)
+	{
+		slotCount += item.isClaimed;
+	}
+
+	if (slotCount != _stats.slotCount)
+	{
+		out << "organizer has " << slotCount << " slots, stats count "
+			<< _stats.slotCount << std::endl;
+		return false;
+	}
+
+	// Sweep from left to right so only rects that share columns are compared
+	std::sort(rects.begin(), rects.end(), [](const Rect &a, const Rect &b)
+	{
+		return a.x < b.x;
+	});
+	for (size_t i = 0; i < rects.size(); i++)
+	{
+		for (auto j = i + 1; j < rects.size(); j++)
+		{
+			if (rects[j].x > rects[i].endX())
+			{
+				break;
+			}
+
+			if (rects[j].y <= rects[i].endY() && rects[i].y <= rects[j].endY())
+			{
+				out << "slots " << rects[i] << " and " << rects[j]
+					<< " overlap" << std::endl;
+				return false;
+			}
+		}
+	}
+
+	return _spacialIndex.verify(_slab, out)
+		&& _yCache.verify(_slab, out);
+}
+
+bool RectangleOrganizer::empty()
+{
+	return _freePlaces.size() == _slab.size();
+}
+
+SlotSearchResult RectangleOrganizer::tryClaimSlot(Size size)
+{
+	if (_buddy)
+	{
+		return _buddy->tryClaimSlot(size);
+	}
+
+	TraceScope trace(
+		"RectangleOrganizer::tryClaimSlot",
+		"width", size.width,
+		"height", size.height);
+
+	// if height or width is zero then it isn't even valid so give up
+	if (size.height <= 0 || size.width <= 0)
+	{
+		return SlotSearchResult::notFound();
+	}
+
+	// if it couldn't possibly fit then give up right away
+	if (size.width > _size.width || size.height > _size.height)
+	{
+		_stats.failedClaims++;
+		return SlotSearchResult::notFound();
+	}
+
+	// short rects go on a shelf, or anywhere else once no new shelf fits
+	if (size.height <= _options.shelfMaxHeight
+		&& size.width <= std::min(_options.shelfWidth, _size.width))
+	{
+		auto result = claimOnShelf(size);
+		if (result.isFound)
+		{
+			return result;
+		}
+	}
+
+	auto result = claimSlot(size);
+	if (result.isFound)
+	{
+		countSlot(result.slot.rect, true);
+	}
+	else
+	{
+		_stats.failedClaims++;
+	}
+
+	return result;
+}
+
+SlotSearchResult RectangleOrganizer::claimSlot(Size size)
+{
+	// if the whole thing is empty then just put at 0,0
+	if (empty())
+	{
+		return SlotSearchResult::found(
+			addSlot({ 0, 0, size.width, size.height }));
+	}
+
+	// try every usable y value in priority order
+	auto result = SlotSearchResult::notFound();
+	auto resultRef = &result;
+	_yCache.withYValuesInPriorityOrder([this, size, resultRef](unsigned y)
+	{
+		auto searchResult = search(y, size);
+		if (searchResult.isFound)
+		{
+			*resultRef = SlotSearchResult::found(
+				addSlot(searchResult.slot.rect));
+			return true;
+		}
+		return false;
+	});
+
+	return result;
+}
+
+SlotSearchResult RectangleOrganizer::search(unsigned y, Size size)
+{
+	auto result = SlotSearchResult::notFound();
+	auto pResult = &result;
+	withXOptions(y, [this, y, size, pResult](unsigned x) -> bool
+	{
+		Rect rect{ x, y, size.width, size.height };
+		if (isRectOpen(rect))
+		{
+			*pResult = SlotSearchResult::found({ rect, 0 });
+			return true;
+		}
+		return false;
+	});
+	return result;
+}
+
+bool RectangleOrganizer::releaseSlot(uint64_t index)
+{
+	if (_buddy)
+	{
+		return _buddy->releaseSlot(index);
+	}
+
+	if (!isClaimed(index))
+	{
+		return false;
+	}
+
+	auto place = placeOf(index);
+	if (isShelfItem(index))
+	{
+		releaseItem(place & ~shelfItemBit);
+		return true;
+	}
+
+	countSlot(_slab[place].rect, false);
+	removeSlot(place);
+	return true;
+}
+
+bool RectangleOrganizer::isClaimed(uint64_t index) const
+{
+	if (_buddy)
+	{
+		return _buddy->isClaimed(index);
+	}
+
+	auto place = placeOf(index);
+	if (isShelfItem(index))
+	{
+		place &= ~shelfItemBit;
+		return place < _shelfItems.size()
+			&& _shelfItems[place].isClaimed
+			&& _shelfItems[place].generation == generationOf(index);
+	}
+
+	return place < _slab.size()
+		&& _slab[place].isClaimed
+		&& _slab[place].generation == generationOf(index);
+}
+
+bool RectangleOrganizer::isClaimed(const Slot &slot) const
+{
+	if (_buddy)
+	{
+		return _buddy->isClaimed(slot);
+	}
+
+	if (!isClaimed(slot.index))
+	{
+		return false;
+	}
+
+	auto place = placeOf(slot.index) & ~shelfItemBit;
+	auto rect = isShelfItem(slot.index)
+		? _shelfItems[place].rect
+		: _slab[place].rect;
+	auto expected = slot.rect;
+	return rect == expected;
+}
+
+bool RectangleOrganizer::isRectOpen(Rect &rect)
+{
+	// if the rest starts in negative space then it is not open
+	if (rect.x < 0 || rect.y < 0)
+	{
+		return false;
+	}
+
+	// if rect would go off the edge of the texture space then it is not open
+	if (rect.endX() >= _size.width || rect.endY() >= _size.height)
+	{
+		return false;
+	}
+
+
+	// if the rect overlaps with any existing slot then it is not open
+	return !_spacialIndex.overlapsAny(rect);
+}
+
+void RectangleOrganizer::withXOptions(
+	unsigned y, std::function<bool(unsigned)> callback)
+{
+	if (callback(0))
+	{
+		return;
+	}
+
+	_spacialIndex.withSlotsOnYLine(y, [this, callback](uint32_t place)
+	{
+		auto slot = _slab[place];
+		if (slot.rect.x > 0 && callback(slot.rect.x))
+		{
+			return true;
+		}
+
+		auto endX = slot.rect.endX() + 1;
+		if (callback(endX))
+		{
+			return true;
+		}
+
+		return false;
+	});
+
+	_usedXOptions.clear();
+}
+
+static bool isSpanBefore(const Shelf::Span &a, const Shelf::Span &b)
+{
+	return a.x < b.x;
+}
+
+static unsigned lowestBit(uint64_t bits)
+{
+#if defined(__GNUC__)
+	return static_cast<unsigned>(__builtin_ctzll(bits));
+#else
+	unsigned bit = 0;
+	for (; (bits & 1) == 0; bits >>= 1)
+	{
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+// The narrowest bucket at least the width wide that holds a shelf, or the
+// number of buckets when none does
+static size_t firstOpenBucket(const ShelfClass &open, unsigned width)
+{
+	for (size_t word = width / 64; word < open.mask.size(); word++)
+	{
+		auto bits = open.mask[word];
+		if (word == width / 64)
+		{
+			bits &= ~uint64_t{ 0 } << width % 64;
+		}
+		if (bits != 0)
+		{
+			return word * 64 + lowestBit(bits);
+		}
+	}
+	return open.buckets.size();
+}
+
+static unsigned widestSpan(const std::vector<Shelf::Span> &spans)
+{
+	unsigned widest = 0;
+	for (auto &span : spans)
+	{
+		widest = std::max(widest, span.width);
+	}
+	return widest;
+}
+
+SlotSearchResult RectangleOrganizer::claimOnShelf(Size size)
+{
+	auto step = _options.shelfHeightStep;
+	auto height = std::min(
+		(size.height + step - 1) / step * step, _size.height);
+
+	// The newest shelf whose widest span fits the rect most closely
+	uint32_t shelfIndex = 0;
+	Rect rect;
+	auto &open = _openShelves[height];
+	auto bucket = firstOpenBucket(open, size.width);
+	auto isFound = bucket < open.buckets.size();
+	if (isFound)
+	{
+		shelfIndex = open.buckets[bucket].back();
+	}
+
+	if ((!isFound && !openShelf(height, shelfIndex))
+		|| !claimSpan(shelfIndex, size, rect))
+	{
+		return SlotSearchResult::notFound();
+	}
+
+	uint32_t place;
+	if (_freeShelfItems.empty())
+	{
+		place = static_cast<uint32_t>(_shelfItems.size());
+		_shelfItems.push_back({ rect, shelfIndex, 1, true });
+	}
+	else
+	{
+		place = _freeShelfItems.back();
+		_freeShelfItems.pop_back();
+		_shelfItems[place].rect = rect;
+		_shelfItems[place].shelf = shelfIndex;
+		_shelfItems[place].isClaimed = true;
+	}
+
+	_shelves[shelfIndex].itemCount++;
+	countSlot(rect, true);
+	return SlotSearchResult::found({
+		rect,
+		handle(place | shelfItemBit, _shelfItems[place].generation) });
+}
+
+bool RectangleOrganizer::claimSpan(
+	uint32_t shelfIndex, Size size, Rect &rect)
+{
+	auto &shelf = _shelves[shelfIndex];
+	auto &spans = shelf.freeSpans;
+	for (size_t i = 0; i < spans.size(); i++)
+	{
+		auto &span = spans[i];
+		if (span.width < size.width)
+		{
+			continue;
+		}
+
+		rect = { span.x, shelf.rect.y, size.width, size.height };
+		auto wasWidest = span.width == shelf.widestSpan;
+		span.x += size.width;
+		span.width -= size.width;
+		if (span.width == 0)
+		{
+			spans.erase(spans.begin() + i);
+		}
+
+		// Only the span that was cut can change which bucket the shelf is in
+		if (wasWidest)
+		{
+			removeOpenShelf(shelfIndex);
+			shelf.widestSpan = widestSpan(spans);
+			addOpenShelf(shelfIndex);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+bool RectangleOrganizer::openShelf(unsigned height, uint32_t &shelfIndex)
+{
+	auto result = claimSlot(
+		{ std::min(_options.shelfWidth, _size.width), height });
+	if (!result.isFound)
+	{
+		return false;
+	}
+
+	if (_freeShelves.empty())
+	{
+		shelfIndex = static_cast<uint32_t>(_shelves.size());
+		_shelves.emplace_back();
+	}
+	else
+	{
+		shelfIndex = _freeShelves.back();
+		_freeShelves.pop_back();
+	}
+
+	auto &shelf = _shelves[shelfIndex];
+	auto rect = result.slot.rect;
+	shelf.slot = result.slot.index;
+	shelf.rect = rect;
+	shelf.freeSpans.assign(1, { rect.x, rect.width });
+	shelf.itemCount = 0;
+	shelf.widestSpan = rect.width;
+	shelf.isLive = true;
+	addOpenShelf(shelfIndex);
+	return true;
+}
+
+void RectangleOrganizer::addOpenShelf(uint32_t shelfIndex)
+{
+	auto &shelf = _shelves[shelfIndex];
+	if (shelf.widestSpan == 0)
+	{
+		return;
+	}
+
+	auto &open = _openShelves[shelf.rect.height];
+	auto bucket = shelf.widestSpan;
+	if (open.buckets.size() <= bucket)
+	{
+		open.buckets.resize(bucket + 1);
+		open.mask.resize(bucket / 64 + 1, 0);
+	}
+	shelf.openPosition = static_cast<uint32_t>(open.buckets[bucket].size());
+	open.buckets[bucket].push_back(shelfIndex);
+	open.mask[bucket / 64] |= uint64_t{ 1 } << bucket % 64;
+}
+
+void RectangleOrganizer::removeOpenShelf(uint32_t shelfIndex)
+{
+	auto &shelf = _shelves[shelfIndex];
+	if (shelf.widestSpan == 0)
+	{
+		return;
+	}
+
+	// The last shelf of the bucket takes its place
+	auto &open = _openShelves[shelf.rect.height];
+	auto bucket = shelf.widestSpan;
+	auto &shelves = open.buckets[bucket];
+	auto last = shelves.back();
+	shelves[shelf.openPosition] = last;
+	_shelves[last].openPosition = shelf.openPosition;
+	shelves.pop_back();
+	if (shelves.empty())
+	{
+		open.mask[bucket / 64] &= ~(uint64_t{ 1 } << bucket % 64);
+	}
+}
+
+void RectangleOrganizer::releaseItem(uint32_t place)
+{
+	auto &item = _shelfItems[place];
+	auto shelfIndex = item.shelf;
+	auto &shelf = _shelves[shelfIndex];
+	auto &spans = shelf.freeSpans;
+	countSlot(item.rect, false);
+
+	item.isClaimed = false;
+	item.generation++;
+	if (item.generation == 0)
+	{
+		item.generation = 1;
+	}
+	_freeShelfItems.push_back(place);
+
+	// An empty shelf goes back to the texture for any size to use
+	removeOpenShelf(shelfIndex);
+	shelf.itemCount--;
+	if (shelf.itemCount == 0)
+	{
+		removeSlot(placeOf(shelf.slot));
+		spans.clear();
+		shelf.widestSpan = 0;
+		shelf.isLive = false;
+		_freeShelves.push_back(shelfIndex);
+		return;
+	}
+
+	// Put the columns back, joining the spans either side if they touch
+	Shelf::Span span{ item.rect.x, item.rect.width };
+	auto next = std::lower_bound(
+		spans.begin(), spans.end(), span, isSpanBefore);
+	unsigned joined;
+	if (next != spans.begin()
+		&& (next - 1)->x + (next - 1)->width == span.x)
+	{
+		auto previous = next - 1;
+		previous->width += span.width;
+		if (next != spans.end() && span.x + span.width == next->x)
+		{
+			previous->width += next->width;
+			spans.erase(next);
+		}
+		joined = previous->width;
+	}
+	else if (next != spans.end() && span.x + span.width == next->x)
+	{
+		next->x = span.x;
+		next->width += span.width;
+		joined = next->width;
+	}
+	else
+	{
+		spans.insert(next, span);
+		joined = span.width;
+	}
+
+	shelf.widestSpan = std::max(shelf.widestSpan, joined);
+	addOpenShelf(shelfIndex);
+}
+
+bool RectangleOrganizer::verifyShelves(std::ostream &out) const
+{
+	std::vector<bool> listed(_shelves.size(), false);
+	for (auto shelfIndex : _freeShelves)
+	{
+		if (shelfIndex >= _shelves.size() || _shelves[shelfIndex].isLive
+			|| listed[shelfIndex])
+		{
+			out << "free shelf entry " << shelfIndex
+				<< " is live or repeated" << std::endl;
+			return false;
+		}
+		listed[shelfIndex] = true;
+	}
+
+	// Every column of a shelf is in exactly one item or free span
+	std::vector<std::vector<Shelf::Span>> used(_shelves.size());
+	std::vector<uint32_t> itemCounts(_shelves.size(), 0);
+	std::vector<bool> listedItems(_shelfItems.size(), false);
+	for (auto place : _freeShelfItems)
+	{
+		if (place >= _shelfItems.size() || _shelfItems[place].isClaimed
+			|| listedItems[place])
+		{
+			out << "free shelf item entry " << place
+				<< " is claimed or repeated" << std::endl;
+			return false;
+		}
+		listedItems[place] = true;
+	}
+
+	for (uint32_t place = 0; place < _shelfItems.size(); place++)
+	{
+		auto item = _shelfItems[place];
+		if (item.generation == 0 || item.isClaimed == listedItems[place])
+		{
+			out << "shelf item " << place << " has generation 0 or "
+				<< "doesn't match the free list" << std::endl;
+			return false;
+		}
+
+		if (!item.isClaimed)
+		{
+			continue;
+		}
+
+		if (item.shelf >= _shelves.size() || !_shelves[item.shelf].isLive)
+		{
+			out << "shelf item " << item.rect << " is on a dead shelf"
+				<< std::endl;
+			return false;
+		}
+
+		auto shelfRect = _shelves[item.shelf].rect;
+		if (item.rect.y != shelfRect.y
+			|| item.rect.height > shelfRect.height
+			|| item.rect.width == 0 || item.rect.height == 0)
+		{
+			out << "shelf item " << item.rect << " doesn't fit shelf "
+				<< shelfRect << std::endl;
+			return false;
+		}
+
+		used[item.shelf].push_back({ item.rect.x, item.rect.width });
+		itemCounts[item.shelf]++;
+	}
+
+	size_t openCount = 0;
+	for (uint32_t shelfIndex = 0; shelfIndex < _shelves.size(); shelfIndex++)
+	{
+		auto &shelf = _shelves[shelfIndex];
+		if (!shelf.isLive)
+		{
+			if (!listed[shelfIndex])
+			{
+				out << "dead shelf " << shelfIndex
+					<< " isn't on the free list" << std::endl;
+				return false;
+			}
+			continue;
+		}
+
+		auto rect = shelf.rect;
+		auto slabRect = isShelfItem(shelf.slot) || !isClaimed(shelf.slot)
+			? Rect{ 0, 0, 0, 0 }
+			: _slab[placeOf(shelf.slot)].rect;
+		if (!(rect == slabRect))
+		{
+			out << "shelf " << rect << " isn't claimed in the slab"
+				<< std::endl;
+			return false;
+		}
+
+		if (shelf.itemCount == 0 || shelf.itemCount != itemCounts[shelfIndex])
+		{
+			out << "shelf " << rect << " counts " << shelf.itemCount
+				<< " items, holds " << itemCounts[shelfIndex] << std::endl;
+			return false;
+		}
+
+		auto &spans = shelf.freeSpans;
+		for (size_t i = 0; i < spans.size(); i++)
+		{
+			if (spans[i].width == 0
+				|| (i > 0 && spans[i - 1].x + spans[i - 1].width >= spans[i].x))
+			{
+				out << "shelf " << rect << " has empty, unsorted or "
+					<< "touching free spans" << std::endl;
+				return false;
+			}
+		}
+
+		auto &columns = used[shelfIndex];
+		columns.insert(columns.end(), spans.begin(), spans.end());
+		std::sort(columns.begin(), columns.end(), isSpanBefore);
+		auto x = rect.x;
+		for (auto &span : columns)
+		{
+			if (span.x != x)
+			{
+				out << "shelf " << rect << " has a gap or overlap at x " << x
+					<< std::endl;
+				return false;
+			}
+			x += span.width;
+		}
+		if (x != rect.x + rect.width)
+		{
+			out << "shelf " << rect << " ends at x " << x << std::endl;
+			return false;
+		}
+
+		auto widest = widestSpan(spans);
+		auto found = _openShelves.find(rect.height);
+		if (shelf.widestSpan != widest
+			|| (widest > 0
+				&& (found == _openShelves.end()
+					|| widest >= found->second.buckets.size()
+					|| shelf.openPosition
+						>= found->second.buckets[widest].size()
+					|| found->second.buckets[widest][shelf.openPosition]
+						!= shelfIndex)))
+		{
+			out << "shelf " << rect << " isn't in the open bucket for its "
+				<< "widest span of " << widest << std::endl;
+			return false;
+		}
+		openCount += widest > 0;
+	}
+
+	// Open shelves were each found in their bucket, so any extra entries are
+	// repeats or dead shelves
+	size_t listedOpen = 0;
+	for (auto &open : _openShelves)
 	{
-		if (callback(_yCountPriority[i].y))
+		auto &buckets = open.second.buckets;
+		for (size_t bucket = 0; bucket < buckets.size(); bucket++)
 		{
-			break;
+			auto isMarked = bucket / 64 < open.second.mask.size()
+				&& (open.second.mask[bucket / 64] >> bucket % 64 & 1) != 0;
+			if (isMarked == buckets[bucket].empty())
+			{
+				out << "open bucket " << bucket << " for height "
+					<< open.first << " doesn't match its mask bit"
+					<< std::endl;
+				return false;
+			}
+			listedOpen += buckets[bucket].size();
 		}
 	}
-}
-
-// RectangleOrganizer
-
-RectangleOrganizer::RectangleOrganizer(Size size) :
-	_size(size),
-	_nextIndex(0),
-	_spacialIndex(
-		size, { SPACIAL_INDEX_BLOCK_WIDTH, SPACIAL_INDED_BLOCK_HEIGHT }),
-	_yCache(size.height),
-	_moved(false)
-{ }
-
-RectangleOrganizer::RectangleOrganizer(RectangleOrganizer &&other) :
-	_size(other._size),
-	_nextIndex(other._nextIndex),
-	_slotMap(std::move(other._slotMap)),
-	_spacialIndex(std::move(other._spacialIndex)),
-	_yCache(std::move(other._yCache)),
-	_moved(false)
-{
-	other._moved = true;
-}
-
-void RectangleOrganizer::addSlot(Slot slot)
-{
-	_slotMap[slot.index] = slot;
-	_slotIndexes.push_back(slot.index);
-	_spacialIndex.add(slot);
-	_yCache.increment(slot.rect.endY() + 1);
-	_yCache.increment(slot.rect.y);
-}
-
-void RectangleOrganizer::removeSlot(uint64_t slotIndex)
-{
-	auto slot = _slotMap[slotIndex];
-	_yCache.decrement(slot.rect.endY() + 1);
-	_yCache.decrement(slot.rect.y);
-	_spacialIndex.remove(slot);
-	_slotIndexes.erase(
-		std::remove(_slotIndexes.begin(), _slotIndexes.end(), slotIndex),
-		_slotIndexes.end());
-	_slotMap.erase(slotIndex);
-}
+	if (listedOpen != openCount)
+	{
+		out << "open buckets hold " << listedOpen << " shelves, "
+			<< openCount << " are open" << std::endl;
+		return false;
+	}
 
-bool RectangleOrganizer::empty()
-{
-	return _slotMap.empty();
+	return true;
 }
 
-SlotSearchResult RectangleOrganizer::tryClaimSlot(Size size)
+void RectangleOrganizer::saveShelves(std::ostream &out) const
 {
-	// if height or width is zero then it isn't even valid so give up
-	if (size.height <= 0 || size.width <= 0)
+	writeBinary(out, static_cast<uint32_t>(_shelves.size()));
+	for (auto &shelf : _shelves)
 	{
-		return SlotSearchResult::notFound();
+		writeBinary(out, shelf.slot);
+		writeBinary(out, shelf.rect);
+		writeBinary(out, shelf.itemCount);
+		writeBinary(out, static_cast<uint8_t>(shelf.isLive));
+		writeBinary(out, shelf.openPosition);
+		writeBinary(out, static_cast<uint32_t>(shelf.freeSpans.size()));
+		writeArray(out, shelf.freeSpans);
 	}
 
-	// if it couldn't possibly fit then give up right away
-	if (size.width > _size.width || size.height > _size.height)
-	{
-		return SlotSearchResult::notFound();
-	}
+	// Open buckets are rebuilt from the positions of their shelves
+	writeBinary(out, static_cast<uint32_t>(_freeShelves.size()));
+	writeArray(out, _freeShelves);
 
-	// if the whole thing is empty then just put at 0,0
-	if (empty())
+	writeBinary(out, static_cast<uint32_t>(_shelfItems.size()));
+	for (auto &item : _shelfItems)
 	{
-		Slot slot{ { 0, 0, size.width, size.height }, _nextIndex++ };
-		addSlot(slot);
-		return SlotSearchResult::found(slot);
+		writeBinary(out, item.rect);
+		writeBinary(out, item.shelf);
+		writeBinary(out, item.generation);
+		writeBinary(out, static_cast<uint8_t>(item.isClaimed));
 	}
 
-	// try every usable y value in priority order
-	auto result = SlotSearchResult::notFound();
-	auto resultRef = &result;
-	_yCache.withYValuesInPriorityOrder([this, size, resultRef](unsigned y)
-	{
-		auto searchResult = search(y, size);
-		if (searchResult.isFound)
-		{
-			addSlot(searchResult.slot);
-			*resultRef = searchResult;
-			return true;
-		}
-		return false;
-	});
-
-	return result;
+	writeBinary(out, static_cast<uint32_t>(_freeShelfItems.size()));
+	writeArray(out, _freeShelfItems);
 }
 
-SlotSearchResult RectangleOrganizer::search(unsigned y, Size size)
+// Puts every open shelf back at its position in its bucket, which has to
+// come out with no gaps and no two shelves in one place
+bool RectangleOrganizer::loadOpenShelves()
 {
-	auto result = SlotSearchResult::notFound();
-	auto pResult = &result;
-	withXOptions(y, [this, y, size, pResult](unsigned x) -> bool
+	const uint32_t unused = 0xffffffffu;
+	for (auto &shelf : _shelves)
 	{
-		Rect rect{ x, y, size.width, size.height };
-		if (isRectOpen(rect))
+		if (shelf.widestSpan > 0)
 		{
-			*pResult = SlotSearchResult::found({ rect, _nextIndex++ });
-			return true;
+			auto &open = _openShelves[shelf.rect.height];
+			auto bucket = shelf.widestSpan;
+			if (open.buckets.size() <= bucket)
+			{
+				open.buckets.resize(bucket + 1);
+				open.mask.resize(bucket / 64 + 1, 0);
+			}
+			open.buckets[bucket].push_back(unused);
+			open.mask[bucket / 64] |= uint64_t{ 1 } << bucket % 64;
 		}
-		return false;
-	});
-	return result;
-}
+	}
 
-bool RectangleOrganizer::releaseSlot(uint64_t index)
-{
-	if (_slotMap.find(index) != _slotMap.end())
+	for (uint32_t shelfIndex = 0; shelfIndex < _shelves.size(); shelfIndex++)
 	{
-		removeSlot(index);
-		return true;
-	}
+		auto &shelf = _shelves[shelfIndex];
+		if (shelf.widestSpan == 0)
+		{
+			continue;
+		}
 
-	return false;
+		auto &shelves = _openShelves[shelf.rect.height]
+			.buckets[shelf.widestSpan];
+		if (shelf.openPosition >= shelves.size()
+			|| shelves[shelf.openPosition] != unused)
+		{
+			return false;
+		}
+		shelves[shelf.openPosition] = shelfIndex;
+	}
+	return true;
 }
 
-bool RectangleOrganizer::isRectOpen(Rect &rect)
+bool RectangleOrganizer::loadShelves(std::istream &in)
 {
-	// if the rest starts in negative space then it is not open
-	if (rect.x < 0 || rect.y < 0)
+	// Shelves and items are added as they're read, so a corrupt count runs
+	// out of stream before it runs out of memory
+	uint32_t count;
+	if (!readBinary(in, count))
 	{
 		return false;
 	}
 
-	// if rect would go off the edge of the texture space then it is not open
-	if (rect.endX() >= _size.width || rect.endY() >= _size.height)
+	while (_shelves.size() < count)
 	{
-		return false;
-	}
-
-
-	// if the rect overlaps with any existing slot then it is not open
-	bool foundOverlap = false;
-	bool *foundOverlapRef = &foundOverlap;
-	_spacialIndex.withNearSlots(
-		rect, [this, rect, foundOverlapRef](uint64_t slotIndex)
+		Shelf shelf;
+		uint8_t isLive;
+		uint32_t spanCount;
+		if (!readBinary(in, shelf.slot)
+			|| !readBinary(in, shelf.rect)
+			|| !readBinary(in, shelf.itemCount)
+			|| !readBinary(in, isLive)
+			|| !readBinary(in, shelf.openPosition)
+			|| !readBinary(in, spanCount)
+			|| !readArray(in, shelf.freeSpans, spanCount))
 		{
-			if (checkOverlap(rect, _slotMap[slotIndex].rect))
-			{
-				*foundOverlapRef = true;
-				return true;
-			}
 			return false;
-		});
-
-	return !foundOverlap;
-}
+		}
 
-bool RectangleOrganizer::checkOverlap(Rect a, Rect b)
-{
-	auto aStartsAfterBHorizontally = b.endX() < a.x;
-	auto bStartsAfterAHorizontally = a.endX() < b.x;
-	auto aStartsAfterBVertically = b.endY() < a.y;
-	auto bStartsAfterAVertically = a.endY() < b.y;
+		// The widest span picks the shelf's bucket, so it can't be wider than
+		// any shelf could be
+		shelf.isLive = isLive != 0;
+		shelf.widestSpan = shelf.isLive ? widestSpan(shelf.freeSpans) : 0;
+		if (shelf.widestSpan > _size.width)
+		{
+			return false;
+		}
 
-	auto overlapsHorizontally =
-		!aStartsAfterBHorizontally && !bStartsAfterAHorizontally;
-	auto overlapsVertically =
-		!aStartsAfterBVertically && !bStartsAfterAVertically;
+		// The shelf's strip was counted with the slab, its items count instead
+		if (shelf.isLive)
+		{
+			countSlot(shelf.rect, false);
+		}
+		_shelves.push_back(std::move(shelf));
+	}
 
-	return overlapsHorizontally && overlapsVertically;
-}
+	if (!readBinary(in, count)
+		|| !readArray(in, _freeShelves, count)
+		|| !isEachBelow(_freeShelves, _shelves.size())
+		|| !loadOpenShelves())
+	{
+		return false;
+	}
 
-void RectangleOrganizer::withXOptions(
-	unsigned y, std::function<bool(unsigned)> callback)
-{
-	if (callback(0))
+	if (!readBinary(in, count))
 	{
-		return;
+		return false;
 	}
 
-	_spacialIndex.withSlotsOnYLine(y, [this, callback](uint64_t slotIndex)
+	while (_shelfItems.size() < count)
 	{
-		auto slot = _slotMap[slotIndex];
-		if (slot.rect.x > 0 && callback(slot.rect.x))
+		ShelfItem item;
+		uint8_t isClaimed;
+		if (!readBinary(in, item.rect)
+			|| !readBinary(in, item.shelf)
+			|| !readBinary(in, item.generation)
+			|| !readBinary(in, isClaimed)
+			|| item.shelf >= _shelves.size())
 		{
-			return true;
+			return false;
 		}
 
-		auto endX = slot.rect.endX() + 1;
-		if (callback(endX))
+		item.isClaimed = isClaimed != 0;
+		if (item.isClaimed)
 		{
-			return true;
+			countSlot(item.rect, true);
 		}
+		_shelfItems.push_back(item);
+	}
 
-		return false;
-	});
-
-	_usedXOptions.clear();
+	return readBinary(in, count)
+		&& readArray(in, _freeShelfItems, count)
+		&& isEachBelow(_freeShelfItems, _shelfItems.size());
 }
 
 // TextLayout
@@ -450,14 +3149,42 @@ void RectangleOrganizer::withXOptions(
 TextLayout::TextLayout(Size size) :
 	_size(size),
 	_penX(0),
-	_currentLine(0)
+	_currentLine(0),
+	_lineStart(0),
+	_trailingDividers(0),
+	_trailingWordChars(0),
+	_skippedChars(0)
 { }
 
-void TextLayout::nextChar(wchar_t ch, Size charSize, unsigned kerning)
+void TextLayout::nextChar(
+	wchar_t ch, Size charSize, int kerning, unsigned ascent)
 {
-	_chars.push_back({ ch, charSize, kerning, _currentLine });
+	if (_skippedChars > 0)
+	{
+		_skippedChars--;
+		return;
+	}
+
+	auto index = static_cast<unsigned>(_chars.size());
+	_chars.push_back({ ch, charSize, kerning, ascent, _currentLine });
 	_penX += charSize.width + getKerningOffset(kerning);
-	checkWrap(ch);
+
+	// The first char never counts as trailing whitespace
+	if (isWordDivider(ch))
+	{
+		_trailingDividers = index > 0 ? _trailingDividers + 1 : 0;
+		_trailingWordChars = 0;
+	}
+	else
+	{
+		_trailingDividers = 0;
+		_trailingWordChars++;
+	}
+
+	if (index != _lineStart && _penX > _size.width)
+	{
+		wrap();
+	}
 }
 
 TextBlockMetrics TextLayout::metrics()
@@ -468,17 +3195,19 @@ TextBlockMetrics TextLayout::metrics()
 		std::vector<LineMetrics>(_currentLine + 1, { 0 })
 	};
 
-	unsigned totalWidth = 0;
 	for (auto &charLayout : _chars)
 	{
-		totalWidth += charLayout.size.width;
 		auto &lineMetrics = metrics.lines[charLayout.line];
 		lineMetrics.height = std::max(
 			lineMetrics.height, charLayout.size.height);
+		lineMetrics.baseline = std::max(
+			lineMetrics.baseline, charLayout.ascent);
 		lineMetrics.chars += 1;
 	}
 
-	metrics.size.width = std::min(_size.width, totalWidth);
+	// The widest line, kerned the same way the pen moves when drawing
+	auto widths = lineWidths();
+	metrics.size.width = *std::max_element(widths.begin(), widths.end());
 	metrics.size.height = std::accumulate(
 		metrics.lines.begin(),
 		metrics.lines.end(),
@@ -488,44 +3217,104 @@ TextBlockMetrics TextLayout::metrics()
 	return metrics;
 }
 
-unsigned TextLayout::getKerningOffset(unsigned kerning)
+std::vector<unsigned> TextLayout::lineWidths() const
 {
-	return _penX == 0 ? 0 : kerning;
+	std::vector<unsigned> widths(_currentLine + 1, 0);
+	for (size_t i = 0; i < _chars.size(); i++)
+	{
+		auto &charLayout = _chars[i];
+		auto isLineStart = i == 0 || _chars[i - 1].line != charLayout.line;
+		widths[charLayout.line] += charLayout.size.width
+			+ (isLineStart ? 0 : charLayout.kerning);
+	}
+
+	for (auto &width : widths)
+	{
+		width = std::min(width, _size.width);
+	}
+	return widths;
 }
 
-void TextLayout::checkWrap(wchar_t ch)
+unsigned TextLayout::resumePoint(unsigned firstChangedChar)
 {
-	unsigned index = _chars.size() - 1;
-	if (!isFirstCharOnLine(index) && _penX > _size.width)
+	auto index = std::min(firstChangedChar, charCount());
+	while (index > 0 && !isWordDivider(_chars[index - 1].ch))
 	{
-		wrap();
+		index--;
 	}
+	return index;
 }
 
-void TextLayout::wrap()
+void TextLayout::rewind(unsigned index)
 {
-	unsigned wordSize = getWrapCharCount();
+	_chars.resize(std::min(index, charCount()));
+	index = charCount();
+
+	_penX = 0;
+	_currentLine = index > 0 ? _chars.back().line : 0;
+	_lineStart = index;
+	_trailingDividers = 0;
+	_trailingWordChars = 0;
+	_skippedChars = index > 0 ? 1 : 0;
 
-	if (wordSize == 0)
+	while (_lineStart > 0 && _chars[_lineStart - 1].line == _currentLine)
 	{
-		return;
+		_lineStart--;
+	}
+
+	for (auto i = _lineStart; i < index; i++)
+	{
+		_penX += _chars[i].size.width + getKerningOffset(_chars[i].kerning);
 	}
 
-	unsigned firstCharIndex = _chars.size() - wordSize;
+	for (auto i = index; i > 1 && isWordDivider(_chars[i - 1].ch); i--)
+	{
+		_trailingDividers++;
+	}
 
-	if (isFirstCharOnLine(firstCharIndex))
+	for (auto i = index; i > 0 && !isWordDivider(_chars[i - 1].ch); i--)
 	{
-		wrapFrom(_chars.size() - 1);
+		_trailingWordChars++;
 	}
-	else
+}
+
+int TextLayout::getKerningOffset(int kerning)
+{
+	return _penX == 0 ? 0 : kerning;
+}
+
+// Everything wrap() needs is tracked as chars arrive, so deciding where to
+// break never looks back through the line. The only walk is in wrapFrom()
+// over the chars that move, and a char is moved as part of a word at most
+// once since that word then starts its line.
+void TextLayout::wrap()
+{
+	// A single divider may hang past the edge, a second one wraps
+	if (_trailingDividers == 1)
 	{
-		wrapFrom(_chars.size() - wordSize);
+		return;
+	}
+
+	auto last = static_cast<unsigned>(_chars.size()) - 1;
+	if (_trailingDividers > 1)
+	{
+		wrapFrom(last);
+		return;
 	}
+
+	// Move the whole word down unless it already starts the line, in which
+	// case it can't fit anywhere and only the overflowing char moves. A
+	// divider that starts a line counts as part of the word after it.
+	auto wordStart = last + 1 - _trailingWordChars;
+	auto startsLine = wordStart == 0
+		|| (_lineStart > 0 && wordStart <= _lineStart + 1);
+	wrapFrom(startsLine ? last : wordStart);
 }
 
 void TextLayout::wrapFrom(unsigned index)
 {
 	_currentLine++;
+	_lineStart = index;
 	_penX = 0;
 	for (unsigned i = index; i < _chars.size(); i++)
 	{
@@ -534,80 +3323,263 @@ void TextLayout::wrapFrom(unsigned index)
 	}
 }
 
-unsigned TextLayout::getWrapCharCount()
+bool TextLayout::isWhitespace(wchar_t ch)
+{
+	return ch == ' ' || ch == '\t';
+}
+
+bool TextLayout::isWordDivider(wchar_t ch)
+{
+	return isWhitespace(ch) || ch == '-';
+}
+
+// ThreadCpuTimer
+
+uint64_t ThreadCpuTimer::now()
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return static_cast<uint64_t>(time.tv_sec) * 1000000000u
+		+ static_cast<uint64_t>(time.tv_nsec);
+#else
+	return 0;
+#endif
+}
+
+// TraceRing
+
+TraceRing::TraceRing(size_t capacity, unsigned threadId) :
+	_threadId(threadId),
+	_head(0)
 {
-	unsigned trailingWhitespaceChars = getEndOfLineWhitespaceCount();
-	if (trailingWhitespaceChars == 1)
+	size_t size = 2;
+	while (size < capacity)
 	{
-		return 0;
+		size <<= 1;
 	}
-	else if (trailingWhitespaceChars > 1)
+
+	_slots.reset(new Slot[size]);
+	for (size_t i = 0; i < size; i++)
 	{
-		return 1;
+		_slots[i].sequence.store(0, std::memory_order_relaxed);
 	}
+	_capacity = size;
+	_mask = size - 1;
+}
 
-	unsigned count = 0;
-	for (unsigned i = _chars.size(); i > 0; i--)
+void TraceRing::copyTo(std::vector<TraceEvent> &events) const
+{
+	auto head = _head.load(std::memory_order_acquire);
+	auto first = head > _capacity ? head - _capacity : 0;
+	for (auto i = first; i < head; i++)
 	{
-		unsigned index = i - 1;
-
-		if (index > 0 && _chars[index].line > _chars[index - 1].line)
+		auto &slot = _slots[i & _mask];
+		if (slot.sequence.load(std::memory_order_acquire) != i + 1)
 		{
-			count++;
-			break;
+			continue;
 		}
 
-		bool isDivider = isWordDivider(_chars[index].ch);
-		if (isDivider)
+		uint64_t words[TRACE_EVENT_WORDS];
+		for (size_t w = 0; w < TRACE_EVENT_WORDS; w++)
 		{
-			break;
+			words[w] = slot.words[w].load(std::memory_order_relaxed);
 		}
-		else
+
+		// The owner wrote over it while it was read if the stamp changed
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != i + 1)
 		{
-			count++;
+			continue;
 		}
+
+		TraceEvent event;
+		std::memcpy(&event, words, sizeof(event));
+		events.push_back(event);
 	}
+}
 
-	return count;
+uint64_t TraceRing::dropped() const
+{
+	auto head = _head.load(std::memory_order_acquire);
+	return head > _capacity ? head - _capacity : 0;
 }
 
-unsigned TextLayout::getEndOfLineWhitespaceCount()
+// TraceSink
+
+std::atomic<bool> TraceSink::_isInstalled(false);
+std::shared_ptr<TraceSink> TraceSink::_installed;
+
+static std::atomic<uint64_t> nextTraceSinkId(1);
+
+struct ThreadTraceRing
 {
-	unsigned count = 0;
-	unsigned index = _chars.size() - 1;
-	do
+	uint64_t sinkId;
+	TraceRing *ring;
+};
+
+static thread_local ThreadTraceRing threadTraceRing{ 0, nullptr };
+
+TraceSink::TraceSink(size_t eventsPerThread) :
+	_eventsPerThread(eventsPerThread),
+	_id(nextTraceSinkId++)
+{ }
+
+void TraceSink::install(std::shared_ptr<TraceSink> sink)
+{
+	auto isInstalled = sink != nullptr;
+	std::atomic_store(&_installed, std::move(sink));
+	_isInstalled.store(isInstalled, std::memory_order_release);
+}
+
+void TraceSink::begin(
+	const char *name,
+	unsigned argCount,
+	const char *argName0,
+	int64_t arg0,
+	const char *argName1,
+	int64_t arg1)
+{
+	threadRing().push({
+		name,
+		'B',
+		_clock.nanos(),
+		argCount,
+		{ argName0, argName1 },
+		{ arg0, arg1 } });
+}
+
+void TraceSink::end(const char *name)
+{
+	threadRing().push({
+		name, 'E', _clock.nanos(), 0, { nullptr, nullptr }, { 0, 0 } });
+}
+
+std::vector<std::pair<unsigned, TraceEvent>> TraceSink::events() const
+{
+	std::vector<std::pair<unsigned, TraceEvent>> events;
+	std::vector<TraceEvent> ringEvents;
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (auto &ring : _rings)
 	{
-		if (!isWordDivider(_chars[index].ch))
+		ringEvents.clear();
+		ring->copyTo(ringEvents);
+		for (auto &event : ringEvents)
 		{
-			break;
+			events.push_back({ ring->threadId(), event });
 		}
-		count++;
-	} while (--index > 0);
+	}
+	return events;
+}
 
-	return count;
+uint64_t TraceSink::dropped() const
+{
+	uint64_t dropped = 0;
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (auto &ring : _rings)
+	{
+		dropped += ring->dropped();
+	}
+	return dropped;
 }
 
-bool TextLayout::isFirstCharOnLine(unsigned index)
+static void writeJsonString(std::ostream &out, const char *text)
 {
-	if (index == 0)
+	out << '"';
+	for (; *text; text++)
 	{
-		return true;
+		if (*text == '"' || *text == '\\')
+		{
+			out << '\\';
+		}
+		out << *text;
 	}
+	out << '"';
+}
 
-	auto thisCharLine = _chars[index].line;
-	auto lastCharLine = _chars[index - 1].line;
+bool TraceSink::writeJson(std::ostream &out) const
+{
+	auto events = this->events();
+
+	// Timestamps are in microseconds, written out to the nanosecond
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	bool first = true;
+	unsigned thread = 0;
+	unsigned depth = 0;
+	for (auto &entry : events)
+	{
+		if (entry.first != thread)
+		{
+			thread = entry.first;
+			depth = 0;
+		}
 
-	return thisCharLine > lastCharLine;
+		// A wrapped ring can start part way into a scope, skip its end
+		auto &event = entry.second;
+		if (event.phase == 'E' && depth == 0)
+		{
+			continue;
+		}
+		depth += event.phase == 'B' ? 1 : -1;
+
+		auto fraction = std::to_string(1000 + event.nanos % 1000);
+		out << (first ? "\n" : ",\n") << "{\"name\":";
+		writeJsonString(out, event.name);
+		out << ",\"ph\":\"" << event.phase << "\",\"ts\":"
+			<< event.nanos / 1000 << "." << fraction.substr(1)
+			<< ",\"pid\":1,\"tid\":" << thread;
+		if (event.argCount > 0)
+		{
+			out << ",\"args\":{";
+			for (unsigned i = 0; i < event.argCount; i++)
+			{
+				out << (i == 0 ? "" : ",");
+				writeJsonString(out, event.argNames[i]);
+				out << ":" << event.args[i];
+			}
+			out << "}";
+		}
+		out << "}";
+		first = false;
+	}
+	out << "\n]}\n";
+	return out.good();
 }
 
-bool TextLayout::isWhitespace(wchar_t ch)
+bool TraceSink::writeJson(const std::string &path) const
 {
-	return ch == ' ' || ch == '\t';
+	std::ofstream out(path);
+	if (!out)
+	{
+		std::cout << "failed to open '" << path << "'" << std::endl;
+		return false;
+	}
+
+	return writeJson(out);
 }
 
-bool TextLayout::isWordDivider(wchar_t ch)
+TraceRing &TraceSink::threadRing()
 {
-	return isWhitespace(ch) || ch == '-';
+	// Threads only remember their ring in the sink they used last, coming
+	// back to a sink finds the ring they had in it
+	auto &cached = threadTraceRing;
+	if (cached.sinkId != _id)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto thread = std::this_thread::get_id();
+		auto found = std::find(
+			_ringThreads.begin(), _ringThreads.end(), thread);
+		if (found == _ringThreads.end())
+		{
+			auto threadId = static_cast<unsigned>(_rings.size() + 1);
+			_rings.emplace_back(new TraceRing(_eventsPerThread, threadId));
+			_ringThreads.push_back(thread);
+			found = _ringThreads.end() - 1;
+		}
+		cached = { _id, _rings[found - _ringThreads.begin()].get() };
+	}
+
+	return *cached.ring;
 }
 
 END_XT_NAMESPACE
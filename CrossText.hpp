@@ -4,12 +4,35 @@
 #include <unordered_map>
 #include <iostream>
 #include <algorithm>
-#include <stack>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 #define SPACIAL_INDEX_BLOCK_WIDTH 128
 #define SPACIAL_INDED_BLOCK_HEIGHT 16
 
+#define XT_STATE_MAGIC 0x53545458 // "XTTS" little endian
+#define XT_STATE_VERSION 7
+#define XT_STATE_MAX_STRING (1 << 20)
+#define XT_STATE_READ_CHUNK 65536
+
+#define XT_MEASURE_CACHE_SIZE 1024
+#define XT_TRACE_RING_SIZE 65536
+
+#define XT_SLOT_SIZE_BUCKETS 25
+#define XT_FREE_RECT_GRID 256
+#define XT_SHELF_WIDTH 256
+#define XT_SHELF_HEIGHT_STEP 2
+#define XT_BUDDY_MIN_SIZE 4
+#define XT_ORGANIZER_MAX_SIZE 65536
+
 #define BEGIN_XT_NAMESPACE namespace xt {
 #define END_XT_NAMESPACE }
 
@@ -28,9 +51,42 @@ struct LineMetrics
 	unsigned chars;
 };
 
+// Search looks for the best place for each rect. Buddy hands out square
+// blocks from a quadtree instead, see BuddyOrganizer.
+enum class OrganizerKind
+{
+	Search,
+	Buddy
+};
+
+// Rects no taller than shelfMaxHeight go on shelves, strips of the texture
+// that are claimed like any other slot and then cut up from left to right
+// for rects of one height class. Heights are rounded up to a multiple of
+// shelfHeightStep to pick the class. Shelves are off while shelfMaxHeight
+// is 0, and always with the buddy kind.
+//
+// Open shelves are kept in buckets by the width of their widest free span,
+// so a claim takes the newest shelf of the narrowest bucket with room,
+// found with a bitmask word per 64 columns of shelfWidth however many
+// shelves there are. Claiming on and releasing to a shelf then take time in
+// proportion to its number of free spans, at most shelfWidth. When no open
+// shelf has room a new one is claimed, which is an ordinary search.
+struct OrganizerOptions
+{
+	OrganizerKind kind = OrganizerKind::Search;
+	unsigned shelfMaxHeight = 0;
+	unsigned shelfHeightStep = XT_SHELF_HEIGHT_STEP;
+	unsigned shelfWidth = XT_SHELF_WIDTH;
+};
+
 struct TextManagerOptions
 {
 	Size textureSize;
+	bool kerning = true;
+	unsigned measureCacheSize = XT_MEASURE_CACHE_SIZE;
+	// Prints every placement as it's found, for debugging the organizer
+	bool logPlacements = false;
+	OrganizerOptions organizer;
 };
 
 struct TextBlockMetrics
@@ -201,6 +257,15 @@ struct Style
 	}
 };
 
+// Tells fonts apart by their face rather than their address, so nothing
+// keyed on it mixes up a freed font with another loaded in its place.
+// Fonts provide it as faceId(), no font is 0.
+template <typename TFont>
+inline uint64_t fontId(TFont *font)
+{
+	return font ? font->faceId() : 0;
+}
+
 template <typename TFont>
 struct StyleRange
 {
@@ -208,6 +273,319 @@ struct StyleRange
 	Range range;
 };
 
+#define XT_DECODE_BUFFER_SIZE 256
+
+// Non-owning view of encoded text. The size is in code units, not chars.
+template <typename TChar>
+struct BasicTextView
+{
+	const TChar *data;
+	size_t size;
+
+	BasicTextView() : data(nullptr), size(0)
+	{ }
+
+	BasicTextView(const TChar *data_, size_t size_) :
+		data(data_), size(size_)
+	{ }
+
+	BasicTextView(const std::basic_string<TChar> &str) :
+		data(str.data()), size(str.size())
+	{ }
+};
+
+using Utf8View = BasicTextView<char>;
+using Utf16View = BasicTextView<char16_t>;
+using Utf32View = BasicTextView<char32_t>;
+using WideView = BasicTextView<wchar_t>;
+
+template <typename TChar>
+BasicTextView<TChar> textView(const std::basic_string<TChar> &str)
+{
+	return BasicTextView<TChar>(str);
+}
+
+// Decoders turn a text view into wchar_t chunks on the fly so that text in
+// any encoding can be walked without building a std::wstring first. They all
+// have the same interface:
+//
+//   length() - number of chars in the whole text
+//   read(max, chars) - decodes up to max more chars, points chars at them
+//                      and returns how many there were (0 at the end)
+//
+// The chars returned by read() are only valid until the next call. A char is
+// a code point, except where wchar_t is 16 bits: there code points outside
+// the basic plane come out as surrogate pairs, like std::wstring holds them.
+
+class WideDecoder
+{
+public:
+	WideDecoder(WideView text) : _text(text), _position(0)
+	{ }
+
+	unsigned length() const { return static_cast<unsigned>(_text.size); }
+
+	size_t read(size_t max, const wchar_t *&chars)
+	{
+		auto count = std::min(max, _text.size - _position);
+		chars = _text.data + _position;
+		_position += count;
+		return count;
+	}
+
+private:
+	WideView _text;
+	size_t _position;
+};
+
+class Utf8Decoder
+{
+public:
+	Utf8Decoder(Utf8View text);
+	unsigned length() const;
+	size_t read(size_t max, const wchar_t *&chars);
+
+private:
+	Utf8View _text;
+	size_t _position;
+	wchar_t _pending;
+	wchar_t _buffer[XT_DECODE_BUFFER_SIZE];
+};
+
+class Utf16Decoder
+{
+public:
+	Utf16Decoder(Utf16View text);
+	unsigned length() const;
+	size_t read(size_t max, const wchar_t *&chars);
+
+private:
+	Utf16View _text;
+	size_t _position;
+	wchar_t _pending;
+	wchar_t _buffer[XT_DECODE_BUFFER_SIZE];
+};
+
+class Utf32Decoder
+{
+public:
+	Utf32Decoder(Utf32View text);
+	unsigned length() const;
+	size_t read(size_t max, const wchar_t *&chars);
+
+private:
+	Utf32View _text;
+	size_t _position;
+	wchar_t _pending;
+	wchar_t _buffer[XT_DECODE_BUFFER_SIZE];
+};
+
+inline WideDecoder makeDecoder(WideView text) { return WideDecoder(text); }
+inline Utf8Decoder makeDecoder(Utf8View text) { return Utf8Decoder(text); }
+inline Utf16Decoder makeDecoder(Utf16View text) { return Utf16Decoder(text); }
+inline Utf32Decoder makeDecoder(Utf32View text) { return Utf32Decoder(text); }
+
+template <typename TChar>
+std::wstring decodeText(BasicTextView<TChar> text)
+{
+	auto decoder = makeDecoder(text);
+	std::wstring decoded;
+	decoded.reserve(decoder.length());
+
+	const wchar_t *chars;
+	size_t count;
+	while ((count = decoder.read(XT_DECODE_BUFFER_SIZE, chars)) > 0)
+	{
+		decoded.append(chars, count);
+	}
+	return decoded;
+}
+
+// True when the text decodes to exactly the given wide string. Only a
+// buffer's worth is decoded at a time, so nothing is allocated.
+template <typename TChar>
+bool decodesTo(BasicTextView<TChar> text, const std::wstring &decoded)
+{
+	auto decoder = makeDecoder(text);
+	size_t position = 0;
+
+	const wchar_t *chars;
+	size_t count;
+	while ((count = decoder.read(XT_DECODE_BUFFER_SIZE, chars)) > 0)
+	{
+		if (count > decoded.size() - position
+			|| !std::equal(chars, chars + count, decoded.begin() + position))
+		{
+			return false;
+		}
+		position += count;
+	}
+	return position == decoded.size();
+}
+
+// A span of text where the effective style doesn't change
+template <typename TFont>
+struct StyleRun
+{
+	Style<TFont> style;
+	unsigned start;
+	unsigned length;
+};
+
+// Flattens the (possibly nested) style ranges, sorted by start, into
+// contiguous runs of identical effective style covering the whole text. A
+// range applies from its start until it ends and no later range covers it,
+// the same as if the ranges were pushed on and popped off a stack.
+template <typename TFont>
+std::vector<StyleRun<TFont>> itemizeStyleRuns(
+	const Style<TFont> &baseStyle,
+	const std::vector<StyleRange<TFont>> &styleRanges,
+	unsigned textLength)
+{
+	std::vector<StyleRun<TFont>> runs;
+	if (textLength == 0)
+	{
+		return runs;
+	}
+
+	StyleRange<TFont> baseRange{ baseStyle, { 0, textLength } };
+	std::vector<const StyleRange<TFont> *> rangeStack{ &baseRange };
+	unsigned nextRangeIndex = 0;
+	unsigned position = 0;
+
+	while (position < textLength)
+	{
+		while (nextRangeIndex < styleRanges.size()
+			&& styleRanges[nextRangeIndex].range.start <= position)
+		{
+			auto &styleRange = styleRanges[nextRangeIndex++];
+			if (styleRange.range.length > 0
+				&& styleRange.range.last() >= position)
+			{
+				rangeStack.push_back(&styleRange);
+			}
+		}
+
+		auto top = rangeStack.back();
+		auto end = std::min(top->range.last() + 1, textLength);
+		if (nextRangeIndex < styleRanges.size())
+		{
+			end = std::min(end, styleRanges[nextRangeIndex].range.start);
+		}
+
+		auto &style = top->style;
+		if (!runs.empty()
+			&& runs.back().style.font == style.font
+			&& runs.back().style.size == style.size
+			&& runs.back().style.foreground.color.rgba
+				== style.foreground.color.rgba)
+		{
+			runs.back().length += end - position;
+		}
+		else
+		{
+			runs.push_back({ style, position, end - position });
+		}
+
+		position = end;
+		while (rangeStack.size() > 1
+			&& rangeStack.back()->range.last() < position)
+		{
+			rangeStack.pop_back();
+		}
+	}
+
+	return runs;
+}
+
+// Makes sure ranges are not out of order, itemizing expects them by start
+template <typename TFont>
+void sortStyleRanges(std::vector<StyleRange<TFont>> &styleRanges)
+{
+	std::sort(
+		styleRanges.begin(),
+		styleRanges.end(),
+		[](const StyleRange<TFont> &a, const StyleRange<TFont> &b)
+		{
+			return a.range.start < b.range.start;
+		});
+}
+
+// Hands the chars from one index up to another to a metric builder or char
+// renderer, one call per style run.
+template <typename TFont, typename THandler>
+void walkStyleRuns(
+	const std::wstring &text,
+	unsigned from,
+	unsigned to,
+	const std::vector<StyleRun<TFont>> &runs,
+	THandler &handler)
+{
+	for (auto &run : runs)
+	{
+		auto start = std::max(run.start, from);
+		auto end = std::min(run.start + run.length, to);
+		if (start >= end)
+		{
+			continue;
+		}
+
+		handler.onRun(
+			run.style.font,
+			run.style.size,
+			run.style.foreground,
+			text.data() + start,
+			end - start);
+	}
+}
+
+// The same for a view of text in any encoding, decoded a buffer at a time
+// as it's walked rather than into a std::wstring first. Wide text still
+// comes back in one piece per run.
+template <typename TChar, typename TFont, typename THandler>
+void walkStyleRuns(
+	BasicTextView<TChar> text,
+	unsigned from,
+	unsigned to,
+	const std::vector<StyleRun<TFont>> &runs,
+	THandler &handler)
+{
+	auto decoder = makeDecoder(text);
+	unsigned position = 0;
+	for (auto &run : runs)
+	{
+		auto start = std::max(run.start, from);
+		auto end = std::min(run.start + run.length, to);
+		if (start >= end)
+		{
+			continue;
+		}
+
+		while (position < end)
+		{
+			// Chars before the start are read and dropped
+			const wchar_t *chars;
+			auto wanted = position < start ? start - position : end - position;
+			auto count = static_cast<unsigned>(decoder.read(wanted, chars));
+			if (count == 0)
+			{
+				return;
+			}
+
+			if (position >= start)
+			{
+				handler.onRun(
+					run.style.font,
+					run.style.size,
+					run.style.foreground,
+					chars,
+					count);
+			}
+			position += count;
+		}
+	}
+}
+
 template <typename TFont>
 struct TextOptions
 {
@@ -215,10 +593,13 @@ struct TextOptions
 	AntialiasMode antialiasMode;
 	std::vector<StyleRange<TFont>> styleRanges;
 	Color background;
+	bool recolorable;
+	bool editable;
 
 	inline static TextOptions fromStyle(Style<TFont> base)
 	{
-		return{ base, AntialiasMode::Grayscale, {}, 0x00000000 };
+		return{
+			base, AntialiasMode::Grayscale, {}, 0x00000000, false, false };
 	}
 
 	TextOptions withStyle(Style<TFont> newBaseStyle)
@@ -248,8 +629,30 @@ struct TextOptions
 		opts.background = newBackground;
 		return opts;
 	}
+
+	// Recolorable blocks keep the coverage of their glyphs on the side so
+	// TextBlock::recolor() can retint pixels without drawing them again.
+	TextOptions withRecolorable(bool newRecolorable)
+	{
+		TextOptions opts(*this);
+		opts.recolorable = newRecolorable;
+		return opts;
+	}
+
+	// Editable blocks keep their decoded text and layout from the start, so
+	// even the first TextBlock::setText() only redraws the lines that changed
+	// and recolor() can draw lines again. Other blocks stream their text
+	// through the decoder and keep neither until setText() is first called.
+	TextOptions withEditable(bool newEditable)
+	{
+		TextOptions opts(*this);
+		opts.editable = newEditable;
+		return opts;
+	}
 };
 
+// Index is the handle the organizer gave out for the slot. It stops
+// matching once the slot is released, even if the space is claimed again.
 struct Slot
 {
 	Rect rect;
@@ -279,12 +682,246 @@ struct SlotSearchResult
 	}
 };
 
+// Raw binary helpers used to save and load atlas state. The format is only
+// meant to be read back by the same build on the same machine.
+template <typename T>
+inline void writeBinary(std::ostream &out, const T &value)
+{
+	out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+inline bool readBinary(std::istream &in, T &value)
+{
+	in.read(reinterpret_cast<char *>(&value), sizeof(T));
+	return in.good();
+}
+
+void writeBinary(std::ostream &out, const Rect &rect);
+bool readBinary(std::istream &in, Rect &rect);
+void writeBinary(std::ostream &out, const std::string &str);
+bool readBinary(std::istream &in, std::string &str);
+void writeBinary(std::ostream &out, const TextBlockMetrics &metrics);
+bool readBinary(std::istream &in, TextBlockMetrics &metrics);
+
+uint64_t hashBytes(const void *data, size_t length, uint64_t seed);
+
+// Feeds more bytes into a hash from hashBytes(), so hashing data in pieces
+// gives the same result as hashing it in one go
+uint64_t continueHash(const void *data, size_t length, uint64_t hash);
+
+// Hash of the decoded text, so the same text hashes the same in any encoding
+template <typename TChar>
+uint64_t hashText(BasicTextView<TChar> text)
+{
+	auto decoder = makeDecoder(text);
+	auto hash = hashBytes(nullptr, 0, 0);
+
+	const wchar_t *chars;
+	size_t count;
+	while ((count = decoder.read(XT_DECODE_BUFFER_SIZE, chars)) > 0)
+	{
+		hash = continueHash(chars, count * sizeof(wchar_t), hash);
+	}
+	return hash;
+}
+
+// Writes a row of RGBA pixels from glyph coverage. Covered pixels get the
+// color with its alpha scaled by the coverage, the same way renderers scale
+// it, and uncovered ones get the background, which is what a recolorable
+// block's slot is cleared to before its glyphs are drawn.
+void tintCoverage(
+	const uint8_t *coverage,
+	size_t count,
+	Color color,
+	Color background,
+	uint8_t *rgba);
+
+// Glyph coverage of a block's slot plus the x offset each char was drawn at,
+// filled in by char renderers as they draw.
+class CoverageBuffer
+{
+public:
+	void reset(Size size, unsigned charCount)
+	{
+		_size = size;
+		_alpha.assign(static_cast<size_t>(size.width) * size.height, 0);
+		_charX.assign(charCount, 0);
+	}
+
+	void clear()
+	{
+		_size = { 0, 0 };
+		_alpha.clear();
+		_charX.clear();
+	}
+
+	// Glyphs can overlap, so a pixel keeps the most coverage any of them
+	// gave it. Returns the coverage the pixel ends up with.
+	uint8_t accumulate(unsigned x, unsigned y, uint8_t alpha)
+	{
+		if (x >= _size.width || y >= _size.height)
+		{
+			return alpha;
+		}
+
+		auto &covered = _alpha[static_cast<size_t>(y) * _size.width + x];
+		covered = std::max(covered, alpha);
+		return covered;
+	}
+
+	void setCharX(unsigned index, unsigned x)
+	{
+		if (index < _charX.size())
+		{
+			_charX[index] = x;
+		}
+	}
+
+	// Like std::string::replace, keeps the offsets of the chars around a
+	// changed span lined up with the new text.
+	void replaceChars(unsigned start, unsigned oldCount, unsigned newCount)
+	{
+		auto first = _charX.begin() + start;
+		_charX.erase(first, first + oldCount);
+		_charX.insert(_charX.begin() + start, newCount, 0);
+	}
+
+	void clearRows(unsigned top, unsigned bottom)
+	{
+		bottom = std::min(bottom, _size.height);
+		for (auto y = top; y < bottom; y++)
+		{
+			std::fill_n(row(y), _size.width, 0);
+		}
+	}
+
+	bool isEmpty() const { return _alpha.empty(); }
+	Size size() const { return _size; }
+	unsigned charX(unsigned index) const { return _charX[index]; }
+	const uint8_t *row(unsigned y) const { return &_alpha[y * _size.width]; }
+	uint8_t *row(unsigned y) { return &_alpha[y * _size.width]; }
+
+private:
+	Size _size{ 0, 0 };
+	std::vector<uint8_t> _alpha;
+	std::vector<unsigned> _charX;
+};
+
+// Bounded map that evicts the least recently used entry once it is full.
+// find() and insert() are both O(1) and count as a use.
+template <typename TKey, typename TValue, typename THash = std::hash<TKey>>
+class LruCache
+{
+public:
+	LruCache(size_t capacity) : _capacity(std::max<size_t>(capacity, 1))
+	{ }
+
+	TValue *find(const TKey &key)
+	{
+		auto it = _index.find(key);
+		if (it == _index.end())
+		{
+			return nullptr;
+		}
+
+		_entries.splice(_entries.begin(), _entries, it->second);
+		return &it->second->second;
+	}
+
+	TValue &insert(TKey key, TValue value)
+	{
+		auto it = _index.find(key);
+		if (it != _index.end())
+		{
+			it->second->second = std::move(value);
+			_entries.splice(_entries.begin(), _entries, it->second);
+			return it->second->second;
+		}
+
+		_entries.emplace_front(std::move(key), std::move(value));
+		_index[_entries.front().first] = _entries.begin();
+
+		if (_entries.size() > _capacity)
+		{
+			_index.erase(_entries.back().first);
+			_entries.pop_back();
+		}
+
+		return _entries.front().second;
+	}
+
+	void clear()
+	{
+		_index.clear();
+		_entries.clear();
+	}
+
+	size_t size() const { return _entries.size(); }
+	size_t capacity() const { return _capacity; }
+
+private:
+	using Entries = std::list<std::pair<TKey, TValue>>;
+
+	size_t _capacity;
+	Entries _entries;
+	std::unordered_map<TKey, typename Entries::iterator, THash> _index;
+};
+
 struct YCount
 {
 	unsigned y;
 	unsigned *count;
 };
 
+// A place in an organizer's slab of slots. A place keeps its generation
+// while it's free and gets a new one when it's released, so handles to the
+// slot that was there stop matching.
+struct SlabSlot
+{
+	Rect rect;
+	uint32_t generation;
+	bool isClaimed;
+};
+
+// The slots that touch one block of a spacial index. Each slot's edges are
+// copied next to its place as 16 bit values, one array per edge, so overlap
+// tests read straight through the block without going back to the slab.
+// Right and bottom are the last column and row the slot covers, which is
+// why organizers are at most XT_ORGANIZER_MAX_SIZE pixels a side.
+struct SpacialBlock
+{
+	std::vector<uint32_t> places;
+	std::vector<uint16_t> left;
+	std::vector<uint16_t> top;
+	std::vector<uint16_t> right;
+	std::vector<uint16_t> bottom;
+
+	size_t size() const { return places.size(); }
+	void push(uint32_t place, Rect rect);
+	void erase(uint32_t place);
+	void clear();
+	bool overlaps(Rect rect) const;
+};
+
+enum class OverlapKernel
+{
+	Scalar,
+	Sse41,
+	Avx2
+};
+
+// Bit i of the result is set when rect first + i of the block overlaps the
+// rect, for up to 16 rects. Full runs of 16 use the widest kernel the CPU
+// has, which is picked the first time this is called.
+uint32_t overlapMask(const SpacialBlock &block, size_t first, Rect rect);
+
+// Makes overlapMask() use the given kernel from now on. Fails if the CPU or
+// the build doesn't have it. Meant for tests and benchmarks.
+bool useOverlapKernel(OverlapKernel kernel);
+OverlapKernel overlapKernel();
+const char *overlapKernelName(OverlapKernel kernel);
+
 class SpacialIndex
 {
 public:
@@ -292,41 +929,53 @@ public:
 	SpacialIndex(const SpacialIndex &other) = delete;
 	SpacialIndex(SpacialIndex &&other);
 
-	void add(Slot slot);
+	// Blocks hold the slab places of the slots that touch them
+	void add(uint32_t place, Rect rect);
 
-	void remove(Slot slot);
+	void remove(uint32_t place, Rect rect);
 
 	bool withNearBlocks(
 		Rect rect,
-		std::function<bool(std::vector<uint64_t> &)> action);
+		std::function<bool(SpacialBlock &)> action);
+
+	// Whether any slot in the index overlaps the rect
+	bool overlapsAny(Rect rect) const;
 
 	bool withNearSlots(
 		Rect rect,
-		std::function<bool(uint64_t)> action);
+		std::function<bool(uint32_t)> action);
 
 	bool withSlotsOnYLine(
 		unsigned y,
-		std::function<bool(uint64_t)> action);
+		std::function<bool(uint32_t)> action);
 
 	bool withSlotsInBlockRange(
 		unsigned leftColumn,
 		unsigned rightColumn,
 		unsigned topRow,
 		unsigned bottomRow,
-		std::function<bool(uint64_t)> action);
+		std::function<bool(uint32_t)> action);
 
 	bool withBlocksInRange(
 		unsigned leftColumn,
 		unsigned rightColumn,
 		unsigned topRow,
 		unsigned bottomRow,
-		std::function<bool(std::vector<uint64_t> &)> action);
+		std::function<bool(SpacialBlock &)> action);
+
+	void clear();
+	void save(std::ostream &out) const;
+	bool load(std::istream &in);
+
+	// Checks that every slot is in exactly the blocks it touches and that
+	// blocks hold nothing else. Problems are written to out.
+	bool verify(const std::vector<SlabSlot> &slab, std::ostream &out) const;
 
 private:
 	Size _blockSize;
 	unsigned _xBlocks;
 	unsigned _yBlocks;
-	std::vector<std::vector<uint64_t>> _data;
+	std::vector<SpacialBlock> _data;
 
 	unsigned getBlockIndex(unsigned x, unsigned y);
 	static unsigned calcBlockCount(unsigned totalSize, unsigned blockSize);
@@ -341,162 +990,1892 @@ public:
 	void increment(unsigned y);
 	void decrement(unsigned y);
 	void withYValuesInPriorityOrder(std::function<bool(unsigned y)> callback);
+	void clear();
+	void save(std::ostream &out) const;
+	bool load(std::istream &in);
+
+	// Checks the counts against the top and bottom edges of the slots and
+	// that the priority list holds exactly the y values with a count.
+	bool verify(const std::vector<SlabSlot> &slab, std::ostream &out) const;
 
 private:
 	std::vector<unsigned> _yCounts;
 	std::vector<YCount> _yCountPriority;
 };
 
-class RectangleOrganizer
+// How full an organizer is and how broken up its free space is. Everything
+// but the largest free rect is kept up to date as slots come and go. The
+// largest free rect is searched for on a grid of at most XT_FREE_RECT_GRID
+// cells a side the first time it's asked for after a change, so it can come
+// out up to a cell smaller than it really is.
+struct OrganizerStats
 {
-public:
-	RectangleOrganizer(Size size);
-	RectangleOrganizer(const RectangleOrganizer &) = delete;
-	RectangleOrganizer(RectangleOrganizer &&);
-	SlotSearchResult tryClaimSlot(Size size);
-	bool releaseSlot(uint64_t index);
+	uint64_t totalArea;
+	uint64_t usedArea;
+	// Used area plus whatever claims were padded by to fit the organizer's
+	// blocks, which nothing else can use until the slots are released
+	uint64_t reservedArea;
+	uint64_t slotCount;
+	uint64_t failedClaims;
+	Size largestFreeRect;
+
+	// Bucket i counts slots with an area of 2^i up to 2^(i + 1) - 1 pixels,
+	// the last bucket takes everything bigger
+	std::array<uint64_t, XT_SLOT_SIZE_BUCKETS> slotSizes;
+
+	uint64_t freeArea() const { return totalArea - reservedArea; }
+
+	// The share of reserved area that is padding
+	double internalFragmentation() const
+	{
+		return reservedArea == 0
+			? 0.0
+			: 1.0 - static_cast<double>(usedArea) / reservedArea;
+	}
 
-private:
-	bool isRectOpen(Rect &rect);
-	void withXOptions(unsigned y, std::function<bool(unsigned)> callback);
-	bool checkOverlap(Rect a, Rect b);
-	SlotSearchResult search(unsigned y, Size size);
-	void addSlot(Slot slot);
-	void removeSlot(uint64_t slotIndex);
-	bool empty();
-	uint64_t nextIndex() { return _nextIndex++; }
+	// 0 while all the free area is one rectangle, going towards 1 as it
+	// breaks up into pieces too small to use
+	double fragmentation() const
+	{
+		auto largest = uint64_t{ largestFreeRect.width }
+			* largestFreeRect.height;
+		return freeArea() == 0
+			? 0.0
+			: 1.0 - static_cast<double>(largest) / freeArea();
+	}
 
-	std::vector<uint64_t> _slotIndexes;
-	Size _size;
-	uint64_t _nextIndex;
-	std::unordered_map<uint64_t, Slot> _slotMap;
-	SpacialIndex _spacialIndex;
-	YCache _yCache;
-	std::unordered_map<unsigned, bool> _usedXOptions;
-	bool _moved;
+	static unsigned sizeBucket(uint64_t area);
 };
 
-template <typename TImageData>
-class Texture
+// A strip of texture claimed from the organizer for one height class. The
+// free spans are the unclaimed runs of columns in the strip, sorted by x
+// with no two touching. A shelf with a free span is open, and sits at
+// openPosition in the bucket of its class for the width of its widest span.
+struct Shelf
 {
-public:
-	Texture(TImageData imageData) :
-		_imageData(std::move(imageData)), _organizer(imageData.size())
-	{ }
-
-	Texture(const Texture &) = delete;
-
-	Texture(Texture &&other) :
-		_imageData(std::move(other._imageData)),
-		_organizer(std::move(other._organizer))
-	{ }
-
-	TImageData &imageData() { return _imageData; }
-	RectangleOrganizer &organizer() { return _organizer; }
+	struct Span
+	{
+		unsigned x;
+		unsigned width;
+	};
 
-private:
-	TImageData _imageData;
-	RectangleOrganizer _organizer;
+	uint64_t slot;
+	Rect rect;
+	std::vector<Span> freeSpans;
+	uint32_t itemCount;
+	unsigned widestSpan;
+	uint32_t openPosition;
+	bool isLive;
 };
 
-template <typename TImageData>
-struct Placement
+// The open shelves of one height class in buckets by the width of their
+// widest free span. Bit w of the mask is set while bucket w has a shelf.
+struct ShelfClass
+{
+	std::vector<std::vector<uint32_t>> buckets;
+	std::vector<uint64_t> mask;
+};
+
+// A rect handed out from a shelf. Items have a slab of their own with
+// generations that work like the organizer's.
+struct ShelfItem
+{
+	Rect rect;
+	uint32_t shelf;
+	uint32_t generation;
+	bool isClaimed;
+};
+
+// One block of a buddy organizer's quadtree. Children is the first of the
+// block's four quarters while it's split.
+struct BuddyNode
+{
+	Size claimedSize;
+	uint32_t generation;
+	uint32_t freePosition;
+	uint32_t children;
+	uint8_t level;
+	uint8_t state;
+};
+
+// A 2D buddy allocator. The texture is tiled with squares of the largest
+// power of two side that fits in it, then the strips left at the right and
+// the bottom are tiled with smaller squares, down to XT_BUDDY_MIN_SIZE, and
+// each square is the root of a quadtree of blocks. A claim is rounded up to
+// a square block with a power of two side no smaller than
+// XT_BUDDY_MIN_SIZE, splitting bigger blocks into quarters as needed, and a
+// released block joins up with its three buddies as soon as they're all
+// free. Both take time in proportion to the number of levels, however full
+// the texture is.
+//
+// Only the roots and the quarters of split blocks have nodes, so memory
+// goes with how finely the texture has been split. Quarters that join back
+// up are kept for the next split, along with their generations, until the
+// organizer is cleared.
+class BuddyOrganizer
+{
+public:
+	BuddyOrganizer(Size size);
+	BuddyOrganizer(const BuddyOrganizer &) = delete;
+	BuddyOrganizer(BuddyOrganizer &&) = default;
+	SlotSearchResult tryClaimSlot(Size size);
+	bool releaseSlot(uint64_t index);
+	bool isClaimed(uint64_t index) const;
+	bool isClaimed(const Slot &slot) const;
+	void clear();
+	void save(std::ostream &out) const;
+	bool load(std::istream &in);
+
+	// Total area is what the roots cover, used area counts the sizes that
+	// were asked for and reserved area the blocks they were given. The
+	// largest free rect is the biggest free block, buddies that are free
+	// but can't join aren't put together.
+	OrganizerStats stats();
+
+	bool verify(std::ostream &out) const;
+
+private:
+	// Unused is a quarter that was joined back up and is waiting to be
+	// handed out by another split
+	enum NodeState : uint8_t
+	{
+		Unused,
+		Free,
+		Split,
+		Claimed
+	};
+
+	void addRoots(Rect area);
+	Rect nodeRect(uint32_t node) const;
+	uint32_t split(uint32_t node);
+	void pushFree(uint32_t node, unsigned level);
+	void removeFree(uint32_t node, unsigned level);
+	void countSlot(Size size, unsigned side, bool added);
+	bool loadNodes(std::istream &in);
+	bool verifyNode(
+		uint32_t node,
+		unsigned level,
+		OrganizerStats &counted,
+		size_t &quadCount,
+		std::ostream &out) const;
+
+	// The first nodes are the roots, then each group of four is a quad of
+	// quarters, in the order top left, top right, bottom left, bottom right
+	uint32_t quadOf(uint32_t node) const
+	{
+		return static_cast<uint32_t>((node - _roots.size()) / 4);
+	}
+
+	uint32_t firstOfQuad(uint32_t quad) const
+	{
+		return static_cast<uint32_t>(_roots.size() + uint64_t{ quad } * 4);
+	}
+
+	static uint64_t handle(uint32_t node, uint32_t generation)
+	{
+		return uint64_t{ generation } << 32 | node;
+	}
+
+	Size _size;
+	unsigned _rootSide;
+	unsigned _levels;
+	std::vector<Rect> _roots;
+	std::vector<BuddyNode> _nodes;
+	std::vector<uint32_t> _quadParents;
+	std::vector<uint32_t> _freeQuads;
+	std::vector<std::vector<uint32_t>> _freeNodes;
+	OrganizerStats _stats;
+};
+
+class RectangleOrganizer
+{
+public:
+	// A side longer than XT_ORGANIZER_MAX_SIZE is cut down to it, the rest
+	// of the texture is never handed out
+	RectangleOrganizer(Size size, OrganizerOptions options = {});
+	RectangleOrganizer(const RectangleOrganizer &) = delete;
+	RectangleOrganizer(RectangleOrganizer &&);
+	SlotSearchResult tryClaimSlot(Size size);
+	bool releaseSlot(uint64_t index);
+	bool isClaimed(uint64_t index) const;
+
+	// Whether the slot is claimed and still has the rect it was handed out
+	// with, for checking slots that were kept somewhere else
+	bool isClaimed(const Slot &slot) const;
+	void clear();
+
+	// Writes the slab along with the spacial index, y cache and shelves so
+	// that load() reproduces this organizer exactly, including the handles
+	// it gives out and the order in which future searches try positions.
+	// Options aren't saved, they come from the organizer being loaded into.
+	// A state that doesn't pass verify() isn't loaded.
+	void save(std::ostream &out) const;
+	bool load(std::istream &in);
+
+	// Failed claims count every claim that didn't fit since the organizer
+	// was made, clear() and load() leave them alone.
+	OrganizerStats stats();
+
+	// Checks that slots are in bounds and don't overlap and that the free
+	// list, spacial index, y cache and shelves all agree with the slab.
+	// Slow, it's meant for tests. Problems are written to out.
+	bool verify(std::ostream &out) const;
+
+private:
+	bool isRectOpen(Rect &rect);
+	void withXOptions(unsigned y, std::function<bool(unsigned)> callback);
+	SlotSearchResult search(unsigned y, Size size);
+	SlotSearchResult claimSlot(Size size);
+	Slot addSlot(Rect rect);
+	void removeSlot(uint32_t place);
+	bool empty();
+	void countSlot(Rect rect, bool added);
+	Size findLargestFreeRect();
+
+	SlotSearchResult claimOnShelf(Size size);
+	bool claimSpan(uint32_t shelfIndex, Size size, Rect &rect);
+	bool openShelf(unsigned height, uint32_t &shelfIndex);
+	void addOpenShelf(uint32_t shelfIndex);
+	void removeOpenShelf(uint32_t shelfIndex);
+	void releaseItem(uint32_t place);
+	bool verifyShelves(std::ostream &out) const;
+	void saveShelves(std::ostream &out) const;
+	bool loadParts(std::istream &in);
+	bool loadShelves(std::istream &in);
+	bool loadOpenShelves();
+
+	// Slot indexes are handles with the slot's place in the slab in the low
+	// 32 bits and the place's generation in the high 32 bits
+	static uint64_t handle(uint32_t place, uint32_t generation)
+	{
+		return uint64_t{ generation } << 32 | place;
+	}
+
+	static uint32_t placeOf(uint64_t handle)
+	{
+		return static_cast<uint32_t>(handle);
+	}
+
+	static uint32_t generationOf(uint64_t handle)
+	{
+		return static_cast<uint32_t>(handle >> 32);
+	}
+
+	// Shelf items share the handle layout with the top bit of the place set
+	static const uint32_t shelfItemBit = 0x80000000u;
+
+	static bool isShelfItem(uint64_t handle)
+	{
+		return (placeOf(handle) & shelfItemBit) != 0;
+	}
+
+	Size _size;
+	OrganizerOptions _options;
+	std::unique_ptr<BuddyOrganizer> _buddy;
+	std::vector<SlabSlot> _slab;
+	std::vector<uint32_t> _freePlaces;
+	SpacialIndex _spacialIndex;
+	YCache _yCache;
+	std::unordered_map<unsigned, bool> _usedXOptions;
+
+	// Open shelves for each class height. Dead shelves keep their place in
+	// _shelves until a new shelf reuses it.
+	std::vector<Shelf> _shelves;
+	std::vector<uint32_t> _freeShelves;
+	std::unordered_map<unsigned, ShelfClass> _openShelves;
+	std::vector<ShelfItem> _shelfItems;
+	std::vector<uint32_t> _freeShelfItems;
+
+	OrganizerStats _stats;
+	bool _freeRectStale;
+	bool _moved;
+};
+
+template <typename TImageData>
+class Texture
+{
+public:
+	Texture(TImageData imageData, OrganizerOptions options = {}) :
+		_imageData(std::move(imageData)),
+		_organizer(imageData.size(), options)
+	{ }
+
+	Texture(const Texture &) = delete;
+
+	Texture(Texture &&other) :
+		_imageData(std::move(other._imageData)),
+		_organizer(std::move(other._organizer))
+	{ }
+
+	TImageData &imageData() { return _imageData; }
+	RectangleOrganizer &organizer() { return _organizer; }
+
+private:
+	TImageData _imageData;
+	RectangleOrganizer _organizer;
+};
+
+// Epoch is the number of loads the manager had done when the placement was
+// handed out. A load replaces every slot, so older placements are stale.
+template <typename TImageData>
+struct Placement
 {
 	bool isFound;
 	Slot slot;
 	Texture<TImageData> *texture;
+	unsigned epoch;
+
+	static Placement notFound()
+	{
+		return{ false, {0}, nullptr, 0 };
+	}
+
+	static Placement found(Slot slot_, Texture<TImageData> *texture_)
+	{
+		return{ true, slot_, texture_, 0 };
+	}
+};
+
+struct CharLayout
+{
+	wchar_t ch;
+	Size size;
+	int kerning;
+	unsigned ascent;
+	unsigned line;
+};
+
+class TextLayout
+{
+public:
+	TextLayout(Size maxSize);
+	// Kerning is the adjustment between this char and the one before it and
+	// is ignored for the first char on a line. Ascent is the distance from
+	// the top of the char to its baseline.
+	void nextChar(wchar_t ch, Size charSize, int kerning, unsigned ascent = 0);
+	// The block is as wide as its widest line in lineWidths()
+	TextBlockMetrics metrics();
+	// Width of each line including kerning, at most the layout width
+	std::vector<unsigned> lineWidths() const;
+	unsigned charCount() const { return static_cast<unsigned>(_chars.size()); }
+	unsigned lineOf(unsigned index) const { return _chars[index].line; }
+
+	// The latest point at or before a changed char that layout can pick up
+	// from. That is just after a word divider, since nothing before a divider
+	// moves to another line once the divider is in.
+	unsigned resumePoint(unsigned firstChangedChar);
+
+	// Drops the chars from a resume point on so new ones can be added from
+	// there. The char before the resume point is expected to be added again
+	// first, so builders can kern against it, and is skipped.
+	void rewind(unsigned index);
+
+private:
+	void wrap();
+	void wrapFrom(unsigned index);
+	bool isWhitespace(wchar_t ch);
+	bool isWordDivider(wchar_t ch);
+	int getKerningOffset(int kerning);
+
+	Size _size;
+	std::vector<CharLayout> _chars;
+	unsigned _penX;
+	unsigned _currentLine;
+	unsigned _lineStart;
+	unsigned _trailingDividers;
+	unsigned _trailingWordChars;
+	unsigned _skippedChars;
+};
+
+// What a measurement depends on. Only the font and size of each style
+// matter since colors don't change metrics. The base style comes first with
+// an empty range, followed by the style ranges as they were given.
+struct MeasureStyle
+{
+	uint64_t font;
+	float size;
+	Range range;
+};
+
+struct MeasureKey
+{
+	std::wstring text;
+	unsigned maxWidth;
+	std::vector<MeasureStyle> styles;
+};
+
+// Measurements are cached under a hash of their key. The full key is kept
+// alongside to check a hit against, so a hash collision is only a miss.
+struct MeasureEntry
+{
+	MeasureKey key;
+	TextBlockMetrics metrics;
+};
+
+// Wall time from the monotonic clock, so it never jumps with the time of day
+class WallTimer
+{
+public:
+	WallTimer() : _start(std::chrono::steady_clock::now())
+	{ }
+
+	uint64_t nanos() const
+	{
+		return static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - _start).count());
+	}
+
+	double millis() const { return nanos() / 1000000.0; }
+
+private:
+	std::chrono::steady_clock::time_point _start;
+};
+
+// CPU time spent by the calling thread, which leaves out time spent waiting.
+// Always zero where there is no per thread clock.
+class ThreadCpuTimer
+{
+public:
+	ThreadCpuTimer() : _start(now())
+	{ }
+
+	uint64_t nanos() const { return now() - _start; }
+	double millis() const { return nanos() / 1000000.0; }
+
+	static uint64_t now();
+
+private:
+	uint64_t _start;
+};
+
+struct StageStats
+{
+	uint64_t count;
+	uint64_t totalNanos;
+	uint64_t maxNanos;
+
+	void record(uint64_t nanos)
+	{
+		count++;
+		totalNanos += nanos;
+		maxNanos = std::max(maxNanos, nanos);
+	}
+
+	double totalMillis() const { return totalNanos / 1000000.0; }
+	double maxMillis() const { return maxNanos / 1000000.0; }
+	double meanMillis() const
+	{
+		return count == 0 ? 0.0 : totalMillis() / count;
+	}
+};
+
+// Wall time spent in each stage of getting text into textures, kept by the
+// manager for every block it serves. Metrics covers walking runs through
+// the metric builder, for blocks and for measure() misses.
+struct PipelineStats
+{
+	StageStats metrics;
+	StageStats placement;
+	StageStats render;
+	StageStats commit;
+	uint64_t failedPlacements;
+};
+
+// Records the wall time of a scope into a stage when it ends
+class StageTimer
+{
+public:
+	StageTimer(StageStats &stage) : _stage(stage)
+	{ }
+
+	StageTimer(const StageTimer &) = delete;
+
+	~StageTimer()
+	{
+		_stage.record(_timer.nanos());
+	}
+
+private:
+	StageStats &_stage;
+	WallTimer _timer;
+};
+
+struct TraceEvent
+{
+	// Names must outlive the sink, string literals are what's expected
+	const char *name;
+	char phase;
+	uint64_t nanos;
+	unsigned argCount;
+	const char *argNames[2];
+	int64_t args[2];
+};
+
+static_assert(sizeof(TraceEvent) % 8 == 0, "trace events are copied by word");
+
+// Events of one thread. Only the owning thread pushes, and once the ring is
+// full the oldest events are overwritten, so pushing never blocks or
+// allocates. Each slot is stamped with the position of the event in it, the
+// way a seqlock is, so a copy can tell an event apart from one that was
+// being overwritten while it was read.
+class TraceRing
+{
+public:
+	TraceRing(size_t capacity, unsigned threadId);
+	TraceRing(const TraceRing &) = delete;
+
+	void push(const TraceEvent &event)
+	{
+		auto head = _head.load(std::memory_order_relaxed);
+		auto &slot = _slots[head & _mask];
+		slot.sequence.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		uint64_t words[TRACE_EVENT_WORDS];
+		std::memcpy(words, &event, sizeof(event));
+		for (size_t i = 0; i < TRACE_EVENT_WORDS; i++)
+		{
+			slot.words[i].store(words[i], std::memory_order_relaxed);
+		}
+
+		slot.sequence.store(head + 1, std::memory_order_release);
+		_head.store(head + 1, std::memory_order_release);
+	}
+
+	// Appends the events still in the ring, oldest first
+	void copyTo(std::vector<TraceEvent> &events) const;
+
+	unsigned threadId() const { return _threadId; }
+	uint64_t dropped() const;
+
+private:
+	static const size_t TRACE_EVENT_WORDS = sizeof(TraceEvent) / 8;
+
+	// Zero while the owner writes, one past the event's position after
+	struct Slot
+	{
+		std::atomic<uint64_t> sequence;
+		std::atomic<uint64_t> words[TRACE_EVENT_WORDS];
+	};
+
+	std::unique_ptr<Slot[]> _slots;
+	uint64_t _capacity;
+	uint64_t _mask;
+	unsigned _threadId;
+	std::atomic<uint64_t> _head;
+};
+
+// Collects begin and end events from any thread while it is installed and
+// writes them out in the Chrome trace_event format, which Perfetto and
+// chrome://tracing both open. Each thread gets its own ring the first time
+// it records and keeps it for the life of the sink. The sink only takes a
+// lock when a thread records into a different sink than it did last.
+//
+// Open scopes share ownership of the sink they started on, so it can be
+// uninstalled and released while other threads are still in one. Dumping
+// while other threads are still tracing skips any events they overwrite
+// during the dump.
+class TraceSink
+{
+public:
+	TraceSink(size_t eventsPerThread = XT_TRACE_RING_SIZE);
+	TraceSink(const TraceSink &) = delete;
+	TraceSink(TraceSink &&) = delete;
+
+	static void install(std::shared_ptr<TraceSink> sink);
+	static std::shared_ptr<TraceSink> installed()
+	{
+		// The flag keeps the cost to one atomic load when there's no sink
+		if (!_isInstalled.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+		return std::atomic_load(&_installed);
+	}
+
+	void begin(
+		const char *name,
+		unsigned argCount,
+		const char *argName0,
+		int64_t arg0,
+		const char *argName1,
+		int64_t arg1);
+	void end(const char *name);
+
+	// Events still in the rings, grouped by thread and oldest first
+	std::vector<std::pair<unsigned, TraceEvent>> events() const;
+	uint64_t dropped() const;
+
+	bool writeJson(std::ostream &out) const;
+	bool writeJson(const std::string &path) const;
+
+private:
+	TraceRing &threadRing();
+
+	static std::atomic<bool> _isInstalled;
+	static std::shared_ptr<TraceSink> _installed;
+
+	size_t _eventsPerThread;
+	uint64_t _id;
+	WallTimer _clock;
+	mutable std::mutex _mutex;
+	std::vector<std::unique_ptr<TraceRing>> _rings;
+	std::vector<std::thread::id> _ringThreads;
+};
+
+// Records a begin event when it is created and the matching end event when
+// the scope ends. Costs one atomic load when no sink is installed.
+class TraceScope
+{
+public:
+	TraceScope(const char *name) :
+		TraceScope(name, 0, nullptr, 0, nullptr, 0)
+	{ }
+
+	TraceScope(const char *name, const char *argName, int64_t arg) :
+		TraceScope(name, 1, argName, arg, nullptr, 0)
+	{ }
+
+	TraceScope(
+		const char *name,
+		const char *argName0,
+		int64_t arg0,
+		const char *argName1,
+		int64_t arg1) :
+		TraceScope(name, 2, argName0, arg0, argName1, arg1)
+	{ }
+
+	TraceScope(const TraceScope &) = delete;
+
+	~TraceScope()
+	{
+		if (_sink)
+		{
+			_sink->end(_name);
+		}
+	}
+
+private:
+	TraceScope(
+		const char *name,
+		unsigned argCount,
+		const char *argName0,
+		int64_t arg0,
+		const char *argName1,
+		int64_t arg1) :
+		_sink(TraceSink::installed()),
+		_name(name)
+	{
+		if (_sink)
+		{
+			_sink->begin(name, argCount, argName0, arg0, argName1, arg1);
+		}
+	}
+
+	std::shared_ptr<TraceSink> _sink;
+	const char *_name;
+};
+
+// A placement remembered under a key so it can be saved with the manager and
+// handed back to a block with the same key after a load.
+struct RetainedPlacement
+{
+	unsigned textureIndex;
+	Slot slot;
+	uint64_t contentHash;
+	TextBlockMetrics metrics;
+	bool claimed;
+};
+
+template <typename TText>
+class TextManager
+{
+public:
+	using TImageData = typename TText::ImageData;
+	using TSysContext = typename TText::SysContext;
+	using TFont = typename TText::Font;
+
+	TextManager(
+		TextManagerOptions options,
+		std::vector<typename TText::ImageData> textures) :
+		_sysContext(TSysContext(options)),
+		_lastUsed(0),
+		_epoch(0),
+		_options(options),
+		_measureCache(options.measureCacheSize)
+	{
+		for (auto &tex : textures)
+		{
+			_textures.push_back(
+				Texture<TImageData>(std::move(tex), options.organizer));
+		}
+	}
+
+	TextManager(const TextManager &) = delete;
+	TextManager(TextManager &&) = delete;
+
+	Placement<TImageData> findPlacement(Size size)
+	{
+		TraceScope trace(
+			"TextManager::findPlacement",
+			"width", size.width,
+			"height", size.height);
+		auto placement = Placement<TImageData>::notFound();
+		{
+			StageTimer timer(_stats.placement);
+			placement = searchPlacement(size);
+		}
+		placement.epoch = _epoch;
+
+		if (!placement.isFound)
+		{
+			_stats.failedPlacements++;
+		}
+
+		if (_options.logPlacements)
+		{
+			auto rect = placement.slot.rect;
+			std::cout << "placement: " << rect.x << "," << rect.y << ","
+				<< rect.width << "," << rect.height << std::endl;
+		}
+
+		return placement;
+	}
+
+	void commit(Texture<TImageData> *texture)
+	{
+		TraceScope trace(
+			"ImageData::commit", "texture", texture - _textures.data());
+		StageTimer timer(_stats.commit);
+		texture->imageData().commit();
+	}
+
+	const PipelineStats &stats() const { return _stats; }
+	PipelineStats &stats() { return _stats; }
+	void resetStats() { _stats = PipelineStats(); }
+
+	// A stale placement's slot may belong to someone else by now, so only
+	// the load that made it stale frees it
+	void releaseRect(const Placement<TImageData> &placement)
+	{
+		if (isCurrent(placement))
+		{
+			placement.texture->organizer().releaseSlot(placement.slot.index);
+		}
+	}
+
+	bool isCurrent(const Placement<TImageData> &placement) const
+	{
+		return placement.isFound && placement.epoch == _epoch;
+	}
+
+	TFont loadFont(std::string path)
+	{
+		return TFont(path, _sysContext);
+	}
+
+	TextBlockMetrics measure(
+		const std::wstring &text,
+		const TextOptions<TFont> &options,
+		unsigned maxWidth)
+	{
+		return measure(textView(text), options, maxWidth);
+	}
+
+	// Lays out text the same way a block would, but wrapped at maxWidth and
+	// without claiming a slot or rendering anything. Results are cached by
+	// text, fonts, sizes and width, so measuring the same string every frame
+	// only lays it out once. A cache hit decodes the text a buffer at a time
+	// to hash and compare it and doesn't copy it anywhere.
+	template <typename TChar>
+	TextBlockMetrics measure(
+		BasicTextView<TChar> text,
+		const TextOptions<TFont> &options,
+		unsigned maxWidth)
+	{
+		auto hash = hashText(text);
+		hash = hashBytes(&maxWidth, sizeof(maxWidth), hash);
+		hash = hashMeasureStyle(options.baseStyle, { 0, 0 }, hash);
+		for (auto &styleRange : options.styleRanges)
+		{
+			hash = hashMeasureStyle(styleRange.style, styleRange.range, hash);
+		}
+
+		auto cached = _measureCache.find(hash);
+		if (cached && isMeasureOf(cached->key, text, options, maxWidth))
+		{
+			return cached->metrics;
+		}
+
+		MeasureEntry entry{ { decodeText(text), maxWidth, {} }, {} };
+		auto &styles = entry.key.styles;
+		styles.reserve(options.styleRanges.size() + 1);
+		styles.push_back({
+			fontId(options.baseStyle.font), options.baseStyle.size, { 0, 0 } });
+		for (auto &styleRange : options.styleRanges)
+		{
+			styles.push_back({
+				fontId(styleRange.style.font),
+				styleRange.style.size,
+				styleRange.range });
+		}
+
+		auto length = static_cast<unsigned>(entry.key.text.size());
+		auto styleRanges = options.styleRanges;
+		sortStyleRanges(styleRanges);
+		auto runs = itemizeStyleRuns(options.baseStyle, styleRanges, length);
+
+		StageTimer timer(_stats.metrics);
+		TextLayout layout({ maxWidth, _options.textureSize.height });
+		typename TText::MetricBuilder metricBuilder(_sysContext, layout);
+		walkStyleRuns(entry.key.text, 0, length, runs, metricBuilder);
+		entry.metrics = metricBuilder.done();
+		return _measureCache.insert(hash, std::move(entry)).metrics;
+	}
+
+	void clearMeasureCache() { _measureCache.clear(); }
+	size_t measureCacheSize() const { return _measureCache.size(); }
+
+	bool reclaimPlacement(
+		const std::string &key,
+		uint64_t contentHash,
+		Placement<TImageData> &placement,
+		TextBlockMetrics &metrics)
+	{
+		auto it = _retained.find(key);
+		if (it == _retained.end() || it->second.claimed)
+		{
+			return false;
+		}
+
+		auto &retained = it->second;
+		if (retained.contentHash != contentHash)
+		{
+			// same key but different content so the pixels are stale
+			_textures[retained.textureIndex].organizer().releaseSlot(
+				retained.slot.index);
+			_retained.erase(it);
+			return false;
+		}
+
+		retained.claimed = true;
+		placement = Placement<TImageData>::found(
+			retained.slot, &_textures[retained.textureIndex]);
+		placement.epoch = _epoch;
+		metrics = retained.metrics;
+		return true;
+	}
+
+	void retainPlacement(
+		const std::string &key,
+		uint64_t contentHash,
+		Placement<TImageData> placement,
+		const TextBlockMetrics &metrics)
+	{
+		if (!isCurrent(placement) || _retained.find(key) != _retained.end())
+		{
+			return;
+		}
+
+		auto textureIndex =
+			static_cast<unsigned>(placement.texture - &_textures[0]);
+		_retained[key] =
+			{ textureIndex, placement.slot, contentHash, metrics, true };
+	}
+
+	void forgetPlacement(
+		const std::string &key, const Placement<TImageData> &placement)
+	{
+		auto it = _retained.find(key);
+		if (it != _retained.end()
+			&& isCurrent(placement)
+			&& it->second.slot.index == placement.slot.index)
+		{
+			_retained.erase(it);
+		}
+	}
+
+	// Frees every loaded placement that no block has reclaimed yet.
+	void releaseUnclaimed()
+	{
+		for (auto it = _retained.begin(); it != _retained.end();)
+		{
+			if (it->second.claimed)
+			{
+				++it;
+				continue;
+			}
+
+			_textures[it->second.textureIndex].organizer().releaseSlot(
+				it->second.slot.index);
+			it = _retained.erase(it);
+		}
+	}
+
+	// Writes the pixels and organizer state of every texture plus the table
+	// of keyed placements. The image data type needs save/load methods.
+	void save(std::ostream &out)
+	{
+		writeBinary(out, uint32_t{XT_STATE_MAGIC});
+		writeBinary(out, uint32_t{XT_STATE_VERSION});
+		writeBinary(out, static_cast<uint32_t>(_textures.size()));
+		writeBinary(out, _lastUsed);
+
+		for (auto &texture : _textures)
+		{
+			texture.organizer().save(out);
+			texture.imageData().save(out);
+		}
+
+		writeBinary(out, static_cast<uint64_t>(_retained.size()));
+		for (auto &pair : _retained)
+		{
+			writeBinary(out, pair.first);
+			writeBinary(out, pair.second.textureIndex);
+			writeBinary(out, pair.second.slot.rect);
+			writeBinary(out, pair.second.slot.index);
+			writeBinary(out, pair.second.contentHash);
+			writeBinary(out, pair.second.metrics);
+		}
+	}
+
+	// Replaces the state of this manager with one written by save(). Loaded
+	// placements stay claimed until a keyed block reclaims them or
+	// releaseUnclaimed() is called. If the stream doesn't match the textures
+	// of this manager then false is returned and every texture is left empty,
+	// with nothing claimed and its pixels cleared, since the stream may have
+	// been read part way into them. The image data type needs a clear method.
+	// Blocks from before the load keep their pixels on screen until they
+	// change, but their placements are stale so they never free a slot that
+	// was loaded, and updating one finds it a new slot.
+	bool load(std::istream &in)
+	{
+		_epoch++;
+		_retained.clear();
+		if (!loadState(in))
+		{
+			std::cout << "failed to load text manager state" << std::endl;
+			_retained.clear();
+			_lastUsed = 0;
+			for (auto &texture : _textures)
+			{
+				texture.organizer().clear();
+				texture.imageData().clear();
+			}
+			return false;
+		}
+		return true;
+	}
+
+	TextManagerOptions &options() { return _options; }
+
+	TSysContext &sysContext() { return _sysContext; }
+	std::vector<Texture<TImageData>> &textures() { return _textures; }
+
+	// Occupancy of each texture, in the same order as textures()
+	std::vector<OrganizerStats> atlasStats()
+	{
+		std::vector<OrganizerStats> stats;
+		stats.reserve(_textures.size());
+		for (auto &texture : _textures)
+		{
+			stats.push_back(texture.organizer().stats());
+		}
+		return stats;
+	}
+
+private:
+	Placement<TImageData> searchPlacement(Size size)
+	{
+		auto &lastUsedTexture = _textures[_lastUsed];
+		auto firstResult = lastUsedTexture.organizer().tryClaimSlot(size);
+		if (firstResult.isFound)
+		{
+			return Placement<TImageData>::found(
+				firstResult.slot, &_textures.at(_lastUsed));
+		}
+
+		for (unsigned i = 0; i < _textures.size(); i++)
+		{
+			if (i == _lastUsed)
+			{
+				continue;
+			}
+
+			auto result = _textures[i].organizer().tryClaimSlot(size);
+			if (result.isFound)
+			{
+				// found a place for the text block :)
+				_lastUsed = i;
+				return Placement<TImageData>::found(
+					result.slot, &_textures[i]);
+			}
+		}
+
+		// there is nowhere that can fit a text block of this size :(
+		return Placement<TImageData>::notFound();
+	}
+
+	// Field by field so padding never ends up in the hash
+	static uint64_t hashMeasureStyle(
+		const Style<TFont> &style, Range range, uint64_t hash)
+	{
+		auto font = fontId(style.font);
+		hash = hashBytes(&font, sizeof(font), hash);
+		hash = hashBytes(&style.size, sizeof(style.size), hash);
+		hash = hashBytes(&range.start, sizeof(unsigned), hash);
+		return hashBytes(&range.length, sizeof(unsigned), hash);
+	}
+
+	static bool isMeasureStyle(
+		const MeasureStyle &measureStyle,
+		const Style<TFont> &style,
+		Range range)
+	{
+		return measureStyle.font == fontId(style.font)
+			&& measureStyle.size == style.size
+			&& measureStyle.range.start == range.start
+			&& measureStyle.range.length == range.length;
+	}
+
+	template <typename TChar>
+	static bool isMeasureOf(
+		const MeasureKey &key,
+		BasicTextView<TChar> text,
+		const TextOptions<TFont> &options,
+		unsigned maxWidth)
+	{
+		if (key.maxWidth != maxWidth
+			|| key.styles.size() != options.styleRanges.size() + 1
+			|| !isMeasureStyle(key.styles[0], options.baseStyle, { 0, 0 }))
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < options.styleRanges.size(); i++)
+		{
+			auto &styleRange = options.styleRanges[i];
+			if (!isMeasureStyle(
+				key.styles[i + 1], styleRange.style, styleRange.range))
+			{
+				return false;
+			}
+		}
+
+		return decodesTo(text, key.text);
+	}
+
+	bool loadState(std::istream &in)
+	{
+		uint32_t magic, version, textureCount;
+		if (!readBinary(in, magic) || magic != XT_STATE_MAGIC
+			|| !readBinary(in, version) || version != XT_STATE_VERSION
+			|| !readBinary(in, textureCount)
+			|| textureCount != _textures.size()
+			|| !readBinary(in, _lastUsed)
+			|| _lastUsed >= _textures.size())
+		{
+			return false;
+		}
+
+		for (auto &texture : _textures)
+		{
+			if (!texture.organizer().load(in)
+				|| !texture.imageData().load(in))
+			{
+				return false;
+			}
+		}
+
+		uint64_t count;
+		if (!readBinary(in, count))
+		{
+			return false;
+		}
+
+		for (uint64_t i = 0; i < count; i++)
+		{
+			std::string key;
+			RetainedPlacement retained{ 0, { 0 }, 0, {}, false };
+			if (!readBinary(in, key)
+				|| !readBinary(in, retained.textureIndex)
+				|| !readBinary(in, retained.slot.rect)
+				|| !readBinary(in, retained.slot.index)
+				|| !readBinary(in, retained.contentHash)
+				|| !readBinary(in, retained.metrics)
+				|| retained.textureIndex >= _textures.size()
+				|| !_textures[retained.textureIndex].organizer().isClaimed(
+					retained.slot))
+			{
+				return false;
+			}
+			_retained[key] = retained;
+		}
+
+		return true;
+	}
+
+	std::vector<Texture<TImageData>> _textures;
+	TSysContext _sysContext;
+	unsigned _lastUsed;
+	unsigned _epoch;
+	TextManagerOptions _options;
+	std::unordered_map<std::string, RetainedPlacement> _retained;
+	LruCache<uint64_t, MeasureEntry> _measureCache;
+	PipelineStats _stats{};
+};
+
+template <typename TText>
+class TextBlock
+{
+public:
+	using TFont = typename TText::Font;
+	using TImageData = typename TText::ImageData;
+	using TMetricBuilder = typename TText::MetricBuilder;
+	using TCharRenderer = typename TText::CharRenderer;
+
+	TextBlock(
+		TextManager<TText> &manager,
+		std::wstring text,
+		TextOptions<TFont> options) :
+		TextBlock(manager, textView(text), options)
+	{ }
+
+	// Builds from a view of UTF-8, UTF-16, UTF-32 or wide text. The text is
+	// decoded on the fly and doesn't need to outlive the constructor.
+	template <typename TChar>
+	TextBlock(
+		TextManager<TText> &manager,
+		BasicTextView<TChar> text,
+		TextOptions<TFont> options) :
+		_manager(&manager),
+		_options(options),
+		_placement{0},
+		_layout(manager.options().textureSize)
+	{
+		sortStyleRanges(_options.styleRanges);
+		build(text);
+	}
+
+	TextBlock(
+		TextManager<TText> &manager,
+		std::string key,
+		std::wstring text,
+		TextOptions<TFont> options) :
+		TextBlock(manager, std::move(key), textView(text), options)
+	{ }
+
+	// A keyed block is remembered by the manager so it survives
+	// TextManager::save() and load(). If the manager was loaded with a block
+	// that has the same key and content then its pixels are reused as is.
+	template <typename TChar>
+	TextBlock(
+		TextManager<TText> &manager,
+		std::string key,
+		BasicTextView<TChar> text,
+		TextOptions<TFont> options) :
+		_manager(&manager),
+		_options(options),
+		_placement{0},
+		_key(std::move(key)),
+		_layout(manager.options().textureSize),
+		_textHash(hashText(text))
+	{
+		sortStyleRanges(_options.styleRanges);
+
+		auto contentHash = hashContent();
+		if (_manager->reclaimPlacement(
+			_key, contentHash, _placement, _metrics))
+		{
+			// The layout is only needed again once the text changes
+			_charCount = makeDecoder(text).length();
+			if (_options.editable)
+			{
+				_text = decodeText(text);
+				_hasText = true;
+			}
+			return;
+		}
+
+		build(text);
+
+		if (_placement.isFound)
+		{
+			_manager->retainPlacement(
+				_key, contentHash, _placement, _metrics);
+		}
+	}
+
+	TextBlock(const TextBlock &) = delete;
+
+	TextBlock(TextBlock &&other) :
+		_manager(other._manager),
+		_options(other._options),
+		_placement(other._placement),
+		_metrics(std::move(other._metrics)),
+		_key(std::move(other._key)),
+		_text(std::move(other._text)),
+		_layout(std::move(other._layout)),
+		_textHash(other._textHash),
+		_charCount(other._charCount),
+		_hasText(other._hasText),
+		_hasLayout(other._hasLayout),
+		_coverage(std::move(other._coverage))
+	{
+		other._manager = nullptr;
+	}
+
+	TextBlock &operator=(const TextBlock &other) = delete;
+
+	TextBlock &operator=(TextBlock &&other)
+	{
+		dispose();
+		_manager = other._manager;
+		_placement = other._placement;
+		_options = other._options;
+		_metrics = std::move(other._metrics);
+		_key = std::move(other._key);
+		_text = std::move(other._text);
+		_layout = std::move(other._layout);
+		_textHash = other._textHash;
+		_charCount = other._charCount;
+		_hasText = other._hasText;
+		_hasLayout = other._hasLayout;
+		_coverage = std::move(other._coverage);
+		other._manager = nullptr;
+		return *this;
+	}
+
+	~TextBlock()
+	{
+		dispose();
+	}
+
+	void setText(std::wstring text)
+	{
+		setText(textView(text));
+	}
+
+	// Replaces the text and keeps the options. Layout picks up from the
+	// last word break before the first changed char, the slot is kept if
+	// the new size still fits in it, and only the lines that differ from
+	// before are cleared to the background and rendered again. A block that
+	// isn't editable has no old text to compare with, so the first call lays
+	// out and draws everything and the block keeps its text from then on.
+	template <typename TChar>
+	void setText(BasicTextView<TChar> text)
+	{
+		if (dead())
+		{
+			return;
+		}
+
+		auto newText = decodeText(text);
+		auto prefix = 0u;
+		auto suffix = 0u;
+		if (_hasText)
+		{
+			prefix = static_cast<unsigned>(std::mismatch(
+				_text.begin(),
+				_text.begin() + std::min(_text.size(), newText.size()),
+				newText.begin()).first - _text.begin());
+			if (prefix == _text.size() && prefix == newText.size())
+			{
+				return;
+			}
+
+			while (prefix + suffix < std::min(_text.size(), newText.size())
+				&& _text[_text.size() - 1 - suffix]
+					== newText[newText.size() - 1 - suffix])
+			{
+				suffix++;
+			}
+
+			if (!_hasLayout)
+			{
+				// A reclaimed block has to lay out its old text once first
+				_layout.rewind(0);
+				layout(0, itemize());
+			}
+		}
+
+		auto oldLength = charCount();
+		auto oldMetrics = std::move(_metrics);
+		_text = std::move(newText);
+		_charCount = static_cast<unsigned>(_text.size());
+		_hasText = true;
+		if (!_key.empty())
+		{
+			_textHash = hashText(textView(_text));
+		}
+
+		auto runs = itemize();
+		auto resumeAt = _layout.resumePoint(prefix);
+		_layout.rewind(resumeAt);
+		layout(resumeAt, runs);
+		_hasLayout = true;
+		_metrics = _layout.metrics();
+
+		auto oldPlacement = _placement;
+		auto fits = _manager->isCurrent(_placement)
+			&& _metrics.size.width <= _placement.slot.rect.width
+			&& _metrics.size.height <= _placement.slot.rect.height;
+
+		if (fits)
+		{
+			if (!_coverage.isEmpty())
+			{
+				_coverage.replaceChars(
+					prefix,
+					oldLength - prefix - suffix,
+					charCount() - prefix - suffix);
+			}
+
+			auto lines = changedLines(
+				oldMetrics, oldLength, prefix, suffix);
+			clearLines(lines.start, lines.length, oldMetrics);
+			render(_text, runs, lines.start, lines.length);
+		}
+		else
+		{
+			if (_placement.isFound)
+			{
+				_manager->releaseRect(_placement);
+			}
+
+			// The new slot may overlap the old one, or anything else that was
+			// released, so it starts from the background too
+			auto lineCount = static_cast<unsigned>(_metrics.lines.size());
+			_placement = _manager->findPlacement(_metrics.size);
+			resetCoverage();
+			if (_placement.isFound)
+			{
+				clearLines(0, lineCount, _metrics);
+			}
+			render(_text, runs, 0, lineCount);
+		}
+
+		updateRetained(oldPlacement);
+	}
+
+	// Changes the foreground of a range of chars. Recolorable blocks retint
+	// the range's pixels from the coverage they kept, so no glyphs are loaded
+	// and nothing moves. Editable blocks render the lines of the range again,
+	// and other blocks have nothing to draw them from.
+	void recolor(Range range, Brush foreground)
+	{
+		if (dead())
+		{
+			return;
+		}
+
+		if (_placement.isFound && _coverage.isEmpty() && !_hasText)
+		{
+			std::cout << "failed to recolor a block that is neither "
+				<< "recolorable nor editable" << std::endl;
+			return;
+		}
+
+		auto start = std::min(range.start, charCount());
+		auto end = start + std::min(range.length, charCount() - start);
+		if (start == end)
+		{
+			return;
+		}
+
+		recolorStyleRanges(start, end, foreground);
+
+		if (_manager->isCurrent(_placement))
+		{
+			unsigned firstLine = 0;
+			unsigned lineCount = 0;
+			unsigned lineStart = 0;
+			unsigned top = 0;
+			for (unsigned i = 0; i < _metrics.lines.size(); i++)
+			{
+				auto &line = _metrics.lines[i];
+				auto lineEnd = lineStart + line.chars;
+				if (lineStart < end && lineEnd > start)
+				{
+					firstLine = lineCount == 0 ? i : firstLine;
+					lineCount++;
+
+					if (!_coverage.isEmpty())
+					{
+						auto left = start <= lineStart
+							? 0 : _coverage.charX(start);
+						auto right = end >= lineEnd
+							? _coverage.size().width : _coverage.charX(end);
+						retint(left, right, top, top + line.height,
+							foreground.color);
+					}
+				}
+
+				lineStart = lineEnd;
+				top += line.height;
+			}
+
+			if (!_coverage.isEmpty())
+			{
+				_manager->commit(_placement.texture);
+			}
+			else
+			{
+				clearLines(firstLine, lineCount, _metrics);
+				render(_text, itemize(), firstLine, lineCount);
+			}
+		}
+
+		updateRetained(_placement);
+	}
+
+	Texture<TImageData> *texture() { return _placement.texture; }
+	const Slot &slot() const { return _placement.slot; }
+	const TextBlockMetrics &metrics() const { return _metrics; }
+
+	// Only kept by editable blocks and once setText() has been called,
+	// empty otherwise
+	const std::wstring &text() const { return _text; }
+
+private:
+	// Everything that changes the pixels, so a reclaimed slot is only
+	// reused when drawing the block again would give the same ones
+	uint64_t hashContent()
+	{
+		auto hash = hashBytes(&_textHash, sizeof(_textHash), 0);
+		hash = hashBytes(
+			&_options.antialiasMode, sizeof(AntialiasMode), hash);
+		hash = hashBytes(&_options.background, sizeof(Color), hash);
+		hash = hashStyle(_options.baseStyle, hash);
+		for (auto &styleRange : _options.styleRanges)
+		{
+			hash = hashBytes(&styleRange.range, sizeof(Range), hash);
+			hash = hashStyle(styleRange.style, hash);
+		}
+		return hash;
+	}
+
+	static uint64_t hashStyle(const Style<TFont> &style, uint64_t hash)
+	{
+		auto font = fontId(style.font);
+		hash = hashBytes(&font, sizeof(font), hash);
+		hash = hashBytes(&style.size, sizeof(float), hash);
+		return hashBytes(&style.foreground, sizeof(Brush), hash);
+	}
+
+	std::vector<StyleRun<TFont>> itemize()
+	{
+		return itemizeStyleRuns(
+			_options.baseStyle, _options.styleRanges, charCount());
+	}
+
+	template <typename TChar>
+	void build(BasicTextView<TChar> text)
+	{
+		if (_options.editable)
+		{
+			_text = decodeText(text);
+			_hasText = true;
+			build(_text, _layout);
+			_hasLayout = true;
+		}
+		else
+		{
+			// Nothing of the layout is kept, setText() starts over anyway
+			TextLayout layout(_manager->options().textureSize);
+			build(text, layout);
+		}
+	}
+
+	template <typename TSource>
+	void build(const TSource &text, TextLayout &layout)
+	{
+		_charCount = charCount(text);
+
+		// Work out where the style changes once for both passes
+		auto runs = itemize();
+
+		// Calculate how much space it will take up so we know where it fits
+		layoutRuns(layout, text, 0, runs);
+		_metrics = layout.metrics();
+		Size size = _metrics.size;
+
+		// Find a spot (or not)
+		_placement = _manager->findPlacement(size);
+		resetCoverage();
+
+		// Retinting writes the background between glyphs, so recolorable
+		// blocks start from it too and drawing again gives the same pixels
+		auto lineCount = static_cast<unsigned>(_metrics.lines.size());
+		if (!_coverage.isEmpty())
+		{
+			clearLines(0, lineCount, _metrics);
+		}
+
+		// Render the characters to the texture if a spot was found`
+		render(text, runs, 0, lineCount);
+	}
+
+	// Adds the chars from a resume point on to the kept layout. The char
+	// before the resume point is walked again for kerning, the layout skips
+	// it.
+	void layout(unsigned from, const std::vector<StyleRun<TFont>> &runs)
+	{
+		layoutRuns(_layout, _text, from, runs);
+	}
 
-	static Placement notFound()
+	template <typename TSource>
+	void layoutRuns(
+		TextLayout &layout,
+		const TSource &text,
+		unsigned from,
+		const std::vector<StyleRun<TFont>> &runs)
 	{
-		return{ false, {0}, nullptr };
+		TraceScope trace(
+			"TextBlock::metrics", "from", from, "chars", charCount());
+		StageTimer timer(_manager->stats().metrics);
+		TMetricBuilder metricBuilder(_manager->sysContext(), layout);
+		walkStyleRuns(
+			text, from > 0 ? from - 1 : 0, charCount(), runs, metricBuilder);
 	}
 
-	static Placement found(Slot slot_, Texture<TImageData> *texture_)
+	template <typename TSource>
+	void render(
+		const TSource &text,
+		const std::vector<StyleRun<TFont>> &runs,
+		unsigned firstLine,
+		unsigned lineCount)
 	{
-		return{ true, slot_, texture_ };
+		if (!_placement.isFound || lineCount == 0)
+			return;
+
+		unsigned from = 0;
+		for (unsigned i = 0; i < firstLine; i++)
+		{
+			from += _metrics.lines[i].chars;
+		}
+
+		auto to = from;
+		for (unsigned i = firstLine; i < firstLine + lineCount; i++)
+		{
+			to += _metrics.lines[i].chars;
+		}
+
+		{
+			TraceScope trace(
+				"TextBlock::render",
+				"firstLine", firstLine,
+				"lines", lineCount);
+			StageTimer timer(_manager->stats().render);
+			TCharRenderer charRenderer(
+				_manager->sysContext(),
+				_placement.texture->imageData(),
+				_placement.slot.rect,
+				_metrics,
+				firstLine,
+				_coverage.isEmpty() ? nullptr : &_coverage);
+
+			walkStyleRuns(text, from, to, runs, charRenderer);
+		}
+
+		_manager->commit(_placement.texture);
 	}
-};
 
-template <typename TText>
-class TextManager
-{
-public:
-	using TImageData = typename TText::ImageData;
-	using TSysContext = typename TText::SysContext;
-	using TFont = typename TText::Font;
+	// Lines before the first changed char keep their pixels, and so do lines
+	// made only of the unchanged tail of the text if they end up in the same
+	// place with the same style. Everything in between is redrawn.
+	Range changedLines(
+		const TextBlockMetrics &oldMetrics,
+		unsigned oldLength,
+		unsigned prefix,
+		unsigned suffix)
+	{
+		auto &lines = _metrics.lines;
+		auto &oldLines = oldMetrics.lines;
 
-	TextManager(
-		TextManagerOptions options,
-		std::vector<typename TText::ImageData> textures) :
-		_sysContext(TSysContext(options)),
-		_lastUsed(0),
-		_options(options)
+		unsigned first = 0;
+		unsigned lineEnd = 0;
+		while (first < lines.size() && first < oldLines.size())
+		{
+			lineEnd += lines[first].chars;
+			if (lineEnd > prefix || !sameLine(lines[first], oldLines[first]))
+			{
+				break;
+			}
+			first++;
+		}
+
+		// The tail can only be matched up if its style didn't move with it
+		auto newLength = charCount();
+		unsigned last = static_cast<unsigned>(lines.size());
+		if (oldLength == newLength || _options.styleRanges.empty())
+		{
+			auto newStart = newLength;
+			auto oldStart = oldLength;
+			auto newBottom = _metrics.size.height;
+			auto oldBottom = oldMetrics.size.height;
+			auto oldLast = static_cast<unsigned>(oldLines.size());
+			while (last > first && oldLast > first)
+			{
+				auto &line = lines[last - 1];
+				auto &oldLine = oldLines[oldLast - 1];
+				newStart -= line.chars;
+				oldStart -= oldLine.chars;
+				if (newStart < newLength - suffix
+					|| newStart - oldStart != newLength - oldLength
+					|| newBottom != oldBottom
+					|| !sameLine(line, oldLine))
+				{
+					break;
+				}
+
+				newBottom -= line.height;
+				oldBottom -= oldLine.height;
+				last--;
+				oldLast--;
+			}
+		}
+
+		return{ first, last - first };
+	}
+
+	static bool sameLine(const LineMetrics &a, const LineMetrics &b)
 	{
-		for (auto &tex : textures)
+		return a.height == b.height
+			&& a.baseline == b.baseline
+			&& a.chars == b.chars;
+	}
+
+	// Fills the rows of the given lines with the background. If the lines run
+	// to the end of the text then so does the fill, to cover old lines that
+	// are no longer there.
+	void clearLines(
+		unsigned firstLine,
+		unsigned lineCount,
+		const TextBlockMetrics &oldMetrics)
+	{
+		auto rect = _placement.slot.rect;
+		unsigned top = 0;
+		for (unsigned i = 0; i < firstLine; i++)
+		{
+			top += _metrics.lines[i].height;
+		}
+
+		auto bottom = top;
+		for (unsigned i = firstLine; i < firstLine + lineCount; i++)
 		{
-			_textures.push_back(Texture<TImageData>(std::move(tex)));
+			bottom += _metrics.lines[i].height;
+		}
+
+		if (firstLine + lineCount == _metrics.lines.size())
+		{
+			bottom = std::max(bottom, oldMetrics.size.height);
+		}
+
+		_coverage.clearRows(top, bottom);
+
+		auto &imageData = _placement.texture->imageData();
+		auto background = _options.background;
+		for (auto y = top; y < std::min(bottom, rect.height); y++)
+		{
+			for (unsigned x = 0; x < rect.width; x++)
+			{
+				imageData.setPixel(
+					rect.x + x,
+					rect.y + y,
+					background.redByte(),
+					background.greenByte(),
+					background.blueByte(),
+					background.alphaByte());
+			}
 		}
 	}
 
-	TextManager(const TextManager &) = delete;
-	TextManager(TextManager &&) = delete;
+	unsigned charCount() const
+	{
+		return _charCount;
+	}
 
-	Placement<TImageData> findPlacement(Size size)
+	static unsigned charCount(const std::wstring &text)
 	{
-		auto &lastUsedTexture = _textures[_lastUsed];
-		auto firstResult = lastUsedTexture.organizer().tryClaimSlot(size);
-		if (firstResult.isFound)
+		return static_cast<unsigned>(text.size());
+	}
+
+	template <typename TChar>
+	static unsigned charCount(BasicTextView<TChar> text)
+	{
+		return makeDecoder(text).length();
+	}
+
+	void resetCoverage()
+	{
+		if (_options.recolorable && _placement.isFound)
 		{
-			return Placement<TImageData>::found(
-				firstResult.slot, &_textures.at(_lastUsed));
+			auto rect = _placement.slot.rect;
+			_coverage.reset({ rect.width, rect.height }, charCount());
+		}
+		else
+		{
+			_coverage.clear();
 		}
+	}
 
-		for (unsigned i = 0; i < _textures.size(); i++)
+	// Flattens the style ranges with the new foreground swapped in over the
+	// recolored chars. Only runs that differ from the base style are kept so
+	// recoloring the same text over and over doesn't grow the list.
+	void recolorStyleRanges(unsigned start, unsigned end, Brush foreground)
+	{
+		auto length = charCount();
+		for (auto &styleRange : _options.styleRanges)
 		{
-			if (i == _lastUsed)
+			length = std::max(
+				length, styleRange.range.start + styleRange.range.length);
+		}
+
+		std::vector<StyleRange<TFont>> ranges;
+		auto add = [this, &ranges](Style<TFont> style, unsigned a, unsigned b)
+		{
+			if (a >= b || sameStyle(style, _options.baseStyle))
 			{
-				continue;
+				return;
 			}
 
-			auto result = _textures[i].organizer().tryClaimSlot(size);
-			if (result.isFound)
+			if (!ranges.empty())
 			{
-				// found a place for the text block :)
-				_lastUsed = i;
-				return Placement<TImageData>::found(
-					result.slot, &_textures[i]);
+				auto &last = ranges.back();
+				if (last.range.start + last.range.length == a
+					&& sameStyle(last.style, style))
+				{
+					last.range.length += b - a;
+					return;
+				}
 			}
+
+			ranges.push_back({ style, { a, b - a } });
+		};
+
+		auto runs = itemizeStyleRuns(
+			_options.baseStyle, _options.styleRanges, length);
+		for (auto &run : runs)
+		{
+			auto runEnd = run.start + run.length;
+			add(run.style, run.start, std::min(runEnd, start));
+			add(run.style.withForeground(foreground),
+				std::max(run.start, start),
+				std::min(runEnd, end));
+			add(run.style, std::max(run.start, end), runEnd);
 		}
 
-		// there is nowhere that can fit a text block of this size :(
-		return Placement<TImageData>::notFound();
+		_options.styleRanges = std::move(ranges);
 	}
 
-	void releaseRect(Texture<TImageData> *texture, Slot slot)
+	static bool sameStyle(const Style<TFont> &a, const Style<TFont> &b)
 	{
-		texture->organizer().releaseSlot(slot.index);
+		return a.font == b.font
+			&& a.size == b.size
+			&& a.foreground.color.rgba == b.foreground.color.rgba;
 	}
 
-	TFont loadFont(std::string path)
+	// Columns and rows are relative to the slot. Uncovered pixels get the
+	// background, which they already hold since the slot was cleared to it
+	// before anything was drawn.
+	void retint(
+		unsigned left,
+		unsigned right,
+		unsigned top,
+		unsigned bottom,
+		Color color)
 	{
-		return TFont(path, _sysContext);
+		auto size = _coverage.size();
+		right = std::min(right, size.width);
+		bottom = std::min(bottom, size.height);
+		if (left >= right || top >= bottom)
+		{
+			return;
+		}
+
+		auto width = right - left;
+		auto height = bottom - top;
+		TraceScope trace("TextBlock::retint", "width", width, "height", height);
+		StageTimer timer(_manager->stats().render);
+		std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * 4);
+		for (auto y = top; y < bottom; y++)
+		{
+			tintCoverage(
+				_coverage.row(y) + left,
+				width,
+				color,
+				_options.background,
+				&pixels[static_cast<size_t>(y - top) * width * 4]);
+		}
+
+		auto rect = _placement.slot.rect;
+		_placement.texture->imageData().write(
+			std::move(pixels),
+			{ rect.x + left, rect.y + top, width, height });
 	}
 
-	TextManagerOptions &options() { return _options; }
+	// Keyed blocks are remembered by their content, so the manager has to
+	// hear about new text or styles
+	void updateRetained(const Placement<TImageData> &oldPlacement)
+	{
+		if (_key.empty())
+		{
+			return;
+		}
 
-	TSysContext &sysContext() { return _sysContext; }
-	std::vector<Texture<TImageData>> &textures() { return _textures; }
+		_manager->forgetPlacement(_key, oldPlacement);
+		if (_placement.isFound)
+		{
+			_manager->retainPlacement(
+				_key, hashContent(), _placement, _metrics);
+		}
+	}
 
-private:
+	void dispose()
+	{
+		if (!dead() && foundPlacement())
+		{
+			if (!_key.empty())
+			{
+				_manager->forgetPlacement(_key, _placement);
+			}
+			_manager->releaseRect(_placement);
+		}
+	}
 
-	std::vector<Texture<TImageData>> _textures;
-	TSysContext _sysContext;
-	unsigned _lastUsed;
-	TextManagerOptions _options;
+	bool foundPlacement()
+	{
+		return _placement.texture != nullptr;
+	};
+
+	bool dead()
+	{
+		return _manager == nullptr;
+	}
+
+	TextManager<TText> *_manager;
+	TextOptions<TFont> _options;
+	Placement<TImageData> _placement;
+	TextBlockMetrics _metrics;
+	std::string _key;
+	std::wstring _text;
+	TextLayout _layout;
+	uint64_t _textHash = 0;
+	unsigned _charCount = 0;
+	bool _hasText = false;
+	bool _hasLayout = false;
+	CoverageBuffer _coverage;
 };
 
+// For documents too long to fit in one slot. The whole text is laid out
+// once, but only the lines in the visible window are placed and rendered,
+// each line in a slot of its own. Lines that leave the window give their
+// slots back, so atlas use and raster time follow the size of the window
+// rather than the size of the document.
 template <typename TText>
-class TextBlock
+class VirtualTextBlock
 {
 public:
 	using TFont = typename TText::Font;
@@ -504,161 +2883,271 @@ public:
 	using TMetricBuilder = typename TText::MetricBuilder;
 	using TCharRenderer = typename TText::CharRenderer;
 
-	TextBlock(
+	VirtualTextBlock(
 		TextManager<TText> &manager,
 		std::wstring text,
 		TextOptions<TFont> options) :
+		VirtualTextBlock(manager, textView(text), options)
+	{ }
+
+	// Nothing is placed until setVisibleLines() is called
+	template <typename TChar>
+	VirtualTextBlock(
+		TextManager<TText> &manager,
+		BasicTextView<TChar> text,
+		TextOptions<TFont> options) :
 		_manager(&manager),
 		_options(options),
-		_placement{0}
+		_text(decodeText(text)),
+		_window{ 0, 0 }
 	{
-		// Make sure ranges are not out of order
-		std::sort(
-			_options.styleRanges.begin(),
-			_options.styleRanges.end(),
-			[](StyleRange<TFont> a, StyleRange<TFont> b)
-			{
-				return a.range.start < b.range.start;
-			});
-
-		// Calculate how much space it will take up so we know where it fits
-		TextBlockMetrics metrics = calcMetrics(text);
-		Size size = metrics.size;
-
-		// Find a spot (or not)
-		_placement = _manager->findPlacement(size);
+		sortStyleRanges(_options.styleRanges);
+		_runs = itemizeStyleRuns(
+			_options.baseStyle, _options.styleRanges, charCount());
 
-		std::cout
-			<< "placement: " << _placement.slot.rect.x << ","
-			<< _placement.slot.rect.y << ","
-			<< _placement.slot.rect.width << ","
-			<< _placement.slot.rect.height << std::endl;
+		{
+			TraceScope trace("VirtualTextBlock::metrics", "chars", charCount());
+			StageTimer timer(manager.stats().metrics);
+			TextLayout layout(manager.options().textureSize);
+			TMetricBuilder metricBuilder(manager.sysContext(), layout);
+			walkStyleRuns(_text, 0, charCount(), _runs, metricBuilder);
+			_metrics = layout.metrics();
+			_lineWidths = layout.lineWidths();
+		}
 
-		// Render the characters to the texture if a spot was found`
-		if (_placement.isFound)
+		unsigned start = 0;
+		unsigned top = 0;
+		_lineStarts.reserve(_metrics.lines.size() + 1);
+		_lineTops.reserve(_metrics.lines.size() + 1);
+		for (auto &line : _metrics.lines)
 		{
-			render(text, _placement, metrics);
+			_lineStarts.push_back(start);
+			_lineTops.push_back(top);
+			start += line.chars;
+			top += line.height;
 		}
+		_lineStarts.push_back(start);
+		_lineTops.push_back(top);
 	}
 
-	TextBlock(const TextBlock &) = delete;
+	VirtualTextBlock(const VirtualTextBlock &) = delete;
 
-	TextBlock(TextBlock &&other) :
+	VirtualTextBlock(VirtualTextBlock &&other) :
 		_manager(other._manager),
-		_options(other._options),
-		_placement(other._placement)
+		_options(std::move(other._options)),
+		_text(std::move(other._text)),
+		_runs(std::move(other._runs)),
+		_metrics(std::move(other._metrics)),
+		_lineWidths(std::move(other._lineWidths)),
+		_lineStarts(std::move(other._lineStarts)),
+		_lineTops(std::move(other._lineTops)),
+		_window(other._window),
+		_placements(std::move(other._placements))
 	{
 		other._manager = nullptr;
 	}
 
-	TextBlock &operator=(const TextBlock &other) = delete;
+	VirtualTextBlock &operator=(const VirtualTextBlock &) = delete;
 
-	TextBlock &operator=(TextBlock &&other)
+	VirtualTextBlock &operator=(VirtualTextBlock &&other)
 	{
 		dispose();
 		_manager = other._manager;
-		_placement = other._placement;
-		_options = other._options;
+		_options = std::move(other._options);
+		_text = std::move(other._text);
+		_runs = std::move(other._runs);
+		_metrics = std::move(other._metrics);
+		_lineWidths = std::move(other._lineWidths);
+		_lineStarts = std::move(other._lineStarts);
+		_lineTops = std::move(other._lineTops);
+		_window = other._window;
+		_placements = std::move(other._placements);
 		other._manager = nullptr;
 		return *this;
 	}
 
-	~TextBlock()
+	~VirtualTextBlock()
 	{
 		dispose();
 	}
 
-	Texture<TImageData> *texture() { return _placement.texture; }
-
-private:
-	TextBlockMetrics calcMetrics(std::wstring &text)
+	// Lines that stay in the window keep their slots and pixels. The ones
+	// that left are released first so new lines can take their space.
+	void setVisibleLines(unsigned firstLine, unsigned count)
 	{
-		auto maxSize = _manager->options().textureSize;
-		TMetricBuilder metricBuilder(_manager->sysContext(), maxSize);
+		if (dead())
+		{
+			return;
+		}
+
+		firstLine = std::min(firstLine, lineCount());
+		count = std::min(count, lineCount() - firstLine);
+		auto isKept = [firstLine, count](unsigned line)
+		{
+			return line >= firstLine && line < firstLine + count;
+		};
+
+		for (unsigned i = 0; i < _placements.size(); i++)
+		{
+			if (!isKept(_window.start + i))
+			{
+				release(_placements[i]);
+			}
+		}
+
+		std::vector<Placement<TImageData>> placements;
+		std::vector<Texture<TImageData> *> touched;
+		placements.reserve(count);
+		for (auto line = firstLine; line < firstLine + count; line++)
+		{
+			if (isVisible(line))
+			{
+				placements.push_back(_placements[line - _window.start]);
+				continue;
+			}
+
+			placements.push_back(placeLine(line));
+			auto texture = placements.back().texture;
+			if (texture && std::find(touched.begin(), touched.end(), texture)
+				== touched.end())
+			{
+				touched.push_back(texture);
+			}
+		}
 
-		walk(text, metricBuilder);
+		_placements = std::move(placements);
+		_window = { firstLine, count };
 
-		return metricBuilder.done();
+		for (auto texture : touched)
+		{
+			_manager->commit(texture);
+		}
 	}
 
-	void render(
-		std::wstring &text,
-		Placement<TImageData> placement,
-		TextBlockMetrics &metrics)
+	// The lines that cover any of the given rows of the laid out text
+	Range linesAt(unsigned top, unsigned height) const
 	{
-		if (!placement.isFound)
-			return;
+		if (height == 0 || top >= _metrics.size.height)
+		{
+			return{ 0, 0 };
+		}
 
-		TCharRenderer charRenderer(
-			_manager->sysContext(),
-			placement.texture->imageData(),
-			placement.slot.rect,
-			metrics);
+		auto first = std::upper_bound(
+			_lineTops.begin(), _lineTops.end() - 1, top) - 1;
+		auto last = std::lower_bound(
+			first, _lineTops.end() - 1, top + height);
+		return{
+			static_cast<unsigned>(first - _lineTops.begin()),
+			static_cast<unsigned>(last - first) };
+	}
 
-		walk(text, charRenderer);
+	bool isVisible(unsigned line) const
+	{
+		return line >= _window.start && line < _window.start + _window.length;
+	}
 
-		placement.texture->imageData().commit();
+	// Only lines in the window have a placement. A visible line that found
+	// no room, or has nothing to draw, isn't found.
+	Placement<TImageData> linePlacement(unsigned line) const
+	{
+		return isVisible(line)
+			? _placements[line - _window.start]
+			: Placement<TImageData>::notFound();
 	}
 
-	template <typename THandler>
-	void walk(std::wstring &text, THandler &handler)
+	Range visibleLines() const { return _window; }
+	unsigned lineCount() const
 	{
-		std::stack<StyleRange<TFont>> rangeStack;
-		rangeStack.push({
-			_options.baseStyle,
-			{ 0, static_cast<unsigned>(text.size()) }
-		});
-		unsigned nextRangeIndex = 0;
+		return static_cast<unsigned>(_metrics.lines.size());
+	}
+	unsigned lineTop(unsigned line) const { return _lineTops[line]; }
+	unsigned lineWidth(unsigned line) const { return _lineWidths[line]; }
+	const TextBlockMetrics &metrics() const { return _metrics; }
+	const std::wstring &text() const { return _text; }
 
-		bool newStyle = true;
-		for (size_t i = 0; i < text.size(); i++)
+private:
+	Placement<TImageData> placeLine(unsigned line)
+	{
+		auto &lineMetrics = _metrics.lines[line];
+		Size size{ _lineWidths[line], lineMetrics.height };
+		auto placement = _manager->findPlacement(size);
+		if (!placement.isFound)
 		{
-			if (nextRangeIndex < _options.styleRanges.size()
-				&& _options.styleRanges[nextRangeIndex].range.start == i)
-			{
-				rangeStack.push(_options.styleRanges[nextRangeIndex++]);
-				newStyle = true;
-			}
+			return placement;
+		}
 
-			auto style = rangeStack.top().style;
-			if (newStyle)
+		// Slots are reused as lines scroll by, so start from the background
+		TraceScope trace("VirtualTextBlock::render", "line", line);
+		StageTimer timer(_manager->stats().render);
+		auto rect = placement.slot.rect;
+		auto &imageData = placement.texture->imageData();
+		auto background = _options.background;
+		for (unsigned y = 0; y < rect.height; y++)
+		{
+			for (unsigned x = 0; x < rect.width; x++)
 			{
-				handler.onStyleChange(style.font, style.size, style.foreground);
+				imageData.setPixel(
+					rect.x + x,
+					rect.y + y,
+					background.redByte(),
+					background.greenByte(),
+					background.blueByte(),
+					background.alphaByte());
 			}
+		}
 
-			handler.onChar(text[i], style.font, style.size, style.foreground);
+		TextBlockMetrics metrics{ size, { lineMetrics } };
+		TCharRenderer charRenderer(
+			_manager->sysContext(), imageData, rect, metrics, 0, nullptr);
+		walkStyleRuns(
+			_text, _lineStarts[line], _lineStarts[line + 1], _runs,
+			charRenderer);
 
-			newStyle = false;
+		return placement;
+	}
 
-			while (!rangeStack.empty() &&rangeStack.top().range.last() <= i)
-			{
-				rangeStack.pop();
-				newStyle = true;
-			}
+	void release(const Placement<TImageData> &placement)
+	{
+		if (placement.isFound)
+		{
+			_manager->releaseRect(placement);
 		}
 	}
 
+	unsigned charCount() const
+	{
+		return static_cast<unsigned>(_text.size());
+	}
+
 	void dispose()
 	{
-		if (!dead() && foundPlacement())
+		if (dead())
 		{
-			_manager->releaseRect(_placement.texture, _placement.slot);
+			return;
 		}
-	}
 
-	bool foundPlacement()
-	{
-		return _placement.texture != nullptr;
-	};
+		for (auto &placement : _placements)
+		{
+			release(placement);
+		}
+		_placements.clear();
+	}
 
-	bool dead()
+	bool dead() const
 	{
 		return _manager == nullptr;
 	}
 
 	TextManager<TText> *_manager;
 	TextOptions<TFont> _options;
-	Placement<TImageData> _placement;
+	std::wstring _text;
+	std::vector<StyleRun<TFont>> _runs;
+	TextBlockMetrics _metrics;
+	std::vector<unsigned> _lineWidths;
+	std::vector<unsigned> _lineStarts;
+	std::vector<unsigned> _lineTops;
+	Range _window;
+	std::vector<Placement<TImageData>> _placements;
 };
 
 template <typename TTextSystem>
@@ -669,6 +3158,7 @@ public:
 	using Font = typename TTextSystem::Font;
 	using Manager = TextManager<TextPlatform<TTextSystem>>;
 	using Block = TextBlock<TextPlatform<TTextSystem>>;
+	using VirtualBlock = VirtualTextBlock<TextPlatform<TTextSystem>>;
 	using Style = xt::Style<Font>;
 	using Options = TextOptions<Font>;
 
@@ -679,38 +3169,7 @@ private:
 
 	friend class TextManager<TextPlatform<TTextSystem>>;
 	friend class TextBlock<TextPlatform<TTextSystem>>;
-};
-
-struct CharLayout
-{
-	wchar_t ch;
-	Size size;
-	unsigned kerning;
-	unsigned line;
-};
-
-class TextLayout
-{
-public:
-	TextLayout(Size maxSize);
-	void nextChar(wchar_t ch, Size charSize, unsigned kerning);
-	TextBlockMetrics metrics();
-
-private:
-	void checkWrap(wchar_t ch);
-	void wrap();
-	void wrapFrom(unsigned index);
-	bool isWhitespace(wchar_t ch);
-	bool isWordDivider(wchar_t ch);
-	bool isFirstCharOnLine(unsigned index);
-	unsigned getWrapCharCount();
-	unsigned getEndOfLineWhitespaceCount();
-	unsigned getKerningOffset(unsigned kerning);
-
-	Size _size;
-	std::vector<CharLayout> _chars;
-	unsigned _penX;
-	unsigned _currentLine;
+	friend class VirtualTextBlock<TextPlatform<TTextSystem>>;
 };
 
 END_XT_NAMESPACE
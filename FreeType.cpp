@@ -1,25 +1,267 @@
 #include "FreeType.hpp"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 BEGIN_XT_NAMESPACE
 
-// FreeTypeSysContext
+// FreeTypeKerningCache
 
-FreeTypeSysContext::FreeTypeSysContext(TextManagerOptions options) :
-	_options(options)
+#define KERNING_ASCII_CHARS 128
+#define KERNING_UNKNOWN INT16_MIN
+
+FreeTypeKerningCache::FreeTypeKerningCache(FT_Face face) :
+	_face(face),
+	_hasKerning(FT_HAS_KERNING(face))
+{ }
+
+int FreeTypeKerningCache::kerning(wchar_t left, wchar_t right)
+{
+	if (!_hasKerning)
+	{
+		return 0;
+	}
+
+	// Compared unsigned so negative chars, where wchar_t is signed, don't
+	// index the dense table
+	auto leftIndex = static_cast<uint32_t>(left);
+	auto rightIndex = static_cast<uint32_t>(right);
+	if (leftIndex < KERNING_ASCII_CHARS && rightIndex < KERNING_ASCII_CHARS)
+	{
+		if (_ascii.empty())
+		{
+			_ascii.resize(
+				KERNING_ASCII_CHARS * KERNING_ASCII_CHARS, KERNING_UNKNOWN);
+		}
+
+		auto &cached = _ascii[leftIndex * KERNING_ASCII_CHARS + rightIndex];
+		if (cached == KERNING_UNKNOWN)
+		{
+			cached = static_cast<int16_t>(lookup(left, right));
+		}
+		return cached;
+	}
+
+	auto key = (static_cast<uint64_t>(leftIndex) << 32) | rightIndex;
+	auto it = _other.find(key);
+	if (it != _other.end())
+	{
+		return it->second;
+	}
+
+	auto value = lookup(left, right);
+	_other[key] = value;
+	return value;
+}
+
+size_t FreeTypeKerningCache::denseSize() const
+{
+	return static_cast<size_t>(std::count_if(
+		_ascii.begin(),
+		_ascii.end(),
+		[](int16_t value) { return value != KERNING_UNKNOWN; }));
+}
+
+int FreeTypeKerningCache::lookup(wchar_t left, wchar_t right)
 {
-	auto error = FT_Init_FreeType(&_library);
+	FT_Vector delta;
+	auto error = FT_Get_Kerning(
+		_face,
+		FT_Get_Char_Index(_face, left),
+		FT_Get_Char_Index(_face, right),
+		FT_KERNING_DEFAULT,
+		&delta);
+	return error ? 0 : static_cast<int>(delta.x >> 6);
+}
+
+// FreeTypeFace
+
+static std::atomic<uint64_t> nextFaceId(1);
+
+FreeTypeFace::FreeTypeFace(
+	std::shared_ptr<FT_LibraryRec_> library,
+	std::string path,
+	long faceIndex) :
+	_library(library),
+	_id(nextFaceId++),
+	_face(nullptr),
+	_data(nullptr),
+	_length(0),
+	_activeSize(0),
+	_active(nullptr)
+{
+	auto fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+	{
+		auto length = static_cast<size_t>(info.st_size);
+		auto data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			_data = data;
+			_length = length;
+		}
+	}
+	close(fd);
+
+	if (!_data)
+	{
+		return;
+	}
+
+	auto error = FT_New_Memory_Face(
+		_library.get(),
+		static_cast<const FT_Byte *>(_data),
+		static_cast<FT_Long>(_length),
+		faceIndex,
+		&_face);
+	if (error)
+	{
+		_face = nullptr;
+	}
+}
+
+FreeTypeFace::~FreeTypeFace()
+{
+	if (_face)
+	{
+		FT_Done_Face(_face);
+	}
+
+	if (_data)
+	{
+		munmap(_data, _length);
+	}
+}
+
+bool FreeTypeFace::activateSize(float size)
+{
+	auto charSize = static_cast<FT_F26Dot6>(size * 64.0);
+	if (_active && charSize == _activeSize)
+	{
+		return true;
+	}
+
+	auto it = _sizes.find(charSize);
+	if (it != _sizes.end())
+	{
+		if (FT_Activate_Size(it->second.size))
+		{
+			return false;
+		}
+		_activeSize = charSize;
+		_active = &it->second;
+		return true;
+	}
+
+	// Sizes are owned by the face so FT_Done_Face cleans them up
+	FT_Size ftSize;
+	if (FT_New_Size(_face, &ftSize) || FT_Activate_Size(ftSize))
+	{
+		std::cout << "failed to create font size " << size << std::endl;
+		return false;
+	}
+
+	auto result = _sizes.emplace(
+		charSize, FreeTypeSizeEntry{ ftSize, FreeTypeKerningCache(_face) });
+	_activeSize = charSize;
+	_active = &result.first->second;
+	return FT_Set_Char_Size(_face, 0, charSize, 100, 100) == 0;
+}
+
+// FreeTypeFontRegistry
+
+FreeTypeFontRegistry::FreeTypeFontRegistry() :
+	_table(std::make_shared<Table>())
+{
+	_table->thread = std::this_thread::get_id();
+
+	FT_Library library;
+	auto error = FT_Init_FreeType(&library);
 	if (error)
 	{
 		std::cout << "failed to init freetype" << std::endl;
+		return;
+	}
+
+	_table->library = std::shared_ptr<FT_LibraryRec_>(
+		library, FT_Done_FreeType);
+}
+
+std::shared_ptr<FreeTypeFace> FreeTypeFontRegistry::acquire(
+	std::string path, long faceIndex)
+{
+	if (std::this_thread::get_id() != _table->thread)
+	{
+		std::cout << "failed to load font '" << path
+			<< "' from a thread that doesn't own the font registry"
+			<< std::endl;
+		return nullptr;
+	}
+
+	auto key = path + ":" + std::to_string(faceIndex);
+	auto it = _table->faces.find(key);
+	if (it != _table->faces.end())
+	{
+		auto face = it->second.lock();
+		if (face)
+		{
+			return face;
+		}
+	}
+
+	if (!_table->library)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<FreeTypeFace> created(
+		new FreeTypeFace(_table->library, path, faceIndex));
+	if (!created->face())
+	{
+		return nullptr;
 	}
+
+	// Forget the entry once the last font lets go so the table only holds
+	// live faces
+	auto table = _table;
+	std::shared_ptr<FreeTypeFace> face(
+		created.release(),
+		[table, key](FreeTypeFace *released)
+		{
+			auto it = table->faces.find(key);
+			if (it != table->faces.end() && it->second.expired())
+			{
+				table->faces.erase(it);
+			}
+			delete released;
+		});
+	_table->faces[key] = face;
+	return face;
 }
 
-FreeTypeSysContext::~FreeTypeSysContext()
+FreeTypeFontRegistry &FreeTypeFontRegistry::shared()
 {
-	FT_Done_FreeType(_library);
+	static thread_local FreeTypeFontRegistry registry;
+	return registry;
 }
 
+// FreeTypeSysContext
+
+FreeTypeSysContext::FreeTypeSysContext(TextManagerOptions options) :
+	_options(options),
+	_fontRegistry(&FreeTypeFontRegistry::shared())
+{ }
+
 // FreeTypeImageData
 
 FreeTypeImageData::FreeTypeImageData(
@@ -34,27 +276,16 @@ FreeTypeImageData::FreeTypeImageData(FreeTypeImageData &&other) :
 // FreeTypeFont
 
 FreeTypeFont::FreeTypeFont(std::string path, FreeTypeSysContext &context) :
-	_face(nullptr)
-{
-	auto error = FT_New_Face(context.library(), path.c_str(), 0, &_face);
-	if (error)
-	{
-		_face = nullptr;
-		std::cout << "failed to load font '" << path << "'" << std::endl;
-	}
-}
-
-FreeTypeFont::FreeTypeFont(FreeTypeFont &&other) :
-	_face(other._face)
-{
-	other._face = nullptr;
-}
+	FreeTypeFont(path, 0, context)
+{ }
 
-FreeTypeFont::~FreeTypeFont()
+FreeTypeFont::FreeTypeFont(
+	std::string path, long faceIndex, FreeTypeSysContext &context) :
+	_face(context.fontRegistry().acquire(path, faceIndex))
 {
-	if (_face)
+	if (!_face)
 	{
-		FT_Done_Face(_face);
+		std::cout << "failed to load font '" << path << "'" << std::endl;
 	}
 }
 
@@ -62,29 +293,58 @@ FreeTypeFont::~FreeTypeFont()
 
 FreeTypeMetricBuilder::FreeTypeMetricBuilder(
 	FreeTypeSysContext &context,
-	Size maxSize) :
+	TextLayout &layout) :
 	_context(context),
-	_layout(maxSize)
+	_layout(layout),
+	_previousFont(nullptr),
+	_previousSize(0),
+	_previousChar(0)
 { }
 
-void FreeTypeMetricBuilder::onStyleChange(
-	FreeTypeFont *font, float size, Brush foreground)
+void FreeTypeMetricBuilder::onRun(
+	FreeTypeFont *font,
+	float size,
+	Brush foreground,
+	const wchar_t *text,
+	size_t length)
 {
-	FT_Set_Char_Size(font->face(), 0, size*64.0, 100, 100);
-}
+	font->activateSize(size);
 
-void FreeTypeMetricBuilder::onChar(
-	wchar_t ch, FreeTypeFont *font, float size, Brush foreground)
-{
+	// A font that failed to load still takes up its chars, just no space
 	auto face = font->face();
-	auto glyphIndex = FT_Get_Char_Index(face, ch);
-	FT_Load_Glyph(face, glyphIndex, FT_LOAD_DEFAULT);
-	auto fontMetrics = face->size->metrics;
-	auto charMetrics = face->glyph->metrics;
-	auto charWidth = static_cast<unsigned>(charMetrics.horiAdvance >> 6);
-	auto fontHeight = static_cast<unsigned>(fontMetrics.height >> 6);
-
-	_layout.nextChar(ch, { charWidth, fontHeight }, 0);
+	if (!face)
+	{
+		for (size_t i = 0; i < length; i++)
+		{
+			_layout.nextChar(text[i], { 0, 0 }, 0, 0);
+		}
+		_previousFont = nullptr;
+		return;
+	}
+
+	auto fontHeight = static_cast<unsigned>(face->size->metrics.height >> 6);
+	auto ascent = static_cast<unsigned>(face->size->metrics.ascender >> 6);
+
+	// Only kern pairs that share a font and size
+	auto kerning = _context.kerning()
+		&& _previousFont == font
+		&& _previousSize == size;
+	for (size_t i = 0; i < length; i++)
+	{
+		auto ch = text[i];
+		auto glyphIndex = FT_Get_Char_Index(face, ch);
+		FT_Load_Glyph(face, glyphIndex, FT_LOAD_DEFAULT);
+		auto charMetrics = face->glyph->metrics;
+		auto charWidth = static_cast<unsigned>(charMetrics.horiAdvance >> 6);
+		auto charKerning = kerning ? font->kerning(_previousChar, ch) : 0;
+
+		_layout.nextChar(ch, { charWidth, fontHeight }, charKerning, ascent);
+		_previousChar = ch;
+		kerning = _context.kerning();
+	}
+
+	_previousFont = font;
+	_previousSize = size;
 }
 
 TextBlockMetrics FreeTypeMetricBuilder::done()
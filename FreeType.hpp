@@ -1,28 +1,148 @@
 #pragma once
 
 #include "CrossText.hpp"
+#include <memory>
 #include <string>
-#include <time.h>
+#include <thread>
 #include <png.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_SIZES_H
 
 #define DEFAULT_TEXTURE_SIZE 4096
 #define DEFAULT_TEXTURE_COUT 1
 
 BEGIN_XT_NAMESPACE
 
+// Kerning adjustments in pixels for one face at one size. Pairs of ASCII
+// chars live in a dense table, everything else in a hash map, and each pair
+// only asks FreeType once.
+class FreeTypeKerningCache
+{
+public:
+	FreeTypeKerningCache(FT_Face face);
+	int kerning(wchar_t left, wchar_t right);
+
+	// Pairs cached so far in the dense table and in the hash map
+	size_t denseSize() const;
+	size_t otherSize() const { return _other.size(); }
+
+private:
+	int lookup(wchar_t left, wchar_t right);
+
+	FT_Face _face;
+	bool _hasKerning;
+	std::vector<int16_t> _ascii;
+	std::unordered_map<uint64_t, int> _other;
+};
+
+struct FreeTypeSizeEntry
+{
+	FT_Size size;
+	FreeTypeKerningCache kerning;
+};
+
+// A font file mapped into memory and parsed into a face once. Every
+// FreeTypeFont loaded from the same path and face index through one registry
+// shares one of these. Like the FT_Face inside it, a face must only be used
+// from the thread of the registry that made it.
+class FreeTypeFace
+{
+public:
+	FreeTypeFace(
+		std::shared_ptr<FT_LibraryRec_> library,
+		std::string path,
+		long faceIndex);
+	FreeTypeFace(const FreeTypeFace &) = delete;
+	FreeTypeFace(FreeTypeFace &&) = delete;
+	~FreeTypeFace();
+	FT_Face face() { return _face; }
+
+	// Unique for the life of the process, unlike the FT_Face address which
+	// can be handed out again once this face is gone
+	uint64_t id() const { return _id; }
+
+	// Makes the size object for this char size current, creating it the
+	// first time the size is used. Switching between sizes that were used
+	// before doesn't redo any scaling.
+	bool activateSize(float size);
+
+	// Kerning between two chars at the active size
+	int kerning(wchar_t left, wchar_t right)
+	{
+		return _active ? _active->kerning.kerning(left, right) : 0;
+	}
+
+	// Kerning cache of the active size, if there is one
+	const FreeTypeKerningCache *kerningCache() const
+	{
+		return _active ? &_active->kerning : nullptr;
+	}
+
+private:
+	std::shared_ptr<FT_LibraryRec_> _library;
+	uint64_t _id;
+	FT_Face _face;
+	void *_data;
+	size_t _length;
+	std::unordered_map<FT_F26Dot6, FreeTypeSizeEntry> _sizes;
+	FT_F26Dot6 _activeSize;
+	FreeTypeSizeEntry *_active;
+};
+
+// Hands out shared faces keyed by path and face index so loading the same
+// font from several TextManagers only reads and parses the file once. Faces
+// are released through the registry when the last FreeTypeFont using them is
+// destroyed.
+//
+// FreeType faces and the library that makes them are not thread safe, so a
+// registry belongs to the thread that created it: acquire() fails on any
+// other thread, and fonts must be destroyed on that thread too. Managers on
+// different threads each use their own thread's registry.
+class FreeTypeFontRegistry
+{
+public:
+	FreeTypeFontRegistry();
+	FreeTypeFontRegistry(const FreeTypeFontRegistry &) = delete;
+	FreeTypeFontRegistry(FreeTypeFontRegistry &&) = delete;
+	std::shared_ptr<FreeTypeFace> acquire(std::string path, long faceIndex);
+
+	// Faces currently alive in this registry
+	size_t size() const { return _table->faces.size(); }
+
+	// Registry of the calling thread, used by every FreeTypeSysContext made
+	// on that thread unless told otherwise
+	static FreeTypeFontRegistry &shared();
+
+private:
+	// Kept alive by the faces as well so releasing a face still works after
+	// the registry is gone
+	struct Table
+	{
+		std::thread::id thread;
+		std::shared_ptr<FT_LibraryRec_> library;
+		std::unordered_map<std::string, std::weak_ptr<FreeTypeFace>> faces;
+	};
+
+	std::shared_ptr<Table> _table;
+};
+
 class FreeTypeSysContext
 {
 public:
 	FreeTypeSysContext(TextManagerOptions options);
-	~FreeTypeSysContext();
 	Size textureSize() const { return _options.textureSize; }
-	FT_Library library() { return _library; }
+	bool kerning() const { return _options.kerning; }
+	FreeTypeFontRegistry &fontRegistry() { return *_fontRegistry; }
+
+	void setFontRegistry(FreeTypeFontRegistry &registry)
+	{
+		_fontRegistry = &registry;
+	}
 
 private:
 	TextManagerOptions _options;
-	FT_Library _library;
+	FreeTypeFontRegistry *_fontRegistry;
 };
 
 class FreeTypeImageData
@@ -43,30 +163,48 @@ class FreeTypeFont
 {
 public:
 	FreeTypeFont(std::string path, FreeTypeSysContext &context);
-	FreeTypeFont(const FreeTypeFont &) = delete;
-	FreeTypeFont(FreeTypeFont &&other);
-	~FreeTypeFont();
+	FreeTypeFont(
+		std::string path, long faceIndex, FreeTypeSysContext &context);
+	FreeTypeFont(const FreeTypeFont &other) = default;
+	FreeTypeFont(FreeTypeFont &&other) = default;
 	bool isLoaded() { return _face != nullptr; }
-	FT_Face face() { return _face; }
+	FT_Face face() { return _face ? _face->face() : nullptr; }
+	uint64_t faceId() const { return _face ? _face->id() : 0; }
+
+	bool activateSize(float size)
+	{
+		return _face ? _face->activateSize(size) : false;
+	}
+
+	int kerning(wchar_t left, wchar_t right)
+	{
+		return _face ? _face->kerning(left, right) : 0;
+	}
 
 private:
-	FT_Face _face;
+	std::shared_ptr<FreeTypeFace> _face;
 };
 
 class FreeTypeMetricBuilder
 {
 public:
-	FreeTypeMetricBuilder(FreeTypeSysContext &context, Size maxSize);
+	FreeTypeMetricBuilder(FreeTypeSysContext &context, TextLayout &layout);
 	FreeTypeMetricBuilder(const FreeTypeMetricBuilder &) = delete;
 	FreeTypeMetricBuilder(FreeTypeMetricBuilder &&) = delete;
-	void onStyleChange(FreeTypeFont *font, float size, Brush foreground);
-	void onChar(
-		wchar_t ch, FreeTypeFont *font, float size, Brush foreground);
+	void onRun(
+		FreeTypeFont *font,
+		float size,
+		Brush foreground,
+		const wchar_t *text,
+		size_t length);
 	TextBlockMetrics done();
 
 private:
 	FreeTypeSysContext &_context;
-	TextLayout _layout;
+	TextLayout &_layout;
+	FreeTypeFont *_previousFont;
+	float _previousSize;
+	wchar_t _previousChar;
 };
 
 template <typename TImageData>
@@ -77,30 +215,83 @@ public:
 		FreeTypeSysContext &context,
 		TImageData &imageData,
 		Rect rect,
-		TextBlockMetrics &metrics) :
+		TextBlockMetrics &metrics,
+		unsigned firstLine,
+		CoverageBuffer *coverage) :
 		_penX(rect.x),
+		_lineTop(rect.y),
+		_clusterX(rect.x),
+		_isInCluster(false),
+		_charIndex(0),
 		_context(context),
 		_imageData(imageData),
+		_coverage(coverage),
 		_rect(rect),
 		_metrics(metrics),
-		_row(0),
-		_column(0)
-	{ }
+		_row(firstLine),
+		_column(0),
+		_previousFont(nullptr),
+		_previousSize(0),
+		_previousChar(0)
+	{
+		for (unsigned i = 0; i < firstLine; i++)
+		{
+			_lineTop += metrics.lines[i].height;
+			_charIndex += metrics.lines[i].chars;
+		}
+	}
 
 	FreeTypeCharRenderer(const FreeTypeCharRenderer &) = delete;
 
 	FreeTypeCharRenderer(FreeTypeCharRenderer &&) = delete;
 
-	void onStyleChange(FreeTypeFont *font, float size, Brush foreground)
+	void onRun(
+		FreeTypeFont *font,
+		float size,
+		Brush foreground,
+		const wchar_t *text,
+		size_t length)
 	{
-		FT_Set_Char_Size(font->face(), 0, size*64.0, 100, 100);
+		font->activateSize(size);
+
+		auto face = font->face();
+		if (!face)
+		{
+			advance(0, static_cast<unsigned>(length));
+			_previousFont = nullptr;
+			return;
+		}
+
+		auto kerning = _context.kerning()
+			&& _previousFont == font
+			&& _previousSize == size;
+		for (size_t i = 0; i < length; i++)
+		{
+			auto ch = text[i];
+			if (kerning && _column > 0)
+			{
+				_penX += font->kerning(_previousChar, ch);
+			}
+			renderGlyph(face, FT_Get_Char_Index(face, ch), foreground, 0, 0);
+			advance(face->glyph->advance.x >> 6, 1);
+			_previousChar = ch;
+			kerning = _context.kerning();
+		}
+
+		_previousFont = font;
+		_previousSize = size;
 	}
 
-	void onChar(
-		wchar_t ch, FreeTypeFont *font, float size, Brush foreground)
+protected:
+	// Draws one glyph at the pen, moved by the offsets in pixels. Positive
+	// offsets go right and up.
+	void renderGlyph(
+		FT_Face face,
+		FT_UInt glyphIndex,
+		Brush foreground,
+		int xOffset,
+		int yOffset)
 	{
-		auto face = font->face();
-		auto glyphIndex = FT_Get_Char_Index(face, ch);
 		auto error = FT_Load_Glyph(face, glyphIndex, FT_LOAD_DEFAULT);
 
 		if (error)
@@ -122,9 +313,9 @@ public:
 
 		auto lineMetrics = _metrics.lines[_row];
 
-		unsigned effectivePenY =
-			lineMetrics.baseline - face->glyph->bitmap_top + _rect.y;
-		unsigned effectivePenX = _penX + face->glyph->bitmap_left;
+		unsigned effectivePenY = _lineTop + lineMetrics.baseline
+			- face->glyph->bitmap_top - yOffset;
+		unsigned effectivePenX = _penX + face->glyph->bitmap_left + xOffset;
 
 		auto bitmap = face->glyph->bitmap;
 
@@ -140,53 +331,74 @@ public:
 				auto realX = x + effectivePenX;
 				auto realY = y + effectivePenY;
 
+				// Uncovered pixels are left alone so they don't wipe out a
+				// neighbouring glyph that overlaps this one's bitmap
 				auto ftalpha = bitmap.buffer[y * bitmap.width + x];
+				if (ftalpha == 0)
+				{
+					continue;
+				}
+
+				if (_coverage)
+				{
+					ftalpha = _coverage->accumulate(
+						realX - _rect.x, realY - _rect.y, ftalpha);
+				}
+
 				auto ftalphaf = static_cast<float>(ftalpha) / 255.0f;
 				auto finalAlpha = static_cast<unsigned>(
 					ftalphaf * static_cast<float>(a));
 				_imageData.setPixel(realX, realY, r, g, b, finalAlpha);
 			}
 		}
+	}
+
+	// Moves the pen past the glyph just drawn and the chars it stands for,
+	// wrapping to the next line once the line's char count is used up
+	void advance(int x, unsigned chars)
+	{
+		if (!_isInCluster)
+		{
+			_clusterX = _penX;
+			_isInCluster = true;
+		}
 
-		_penX += face->glyph->advance.x >> 6;
+		_penX += x;
 
-		_column += 1;
-		if (lineMetrics.chars <= _column)
+		for (unsigned i = 0; i < chars && _row < _metrics.lines.size(); i++)
 		{
-			_column = 0;
-			_row += 1;
-			_penX = _rect.x;
+			if (_coverage)
+			{
+				_coverage->setCharX(_charIndex, _clusterX - _rect.x);
+			}
+			_isInCluster = false;
+			_charIndex += 1;
+			_column += 1;
+			if (_metrics.lines[_row].chars <= _column)
+			{
+				_lineTop += _metrics.lines[_row].height;
+				_column = 0;
+				_row += 1;
+				_penX = _rect.x;
+			}
 		}
 	}
 
-private:
 	unsigned _penX;
+	unsigned _lineTop;
+	unsigned _clusterX;
+	bool _isInCluster;
+	unsigned _charIndex;
 	FreeTypeSysContext &_context;
 	TImageData &_imageData;
+	CoverageBuffer *_coverage;
 	Rect _rect;
 	TextBlockMetrics &_metrics;
 	unsigned _row;
 	unsigned _column;
-};
-
-class LinuxTimer
-{
-public:
-	LinuxTimer()
-	{
-		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &_start);
-	}
-
-	double millis()
-	{
-		struct timespec end;
-		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
-		long diff = end.tv_nsec - _start.tv_nsec;
-		return static_cast<float>(diff) / 1000.0f;
-	}
-
-private:
-	struct timespec _start;
+	FreeTypeFont *_previousFont;
+	float _previousSize;
+	wchar_t _previousChar;
 };
 
 template <typename TImageData>
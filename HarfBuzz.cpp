@@ -0,0 +1,243 @@
+#include "HarfBuzz.hpp"
+#include <algorithm>
+#include <iostream>
+#include <hb-ft.h>
+
+BEGIN_XT_NAMESPACE
+
+// ShapeKeyHash
+
+size_t ShapeKeyHash::operator()(const ShapeKey &key) const
+{
+	auto hash = hashBytes(&key.face, sizeof(key.face), 0);
+	hash = hashBytes(&key.size, sizeof(key.size), hash);
+	hash = hashBytes(key.features.data(), key.features.size(), hash);
+	hash = hashBytes(
+		key.text.data(), key.text.size() * sizeof(wchar_t), hash);
+	return static_cast<size_t>(hash);
+}
+
+// HarfBuzzShaper
+
+HarfBuzzShaper::HarfBuzzShaper(size_t cacheSize) :
+	_buffer(hb_buffer_create()),
+	_cache(cacheSize)
+{ }
+
+HarfBuzzShaper::HarfBuzzShaper(HarfBuzzShaper &&other) :
+	_buffer(other._buffer),
+	_featureString(std::move(other._featureString)),
+	_features(std::move(other._features)),
+	_cache(std::move(other._cache))
+{
+	other._buffer = nullptr;
+}
+
+HarfBuzzShaper::~HarfBuzzShaper()
+{
+	if (_buffer)
+	{
+		hb_buffer_destroy(_buffer);
+	}
+}
+
+bool HarfBuzzShaper::setFeatures(std::string features)
+{
+	std::vector<hb_feature_t> parsed;
+	size_t start = 0;
+	while (start < features.size())
+	{
+		auto end = features.find(',', start);
+		if (end == std::string::npos)
+		{
+			end = features.size();
+		}
+
+		hb_feature_t feature;
+		auto length = static_cast<int>(end - start);
+		if (length > 0
+			&& !hb_feature_from_string(
+				features.data() + start, length, &feature))
+		{
+			std::cout << "failed to parse font feature '"
+				<< features.substr(start, end - start) << "'" << std::endl;
+			return false;
+		}
+
+		if (length > 0)
+		{
+			parsed.push_back(feature);
+		}
+		start = end + 1;
+	}
+
+	_features = std::move(parsed);
+	_featureString = std::move(features);
+	return true;
+}
+
+ShapedRun HarfBuzzShaper::shape(
+	FreeTypeFont *font,
+	float size,
+	const wchar_t *text,
+	size_t length)
+{
+	ShapeKey key
+	{
+		font->faceId(),
+		static_cast<FT_F26Dot6>(size * 64.0),
+		_featureString,
+		std::wstring(text, length)
+	};
+
+	auto cached = _cache.find(key);
+	if (cached)
+	{
+		return *cached;
+	}
+
+	_codepoints.resize(length);
+	for (size_t i = 0; i < length; i++)
+	{
+		_codepoints[i] = static_cast<uint32_t>(text[i]);
+	}
+
+	ShapedRun run;
+	shapeUncached(font->face(), run);
+	return _cache.insert(std::move(key), std::move(run));
+}
+
+void HarfBuzzShaper::shapeUncached(FT_Face face, ShapedRun &run)
+{
+	auto length = static_cast<int>(_codepoints.size());
+	hb_buffer_reset(_buffer);
+	hb_buffer_add_utf32(_buffer, _codepoints.data(), length, 0, length);
+	hb_buffer_guess_segment_properties(_buffer);
+
+	// Created per miss since it picks up the face's current size
+	auto font = hb_ft_font_create_referenced(face);
+	hb_shape(
+		font,
+		_buffer,
+		_features.data(),
+		static_cast<unsigned>(_features.size()));
+	hb_font_destroy(font);
+
+	// Right to left runs come out in visual order, but layout and rendering
+	// walk the chars in logical order. Reversing the clusters restores that
+	// while keeping the glyphs within each cluster in shaping order, and the
+	// renderer puts them back right to left.
+	run.isRightToLeft =
+		HB_DIRECTION_IS_BACKWARD(hb_buffer_get_direction(_buffer));
+	if (run.isRightToLeft)
+	{
+		hb_buffer_reverse_clusters(_buffer);
+	}
+
+	unsigned count = 0;
+	auto infos = hb_buffer_get_glyph_infos(_buffer, &count);
+	auto positions = hb_buffer_get_glyph_positions(_buffer, &count);
+
+	// Clusters cover the chars up to the next higher cluster in the run
+	std::vector<unsigned> clusterStarts;
+	clusterStarts.reserve(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		clusterStarts.push_back(infos[i].cluster);
+	}
+	std::sort(clusterStarts.begin(), clusterStarts.end());
+
+	// Positions come back in 26.6 like the rest of FreeType
+	auto &glyphs = run.glyphs;
+	glyphs.reserve(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		auto cluster = infos[i].cluster;
+		unsigned chars = 0;
+		if (i + 1 == count || infos[i + 1].cluster != cluster)
+		{
+			auto next = std::upper_bound(
+				clusterStarts.begin(), clusterStarts.end(), cluster);
+			auto end = next == clusterStarts.end()
+				? static_cast<unsigned>(length) : *next;
+			chars = end - cluster;
+		}
+
+		glyphs.push_back({
+			infos[i].codepoint,
+			cluster,
+			chars,
+			static_cast<int>(positions[i].x_advance >> 6),
+			static_cast<int>(positions[i].x_offset >> 6),
+			static_cast<int>(positions[i].y_offset >> 6) });
+	}
+}
+
+// HarfBuzzSysContext
+
+HarfBuzzSysContext::HarfBuzzSysContext(TextManagerOptions options) :
+	FreeTypeSysContext(options),
+	_shaper(XT_SHAPE_CACHE_SIZE)
+{
+	if (!options.kerning)
+	{
+		_shaper.setFeatures("-kern");
+	}
+}
+
+// HarfBuzzMetricBuilder
+
+HarfBuzzMetricBuilder::HarfBuzzMetricBuilder(
+	HarfBuzzSysContext &context,
+	TextLayout &layout) :
+	_context(context),
+	_layout(layout)
+{ }
+
+void HarfBuzzMetricBuilder::onRun(
+	FreeTypeFont *font,
+	float size,
+	Brush foreground,
+	const wchar_t *text,
+	size_t length)
+{
+	font->activateSize(size);
+
+	auto face = font->face();
+	if (!face)
+	{
+		for (size_t i = 0; i < length; i++)
+		{
+			_layout.nextChar(text[i], { 0, 0 }, 0, 0);
+		}
+		return;
+	}
+
+	auto fontHeight = static_cast<unsigned>(face->size->metrics.height >> 6);
+	auto ascent = static_cast<unsigned>(face->size->metrics.ascender >> 6);
+
+	// Kerning is already part of the shaped advances
+	unsigned clusterWidth = 0;
+	auto run = _context.shaper().shape(font, size, text, length);
+	for (auto &glyph : run.glyphs)
+	{
+		clusterWidth += static_cast<unsigned>(std::max(glyph.xAdvance, 0));
+		for (unsigned i = 0; i < glyph.chars; i++)
+		{
+			Size charSize{ i == 0 ? clusterWidth : 0, fontHeight };
+			_layout.nextChar(text[glyph.cluster + i], charSize, 0, ascent);
+		}
+
+		if (glyph.chars > 0)
+		{
+			clusterWidth = 0;
+		}
+	}
+}
+
+TextBlockMetrics HarfBuzzMetricBuilder::done()
+{
+	return _layout.metrics();
+}
+
+END_XT_NAMESPACE
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "FreeType.hpp"
+#include <climits>
+#include <string>
+#include <vector>
+#include <hb.h>
+
+#define XT_SHAPE_CACHE_SIZE 1024
+
+BEGIN_XT_NAMESPACE
+
+// One glyph of a shaped run. Cluster is the index of the first char in the
+// run that the glyph came from, and chars is how many chars the cluster
+// covers on its last glyph and 0 on the others. Distances are in pixels.
+struct ShapedGlyph
+{
+	FT_UInt glyphIndex;
+	unsigned cluster;
+	unsigned chars;
+	int xAdvance;
+	int xOffset;
+	int yOffset;
+};
+
+// Glyphs are in the logical order of the chars, right to left runs
+// included, with each cluster's glyphs in the order they're drawn. A right to
+// left run is drawn with its first cluster at the right.
+struct ShapedRun
+{
+	std::vector<ShapedGlyph> glyphs;
+	bool isRightToLeft;
+};
+
+struct ShapeKey
+{
+	uint64_t face;
+	FT_F26Dot6 size;
+	std::string features;
+	std::wstring text;
+
+	bool operator==(const ShapeKey &other) const
+	{
+		return face == other.face
+			&& size == other.size
+			&& features == other.features
+			&& text == other.text;
+	}
+};
+
+struct ShapeKeyHash
+{
+	size_t operator()(const ShapeKey &key) const;
+};
+
+// Turns runs of chars into positioned glyphs with HarfBuzz. Results are kept
+// in an LRU cache keyed by face, size, features and text so a run is only
+// shaped the first time it is seen, which also covers measuring a block and
+// then rendering it.
+class HarfBuzzShaper
+{
+public:
+	HarfBuzzShaper(size_t cacheSize);
+	HarfBuzzShaper(const HarfBuzzShaper &) = delete;
+	HarfBuzzShaper(HarfBuzzShaper &&other);
+	~HarfBuzzShaper();
+
+	// Comma separated features in HarfBuzz syntax, eg. "-liga,+ss01"
+	bool setFeatures(std::string features);
+	const std::string &features() const { return _featureString; }
+
+	// The font must already be set to the given size. The run is a copy
+	// since later calls can evict the cached one.
+	ShapedRun shape(
+		FreeTypeFont *font,
+		float size,
+		const wchar_t *text,
+		size_t length);
+
+	size_t cachedRuns() const { return _cache.size(); }
+
+private:
+	void shapeUncached(FT_Face face, ShapedRun &run);
+
+	hb_buffer_t *_buffer;
+	std::string _featureString;
+	std::vector<hb_feature_t> _features;
+	std::vector<uint32_t> _codepoints;
+	LruCache<ShapeKey, ShapedRun, ShapeKeyHash> _cache;
+};
+
+class HarfBuzzSysContext : public FreeTypeSysContext
+{
+public:
+	HarfBuzzSysContext(TextManagerOptions options);
+	HarfBuzzShaper &shaper() { return _shaper; }
+
+private:
+	HarfBuzzShaper _shaper;
+};
+
+// Still lays out one entry per char so line char counts match the text. A
+// cluster's width goes on its first char and the rest of its chars are
+// zero width, so a ligature takes up the space of its glyph.
+class HarfBuzzMetricBuilder
+{
+public:
+	HarfBuzzMetricBuilder(HarfBuzzSysContext &context, TextLayout &layout);
+	HarfBuzzMetricBuilder(const HarfBuzzMetricBuilder &) = delete;
+	HarfBuzzMetricBuilder(HarfBuzzMetricBuilder &&) = delete;
+	void onRun(
+		FreeTypeFont *font,
+		float size,
+		Brush foreground,
+		const wchar_t *text,
+		size_t length);
+	TextBlockMetrics done();
+
+private:
+	HarfBuzzSysContext &_context;
+	TextLayout &_layout;
+};
+
+// Right to left runs are drawn a line at a time, with the chars still
+// counted off in logical order so lines wrap where layout put them. Char
+// offsets kept for recoloring are each cluster's left edge, so recoloring
+// part of a right to left run retints the wrong span.
+template <typename TImageData>
+class HarfBuzzCharRenderer : public FreeTypeCharRenderer<TImageData>
+{
+public:
+	HarfBuzzCharRenderer(
+		HarfBuzzSysContext &context,
+		TImageData &imageData,
+		Rect rect,
+		TextBlockMetrics &metrics,
+		unsigned firstLine,
+		CoverageBuffer *coverage) :
+		FreeTypeCharRenderer<TImageData>(
+			context, imageData, rect, metrics, firstLine, coverage),
+		_shaper(context.shaper())
+	{ }
+
+	void onRun(
+		FreeTypeFont *font,
+		float size,
+		Brush foreground,
+		const wchar_t *text,
+		size_t length)
+	{
+		font->activateSize(size);
+
+		auto face = font->face();
+		if (!face)
+		{
+			this->advance(0, static_cast<unsigned>(length));
+			return;
+		}
+
+		auto run = _shaper.shape(font, size, text, length);
+		if (!run.isRightToLeft)
+		{
+			for (auto &glyph : run.glyphs)
+			{
+				drawGlyph(face, foreground, glyph);
+			}
+			return;
+		}
+
+		size_t first = 0;
+		while (first < run.glyphs.size())
+		{
+			first = renderRightToLeft(face, foreground, run.glyphs, first);
+		}
+	}
+
+private:
+	void drawGlyph(FT_Face face, Brush foreground, const ShapedGlyph &glyph)
+	{
+		this->renderGlyph(
+			face, glyph.glyphIndex, foreground, glyph.xOffset, glyph.yOffset);
+		this->advance(glyph.xAdvance, glyph.chars);
+	}
+
+	// Draws the glyphs from first to the end of the line, or of the run,
+	// with the first cluster at the right. Returns the glyph after them.
+	size_t renderRightToLeft(
+		FT_Face face,
+		Brush foreground,
+		const std::vector<ShapedGlyph> &glyphs,
+		size_t first)
+	{
+		auto row = this->_row;
+		auto charsLeft = row < this->_metrics.lines.size()
+			? this->_metrics.lines[row].chars - this->_column : UINT_MAX;
+		auto end = first;
+		int width = 0;
+		unsigned chars = 0;
+		while (end < glyphs.size() && chars < charsLeft)
+		{
+			width += glyphs[end].xAdvance;
+			chars += glyphs[end].chars;
+			end++;
+		}
+
+		auto left = static_cast<int>(this->_penX);
+		auto right = left + width;
+		auto glyph = first;
+		while (glyph < end)
+		{
+			auto clusterEnd = glyph;
+			int clusterWidth = 0;
+			while (clusterEnd < end)
+			{
+				clusterWidth += glyphs[clusterEnd].xAdvance;
+				if (glyphs[clusterEnd++].chars > 0)
+				{
+					break;
+				}
+			}
+
+			right -= clusterWidth;
+			this->_penX = static_cast<unsigned>(right);
+			for (; glyph < clusterEnd; glyph++)
+			{
+				drawGlyph(face, foreground, glyphs[glyph]);
+			}
+		}
+
+		// The last cluster wraps to the next line if it ends this one
+		if (this->_row == row)
+		{
+			this->_penX = static_cast<unsigned>(left + width);
+		}
+		return end;
+	}
+
+	HarfBuzzShaper &_shaper;
+};
+
+// FreeType with shaping. The plain FreeType platform stays the cheaper
+// choice for text that never needs ligatures or complex scripts.
+template <typename TImageData>
+class FreeTypeHarfBuzz
+{
+public:
+	using SysContext = HarfBuzzSysContext;
+	using MetricBuilder = HarfBuzzMetricBuilder;
+	using CharRenderer = HarfBuzzCharRenderer<TImageData>;
+	using Font = FreeTypeFont;
+	using ImageData = TImageData;
+};
+
+END_XT_NAMESPACE
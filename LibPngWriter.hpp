@@ -34,9 +34,9 @@ public:
 		for (unsigned sourceRow = 0; sourceRow < rect.height; sourceRow++)
 		{
 			auto destRow = rect.y + sourceRow;
-			auto startSource = sourceRow * rect.width;
-			auto startDest = destRow * _size.width + rect.x;
 			auto bytesPerSourceRow = rect.width * 4;
+			auto startSource = sourceRow * bytesPerSourceRow;
+			auto startDest = (destRow * _size.width + rect.x) * 4;
 
 			std::copy(
 				pixels.begin() + startSource,
@@ -99,6 +99,27 @@ public:
 	}
 
 	Size size() const { return _size; }
+	void clear() { std::fill(_bytes.begin(), _bytes.end(), 0); }
+
+	void save(std::ostream &out) const
+	{
+		writeBinary(out, _size);
+		out.write(
+			reinterpret_cast<const char *>(_bytes.data()), _bytes.size());
+	}
+
+	bool load(std::istream &in)
+	{
+		Size size;
+		if (!readBinary(in, size)
+			|| size.width != _size.width
+			|| size.height != _size.height)
+		{
+			return false;
+		}
+		in.read(reinterpret_cast<char *>(_bytes.data()), _bytes.size());
+		return in.good();
+	}
 
 private:
 	Size _size;
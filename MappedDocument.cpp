@@ -0,0 +1,253 @@
+#include "MappedDocument.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+BEGIN_XT_NAMESPACE
+
+void findLineStarts(
+	const char *bytes,
+	size_t length,
+	uint64_t offset,
+	std::vector<uint64_t> &lineStarts)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	// Compare 16 bytes at a time and walk the bits of the ones that matched
+	auto newline = _mm_set1_epi8('\n');
+	for (; i + 16 <= length; i += 16)
+	{
+		auto chunk = _mm_loadu_si128(
+			reinterpret_cast<const __m128i *>(bytes + i));
+		auto mask = static_cast<unsigned>(
+			_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+		while (mask != 0)
+		{
+			lineStarts.push_back(offset + i + __builtin_ctz(mask) + 1);
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i < length; i++)
+	{
+		if (bytes[i] == '\n')
+		{
+			lineStarts.push_back(offset + i + 1);
+		}
+	}
+}
+
+// MappedDocument
+
+MappedDocument::MappedDocument(std::string path, bool indexInBackground) :
+	_path(path),
+	_map(nullptr),
+	_length(0),
+	_lineStarts(1, 0),
+	_scannedBytes(0),
+	_aheadBytes(0),
+	_isIndexed(true),
+	_stop(false)
+{
+	auto fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		std::cout << "failed to open '" << path << "'" << std::endl;
+		return;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		std::cout << "failed to stat '" << path << "'" << std::endl;
+		close(fd);
+		return;
+	}
+
+	// Nothing to map or index in an empty file, it's just one empty line
+	_length = static_cast<uint64_t>(info.st_size);
+	if (_length == 0)
+	{
+		close(fd);
+		return;
+	}
+
+	auto map = mmap(nullptr, _length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		std::cout << "failed to map '" << path << "'" << std::endl;
+		_length = 0;
+		return;
+	}
+
+	_map = static_cast<const char *>(map);
+	_isIndexed = false;
+	if (indexInBackground)
+	{
+		_indexer = std::thread(&MappedDocument::index, this);
+	}
+}
+
+MappedDocument::~MappedDocument()
+{
+	_stop = true;
+	if (_indexer.joinable())
+	{
+		_indexer.join();
+	}
+
+	if (_map)
+	{
+		munmap(const_cast<char *>(_map), _length);
+	}
+}
+
+void MappedDocument::waitForIndex()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (!_isIndexed && !_indexer.joinable())
+	{
+		_indexer = std::thread(&MappedDocument::index, this);
+	}
+	_indexed.wait(lock, [this] { return _isIndexed.load(); });
+}
+
+uint64_t MappedDocument::indexedLines()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _lineStarts.size();
+}
+
+uint64_t MappedDocument::knownLines()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _lineStarts.size() + _aheadStarts.size();
+}
+
+Utf8View MappedDocument::line(uint64_t index)
+{
+	uint64_t start;
+	uint64_t scanned;
+	uint64_t remaining;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (index < _lineStarts.size())
+		{
+			return lineFrom(_lineStarts[index]);
+		}
+
+		// Line starts found ahead of the index follow on from its last one
+		auto ahead = index - (_lineStarts.size() - 1);
+		if (ahead <= _aheadStarts.size())
+		{
+			return lineFrom(_aheadStarts[ahead - 1]);
+		}
+
+		start = _aheadStarts.empty() ? _lineStarts.back() : _aheadStarts.back();
+		scanned = _aheadBytes;
+		remaining = ahead - _aheadStarts.size();
+	}
+
+	// Every '\n' before the scanned bytes has its line start known already
+	std::vector<uint64_t> found;
+	auto position = scanned;
+	while (remaining > 0 && position < _length)
+	{
+		auto newline = static_cast<const char *>(
+			std::memchr(_map + position, '\n', _length - position));
+		if (!newline)
+		{
+			position = _length;
+			break;
+		}
+
+		start = static_cast<uint64_t>(newline - _map) + 1;
+		found.push_back(start);
+		position = start;
+		remaining--;
+	}
+
+	{
+		// Keep what was found unless the index or another caller has
+		// scanned past where this scan started in the meantime
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_aheadBytes == scanned)
+		{
+			_aheadStarts.insert(_aheadStarts.end(), found.begin(), found.end());
+			_aheadBytes = position;
+		}
+	}
+
+	return remaining == 0 ? lineFrom(start) : Utf8View();
+}
+
+Utf8View MappedDocument::lineAt(uint64_t offset) const
+{
+	auto start = std::min(offset, _length);
+	while (start > 0 && _map[start - 1] != '\n')
+	{
+		start--;
+	}
+	return lineFrom(start);
+}
+
+void MappedDocument::index()
+{
+	std::vector<uint64_t> found;
+	uint64_t position = 0;
+	while (position < _length && !_stop)
+	{
+		auto length = std::min<uint64_t>(
+			MAPPED_DOCUMENT_CHUNK_SIZE, _length - position);
+		found.clear();
+		findLineStarts(_map + position, length, position, found);
+		position += length;
+
+		// Only the append is locked so readers never wait on a scan
+		std::lock_guard<std::mutex> lock(_mutex);
+		_lineStarts.insert(_lineStarts.end(), found.begin(), found.end());
+		_scannedBytes = position;
+
+		// Starts that line() found ahead are in the index now
+		auto indexed = std::upper_bound(
+			_aheadStarts.begin(), _aheadStarts.end(), position);
+		_aheadStarts.erase(_aheadStarts.begin(), indexed);
+		_aheadBytes = std::max(_aheadBytes, position);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isIndexed = true;
+	}
+	_indexed.notify_all();
+}
+
+Utf8View MappedDocument::lineFrom(uint64_t start) const
+{
+	if (start >= _length)
+	{
+		return Utf8View();
+	}
+
+	auto newline = static_cast<const char *>(
+		std::memchr(_map + start, '\n', _length - start));
+	auto end = newline ? static_cast<uint64_t>(newline - _map) : _length;
+	if (end > start && _map[end - 1] == '\r')
+	{
+		end--;
+	}
+
+	return Utf8View(_map + start, static_cast<size_t>(end - start));
+}
+
+END_XT_NAMESPACE
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "CrossText.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define MAPPED_DOCUMENT_CHUNK_SIZE (1 << 20)
+
+BEGIN_XT_NAMESPACE
+
+// Appends offset + i + 1 for every '\n' at bytes[i], which is where the next
+// line starts. Uses SSE2 when the compiler targets it.
+void findLineStarts(
+	const char *bytes,
+	size_t length,
+	uint64_t offset,
+	std::vector<uint64_t> &lineStarts);
+
+// A read-only, memory mapped UTF-8 file split into lines. The line index is
+// built by a background thread, a chunk at a time, so a document of any size
+// opens right away. Without indexInBackground the indexer only starts in
+// waitForIndex() and lines are found by line() as they're asked for. Lines
+// are handed out as views of the mapped bytes and are only decoded once they
+// are given to a TextBlock.
+//
+// Lines end at '\n', which is not part of the line, and a '\r' before it is
+// dropped too. A file that ends with '\n' has an empty last line.
+class MappedDocument
+{
+public:
+	MappedDocument(std::string path, bool indexInBackground = true);
+	MappedDocument(const MappedDocument &) = delete;
+	MappedDocument(MappedDocument &&) = delete;
+	~MappedDocument();
+
+	bool isOpen() const { return _map != nullptr; }
+	uint64_t byteSize() const { return _length; }
+
+	bool isIndexed() const { return _isIndexed.load(); }
+	void waitForIndex();
+
+	// Lines found so far. Once isIndexed() this is the line count.
+	uint64_t indexedLines();
+
+	// Lines whose start is known, by the index or by line() looking ahead.
+	uint64_t knownLines();
+
+	// Works for any line even while indexing. A line past the index is found
+	// by scanning on the calling thread from the last line start known, and
+	// the starts it finds are kept until the index gets to them. Lines past
+	// the end of the file are empty.
+	Utf8View line(uint64_t index);
+
+	// The line that a byte offset falls in, found by scanning back to the
+	// previous '\n'. Handy for jumping to a position in a file that isn't
+	// indexed that far yet.
+	Utf8View lineAt(uint64_t offset) const;
+
+private:
+	void index();
+	Utf8View lineFrom(uint64_t start) const;
+
+	std::string _path;
+	const char *_map;
+	uint64_t _length;
+
+	std::mutex _mutex;
+	std::condition_variable _indexed;
+	std::vector<uint64_t> _lineStarts;
+	uint64_t _scannedBytes;
+	std::vector<uint64_t> _aheadStarts;
+	uint64_t _aheadBytes;
+	std::atomic<bool> _isIndexed;
+	std::atomic<bool> _stop;
+	std::thread _indexer;
+};
+
+END_XT_NAMESPACE
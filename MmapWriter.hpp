@@ -0,0 +1,481 @@
+#pragma once
+
+#include "CrossText.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MMAP_IMAGE_MAGIC 0x4d495458 // "XTIM" little endian
+#define MMAP_IMAGE_VERSION 1
+
+BEGIN_XT_NAMESPACE
+
+enum class MmapPixelFormat : uint32_t
+{
+	Rgba8 = 1
+};
+
+// Raw header at the start of the file. The pixels start at headerSize,
+// which the writer rounds up to its page size so the pixel area can be
+// mapped on its own. Readers take it from the header.
+struct MmapImageHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	MmapPixelFormat format;
+	uint32_t headerSize;
+};
+
+// Image data that lives in a memory mapped file instead of the heap. The
+// file is created sparse so pages are only backed once a slot is rendered
+// into them, and commit() only flushes the pages that were touched since the
+// last commit. Other processes can open the same file with MmapReader.
+class MmapWriter
+{
+public:
+	MmapWriter(Size size, std::string path) :
+		_size(size),
+		_path(path),
+		_fd(-1),
+		_map(nullptr),
+		_mapLength(0),
+		_pageSize(static_cast<size_t>(sysconf(_SC_PAGESIZE))),
+		_headerSize(
+			(sizeof(MmapImageHeader) + _pageSize - 1) / _pageSize * _pageSize),
+		_dirtyPageCount(0),
+		_lastDirtyPage(SIZE_MAX)
+	{
+		_mapLength = _headerSize
+			+ static_cast<size_t>(size.width) * size.height * 4;
+
+		_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (_fd < 0)
+		{
+			std::cout << "failed to open '" << path << "'" << std::endl;
+			return;
+		}
+
+		if (ftruncate(_fd, static_cast<off_t>(_mapLength)) != 0)
+		{
+			std::cout << "failed to size '" << path << "'" << std::endl;
+			close();
+			return;
+		}
+
+		auto map = mmap(
+			nullptr, _mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+		if (map == MAP_FAILED)
+		{
+			std::cout << "failed to map '" << path << "'" << std::endl;
+			close();
+			return;
+		}
+
+		_map = static_cast<uint8_t *>(map);
+		_dirtyPages.resize((pageCount() + 63) / 64, 0);
+
+		MmapImageHeader header
+		{
+			MMAP_IMAGE_MAGIC,
+			MMAP_IMAGE_VERSION,
+			size.width,
+			size.height,
+			MmapPixelFormat::Rgba8,
+			static_cast<uint32_t>(_headerSize)
+		};
+		std::memcpy(_map, &header, sizeof(header));
+		markDirty(0, sizeof(header));
+	}
+
+	MmapWriter(const MmapWriter &) = delete;
+
+	MmapWriter(MmapWriter &&other) :
+		_size(other._size),
+		_path(std::move(other._path)),
+		_fd(other._fd),
+		_map(other._map),
+		_mapLength(other._mapLength),
+		_pageSize(other._pageSize),
+		_headerSize(other._headerSize),
+		_dirtyPages(std::move(other._dirtyPages)),
+		_dirtyPageCount(other._dirtyPageCount),
+		_lastDirtyPage(other._lastDirtyPage)
+	{
+		other._fd = -1;
+		other._map = nullptr;
+		other._mapLength = 0;
+		other._dirtyPageCount = 0;
+	}
+
+	~MmapWriter()
+	{
+		commit();
+		close();
+	}
+
+	void write(std::vector<uint8_t> pixels, Rect rect)
+	{
+		if (!isOpen())
+			return;
+		if (uint64_t{ rect.x } + rect.width > _size.width)
+			return;
+		if (uint64_t{ rect.y } + rect.height > _size.height)
+			return;
+		if (pixels.size() < size_t{ rect.width } * rect.height * 4)
+			return;
+		if (rect.width == 0 || rect.height == 0)
+			return;
+
+		auto bytesPerSourceRow = size_t{ rect.width } * 4;
+		for (unsigned sourceRow = 0; sourceRow < rect.height; sourceRow++)
+		{
+			auto destRow = rect.y + sourceRow;
+			std::memcpy(
+				_map + pixelOffset(rect.x, destRow),
+				&pixels[sourceRow * bytesPerSourceRow],
+				bytesPerSourceRow);
+		}
+		markDirty(rect);
+	}
+
+	void commit()
+	{
+		if (!isOpen() || _dirtyPageCount == 0)
+			return;
+
+		// Flush each run of consecutive dirty pages with a single msync
+		auto pages = pageCount();
+		size_t page = 0;
+		while (page < pages)
+		{
+			if (!isPageDirty(page))
+			{
+				page++;
+				continue;
+			}
+
+			auto firstPage = page;
+			while (page < pages && isPageDirty(page))
+			{
+				page++;
+			}
+
+			auto start = firstPage * _pageSize;
+			auto length = std::min(
+				(page - firstPage) * _pageSize, _mapLength - start);
+			if (msync(_map + start, length, MS_SYNC) != 0)
+			{
+				std::cout << "failed to sync '" << _path << "'" << std::endl;
+			}
+		}
+
+		std::fill(_dirtyPages.begin(), _dirtyPages.end(), 0);
+		_dirtyPageCount = 0;
+		_lastDirtyPage = SIZE_MAX;
+	}
+
+	void setPixel(
+		unsigned x,
+		unsigned y,
+		uint8_t r,
+		uint8_t g,
+		uint8_t b,
+		uint8_t a)
+	{
+		if (x >= _size.width)
+			return;
+		if (y >= _size.height)
+			return;
+		if (!isOpen())
+			return;
+
+		auto offset = pixelOffset(x, y);
+		_map[offset + 0] = r;
+		_map[offset + 1] = g;
+		_map[offset + 2] = b;
+		_map[offset + 3] = a;
+
+		// Pixels are set a row at a time, so most land on the last page
+		if (offset / _pageSize != _lastDirtyPage)
+		{
+			markDirty(offset, 4);
+		}
+	}
+
+	// Zeroes every pixel. Where the file system can punch holes the pixel
+	// pages go back to being sparse, and there's nothing left to flush.
+	void clear()
+	{
+		if (isOpen())
+		{
+			zero(_headerSize, _mapLength - _headerSize);
+		}
+	}
+
+	Size size() const { return _size; }
+	bool isOpen() const { return _map != nullptr; }
+	const std::string &path() const { return _path; }
+
+	void save(std::ostream &out) const
+	{
+		writeBinary(out, _size);
+		if (isOpen())
+		{
+			out.write(
+				reinterpret_cast<const char *>(_map + _headerSize),
+				_mapLength - _headerSize);
+		}
+	}
+
+	bool load(std::istream &in)
+	{
+		Size size;
+		if (!isOpen()
+			|| !readBinary(in, size)
+			|| size.width != _size.width
+			|| size.height != _size.height)
+		{
+			return false;
+		}
+
+		// Read a page at a time so pages that are all zeros, as most of a
+		// part filled atlas is, stay holes in the file, and pages that
+		// haven't changed aren't dirtied
+		std::vector<char> page(_pageSize);
+		for (auto offset = _headerSize; offset < _mapLength; )
+		{
+			auto length = std::min(_pageSize, _mapLength - offset);
+			if (!in.read(page.data(), length))
+			{
+				return false;
+			}
+
+			auto target = _map + offset;
+			if (isZero(page.data(), length))
+			{
+				if (!isZero(target, length))
+				{
+					zero(offset, length);
+				}
+			}
+			else if (std::memcmp(target, page.data(), length) != 0)
+			{
+				std::memcpy(target, page.data(), length);
+				markDirty(offset, length);
+			}
+			offset += length;
+		}
+		return true;
+	}
+
+private:
+	size_t pixelOffset(unsigned x, unsigned y) const
+	{
+		return _headerSize + (static_cast<size_t>(_size.width) * y + x) * 4;
+	}
+
+	// Each byte matches the one after it and the first is zero
+	static bool isZero(const void *bytes, size_t length)
+	{
+		auto p = static_cast<const uint8_t *>(bytes);
+		return length == 0
+			|| (p[0] == 0 && std::memcmp(p, p + 1, length - 1) == 0);
+	}
+
+	// Punches a hole where it can so the pages stop taking up space
+	void zero(size_t offset, size_t length)
+	{
+#ifdef FALLOC_FL_PUNCH_HOLE
+		if (fallocate(
+				_fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				static_cast<off_t>(offset),
+				static_cast<off_t>(length)) == 0)
+		{
+			return;
+		}
+#endif
+		std::memset(_map + offset, 0, length);
+		markDirty(offset, length);
+	}
+
+	size_t pageCount() const
+	{
+		return (_mapLength + _pageSize - 1) / _pageSize;
+	}
+
+	bool isPageDirty(size_t page) const
+	{
+		return (_dirtyPages[page / 64] >> (page % 64)) & 1;
+	}
+
+	void markDirty(size_t offset, size_t length)
+	{
+		auto lastPage = (offset + length - 1) / _pageSize;
+		for (auto page = offset / _pageSize; page <= lastPage; page++)
+		{
+			auto &word = _dirtyPages[page / 64];
+			uint64_t bit = uint64_t{1} << (page % 64);
+			if (!(word & bit))
+			{
+				word |= bit;
+				_dirtyPageCount++;
+			}
+		}
+		_lastDirtyPage = lastPage;
+	}
+
+	// Rows more than a page apart leave the pages between them clean
+	void markDirty(Rect rect)
+	{
+		auto rowLength = size_t{ rect.width } * 4;
+		auto rowStride = static_cast<size_t>(_size.width) * 4;
+		if (rowStride - rowLength < _pageSize)
+		{
+			auto start = pixelOffset(rect.x, rect.y);
+			auto end = pixelOffset(rect.x, rect.y + rect.height - 1)
+				+ rowLength;
+			markDirty(start, end - start);
+			return;
+		}
+
+		for (unsigned row = 0; row < rect.height; row++)
+		{
+			markDirty(pixelOffset(rect.x, rect.y + row), rowLength);
+		}
+	}
+
+	void close()
+	{
+		if (_map)
+		{
+			munmap(_map, _mapLength);
+			_map = nullptr;
+		}
+
+		if (_fd >= 0)
+		{
+			::close(_fd);
+			_fd = -1;
+		}
+	}
+
+	Size _size;
+	std::string _path;
+	int _fd;
+	uint8_t *_map;
+	size_t _mapLength;
+	size_t _pageSize;
+	size_t _headerSize;
+	std::vector<uint64_t> _dirtyPages;
+	size_t _dirtyPageCount;
+	size_t _lastDirtyPage;
+};
+
+// Read-only view of a file written by MmapWriter. Pages are shared with the
+// writing process so pixels show up here as soon as they are rendered there.
+class MmapReader
+{
+public:
+	MmapReader(std::string path) :
+		_size{ 0, 0 },
+		_map(nullptr),
+		_mapLength(0),
+		_pixels(nullptr)
+	{
+		auto fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			std::cout << "failed to open '" << path << "'" << std::endl;
+			return;
+		}
+
+		struct stat info;
+		if (fstat(fd, &info) != 0
+			|| static_cast<size_t>(info.st_size) < sizeof(MmapImageHeader))
+		{
+			std::cout << "not an image file '" << path << "'" << std::endl;
+			::close(fd);
+			return;
+		}
+
+		auto length = static_cast<size_t>(info.st_size);
+		auto map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED)
+		{
+			std::cout << "failed to map '" << path << "'" << std::endl;
+			return;
+		}
+
+		MmapImageHeader header;
+		std::memcpy(&header, map, sizeof(header));
+		auto expectedLength = static_cast<size_t>(header.headerSize)
+			+ static_cast<size_t>(header.width) * header.height * 4;
+		if (header.magic != MMAP_IMAGE_MAGIC
+			|| header.version != MMAP_IMAGE_VERSION
+			|| header.format != MmapPixelFormat::Rgba8
+			|| header.headerSize < sizeof(header)
+			|| expectedLength > length)
+		{
+			std::cout << "not an image file '" << path << "'" << std::endl;
+			munmap(map, length);
+			return;
+		}
+
+		_map = static_cast<const uint8_t *>(map);
+		_mapLength = length;
+		_pixels = _map + header.headerSize;
+		_size = { header.width, header.height };
+	}
+
+	MmapReader(const MmapReader &) = delete;
+
+	MmapReader(MmapReader &&other) :
+		_size(other._size),
+		_map(other._map),
+		_mapLength(other._mapLength),
+		_pixels(other._pixels)
+	{
+		other._map = nullptr;
+		other._mapLength = 0;
+	}
+
+	~MmapReader()
+	{
+		if (_map)
+		{
+			munmap(const_cast<uint8_t *>(_map), _mapLength);
+		}
+	}
+
+	bool isOpen() const { return _map != nullptr; }
+	Size size() const { return _size; }
+
+	// RGBA rows of size().width pixels, tightly packed
+	const uint8_t *pixels() const { return _pixels; }
+
+	Color pixel(unsigned x, unsigned y) const
+	{
+		auto p = _pixels + (static_cast<size_t>(_size.width) * y + x) * 4;
+		return { (uint32_t{p[0]} << 24) | (uint32_t{p[1]} << 16)
+			| (uint32_t{p[2]} << 8) | uint32_t{p[3]} };
+	}
+
+private:
+	Size _size;
+	const uint8_t *_map;
+	size_t _mapLength;
+	const uint8_t *_pixels;
+};
+
+END_XT_NAMESPACE
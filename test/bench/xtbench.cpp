@@ -0,0 +1,497 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "CrossText.hpp"
+#include "FreeType.hpp"
+
+using namespace xt;
+
+/*
+xtbench times the parts of the pipeline one operation at a time and reports
+latency percentiles for each, so runs can be compared between releases.
+
+usage: xtbench [--json <path>] [--filter <text>] [--font <path>]
+
+Every benchmark is seeded the same way on every run and does a fixed number
+of operations after a short warm up. --filter only runs benchmarks whose
+name contains the text. The FreeType benchmarks are skipped if the font
+can't be loaded.
+*/
+
+#define DEFAULT_FONT "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf"
+#define WARMUP_OPS 20
+#define SEED 42
+
+// Pixels only go to memory so rendering is timed without any I/O
+class BenchImageData
+{
+public:
+	BenchImageData(Size size) :
+		_size(size), _bytes(size.width * size.height * 4, 0)
+	{ }
+
+	BenchImageData(const BenchImageData &) = delete;
+	BenchImageData(BenchImageData &&other) = default;
+
+	void commit() { }
+
+	void setPixel(
+		unsigned x,
+		unsigned y,
+		uint8_t r,
+		uint8_t g,
+		uint8_t b,
+		uint8_t a)
+	{
+		if (x >= _size.width || y >= _size.height)
+			return;
+
+		auto offset = (_size.width * y + x) * 4;
+		_bytes[offset + 0] = r;
+		_bytes[offset + 1] = g;
+		_bytes[offset + 2] = b;
+		_bytes[offset + 3] = a;
+	}
+
+	void write(std::vector<uint8_t> pixels, Rect rect)
+	{
+		for (unsigned row = 0; row < rect.height; row++)
+		{
+			std::memcpy(
+				&_bytes[((rect.y + row) * _size.width + rect.x) * 4],
+				&pixels[row * rect.width * 4],
+				rect.width * 4);
+		}
+	}
+
+	Size size() const { return _size; }
+
+private:
+	Size _size;
+	std::vector<uint8_t> _bytes;
+};
+
+using Text = TextPlatform<FreeType<BenchImageData>>;
+
+struct BenchResult
+{
+	std::string name;
+	std::vector<double> nanos;
+	double itemsPerOp;
+	std::string items;
+
+	double percentile(double p) const
+	{
+		// Nearest rank, the samples are sorted by then
+		auto rank = static_cast<size_t>(p / 100.0 * nanos.size() + 0.5);
+		return nanos[std::min(std::max<size_t>(rank, 1), nanos.size()) - 1];
+	}
+
+	double mean() const
+	{
+		double total = 0;
+		for (auto n : nanos)
+		{
+			total += n;
+		}
+		return total / nanos.size();
+	}
+};
+
+class Bench
+{
+public:
+	Bench(std::string filter) : _filter(std::move(filter))
+	{ }
+
+	// Runs op warm up + count times and records how long each of the counted
+	// runs took. Items are what one op processes, eg. chars, for throughput.
+	void run(
+		std::string name,
+		unsigned count,
+		std::function<void()> op,
+		double itemsPerOp = 0,
+		std::string items = "")
+	{
+		if (name.find(_filter) == std::string::npos)
+		{
+			return;
+		}
+
+		for (unsigned i = 0; i < WARMUP_OPS; i++)
+		{
+			op();
+		}
+
+		BenchResult result{ name, {}, itemsPerOp, items };
+		result.nanos.reserve(count);
+		for (unsigned i = 0; i < count; i++)
+		{
+			WallTimer timer;
+			op();
+			result.nanos.push_back(static_cast<double>(timer.nanos()));
+		}
+		std::sort(result.nanos.begin(), result.nanos.end());
+
+		print(result);
+		_results.push_back(std::move(result));
+	}
+
+	bool writeJson(const std::string &path) const
+	{
+		std::ofstream out(path);
+		if (!out)
+		{
+			std::cout << "failed to open '" << path << "'" << std::endl;
+			return false;
+		}
+
+		out << std::fixed << std::setprecision(1);
+		out << "{\n  \"unit\": \"ns\",\n  \"benchmarks\": [";
+		for (size_t i = 0; i < _results.size(); i++)
+		{
+			auto &result = _results[i];
+			out << (i == 0 ? "\n" : ",\n")
+				<< "    {\n"
+				<< "      \"name\": \"" << result.name << "\",\n"
+				<< "      \"ops\": " << result.nanos.size() << ",\n"
+				<< "      \"mean\": " << result.mean() << ",\n"
+				<< "      \"min\": " << result.nanos.front() << ",\n"
+				<< "      \"p50\": " << result.percentile(50) << ",\n"
+				<< "      \"p90\": " << result.percentile(90) << ",\n"
+				<< "      \"p99\": " << result.percentile(99) << ",\n"
+				<< "      \"max\": " << result.nanos.back();
+			if (result.itemsPerOp > 0)
+			{
+				out << ",\n      \"itemsPerOp\": " << result.itemsPerOp
+					<< ",\n      \"items\": \"" << result.items << "\"";
+			}
+			out << "\n    }";
+		}
+		out << "\n  ]\n}\n";
+		return out.good();
+	}
+
+private:
+	static void print(const BenchResult &result)
+	{
+		std::cout << std::left << std::setw(32) << result.name << std::right
+			<< std::fixed << std::setprecision(0)
+			<< " p50 " << std::setw(9) << result.percentile(50)
+			<< " p90 " << std::setw(9) << result.percentile(90)
+			<< " p99 " << std::setw(9) << result.percentile(99)
+			<< " max " << std::setw(9) << result.nanos.back() << " ns";
+		if (result.itemsPerOp > 0)
+		{
+			auto perSecond = result.itemsPerOp / result.mean() * 1000.0;
+			std::cout << std::setprecision(2) << "  " << perSecond
+				<< " M " << result.items << "/s";
+		}
+		std::cout << std::endl;
+	}
+
+	std::string _filter;
+	std::vector<BenchResult> _results;
+};
+
+std::wstring prose(unsigned length, std::mt19937 &rng)
+{
+	std::wstring text;
+	while (text.size() < length)
+	{
+		auto wordLength = 1 + rng() % 12;
+		for (unsigned i = 0; i < wordLength; i++)
+		{
+			text.push_back(static_cast<wchar_t>('a' + rng() % 26));
+		}
+		text.push_back(rng() % 10 == 0 ? '-' : ' ');
+	}
+	text.resize(length);
+	return text;
+}
+
+// Fills an organizer to about the given share of its area with random
+// rects, then times releasing a random slot and claiming a new rect.
+void benchOrganizer(Bench &bench, unsigned fillPercent, OrganizerKind kind)
+{
+	std::mt19937 rng(SEED);
+	Size size{ 1024, 1024 };
+	OrganizerOptions options;
+	options.kind = kind;
+	RectangleOrganizer organizer(size, options);
+	auto randomSize = [&rng]()
+	{
+		return Size{
+			8 + static_cast<unsigned>(rng() % 120),
+			8 + static_cast<unsigned>(rng() % 24) };
+	};
+
+	std::vector<uint64_t> slots;
+	uint64_t filled = 0;
+	auto target = uint64_t{ size.width } * size.height * fillPercent / 100;
+	while (filled < target)
+	{
+		auto rect = randomSize();
+		auto result = organizer.tryClaimSlot(rect);
+		if (!result.isFound)
+		{
+			break;
+		}
+		slots.push_back(result.slot.index);
+		filled += rect.width * rect.height;
+	}
+
+	// A buddy organizer can run out of blocks before it gets that full, the
+	// fill stops at the first claim that fails so the name says how full it
+	// really got
+	auto area = uint64_t{ size.width } * size.height;
+	std::string name(
+		kind == OrganizerKind::Buddy ? "buddy churn " : "organizer churn ");
+	bench.run(
+		name + std::to_string(fillPercent) + "% (filled "
+			+ std::to_string(filled * 100 / area) + "%)",
+		2000,
+		[&]()
+		{
+			if (slots.empty())
+			{
+				auto result = organizer.tryClaimSlot(randomSize());
+				if (result.isFound)
+				{
+					slots.push_back(result.slot.index);
+				}
+				return;
+			}
+
+			auto victim = rng() % slots.size();
+			organizer.releaseSlot(slots[victim]);
+			auto result = organizer.tryClaimSlot(randomSize());
+			if (result.isFound)
+			{
+				slots[victim] = result.slot.index;
+			}
+			else
+			{
+				slots[victim] = slots.back();
+				slots.pop_back();
+			}
+		});
+}
+
+// Packs small rects into a texture until one doesn't fit, so every spacial
+// index block holds dozens of slots, then times placing a rect after a
+// release with each overlap kernel the CPU has.
+void benchDenseOrganizer(Bench &bench)
+{
+	auto best = overlapKernel();
+	for (auto kernel : {
+		OverlapKernel::Scalar, OverlapKernel::Sse41, OverlapKernel::Avx2 })
+	{
+		if (!useOverlapKernel(kernel))
+		{
+			continue;
+		}
+
+		std::mt19937 rng(SEED);
+		RectangleOrganizer organizer({ 1024, 1024 });
+		auto randomSize = [&rng]()
+		{
+			return Size{
+				3 + static_cast<unsigned>(rng() % 6),
+				3 + static_cast<unsigned>(rng() % 6) };
+		};
+
+		std::vector<uint64_t> slots;
+		for (;;)
+		{
+			auto result = organizer.tryClaimSlot(randomSize());
+			if (!result.isFound)
+			{
+				break;
+			}
+			slots.push_back(result.slot.index);
+		}
+
+		bench.run(
+			std::string("organizer dense placement ")
+				+ overlapKernelName(kernel),
+			2000,
+			[&]()
+			{
+				auto victim = rng() % slots.size();
+				organizer.releaseSlot(slots[victim]);
+				auto result = organizer.tryClaimSlot(randomSize());
+				if (result.isFound)
+				{
+					slots[victim] = result.slot.index;
+				}
+				else
+				{
+					slots[victim] = slots.back();
+					slots.pop_back();
+				}
+			});
+	}
+	useOverlapKernel(best);
+}
+
+void benchLayout(Bench &bench, const char *name, std::wstring text)
+{
+	bench.run(
+		std::string("layout ") + name,
+		50,
+		[&text]()
+		{
+			TextLayout layout({ 800, 1u << 30 });
+			for (auto ch : text)
+			{
+				layout.nextChar(ch, { 8, 16 }, 0);
+			}
+			layout.metrics();
+		},
+		static_cast<double>(text.size()),
+		"chars");
+}
+
+void benchFreeType(Bench &bench, std::string fontPath)
+{
+	std::vector<Text::ImageData> textures;
+	textures.push_back(Text::ImageData({ 1024, 1024 }));
+	Text::Manager manager({ { 1024, 1024 } }, std::move(textures));
+
+	auto font = manager.loadFont(fontPath);
+	if (!font.isLoaded())
+	{
+		std::cout << "skipping FreeType benchmarks" << std::endl;
+		return;
+	}
+
+	std::mt19937 rng(SEED);
+	std::vector<std::wstring> lines;
+	for (unsigned i = 0; i < 64; i++)
+	{
+		lines.push_back(prose(60, rng));
+	}
+
+	auto &context = manager.sysContext();
+	Brush brush{ 0x000000ff };
+	unsigned next = 0;
+	bench.run(
+		"freetype metric builder",
+		1000,
+		[&]()
+		{
+			auto &line = lines[next++ % lines.size()];
+			TextLayout layout({ 1024, 1024 });
+			FreeTypeMetricBuilder builder(context, layout);
+			builder.onRun(&font, 16.0f, brush, line.data(), line.size());
+			builder.done();
+		},
+		60,
+		"chars");
+
+	std::vector<TextBlockMetrics> metrics;
+	for (auto &line : lines)
+	{
+		TextLayout layout({ 1024, 1024 });
+		FreeTypeMetricBuilder builder(context, layout);
+		builder.onRun(&font, 16.0f, brush, line.data(), line.size());
+		metrics.push_back(builder.done());
+	}
+
+	auto &imageData = manager.textures()[0].imageData();
+	bench.run(
+		"freetype char renderer",
+		1000,
+		[&]()
+		{
+			auto index = next++ % lines.size();
+			auto &line = lines[index];
+			Rect rect{ 0, 0, metrics[index].size.width, 64 };
+			FreeTypeCharRenderer<BenchImageData> renderer(
+				context, imageData, rect, metrics[index], 0, nullptr);
+			renderer.onRun(&font, 16.0f, brush, line.data(), line.size());
+		},
+		60,
+		"chars");
+
+	auto options = Text::Options::fromStyle({ &font, 16.0f, brush });
+	bench.run(
+		"textblock create",
+		1000,
+		[&]()
+		{
+			Text::Block block(manager, lines[next++ % lines.size()], options);
+		},
+		60,
+		"chars");
+}
+
+int main(int argc, char **argv)
+{
+	std::string jsonPath;
+	std::string filter;
+	std::string fontPath(DEFAULT_FONT);
+	for (int i = 1; i < argc; i++)
+	{
+		std::string flag(argv[i]);
+		if (i + 1 >= argc)
+		{
+			std::cout << "missing value for '" << flag << "'" << std::endl;
+			return 1;
+		}
+
+		std::string value(argv[++i]);
+		if (flag == "--json")
+		{
+			jsonPath = value;
+		}
+		else if (flag == "--filter")
+		{
+			filter = value;
+		}
+		else if (flag == "--font")
+		{
+			fontPath = value;
+		}
+		else
+		{
+			std::cout << "unknown option '" << flag << "'" << std::endl;
+			return 1;
+		}
+	}
+
+	Bench bench(filter);
+
+	for (auto fill : { 25u, 50u, 75u, 90u })
+	{
+		benchOrganizer(bench, fill, OrganizerKind::Search);
+	}
+	for (auto fill : { 25u, 50u, 75u, 90u })
+	{
+		benchOrganizer(bench, fill, OrganizerKind::Buddy);
+	}
+	benchDenseOrganizer(bench);
+
+	std::mt19937 rng(SEED);
+	auto length = 100u * 1024u;
+	benchLayout(bench, "prose", prose(length, rng));
+	benchLayout(bench, "one word", std::wstring(length, 'x'));
+	benchLayout(bench, "whitespace", L"x" + std::wstring(length - 1, ' '));
+	benchLayout(bench, "hyphens", std::wstring(length, '-'));
+
+	benchFreeType(bench, fontPath);
+
+	if (!jsonPath.empty() && !bench.writeJson(jsonPath))
+	{
+		return 1;
+	}
+
+	return 0;
+}
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include "FreeType.hpp"
 #include "LibPngWriter.hpp"
 
@@ -135,7 +137,293 @@ int test3()
 	return 0;
 }
 
+int testSharedFonts()
+{
+	std::string path("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+
+	std::vector<Text::ImageData> textures1;
+	textures1.push_back(Text::ImageData({ 256, 256 }, "./shared1_"));
+	std::vector<Text::ImageData> textures2;
+	textures2.push_back(Text::ImageData({ 256, 256 }, "./shared2_"));
+
+	Text::Manager manager1({ { 256, 256 } }, std::move(textures1));
+	Text::Manager manager2({ { 256, 256 } }, std::move(textures2));
+
+	auto &registry = manager1.sysContext().fontRegistry();
+	auto shared = false;
+	{
+		auto font1 = manager1.loadFont(path);
+		auto font2 = manager2.loadFont(path);
+		shared = font1.isLoaded() && font1.face() == font2.face();
+	}
+	std::cout << "fonts share a face: " << (shared ? "yes" : "no")
+		<< std::endl;
+
+	auto released = registry.size() == 0;
+	std::cout << "released faces leave the registry: "
+		<< (released ? "yes" : "no") << std::endl;
+
+	// The registry belongs to this thread, so another one can't use it
+	std::shared_ptr<xt::FreeTypeFace> foreign;
+	std::thread other([&]() { foreign = registry.acquire(path, 0); });
+	other.join();
+	std::cout << "other threads are refused: "
+		<< (foreign ? "no" : "yes") << std::endl;
+
+	return shared && released && !foreign ? 0 : 1;
+}
+
+int testSetText()
+{
+	std::vector<Text::ImageData> textures;
+	textures.push_back(Text::ImageData({ 512, 512 }, "./console_"));
+	Text::Manager manager({ { 512, 512 } }, std::move(textures));
+
+	auto font = manager.loadFont(
+		"/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+	Text::Style style{ &font, 20.0f, 0x000000ff };
+	auto options = Text::Options::fromStyle(style);
+
+	std::wstring log(L"$ make");
+	Text::Block console(manager, log, options);
+	for (auto line : { L" build xt", L" build fttest", L" done" })
+	{
+		log += line;
+		console.setText(log);
+	}
+
+	return console.text() == log ? 0 : 1;
+}
+
+int testKerningCache()
+{
+	xt::FreeTypeFontRegistry registry;
+	auto face = registry.acquire(
+		"/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf", 0);
+	if (!face || !face->activateSize(12.0f))
+	{
+		return 1;
+	}
+
+	auto direct = [&face](wchar_t left, wchar_t right)
+	{
+		auto ft = face->face();
+		FT_Vector delta;
+		FT_Get_Kerning(
+			ft,
+			FT_Get_Char_Index(ft, left),
+			FT_Get_Char_Index(ft, right),
+			FT_KERNING_DEFAULT,
+			&delta);
+		return static_cast<int>(delta.x >> 6);
+	};
+
+	// ASCII pairs fill the dense table and are only looked up once
+	auto small = face->kerning(L'A', L'V');
+	auto cache = face->kerningCache();
+	auto ok = small != 0 && small == direct(L'A', L'V')
+		&& face->kerning(L'A', L'V') == small
+		&& cache->denseSize() == 1 && cache->otherSize() == 0;
+
+	// Anything else, negative chars included, goes to the hash map
+	auto negative = static_cast<wchar_t>(-5);
+	ok = ok && face->kerning(L'\u0100', L'V') == direct(L'\u0100', L'V')
+		&& face->kerning(negative, L'A') == 0
+		&& face->kerning(L'A', negative) == 0
+		&& cache->denseSize() == 1 && cache->otherSize() == 3;
+
+	// Each size keeps its own cache, and switching back reuses it
+	face->activateSize(48.0f);
+	auto large = face->kerning(L'A', L'V');
+	ok = ok && large == direct(L'A', L'V')
+		&& face->kerningCache() != cache
+		&& face->kerningCache()->denseSize() == 1;
+	face->activateSize(12.0f);
+	ok = ok && face->kerningCache() == cache
+		&& face->kerning(L'A', L'V') == small;
+
+	std::cout << "kerning cache at 12px and 48px: " << small << " "
+		<< large << (ok ? "" : " (wrong)") << std::endl;
+	return ok ? 0 : 1;
+}
+
+template <typename TManager>
+std::string textureBytes(TManager &manager)
+{
+	std::ostringstream out;
+	manager.textures()[0].imageData().save(out);
+	return out.str();
+}
+
+int testRecolor()
+{
+	std::string path("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+	std::vector<Text::ImageData> textures1;
+	textures1.push_back(Text::ImageData({ 256, 256 }, "./recolor1_"));
+	std::vector<Text::ImageData> textures2;
+	textures2.push_back(Text::ImageData({ 256, 256 }, "./recolor2_"));
+	Text::Manager recolored({ { 256, 256 } }, std::move(textures1));
+	Text::Manager fresh({ { 256, 256 } }, std::move(textures2));
+
+	auto font1 = recolored.loadFont(path);
+	auto font2 = fresh.loadFont(path);
+	xt::Brush red{ 0xff0000ff };
+	Text::Style style1{ &font1, 20.0f, 0x000000ff };
+	Text::Style style2{ &font2, 20.0f, 0x000000ff };
+	auto options1 = Text::Options::fromStyle(style1)
+		.withBackground({ 0x20406080 })
+		.withRecolorable(true);
+	auto options2 = Text::Options::fromStyle(style2)
+		.withBackground({ 0x20406080 })
+		.withRecolorable(true)
+		.withStyleRanges({ { style2.withForeground(red), { 6, 5 } } });
+
+	// Retinting the second word has to give the pixels drawing it red would
+	Text::Block block1(recolored, L"Hello world", options1);
+	block1.recolor({ 6, 5 }, red);
+	Text::Block block2(fresh, L"Hello world", options2);
+
+	auto rect1 = block1.slot().rect;
+	auto rect2 = block2.slot().rect;
+	auto same = rect1 == rect2
+		&& textureBytes(recolored) == textureBytes(fresh);
+	std::cout << "recolored pixels match a fresh block: "
+		<< (same ? "yes" : "no") << std::endl;
+	return same ? 0 : 1;
+}
+
+int testMissingFont()
+{
+	std::vector<Text::ImageData> textures;
+	textures.push_back(Text::ImageData({ 256, 256 }, "./missing_"));
+	Text::Manager manager({ { 256, 256 } }, std::move(textures));
+
+	auto font = manager.loadFont("./no-such-font.ttf");
+	Text::Style style{ &font, 16.0f, 0x000000ff };
+	auto options = Text::Options::fromStyle(style);
+	Text::Block block(manager, L"nothing to draw", options);
+
+	auto ok = !font.isLoaded() && font.faceId() == 0
+		&& font.kerning(L'A', L'V') == 0 && !font.activateSize(16.0f);
+	std::cout << "missing fonts lay out empty: " << (ok ? "yes" : "no")
+		<< std::endl;
+	return ok ? 0 : 1;
+}
+
+int testVirtualBlock()
+{
+	std::vector<Text::ImageData> textures;
+	textures.push_back(Text::ImageData({ 256, 256 }, "./virtual_"));
+	Text::Manager manager({ { 256, 256 } }, std::move(textures));
+
+	auto font = manager.loadFont(
+		"/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+	Text::Style style{ &font, 16.0f, 0x000000ff };
+	auto options = Text::Options::fromStyle(style);
+
+	std::wstring document;
+	for (unsigned i = 0; i < 2000; i++)
+	{
+		document += L"The quick brown fox jumps over the lazy dog. ";
+	}
+
+	// Far taller than the texture, scrolled through a 200px window
+	Text::VirtualBlock block(manager, document, options);
+	for (unsigned top = 0; top < 2000; top += 150)
+	{
+		auto lines = block.linesAt(top, 200);
+		block.setVisibleLines(lines.start, lines.length);
+		for (auto line = lines.start; line < lines.start + lines.length; line++)
+		{
+			if (!block.linePlacement(line).isFound)
+			{
+				return 1;
+			}
+		}
+	}
+
+	std::cout << "virtual block lines: " << block.lineCount() << std::endl;
+	return 0;
+}
+
+#ifdef XT_HAS_HARFBUZZ
+#include "HarfBuzz.hpp"
+
+using ShapedText = xt::TextPlatform<xt::FreeTypeHarfBuzz<xt::LibPngWriter>>;
+
+int testShaping()
+{
+	std::vector<ShapedText::ImageData> textures;
+	textures.push_back(ShapedText::ImageData({ 256, 256 }, "./shaped_"));
+	ShapedText::Manager manager({ { 256, 256 } }, std::move(textures));
+
+	auto font = manager.loadFont(
+		"/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+	ShapedText::Style style{ &font, 20.0f, 0x000000ff };
+	auto options = ShapedText::Options::fromStyle(style);
+
+	ShapedText::Block block(manager, L"office affine", options);
+	auto &shaper = manager.sysContext().shaper();
+	std::cout << "shaped runs cached: " << shaper.cachedRuns() << std::endl;
+
+	return shaper.cachedRuns() == 1 ? 0 : 1;
+}
+
+int testRightToLeft()
+{
+	std::string path("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf");
+	std::vector<ShapedText::ImageData> shapedTextures;
+	shapedTextures.push_back(
+		ShapedText::ImageData({ 256, 256 }, "./rtl_shaped_"));
+	std::vector<Text::ImageData> plainTextures;
+	plainTextures.push_back(Text::ImageData({ 256, 256 }, "./rtl_plain_"));
+	ShapedText::Manager shaped({ { 256, 256 } }, std::move(shapedTextures));
+	Text::Manager plain({ { 256, 256 } }, std::move(plainTextures));
+
+	auto shapedFont = shaped.loadFont(path);
+	auto plainFont = plain.loadFont(path);
+	ShapedText::Style shapedStyle{ &shapedFont, 20.0f, 0x000000ff };
+	Text::Style plainStyle{ &plainFont, 20.0f, 0x000000ff };
+
+	// Hebrew drawn right to left has to match its letters reversed and
+	// drawn left to right without shaping
+	ShapedText::Block shapedBlock(
+		shaped,
+		L"\u05d0\u05d1\u05d2",
+		ShapedText::Options::fromStyle(shapedStyle));
+	Text::Block plainBlock(
+		plain,
+		L"\u05d2\u05d1\u05d0",
+		Text::Options::fromStyle(plainStyle));
+
+	auto rect1 = shapedBlock.slot().rect;
+	auto rect2 = plainBlock.slot().rect;
+	auto same = rect1 == rect2
+		&& textureBytes(shaped) == textureBytes(plain);
+	std::cout << "right to left runs drawn in visual order: "
+		<< (same ? "yes" : "no") << std::endl;
+	return same ? 0 : 1;
+}
+#endif
+
 int main()
 {
     test3();
+    if (testSetText() != 0)
+        return 1;
+    if (testKerningCache() != 0)
+        return 1;
+    if (testRecolor() != 0)
+        return 1;
+    if (testMissingFont() != 0)
+        return 1;
+    if (testVirtualBlock() != 0)
+        return 1;
+#ifdef XT_HAS_HARFBUZZ
+    if (testShaping() != 0)
+        return 1;
+    if (testRightToLeft() != 0)
+        return 1;
+#endif
+    return testSharedFonts();
 }
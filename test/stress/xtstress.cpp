@@ -0,0 +1,435 @@
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CrossText.hpp"
+
+using namespace xt;
+
+/*
+xtstress churns RectangleOrganizer with seeded random claims and releases and
+checks it after every step. A shadow copy of the texture says whether a
+claimed rect is really free, and RectangleOrganizer::verify() checks the
+spacial index, y cache and slot map against each other.
+
+usage: xtstress [--ops <count>] [--seed <n>] [--verify-every <n>]
+	[--baseline <path>] [--write-baseline] [--tolerance <fraction>]
+
+Each scenario reports organizer operations per second, leaving out the
+checks, and how full the texture gets before claims fail. The run fails when a
+check fails or when a scenario is slower or packs less than its line in the
+baseline file. Throughput is allowed to drop by the tolerance, 25% unless
+given, since it depends on the machine. --write-baseline records this run as
+the new baseline instead of comparing against it.
+*/
+
+#ifndef XTSTRESS_BASELINE
+#define XTSTRESS_BASELINE "baseline.txt"
+#endif
+
+#define DEFAULT_OPS 1000000
+#define DEFAULT_SEED 42
+#define DEFAULT_TOLERANCE 0.25
+#define FILL_TOLERANCE 0.001
+
+struct Scenario
+{
+	std::string name;
+	Size texture;
+	Size minSize;
+	Size maxSize;
+	OrganizerOptions organizer;
+};
+
+struct StressOptions
+{
+	uint64_t ops;
+	uint64_t seed;
+	uint64_t verifyEvery;
+};
+
+struct StressResult
+{
+	std::string name;
+	uint64_t ops;
+	uint64_t seed;
+	double opsPerSecond;
+	double fillRatio;
+};
+
+// Which pixels are claimed, kept apart from the organizer to check it by
+class ShadowTexture
+{
+public:
+	ShadowTexture(Size size) :
+		_size(size),
+		_pixels(static_cast<size_t>(size.width) * size.height, 0),
+		_usedArea(0)
+	{ }
+
+	bool isFree(Rect rect) const
+	{
+		for (auto y = rect.y; y < rect.y + rect.height; y++)
+		{
+			auto row = &_pixels[static_cast<size_t>(y) * _size.width];
+			for (auto x = rect.x; x < rect.x + rect.width; x++)
+			{
+				if (row[x])
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	void fill(Rect rect, uint8_t value)
+	{
+		for (auto y = rect.y; y < rect.y + rect.height; y++)
+		{
+			auto row = &_pixels[static_cast<size_t>(y) * _size.width];
+			std::fill(row + rect.x, row + rect.x + rect.width, value);
+		}
+
+		auto area = uint64_t{ rect.width } * rect.height;
+		_usedArea = value ? _usedArea + area : _usedArea - area;
+	}
+
+	double fillRatio() const
+	{
+		return static_cast<double>(_usedArea) / _pixels.size();
+	}
+
+private:
+	Size _size;
+	std::vector<uint8_t> _pixels;
+	uint64_t _usedArea;
+};
+
+bool fail(const Scenario &scenario, uint64_t op, const std::string &problem)
+{
+	std::cout << scenario.name << ": step " << op << ": " << problem
+		<< std::endl;
+	return false;
+}
+
+// Claims random sizes until one doesn't fit, then releases random slots
+// until half are gone and starts over, so the organizer keeps going from
+// part full to full with the free space more broken up every time. The fill
+// ratio is the mean share of the texture in use when a claim fails.
+bool runScenario(
+	const Scenario &scenario,
+	const StressOptions &options,
+	StressResult &result)
+{
+	std::mt19937_64 rng(options.seed);
+	auto randomSize = [&rng, &scenario]()
+	{
+		auto width = scenario.maxSize.width - scenario.minSize.width + 1;
+		auto height = scenario.maxSize.height - scenario.minSize.height + 1;
+		return Size{
+			scenario.minSize.width + static_cast<unsigned>(rng() % width),
+			scenario.minSize.height + static_cast<unsigned>(rng() % height) };
+	};
+
+	RectangleOrganizer organizer(scenario.texture, scenario.organizer);
+	ShadowTexture shadow(scenario.texture);
+	std::unordered_map<uint64_t, Rect> claimed;
+	std::vector<uint64_t> live;
+	uint64_t organizerNanos = 0;
+	double fillTotal = 0;
+	uint64_t fills = 0;
+	size_t drainTo = 0;
+	bool isFilling = true;
+	std::ostringstream problems;
+
+	for (uint64_t op = 0; op < options.ops; op++)
+	{
+		if (isFilling || live.size() <= drainTo)
+		{
+			isFilling = true;
+			auto size = randomSize();
+			WallTimer timer;
+			auto claim = organizer.tryClaimSlot(size);
+			organizerNanos += timer.nanos();
+
+			if (claim.isFound)
+			{
+				auto rect = claim.slot.rect;
+				if (rect.width != size.width || rect.height != size.height)
+				{
+					return fail(scenario, op, "claimed the wrong size");
+				}
+				if (rect.x + rect.width > scenario.texture.width
+					|| rect.y + rect.height > scenario.texture.height)
+				{
+					return fail(scenario, op, "claimed out of bounds");
+				}
+				if (!shadow.isFree(rect)
+					|| claimed.find(claim.slot.index) != claimed.end())
+				{
+					return fail(scenario, op, "claimed a used slot");
+				}
+
+				shadow.fill(rect, 1);
+				claimed[claim.slot.index] = rect;
+				live.push_back(claim.slot.index);
+			}
+			else
+			{
+				fillTotal += shadow.fillRatio();
+				fills++;
+				drainTo = live.size() / 2;
+				isFilling = false;
+			}
+		}
+		else
+		{
+			auto victim = static_cast<size_t>(rng() % live.size());
+			auto slotIndex = live[victim];
+			WallTimer timer;
+			auto released = organizer.releaseSlot(slotIndex);
+			organizerNanos += timer.nanos();
+
+			if (!released)
+			{
+				return fail(scenario, op, "couldn't release a claimed slot");
+			}
+
+			shadow.fill(claimed[slotIndex], 0);
+			claimed.erase(slotIndex);
+			live[victim] = live.back();
+			live.pop_back();
+		}
+
+		if (options.verifyEvery > 0
+			&& (op + 1) % options.verifyEvery == 0
+			&& !organizer.verify(problems))
+		{
+			return fail(scenario, op, problems.str());
+		}
+	}
+
+	if (!organizer.verify(problems))
+	{
+		return fail(scenario, options.ops, problems.str());
+	}
+
+	result = {
+		scenario.name,
+		options.ops,
+		options.seed,
+		options.ops / (organizerNanos / 1000000000.0),
+		fills > 0 ? fillTotal / fills : shadow.fillRatio() };
+	return true;
+}
+
+// One line per scenario: name ops seed opsPerSecond fillRatio. Lines
+// starting with # are comments.
+bool readBaseline(
+	const std::string &path,
+	std::unordered_map<std::string, StressResult> &baseline)
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		std::cout << "failed to open '" << path << "'" << std::endl;
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		StressResult result;
+		std::istringstream fields(line);
+		if (!(fields >> result.name >> result.ops >> result.seed
+			>> result.opsPerSecond >> result.fillRatio))
+		{
+			std::cout << "failed to read baseline line '" << line << "'"
+				<< std::endl;
+			return false;
+		}
+		baseline[result.name] = result;
+	}
+
+	return true;
+}
+
+bool writeBaseline(
+	const std::string &path,
+	const std::vector<StressResult> &results)
+{
+	std::ofstream out(path);
+	if (!out)
+	{
+		std::cout << "failed to open '" << path << "'" << std::endl;
+		return false;
+	}
+
+#ifdef NDEBUG
+	out << "# recorded from a release build\n";
+#else
+	out << "# recorded from a debug build\n";
+#endif
+	out << "# scenario ops seed opsPerSecond fillRatio\n";
+	for (auto &result : results)
+	{
+		out << result.name << " " << result.ops << " " << result.seed << " "
+			<< std::fixed << std::setprecision(0) << result.opsPerSecond
+			<< " " << std::setprecision(4) << result.fillRatio << "\n";
+	}
+	return out.good();
+}
+
+bool compareToBaseline(
+	const StressResult &result,
+	const std::unordered_map<std::string, StressResult> &baseline,
+	double tolerance)
+{
+	auto found = baseline.find(result.name);
+	if (found == baseline.end())
+	{
+		std::cout << result.name << ": no baseline" << std::endl;
+		return true;
+	}
+
+	// Packing only repeats for the same operations
+	auto &expected = found->second;
+	auto sameRun = expected.ops == result.ops && expected.seed == result.seed;
+	auto slow = result.opsPerSecond < expected.opsPerSecond * (1 - tolerance);
+	auto sparse = sameRun
+		&& result.fillRatio < expected.fillRatio - FILL_TOLERANCE;
+
+	if (slow)
+	{
+		std::cout << result.name << ": " << std::fixed << std::setprecision(0)
+			<< result.opsPerSecond << " ops/s is below the baseline of "
+			<< expected.opsPerSecond << std::endl;
+	}
+	if (sparse)
+	{
+		std::cout << result.name << ": " << std::fixed << std::setprecision(4)
+			<< result.fillRatio << " fill is below the baseline of "
+			<< expected.fillRatio << std::endl;
+	}
+	if (!sameRun)
+	{
+		std::cout << result.name << ": baseline was recorded with other ops "
+			<< "or seed, only throughput is compared" << std::endl;
+	}
+
+	return !slow && !sparse;
+}
+
+int main(int argc, char **argv)
+{
+	StressOptions options{ DEFAULT_OPS, DEFAULT_SEED, 1 };
+	std::string baselinePath(XTSTRESS_BASELINE);
+	bool shouldWriteBaseline = false;
+	double tolerance = DEFAULT_TOLERANCE;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string flag(argv[i]);
+		if (flag == "--write-baseline")
+		{
+			shouldWriteBaseline = true;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+		{
+			std::cout << "missing value for '" << flag << "'" << std::endl;
+			return 1;
+		}
+
+		std::string value(argv[++i]);
+		if (flag == "--ops")
+		{
+			options.ops = std::stoull(value);
+		}
+		else if (flag == "--seed")
+		{
+			options.seed = std::stoull(value);
+		}
+		else if (flag == "--verify-every")
+		{
+			options.verifyEvery = std::stoull(value);
+		}
+		else if (flag == "--baseline")
+		{
+			baselinePath = value;
+		}
+		else if (flag == "--tolerance")
+		{
+			tolerance = std::stod(value);
+		}
+		else
+		{
+			std::cout << "unknown option '" << flag << "'" << std::endl;
+			return 1;
+		}
+	}
+
+	// Labels are single lines of a few font sizes, once without shelves and
+	// once with every label on one
+	OrganizerOptions shelves;
+	shelves.shelfMaxHeight = 20;
+	std::vector<Scenario> scenarios
+	{
+		{ "glyphs", { 1024, 1024 }, { 8, 8 }, { 128, 32 }, {} },
+		{ "lines", { 1024, 1024 }, { 64, 12 }, { 1024, 24 }, {} },
+		{ "small", { 256, 256 }, { 2, 2 }, { 24, 24 }, {} },
+		{ "labels", { 1024, 1024 }, { 16, 14 }, { 200, 20 }, {} },
+		{ "shelves", { 1024, 1024 }, { 16, 14 }, { 200, 20 }, shelves },
+	};
+
+#ifndef NDEBUG
+	std::cout << "not an optimized build, throughput won't match a "
+		<< "baseline from a release build" << std::endl;
+#endif
+
+	std::vector<StressResult> results;
+	for (auto &scenario : scenarios)
+	{
+		StressResult result;
+		if (!runScenario(scenario, options, result))
+		{
+			return 1;
+		}
+
+		std::cout << std::left << std::setw(8) << result.name << std::right
+			<< std::fixed << std::setprecision(0)
+			<< std::setw(12) << result.opsPerSecond << " ops/s"
+			<< std::setprecision(4) << "  fill " << result.fillRatio
+			<< std::endl;
+		results.push_back(result);
+	}
+
+	if (shouldWriteBaseline)
+	{
+		return writeBaseline(baselinePath, results) ? 0 : 1;
+	}
+
+	std::unordered_map<std::string, StressResult> baseline;
+	if (!readBaseline(baselinePath, baseline))
+	{
+		return 1;
+	}
+
+	bool passed = true;
+	for (auto &result : results)
+	{
+		passed = compareToBaseline(result, baseline, tolerance) && passed;
+	}
+
+	return passed ? 0 : 1;
+}
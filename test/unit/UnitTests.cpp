@@ -1,7 +1,15 @@
 #include <string>
+#include <cstdio>
 #include <iostream>
+#include <fstream>
 #include <functional>
+#include <random>
+#include <sstream>
+#include <thread>
 #include "CrossText.hpp"
+#include "MmapWriter.hpp"
+#include "BakedAtlas.hpp"
+#include "MappedDocument.hpp"
 
 using namespace xt;
 
@@ -65,7 +73,7 @@ int summary()
 }
 
 void applyChars(
-	TextLayout &layout, std::wstring text, Size size, unsigned kerning)
+	TextLayout &layout, std::wstring text, Size size, int kerning)
 {
 	for (auto &ch : text)
 	{
@@ -73,6 +81,195 @@ void applyChars(
 	}
 }
 
+// Minimal text system so TextManager and TextBlock can be tested without a
+// font backend. Every char is 10x10 and rendering just counts chars.
+
+struct FakeFont
+{
+	uint64_t id;
+
+	uint64_t faceId() const { return id; }
+};
+
+class FakeSysContext
+{
+public:
+	FakeSysContext(TextManagerOptions options) { }
+
+	unsigned measuredChars = 0;
+};
+
+class FakeImageData
+{
+public:
+	FakeImageData(Size size) : _size(size), _pixels(size.width * size.height)
+	{ }
+
+	void setPixel(
+		unsigned x, unsigned y, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+	{
+		_pixels[y * _size.width + x] = a;
+	}
+
+	void write(std::vector<uint8_t> pixels, Rect rect)
+	{
+		for (unsigned y = 0; y < rect.height; y++)
+		{
+			for (unsigned x = 0; x < rect.width; x++)
+			{
+				_pixels[(rect.y + y) * _size.width + rect.x + x] =
+					pixels[(y * rect.width + x) * 4 + 3];
+			}
+		}
+		writtenPixels += rect.width * rect.height;
+	}
+
+	void commit() { }
+	void clear() { std::fill(_pixels.begin(), _pixels.end(), 0); }
+	Size size() const { return _size; }
+	uint8_t alphaAt(unsigned x, unsigned y) const
+	{
+		return _pixels[y * _size.width + x];
+	}
+
+	void save(std::ostream &out) const
+	{
+		writeBinary(out, _size);
+		out.write(
+			reinterpret_cast<const char *>(_pixels.data()), _pixels.size());
+	}
+
+	bool load(std::istream &in)
+	{
+		Size size;
+		if (!readBinary(in, size) || size.width != _size.width)
+		{
+			return false;
+		}
+		in.read(reinterpret_cast<char *>(_pixels.data()), _pixels.size());
+		return in.good();
+	}
+
+	unsigned renderedChars = 0;
+	unsigned writtenPixels = 0;
+
+private:
+	Size _size;
+	std::vector<uint8_t> _pixels;
+};
+
+class FakeMetricBuilder
+{
+public:
+	FakeMetricBuilder(FakeSysContext &context, TextLayout &layout) :
+		_context(context), _layout(layout)
+	{ }
+
+	void onRun(
+		FakeFont *font,
+		float size,
+		Brush foreground,
+		const wchar_t *text,
+		size_t length)
+	{
+		_context.measuredChars += static_cast<unsigned>(length);
+		for (size_t i = 0; i < length; i++)
+		{
+			_layout.nextChar(text[i], { 10, 10 }, 0);
+		}
+	}
+
+	TextBlockMetrics done() { return _layout.metrics(); }
+
+private:
+	FakeSysContext &_context;
+	TextLayout &_layout;
+};
+
+class FakeCharRenderer
+{
+public:
+	FakeCharRenderer(
+		FakeSysContext &context,
+		FakeImageData &imageData,
+		Rect rect,
+		TextBlockMetrics &metrics,
+		unsigned firstLine,
+		CoverageBuffer *coverage) :
+		_imageData(imageData),
+		_rect(rect),
+		_metrics(metrics),
+		_coverage(coverage),
+		_row(firstLine),
+		_column(0),
+		_charIndex(0)
+	{
+		for (unsigned i = 0; i < firstLine; i++)
+		{
+			_charIndex += metrics.lines[i].chars;
+		}
+	}
+
+	void onRun(
+		FakeFont *font,
+		float size,
+		Brush foreground,
+		const wchar_t *text,
+		size_t length)
+	{
+		_imageData.setPixel(
+			_rect.x, _rect.y, 0, 0, 0, foreground.color.alphaByte());
+		_imageData.renderedChars += length;
+
+		if (!_coverage)
+		{
+			return;
+		}
+
+		// Every char is 10 wide, like the metric builder lays them out
+		_coverage->accumulate(0, 0, 0xff);
+		for (size_t i = 0; i < length && _row < _metrics.lines.size(); i++)
+		{
+			_coverage->setCharX(_charIndex++, _column * 10);
+			if (++_column == _metrics.lines[_row].chars)
+			{
+				_column = 0;
+				_row++;
+			}
+		}
+	}
+
+private:
+	FakeImageData &_imageData;
+	Rect _rect;
+	TextBlockMetrics &_metrics;
+	CoverageBuffer *_coverage;
+	unsigned _row;
+	unsigned _column;
+	unsigned _charIndex;
+};
+
+struct FakeSystem
+{
+	using SysContext = FakeSysContext;
+	using MetricBuilder = FakeMetricBuilder;
+	using CharRenderer = FakeCharRenderer;
+	using Font = FakeFont;
+	using ImageData = FakeImageData;
+};
+
+using FakeText = TextPlatform<FakeSystem>;
+
+std::vector<FakeImageData> fakeTextures(unsigned count, Size size)
+{
+	std::vector<FakeImageData> textures;
+	for (unsigned i = 0; i < count; i++)
+	{
+		textures.push_back(FakeImageData(size));
+	}
+	return textures;
+}
+
 int main()
 {
 	// TextLayout
@@ -106,7 +303,7 @@ int main()
 		applyChars(layout, L"wasd", { 8, 8 }, 0);
 		auto metrics = layout.metrics();
 
-		assertEqual("width", 30u, metrics.size.width);
+		assertEqual("width", 24u, metrics.size.width);
 		assertEqual("height", 16u, metrics.size.height);
 		assertEqual("line count", size_t{2}, metrics.lines.size());
 		assertEqual("1st line char count", 3u, metrics.lines.at(0).chars);
@@ -136,7 +333,7 @@ int main()
 		applyChars(layout, L"was qwe", { 8, 8 }, 0);
 		auto metrics = layout.metrics();
 
-		assertEqual("width", 45u, metrics.size.width);
+		assertEqual("width", 32u, metrics.size.width);
 		assertEqual("height", 16u, metrics.size.height);
 		assertEqual("line count", size_t{2}, metrics.lines.size());
 		assertEqual("1st line char count", 4u, metrics.lines.at(0).chars);
@@ -240,7 +437,7 @@ int main()
 			0);
 		auto metrics = layout.metrics();
 
-		assertEqual("width", 105u, metrics.size.width);
+		assertEqual("width", 100u, metrics.size.width);
 		assertEqual("height", 40u, metrics.size.height);
 		assertEqual("line count", size_t{4}, metrics.lines.size());
 		assertEqual("1st line char count", 6u, metrics.lines.at(0).chars);
@@ -275,7 +472,7 @@ int main()
 		applyChars(layout, L"WORLD", { 12, 12 }, 0);
 		applyChars(layout, L"!", { 30, 30 }, 0);
 		auto metrics = layout.metrics();
-		assertEqual("width", 100u, metrics.size.width);
+		assertEqual("width", 90u, metrics.size.width);
 		assertEqual("height", 50u, metrics.size.height);
 		assertEqual("line count", size_t{2}, metrics.lines.size());
 		assertEqual("1st line char count", 6u, metrics.lines.at(0).chars);
@@ -291,7 +488,7 @@ int main()
 		applyChars(layout, L"D", { 10, 10 }, 2);
 		applyChars(layout, L"fg", { 10, 10 }, 3);
 		auto metrics = layout.metrics();
-		assertEqual("width", 50u, metrics.size.width);
+		assertEqual("width", 58u, metrics.size.width);
 		assertEqual("height", 10u, metrics.size.height);
 		assertEqual("line count", size_t{1}, metrics.lines.size());
 		assertEqual("1st line char count", 5u, metrics.lines.at(0).chars);
@@ -306,7 +503,7 @@ int main()
 		applyChars(layout, L" ", { 10, 10 }, 0);
 		applyChars(layout, L"12345", { 10, 12 }, 0);
 		auto metrics = layout.metrics();
-		assertEqual("width", 115u, metrics.size.width);
+		assertEqual("width", 66u, metrics.size.width);
 		assertEqual("height", 32u, metrics.size.height);
 		assertEqual("line count", size_t{3}, metrics.lines.size());
 		assertEqual("1st line char count", 6u, metrics.lines.at(0).chars);
@@ -317,6 +514,16 @@ int main()
 		assertEqual("3rd line height", 12u, metrics.lines.at(2).height);
 	});
 
+	test("TextLayout: negative kerning", []()
+	{
+		TextLayout layout({ 38, 38 });
+		applyChars(layout, L"A", { 10, 10 }, 0);
+		applyChars(layout, L"VAV", { 10, 10 }, -1);
+		auto metrics = layout.metrics();
+		assertEqual("line count", size_t{1}, metrics.lines.size());
+		assertEqual("1st line char count", 4u, metrics.lines.at(0).chars);
+	});
+
 	test("TextLayout: kerning wrap letter", []()
 	{
 		TextLayout layout({ 105, 105 });
@@ -324,7 +531,7 @@ int main()
 		applyChars(layout, L"d", { 10, 10 }, 6);
 		applyChars(layout, L" 12345678", { 10, 10 }, 0);
 		auto metrics = layout.metrics();
-		assertEqual("width", 105u, metrics.size.width);
+		assertEqual("width", 100u, metrics.size.width);
 		assertEqual("height", 20u, metrics.size.height);
 		assertEqual("line count", size_t{2}, metrics.lines.size());
 		assertEqual("1st line char count", 9u, metrics.lines.at(0).chars);
@@ -333,6 +540,841 @@ int main()
 		assertEqual("2nd line height", 10u, metrics.lines.at(1).height);
 	});
 
+	test("TextLayout: rewind matches a fresh layout", []()
+	{
+		TextLayout edited({ 55, 100 });
+		applyChars(edited, L"aaaa bbbb cccc", { 10, 10 }, 0);
+		auto resumeAt = edited.resumePoint(7);
+		assertEqual("resume point", 5u, resumeAt);
+
+		edited.rewind(resumeAt);
+		applyChars(edited, L" xx yyyyyy", { 10, 10 }, 0);
+
+		TextLayout fresh({ 55, 100 });
+		applyChars(fresh, L"aaaa xx yyyyyy", { 10, 10 }, 0);
+
+		auto a = edited.metrics();
+		auto b = fresh.metrics();
+		assertEqual("char count", fresh.charCount(), edited.charCount());
+		assertEqual("line count", b.lines.size(), a.lines.size());
+		for (unsigned i = 0; i < b.lines.size(); i++)
+		{
+			assertEqual("line chars", b.lines[i].chars, a.lines[i].chars);
+		}
+	});
+
+	// Text decoding
+
+	test("Utf8Decoder: ascii and multi-byte chars", []()
+	{
+		// 20 ASCII chars to hit the 16 byte path, then 2, 3 and 4 byte chars
+		std::string text(
+			"abcdefghijklmnopqrst"
+			"\xc3\xa9" "\xe2\x82\xac" "\xf0\x9f\x98\x80" "!");
+		Utf8Decoder decoder(text);
+		assertEqual("length", 24u, decoder.length());
+
+		std::wstring decoded;
+		const wchar_t *chars;
+		size_t count;
+		while ((count = decoder.read(5, chars)) > 0)
+		{
+			decoded.append(chars, count);
+		}
+
+		assertEqual("decoded length", size_t{24}, decoded.size());
+		assertTrue("ascii", decoded.substr(0, 20) == L"abcdefghijklmnopqrst");
+		assertEqual("2 byte", 0xe9u, static_cast<unsigned>(decoded[20]));
+		assertEqual("3 byte", 0x20acu, static_cast<unsigned>(decoded[21]));
+		assertEqual("4 byte", 0x1f600u, static_cast<unsigned>(decoded[22]));
+		assertEqual("last", static_cast<unsigned>('!'),
+			static_cast<unsigned>(decoded[23]));
+	});
+
+	test("Utf8Decoder: malformed input", []()
+	{
+		std::string text("a\x80\xc3(\xe2\x82");
+		Utf8Decoder decoder(text);
+		assertEqual("length", 6u, decoder.length());
+
+		const wchar_t *chars;
+		auto count = decoder.read(100, chars);
+		assertEqual("count", size_t{6}, count);
+		assertEqual("stray continuation", 0xfffdu,
+			static_cast<unsigned>(chars[1]));
+		assertEqual("bad continuation", 0xfffdu,
+			static_cast<unsigned>(chars[2]));
+		assertEqual("resync", static_cast<unsigned>('('),
+			static_cast<unsigned>(chars[3]));
+		assertEqual("truncated", 0xfffdu, static_cast<unsigned>(chars[4]));
+	});
+
+	test("Utf16Decoder: surrogate pairs", []()
+	{
+		std::u16string text(u"a\U0001F600b");
+		text.push_back(0xd800);
+		Utf16Decoder decoder(text);
+		assertEqual("length", 4u, decoder.length());
+
+		const wchar_t *chars;
+		auto count = decoder.read(100, chars);
+		assertEqual("count", size_t{4}, count);
+		assertEqual("pair", 0x1f600u, static_cast<unsigned>(chars[1]));
+		assertEqual("lone surrogate", 0xfffdu,
+			static_cast<unsigned>(chars[3]));
+	});
+
+	test("Decoders: chars outside the basic plane match std::wstring", []()
+	{
+		// Surrogate pairs where wchar_t is 16 bits, single chars elsewhere.
+		// Reading one char at a time splits any pair across reads.
+		std::wstring expected(L"a\U0001F600b\U00010348");
+		std::string utf8("a\xf0\x9f\x98\x80" "b\xf0\x90\x8d\x88");
+		std::u16string utf16(u"a\U0001F600b\U00010348");
+		std::u32string utf32(U"a\U0001F600b\U00010348");
+
+		auto readAll = [](auto decoder)
+		{
+			std::wstring decoded;
+			const wchar_t *chars;
+			size_t count;
+			while ((count = decoder.read(1, chars)) > 0)
+			{
+				decoded.append(chars, count);
+			}
+			assertEqual("length", static_cast<unsigned>(decoded.size()),
+				decoder.length());
+			return decoded;
+		};
+
+		assertTrue("utf8", readAll(Utf8Decoder(utf8)) == expected);
+		assertTrue("utf16", readAll(Utf16Decoder(utf16)) == expected);
+		assertTrue("utf32", readAll(Utf32Decoder(utf32)) == expected);
+	});
+
+	test("TextBlock: UTF-8 text matches wide text", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style)
+			.withStyleRanges({ { style.withSize(20.0f), { 1, 2 } } });
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+
+		std::string utf8("h\xc3\xa9llo world");
+		FakeText::Block fromUtf8(manager, textView(utf8), options);
+		FakeText::Block fromWide(manager, L"h\u00e9llo world", options);
+
+		auto &utf8Lines = fromUtf8.metrics().lines;
+		auto &wideLines = fromWide.metrics().lines;
+		assertEqual("same size", fromWide.metrics().size.width,
+			fromUtf8.metrics().size.width);
+		assertEqual("same line count", wideLines.size(), utf8Lines.size());
+		assertEqual(
+			"same first line", wideLines[0].chars, utf8Lines[0].chars);
+		assertEqual("rendered chars", 22u,
+			manager.textures()[0].imageData().renderedChars);
+	});
+
+	test("TextBlock: setText only renders changed lines", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style)
+			.withEditable(true);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		auto &imageData = manager.textures()[0].imageData();
+
+		FakeText::Block block(manager, L"aaaa bbbb cccc dddd", options);
+		auto slot = block.slot();
+		assertEqual("line count", size_t{2}, block.metrics().lines.size());
+		assertEqual("first render", 19u, imageData.renderedChars);
+
+		block.setText(L"aaaa bbbb cccc eeee");
+		assertEqual("same slot", slot.index, block.slot().index);
+		assertEqual("last line only", 19u + 9u, imageData.renderedChars);
+
+		block.setText(L"xaaa bbbb cccc eeee");
+		assertEqual("first line only", 28u + 10u, imageData.renderedChars);
+
+		block.setText(L"xaaa bbbb cccc eeee");
+		assertEqual("no change", 38u, imageData.renderedChars);
+		assertTrue("text", block.text() == L"xaaa bbbb cccc eeee");
+	});
+
+	test("TextBlock: a block that isn't editable keeps no text", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		auto &imageData = manager.textures()[0].imageData();
+
+		std::string utf8("aaaa bbbb cccc dddd");
+		FakeText::Block block(manager, textView(utf8), options);
+		auto slot = block.slot();
+		assertTrue("no text kept", block.text().empty());
+		assertEqual("first render", 19u, imageData.renderedChars);
+
+		// With nothing to compare against the first edit draws everything
+		block.setText(L"aaaa bbbb cccc eeee");
+		assertEqual("same slot", slot.index, block.slot().index);
+		assertEqual("all lines", 19u + 19u, imageData.renderedChars);
+		assertTrue("text kept", block.text() == L"aaaa bbbb cccc eeee");
+
+		block.setText(L"xaaa bbbb cccc eeee");
+		assertEqual("first line only", 38u + 10u, imageData.renderedChars);
+
+		FakeText::Block fresh(manager, L"xaaa bbbb cccc eeee", options);
+		assertEqual("width", fresh.metrics().size.width,
+			block.metrics().size.width);
+		assertEqual("height", fresh.metrics().size.height,
+			block.metrics().size.height);
+	});
+
+	test("TextBlock: setText moves to a new slot when it grows", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+
+		FakeText::Block block(manager, L"aaaa", options);
+		block.setText(L"aaaa bbbb cccc");
+
+		FakeText::Block fresh(manager, L"aaaa bbbb cccc", options);
+		assertEqual("width", fresh.metrics().size.width,
+			block.metrics().size.width);
+		assertEqual("height", fresh.metrics().size.height,
+			block.metrics().size.height);
+		assertEqual("slot width", 100u, block.slot().rect.width);
+		assertEqual("slot height", 20u, block.slot().rect.height);
+	});
+
+	test("TextBlock: recolor retints a recolorable block in place", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style)
+			.withRecolorable(true)
+			.withEditable(true);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		auto &imageData = manager.textures()[0].imageData();
+
+		FakeText::Block block(manager, L"aaaa bbbb cccc dddd", options);
+		auto rect = block.slot().rect;
+		assertEqual("first render", 19u, imageData.renderedChars);
+
+		block.recolor({ 0, 4 }, { 0x00000080 });
+		assertEqual("nothing rendered", 19u, imageData.renderedChars);
+		assertEqual("first word only", 40u * 10u, imageData.writtenPixels);
+		assertEqual("retinted", 0x80u,
+			unsigned{ imageData.alphaAt(rect.x, rect.y) });
+
+		block.recolor({ 5, 100 }, { 0x00000040 });
+		assertEqual("still nothing rendered", 19u, imageData.renderedChars);
+		assertEqual("rest of both lines", 400u + 50u * 10u + 100u * 10u,
+			imageData.writtenPixels);
+		assertEqual("first word kept", 0x80u,
+			unsigned{ imageData.alphaAt(rect.x, rect.y) });
+
+		block.setText(L"aaaa bbbb cccc eeee");
+		assertEqual("last line rendered", 19u + 9u, imageData.renderedChars);
+		block.recolor({ 0, 19 }, { 0x000000ff });
+		assertEqual("retinted after setText", 28u, imageData.renderedChars);
+		assertEqual("back to the base color", 0xffu,
+			unsigned{ imageData.alphaAt(rect.x, rect.y) });
+	});
+
+	test("TextBlock: recolor renders lines again without coverage", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style)
+			.withEditable(true);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		auto &imageData = manager.textures()[0].imageData();
+
+		FakeText::Block block(manager, L"aaaa bbbb cccc dddd", options);
+		auto rect = block.slot().rect;
+
+		block.recolor({ 15, 4 }, { 0x00000040 });
+		assertEqual("last line only", 19u + 9u, imageData.renderedChars);
+		assertEqual("no pixels written", 0u, imageData.writtenPixels);
+
+		block.recolor({ 0, 19 }, { 0x00000080 });
+		assertEqual("both lines", 28u + 19u, imageData.renderedChars);
+		assertEqual("recolored", 0x80u,
+			unsigned{ imageData.alphaAt(rect.x, rect.y) });
+	});
+
+	// VirtualTextBlock
+
+	test("VirtualTextBlock: only places lines in the window", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		auto &imageData = manager.textures()[0].imageData();
+
+		std::wstring text;
+		for (unsigned i = 0; i < 100; i++)
+		{
+			text += L"aaaa ";
+		}
+
+		FakeText::VirtualBlock block(manager, text, options);
+		assertEqual("line count", 50u, block.lineCount());
+		assertEqual("height", 500u, block.metrics().size.height);
+		assertEqual("nothing rendered", 0u, imageData.renderedChars);
+
+		block.setVisibleLines(0, 5);
+		assertEqual("first window", 50u, imageData.renderedChars);
+		auto slot = block.linePlacement(3).slot;
+
+		block.setVisibleLines(3, 5);
+		assertEqual("only new lines", 80u, imageData.renderedChars);
+		assertEqual("kept slot", slot.index,
+			block.linePlacement(3).slot.index);
+		assertTrue("left the window", !block.linePlacement(0).isFound);
+
+		// Needs the whole texture, so every old line has to be released
+		block.setVisibleLines(40, 10);
+		assertEqual("whole window", 180u, imageData.renderedChars);
+		assertTrue("first fits", block.linePlacement(40).isFound);
+		assertTrue("last fits", block.linePlacement(49).isFound);
+
+		block.setVisibleLines(45, 100);
+		assertEqual("clamped", 5u, block.visibleLines().length);
+		assertEqual("nothing new", 180u, imageData.renderedChars);
+	});
+
+	test("VirtualTextBlock: lines at rows", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+
+		FakeText::VirtualBlock block(
+			manager, L"aaaa bbbb cccc dddd eeee ffff gggg", options);
+		assertEqual("line count", 4u, block.lineCount());
+		assertEqual("line width", 100u, block.lineWidth(0));
+		assertEqual("last line width", 40u, block.lineWidth(3));
+
+		auto lines = block.linesAt(15, 10);
+		assertEqual("first", 1u, lines.start);
+		assertEqual("count", 2u, lines.length);
+
+		lines = block.linesAt(30, 100);
+		assertEqual("last only", 3u, lines.start);
+		assertEqual("last count", 1u, lines.length);
+		assertEqual("past the end", 0u, block.linesAt(40, 10).length);
+	});
+
+	// PipelineStats
+
+	test("PipelineStats: stages are counted per block", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		auto &stats = manager.stats();
+
+		FakeText::Block block(manager, L"aaaa bbbb cccc dddd", options);
+		assertEqual("metrics", uint64_t{1}, stats.metrics.count);
+		assertEqual("placement", uint64_t{1}, stats.placement.count);
+		assertEqual("render", uint64_t{1}, stats.render.count);
+		assertEqual("commit", uint64_t{1}, stats.commit.count);
+		assertTrue("max within total",
+			stats.render.maxNanos <= stats.render.totalNanos);
+
+		FakeText::Block tooBig(manager, std::wstring(200, 'x'), options);
+		assertEqual("failed placement", uint64_t{1}, stats.failedPlacements);
+		assertEqual("not rendered", uint64_t{1}, stats.render.count);
+
+		manager.measure(L"aaaa", options, 100);
+		assertEqual("measure miss", uint64_t{3}, stats.metrics.count);
+
+		manager.resetStats();
+		assertEqual("reset", uint64_t{0}, stats.placement.count);
+		assertEqual("reset failures", uint64_t{0}, stats.failedPlacements);
+	});
+
+	test("PipelineStats: timers", []()
+	{
+		WallTimer wall;
+		ThreadCpuTimer cpu;
+		volatile unsigned sink = 0;
+		for (unsigned i = 0; i < 1000000; i++)
+		{
+			sink = sink + i;
+		}
+
+		assertTrue("wall time passes", wall.nanos() > 0);
+		assertTrue("thread time passes", cpu.nanos() > 0);
+
+		StageStats stage{};
+		stage.record(3000000);
+		stage.record(1000000);
+		assertEqual("count", uint64_t{2}, stage.count);
+		assertEqual("max", 3.0, stage.maxMillis());
+		assertEqual("mean", 2.0, stage.meanMillis());
+	});
+
+	// TraceSink
+
+	test("TraceSink: pipeline scopes as Chrome trace events", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+
+		auto sink = std::make_shared<TraceSink>();
+		TraceSink::install(sink);
+		FakeText::Block block(manager, L"aaaa bbbb", options);
+		TraceSink::install(nullptr);
+		FakeText::Block untraced(manager, L"cccc", options);
+
+		unsigned begins = 0;
+		unsigned ends = 0;
+		std::string names;
+		for (auto &entry : sink->events())
+		{
+			begins += entry.second.phase == 'B';
+			ends += entry.second.phase == 'E';
+			names += std::string(entry.second.name) + ";";
+		}
+		assertEqual("begins", 5u, begins);
+		assertEqual("ends", 5u, ends);
+		assertTrue("placement traced",
+			names.find("TextManager::findPlacement") != std::string::npos);
+		assertTrue("claim traced", names.find(
+			"RectangleOrganizer::tryClaimSlot") != std::string::npos);
+		assertTrue("metrics traced",
+			names.find("TextBlock::metrics") != std::string::npos);
+		assertTrue("render traced",
+			names.find("TextBlock::render") != std::string::npos);
+		assertTrue("commit traced",
+			names.find("ImageData::commit") != std::string::npos);
+
+		std::ostringstream json;
+		assertTrue("written", sink->writeJson(json));
+		assertTrue("args written", json.str().find(
+			"\"name\":\"RectangleOrganizer::tryClaimSlot\",\"ph\":\"B\"")
+			!= std::string::npos
+			&& json.str().find("\"args\":{\"width\":90,\"height\":10}")
+				!= std::string::npos);
+	});
+
+	test("TraceSink: rings wrap per thread", []()
+	{
+		auto sink = std::make_shared<TraceSink>(8);
+		TraceSink::install(sink);
+		for (unsigned i = 0; i < 7; i++)
+		{
+			TraceScope scope("outer", "i", i);
+		}
+
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < 3; t++)
+		{
+			threads.emplace_back([]()
+			{
+				TraceScope scope("worker");
+			});
+		}
+		for (auto &thread : threads)
+		{
+			thread.join();
+		}
+		TraceSink::install(nullptr);
+
+		auto events = sink->events();
+		assertEqual("kept events", size_t{8 + 3 * 2}, events.size());
+		assertEqual("dropped", uint64_t{6}, sink->dropped());
+		assertEqual("newest last", int64_t{6}, events[6].second.args[0]);
+
+		std::ostringstream json;
+		sink->writeJson(json);
+		auto text = json.str();
+		size_t ends = 0;
+		for (auto at = text.find("\"E\""); at != std::string::npos;
+			at = text.find("\"E\"", at + 1))
+		{
+			ends++;
+		}
+		assertEqual("balanced ends", size_t{4 + 3}, ends);
+		assertTrue("worker thread",
+			text.find("\"tid\":4") != std::string::npos);
+	});
+
+	test("TraceSink: open scopes keep their sink", []()
+	{
+		auto sink = std::make_shared<TraceSink>();
+		std::weak_ptr<TraceSink> released(sink);
+		TraceSink::install(sink);
+		{
+			TraceScope scope("open");
+			TraceSink::install(nullptr);
+			sink.reset();
+			assertTrue("kept while open", !released.expired());
+		}
+		assertTrue("released at the end", released.expired());
+		assertTrue("nothing installed", !TraceSink::installed());
+	});
+
+	test("TraceSink: scopes nest across an install", []()
+	{
+		auto first = std::make_shared<TraceSink>(16);
+		auto second = std::make_shared<TraceSink>(16);
+		TraceSink::install(first);
+		{
+			TraceScope outer("outer");
+			TraceSink::install(second);
+			{
+				TraceScope inner("inner");
+			}
+			TraceSink::install(first);
+			{
+				TraceScope again("again");
+			}
+		}
+		TraceSink::install(nullptr);
+
+		auto events = first->events();
+		assertEqual("first events", size_t{4}, events.size());
+		bool oneThread = true;
+		for (auto &entry : events)
+		{
+			oneThread = oneThread && entry.first == events[0].first;
+		}
+		assertTrue("one ring", oneThread);
+		assertTrue("outer ends last", events.back().second.phase == 'E'
+			&& std::string(events.back().second.name) == "outer");
+		assertEqual("second events", size_t{2}, second->events().size());
+
+		std::ostringstream json;
+		first->writeJson(json);
+		auto text = json.str();
+		assertTrue("outer end written",
+			text.find("{\"name\":\"outer\",\"ph\":\"E\"") != std::string::npos);
+	});
+
+	test("TraceSink: copies skip events being overwritten", []()
+	{
+		TraceRing ring(16, 1);
+		std::atomic<bool> done(false);
+		std::thread writer([&]()
+		{
+			for (int64_t i = 0; i < 200000; i++)
+			{
+				ring.push({ "torn", 'B', static_cast<uint64_t>(i), 2,
+					{ "a", "b" }, { i, -i } });
+			}
+			done = true;
+		});
+
+		bool consistent = true;
+		bool ordered = true;
+		std::vector<TraceEvent> events;
+		while (!done)
+		{
+			events.clear();
+			ring.copyTo(events);
+			for (size_t i = 0; i < events.size(); i++)
+			{
+				auto &event = events[i];
+				consistent = consistent && event.args[0] == -event.args[1]
+					&& event.nanos == static_cast<uint64_t>(event.args[0]);
+				ordered = ordered
+					&& (i == 0 || event.nanos > events[i - 1].nanos);
+			}
+		}
+		writer.join();
+
+		assertTrue("no torn events", consistent);
+		assertTrue("oldest first", ordered);
+		events.clear();
+		ring.copyTo(events);
+		assertEqual("full ring", size_t{16}, events.size());
+	});
+
+	// TextManager::measure
+
+	test("TextManager: measure matches a block", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+
+		FakeText::Block block(manager, L"aaaa bbbb cccc dddd", options);
+		auto metrics = manager.measure(L"aaaa bbbb cccc dddd", options, 100);
+		assertEqual("width", block.metrics().size.width, metrics.size.width);
+		assertEqual("height", block.metrics().size.height,
+			metrics.size.height);
+		assertEqual("line count", block.metrics().lines.size(),
+			metrics.lines.size());
+
+		auto narrow = manager.measure(L"aaaa bbbb cccc dddd", options, 50);
+		assertEqual("narrow width", 50u, narrow.size.width);
+		assertEqual("narrow line count", size_t{4}, narrow.lines.size());
+	});
+
+	test("TextManager: measure caches by text, size and width", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		auto &context = manager.sysContext();
+
+		manager.measure(L"hello", options, 100);
+		manager.measure(L"hello", options, 100);
+		assertEqual("laid out once", 5u, context.measuredChars);
+
+		auto recolored = options.withStyle(
+			style.withForeground({ 0xff0000ff }));
+		manager.measure(L"hello", recolored, 100);
+		assertEqual("color is not part of the key", 5u,
+			context.measuredChars);
+
+		manager.measure(L"hello", options, 30);
+		manager.measure(L"hello", options.withStyle(style.withSize(20)), 100);
+		manager.measure(textView(std::string("hello")), options, 100);
+		assertEqual("width and size are", 15u, context.measuredChars);
+		assertEqual("cached", size_t{3}, manager.measureCacheSize());
+
+		manager.clearMeasureCache();
+		manager.measure(L"hello", options, 100);
+		assertEqual("cleared", 20u, context.measuredChars);
+	});
+
+	test("TextManager: measure keys fonts by face", []()
+	{
+		FakeFont font{ 1 };
+		FakeFont copy{ 1 };
+		FakeFont other{ 2 };
+		auto style = FakeText::Style{ &font, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		auto &context = manager.sysContext();
+
+		manager.measure(L"hello", options, 100);
+		manager.measure(
+			L"hello", options.withStyle(style.withFont(&copy)), 100);
+		assertEqual("same face, other address", 5u, context.measuredChars);
+
+		manager.measure(
+			L"hello", options.withStyle(style.withFont(&other)), 100);
+		assertEqual("other face", 10u, context.measuredChars);
+
+		manager.measure(L"hellp", options, 100);
+		assertEqual("other text", 15u, context.measuredChars);
+	});
+
+	test("TextManager: measure cache is bounded", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		TextManagerOptions managerOptions{ { 100, 100 } };
+		managerOptions.measureCacheSize = 2;
+		FakeText::Manager manager(
+			managerOptions, fakeTextures(1, { 100, 100 }));
+
+		manager.measure(L"a", options, 100);
+		manager.measure(L"b", options, 100);
+		manager.measure(L"c", options, 100);
+		assertEqual("size", size_t{2}, manager.measureCacheSize());
+
+		manager.measure(L"a", options, 100);
+		assertEqual("evicted", 4u, manager.sysContext().measuredChars);
+	});
+
+	// LruCache
+
+	test("LruCache: evicts the least recently used entry", []()
+	{
+		LruCache<int, std::string> cache(2);
+		cache.insert(1, "one");
+		cache.insert(2, "two");
+		assertTrue("find 1", cache.find(1) && *cache.find(1) == "one");
+
+		cache.insert(3, "three");
+		assertEqual("size", size_t{2}, cache.size());
+		assertTrue("2 evicted", cache.find(2) == nullptr);
+		assertTrue("1 kept", cache.find(1) != nullptr);
+		assertTrue("3 kept", cache.find(3) != nullptr);
+
+		cache.insert(1, "uno");
+		assertTrue("replaced", *cache.find(1) == "uno");
+		assertEqual("size after replace", size_t{2}, cache.size());
+	});
+
+	// itemizeStyleRuns
+
+	test("itemizeStyleRuns: no ranges", []()
+	{
+		Style<FakeFont> base{ nullptr, 10.0f, { 0x000000ff } };
+		auto runs = itemizeStyleRuns<FakeFont>(base, {}, 5);
+		assertEqual("run count", size_t{1}, runs.size());
+		assertEqual("start", 0u, runs[0].start);
+		assertEqual("length", 5u, runs[0].length);
+
+		auto empty = itemizeStyleRuns<FakeFont>(base, {}, 0);
+		assertEqual("empty text", size_t{0}, empty.size());
+	});
+
+	test("itemizeStyleRuns: nested ranges", []()
+	{
+		Style<FakeFont> base{ nullptr, 10.0f, { 0x000000ff } };
+		auto big = base.withSize(20.0f);
+		auto red = base.withForeground({ 0xff0000ff });
+		auto runs = itemizeStyleRuns<FakeFont>(
+			base,
+			{ { big, { 2, 6 } }, { red, { 4, 2 } } },
+			10);
+
+		assertEqual("run count", size_t{5}, runs.size());
+		assertEqual("1st start", 0u, runs[0].start);
+		assertEqual("1st length", 2u, runs[0].length);
+		assertEqual("2nd start", 2u, runs[1].start);
+		assertEqual("2nd length", 2u, runs[1].length);
+		assertEqual("2nd size", 20.0f, runs[1].style.size);
+		assertEqual("3rd start", 4u, runs[2].start);
+		assertEqual("3rd length", 2u, runs[2].length);
+		auto color = runs[2].style.foreground.color.rgba;
+		assertEqual("3rd color", 0xff0000ffu, color);
+		assertEqual("4th start", 6u, runs[3].start);
+		assertEqual("4th length", 2u, runs[3].length);
+		assertEqual("4th size", 20.0f, runs[3].style.size);
+		assertEqual("5th start", 8u, runs[4].start);
+		assertEqual("5th length", 2u, runs[4].length);
+		assertEqual("5th size", 10.0f, runs[4].style.size);
+	});
+
+	test("itemizeStyleRuns: identical styles are merged", []()
+	{
+		Style<FakeFont> base{ nullptr, 10.0f, { 0x000000ff } };
+		auto same = base;
+		auto big = base.withSize(20.0f);
+		auto runs = itemizeStyleRuns<FakeFont>(
+			base,
+			{ { same, { 0, 3 } }, { big, { 3, 2 } }, { big, { 5, 2 } } },
+			8);
+
+		assertEqual("run count", size_t{3}, runs.size());
+		assertEqual("1st length", 3u, runs[0].length);
+		assertEqual("2nd start", 3u, runs[1].start);
+		assertEqual("2nd length", 4u, runs[1].length);
+		assertEqual("3rd start", 7u, runs[2].start);
+		assertEqual("3rd length", 1u, runs[2].length);
+	});
+
+	test("itemizeStyleRuns: ranges past the end are clipped", []()
+	{
+		Style<FakeFont> base{ nullptr, 10.0f, { 0x000000ff } };
+		auto big = base.withSize(20.0f);
+		auto runs = itemizeStyleRuns<FakeFont>(
+			base, { { big, { 3, 100 } }, { big, { 50, 1 } } }, 5);
+
+		assertEqual("run count", size_t{2}, runs.size());
+		assertEqual("2nd start", 3u, runs[1].start);
+		assertEqual("2nd length", 2u, runs[1].length);
+	});
+
+	// SpacialBlock
+
+	test("SpacialBlock: inline rect copies", []()
+	{
+		SpacialBlock block;
+		block.push(3, { 10, 10, 5, 5 });
+		block.push(7, { 30, 0, 10, 20 });
+		block.push(9, { 0, 40, 100, 2 });
+		assertTrue("overlaps first", block.overlaps({ 14, 14, 10, 10 }));
+		assertTrue("touching edges miss", !block.overlaps({ 15, 10, 15, 5 }));
+		assertTrue("overlaps last", block.overlaps({ 99, 41, 1, 1 }));
+
+		block.erase(7);
+		assertEqual("erased", size_t{2}, block.size());
+		assertEqual("order kept", 9u, block.places[1]);
+		assertEqual("edges follow", 41u, unsigned{ block.bottom[1] });
+		assertTrue("erased misses", !block.overlaps({ 32, 5, 2, 2 }));
+	});
+
+	test("SpacialBlock: overlap kernels match scalar", []()
+	{
+		std::mt19937 rng(7);
+		SpacialBlock block;
+		for (uint32_t i = 0; i < 45; i++)
+		{
+			// Spread across the whole 16 bit range to catch signed compares
+			block.push(i, {
+				static_cast<unsigned>(rng() % 65000),
+				static_cast<unsigned>(rng() % 65000),
+				1 + static_cast<unsigned>(rng() % 500),
+				1 + static_cast<unsigned>(rng() % 500) });
+		}
+
+		// Queries stay inside 16 bits like anything in a texture does
+		std::vector<Rect> queries;
+		for (unsigned i = 0; i < 300; i++)
+		{
+			auto x = static_cast<unsigned>(rng() % 65000);
+			auto y = static_cast<unsigned>(rng() % 65000);
+			queries.push_back({
+				x,
+				y,
+				1 + static_cast<unsigned>(rng() % (65535 - x)),
+				1 + static_cast<unsigned>(rng() % (65535 - y)) });
+		}
+		queries.push_back({ block.right[20] + 1u, block.top[20], 5, 5 });
+		queries.push_back({ block.right[20], block.bottom[20], 1, 1 });
+
+		auto best = overlapKernel();
+		useOverlapKernel(OverlapKernel::Scalar);
+		std::vector<uint32_t> expected;
+		for (auto &query : queries)
+		{
+			for (size_t first = 0; first < block.size(); first += 16)
+			{
+				expected.push_back(overlapMask(block, first, query));
+			}
+		}
+		// Rect 20 is bit 4 of the second run of 16 for the last two queries
+		auto edgeMask = expected[expected.size() - 5];
+		auto cornerMask = expected[expected.size() - 2];
+		assertEqual("shared edge misses", 0u, edgeMask >> 4 & 1u);
+		assertEqual("last pixel hits", 1u, cornerMask >> 4 & 1u);
+
+		for (auto kernel : { OverlapKernel::Sse41, OverlapKernel::Avx2 })
+		{
+			if (!useOverlapKernel(kernel))
+			{
+				continue;
+			}
+
+			size_t mismatches = 0;
+			size_t at = 0;
+			for (auto &query : queries)
+			{
+				for (size_t first = 0; first < block.size(); first += 16)
+				{
+					mismatches += overlapMask(block, first, query)
+						!= expected[at++];
+				}
+			}
+			assertEqual(overlapKernelName(kernel), size_t{0}, mismatches);
+		}
+
+		useOverlapKernel(best);
+		assertTrue("restored", overlapKernel() == best);
+	});
+
 	// RectangleOrganizer
 
 	test("RectangleOrganizer: zero size tests", []()
@@ -346,6 +1388,20 @@ int main()
 		assertEqual("no width or height not found", false, c3.isFound);
 	});
 
+	test("RectangleOrganizer: sides are cut down to the edge limit", []()
+	{
+		RectangleOrganizer org{{ 70000, 16 }};
+		auto wide = org.tryClaimSlot({ 65536, 16 });
+		assertTrue("widest found", wide.isFound);
+		assertEqual("last column", 65535u, wide.slot.rect.endX());
+		assertEqual("nothing past it", false,
+			org.tryClaimSlot({ 1, 1 }).isFound);
+		assertEqual("area", uint64_t{ 65536 * 16 }, org.stats().totalArea);
+
+		std::ostringstream problems;
+		assertTrue("verifies", org.verify(problems));
+	});
+
 	test("RectangleOrganizer: additive positioning", []()
 	{
 		RectangleOrganizer org{{100, 100}};
@@ -431,5 +1487,1004 @@ int main()
 		assertEqual("6th rect", { 0, 20, 100, 10 }, c6.slot.rect);
 	});
 
+	test("RectangleOrganizer: save and load", []()
+	{
+		RectangleOrganizer org{{100, 100}};
+		auto c1 = org.tryClaimSlot({ 30, 10 });
+		auto c2 = org.tryClaimSlot({ 30, 20 });
+		org.tryClaimSlot({ 30, 10 });
+		org.releaseSlot(c1.slot.index);
+
+		std::stringstream state;
+		org.save(state);
+
+		RectangleOrganizer loaded{{100, 100}};
+		assertTrue("loaded", loaded.load(state));
+		assertEqual(
+			"released slot stays released",
+			false,
+			loaded.releaseSlot(c1.slot.index));
+
+		auto expected = org.tryClaimSlot({ 40, 10 });
+		auto actual = loaded.tryClaimSlot({ 40, 10 });
+		assertEqual(
+			"release loaded slot", true, loaded.releaseSlot(c2.slot.index));
+		org.releaseSlot(c2.slot.index);
+		auto expectedAfterRelease = org.tryClaimSlot({ 30, 20 });
+		auto actualAfterRelease = loaded.tryClaimSlot({ 30, 20 });
+		assertEqual("same next claim", expected.slot, actual.slot);
+		assertEqual(
+			"same claim after release",
+			expectedAfterRelease.slot,
+			actualAfterRelease.slot);
+
+		RectangleOrganizer wrongSize{{50, 50}};
+		std::stringstream state2;
+		org.save(state2);
+		assertEqual("size mismatch fails", false, wrongSize.load(state2));
+	});
+
+	test("RectangleOrganizer: corrupt counts run out of stream", []()
+	{
+		auto header = [](uint32_t slabSize)
+		{
+			std::stringstream state;
+			writeBinary(state, static_cast<uint8_t>(OrganizerKind::Search));
+			writeBinary(state, Size{ 100, 100 });
+			writeBinary(state, slabSize);
+			return state;
+		};
+
+		RectangleOrganizer org{{100, 100}};
+		auto slab = header(0xffffffffu);
+		assertEqual("huge slab fails", false, org.load(slab));
+
+		auto places = header(0);
+		writeBinary(places, 0xffffffffu);
+		assertEqual("huge free list fails", false, org.load(places));
+		assertTrue("still usable", org.tryClaimSlot({ 100, 100 }).isFound);
+	});
+
+	test("RectangleOrganizer: a state that contradicts itself fails", []()
+	{
+		RectangleOrganizer org{{100, 100}};
+		org.tryClaimSlot({ 10, 10 });
+		std::stringstream state;
+		org.save(state);
+
+		// The first slot's x follows the kind, size and slab count, so the
+		// spacial index and y cache still describe it where it was
+		auto bytes = state.str();
+		uint32_t x = 50;
+		std::memcpy(&bytes[1 + 8 + 4], &x, sizeof(x));
+		std::stringstream moved(bytes);
+		RectangleOrganizer loaded{{100, 100}};
+		assertEqual("moved slot fails", false, loaded.load(moved));
+		assertEqual("left empty", uint64_t{0}, loaded.stats().slotCount);
+	});
+
+	test("RectangleOrganizer: stale handles", []()
+	{
+		RectangleOrganizer org{{100, 100}};
+		auto c1 = org.tryClaimSlot({ 10, 10 });
+		auto c2 = org.tryClaimSlot({ 10, 10 });
+		assertTrue("never zero", c1.slot.index != 0);
+		assertTrue("claimed", org.isClaimed(c1.slot.index));
+
+		org.releaseSlot(c1.slot.index);
+		assertTrue("released", !org.isClaimed(c1.slot.index));
+
+		// The freed place is reused under a new generation
+		auto c3 = org.tryClaimSlot({ 20, 20 });
+		assertEqual("same place", c1.slot.index & 0xffffffff,
+			c3.slot.index & 0xffffffff);
+		assertTrue("new handle", c3.slot.index != c1.slot.index);
+		assertEqual("stale release", false, org.releaseSlot(c1.slot.index));
+		assertTrue("new slot kept", org.isClaimed(c3.slot.index));
+		assertTrue("other slot kept", org.isClaimed(c2.slot.index));
+		assertEqual("out of range", false,
+			org.releaseSlot(c3.slot.index + 1000));
+	});
+
+	test("RectangleOrganizer: verify after churn", []()
+	{
+		RectangleOrganizer org{{200, 100}};
+		std::vector<uint64_t> slots;
+		std::ostringstream problems;
+		bool consistent = true;
+		for (unsigned i = 0; i < 300; i++)
+		{
+			auto claim = org.tryClaimSlot({ 5 + i * 7 % 40, 3 + i % 13 });
+			if (claim.isFound)
+			{
+				slots.push_back(claim.slot.index);
+			}
+			if (i % 3 == 2 && !slots.empty())
+			{
+				auto victim = (i * 31) % slots.size();
+				org.releaseSlot(slots[victim]);
+				slots.erase(slots.begin() + victim);
+			}
+			consistent = consistent && org.verify(problems);
+		}
+		assertTrue("consistent", consistent);
+		assertTrue("no problems", problems.str().empty());
+
+		std::stringstream state;
+		org.save(state);
+		RectangleOrganizer loaded{{200, 100}};
+		loaded.load(state);
+		assertTrue("loaded consistent", loaded.verify(problems));
+		org.clear();
+		assertTrue("cleared consistent", org.verify(problems));
+	});
+
+	test("RectangleOrganizer: shelves", []()
+	{
+		OrganizerOptions options;
+		options.shelfMaxHeight = 16;
+		options.shelfHeightStep = 4;
+		options.shelfWidth = 64;
+		RectangleOrganizer org{{100, 100}, options};
+		std::ostringstream problems;
+
+		// 9 and 11 high both round up to 12 and share a shelf
+		auto a = org.tryClaimSlot({ 10, 9 });
+		auto b = org.tryClaimSlot({ 20, 11 });
+		assertEqual("first on shelf", Rect{ 0, 0, 10, 9 }, a.slot.rect);
+		assertEqual("next along shelf", Rect{ 10, 0, 20, 11 }, b.slot.rect);
+
+		auto c = org.tryClaimSlot({ 10, 14 });
+		assertTrue("new class gets a new shelf", c.slot.rect.y >= 12);
+		auto d = org.tryClaimSlot({ 30, 30 });
+		auto e = org.tryClaimSlot({ 80, 8 });
+		assertTrue("tall and wide rects placed", d.isFound && e.isFound);
+		assertTrue("consistent", org.verify(problems));
+
+		// The released columns are used again before the rest of the shelf
+		org.releaseSlot(a.slot.index);
+		auto f = org.tryClaimSlot({ 10, 10 });
+		assertEqual("reused span", Rect{ 0, 0, 10, 10 }, f.slot.rect);
+		assertEqual("stale item", false, org.releaseSlot(a.slot.index));
+		assertTrue("item claimed", org.isClaimed(f.slot.index));
+
+		std::stringstream state;
+		org.save(state);
+		RectangleOrganizer loaded{{100, 100}, options};
+		assertTrue("loaded", loaded.load(state));
+		assertTrue("loaded consistent", loaded.verify(problems));
+		assertEqual("same next item",
+			org.tryClaimSlot({ 5, 12 }).slot,
+			loaded.tryClaimSlot({ 5, 12 }).slot);
+
+		// Emptying a shelf gives its strip back to the texture
+		org.releaseSlot(b.slot.index);
+		org.releaseSlot(f.slot.index);
+		auto stats = org.stats();
+		assertEqual("items and slots counted", uint64_t{4}, stats.slotCount);
+		assertEqual(
+			"used area", uint64_t{140 + 900 + 640 + 60}, stats.usedArea);
+		assertTrue("consistent after release", org.verify(problems));
+		assertTrue("no problems", problems.str().empty());
+	});
+
+	test("RectangleOrganizer: shelves by widest span", []()
+	{
+		OrganizerOptions options;
+		options.shelfMaxHeight = 8;
+		options.shelfWidth = 64;
+		RectangleOrganizer org{{100, 100}, options};
+		std::ostringstream problems;
+
+		// The first shelf keeps 4 columns, too few for the next claim
+		auto a = org.tryClaimSlot({ 30, 8 });
+		auto a2 = org.tryClaimSlot({ 30, 8 });
+		auto b = org.tryClaimSlot({ 40, 8 });
+		assertTrue("new shelf", b.slot.rect.y != a.slot.rect.y
+			|| b.slot.rect.x >= 64);
+		auto c = org.tryClaimSlot({ 4, 8 });
+		assertEqual("narrow span used", Rect{ 60, 0, 4, 8 }, c.slot.rect);
+		auto d = org.tryClaimSlot({ 20, 8 });
+		assertEqual("wide span used", b.slot.rect.y, d.slot.rect.y);
+		assertTrue("consistent", org.verify(problems));
+
+		// Released columns join up and move the shelf up a bucket
+		org.releaseSlot(c.slot.index);
+		org.releaseSlot(a2.slot.index);
+		auto e = org.tryClaimSlot({ 34, 8 });
+		assertEqual("joined span", Rect{ 30, 0, 34, 8 }, e.slot.rect);
+		assertTrue("consistent after release", org.verify(problems));
+		assertTrue("no problems", problems.str().empty());
+	});
+
+	test("BuddyOrganizer: size classes and joining", []()
+	{
+		BuddyOrganizer org{{64, 64}};
+		std::ostringstream problems;
+		auto a = org.tryClaimSlot({ 5, 3 });
+		auto b = org.tryClaimSlot({ 8, 8 });
+		auto c = org.tryClaimSlot({ 20, 10 });
+		assertEqual("smallest block", Rect{ 0, 0, 5, 3 }, a.slot.rect);
+		assertEqual("buddy block", Rect{ 8, 0, 8, 8 }, b.slot.rect);
+		assertEqual("quarter block", Rect{ 32, 0, 20, 10 }, c.slot.rect);
+		assertEqual("too big", false, org.tryClaimSlot({ 65, 1 }).isFound);
+
+		auto stats = org.stats();
+		assertEqual("used", uint64_t{15 + 64 + 200}, stats.usedArea);
+		assertEqual("reserved", uint64_t{64 + 64 + 1024}, stats.reservedArea);
+		assertEqual("failed", uint64_t{1}, stats.failedClaims);
+		assertTrue("padding", stats.internalFragmentation() > 0.75);
+		assertEqual("largest free block", 32u, stats.largestFreeRect.width);
+
+		// The top left quarter joins back up, the one with c can't
+		org.releaseSlot(a.slot.index);
+		org.releaseSlot(b.slot.index);
+		assertEqual("stale", false, org.releaseSlot(a.slot.index));
+		assertEqual("joined", uint64_t{1024}, org.stats().reservedArea);
+		assertTrue("consistent", org.verify(problems));
+		org.releaseSlot(c.slot.index);
+		assertEqual("whole root free", 64u,
+			org.stats().largestFreeRect.width);
+		assertTrue("consistent after release", org.verify(problems));
+
+		// Organizers can be asked to be buddies
+		OrganizerOptions options;
+		options.kind = OrganizerKind::Buddy;
+		RectangleOrganizer buddy{{64, 64}, options};
+		auto d = buddy.tryClaimSlot({ 5, 3 });
+		assertEqual("buddy reserved", uint64_t{64},
+			buddy.stats().reservedArea);
+
+		std::stringstream state;
+		buddy.save(state);
+		std::stringstream state2(state.str());
+		RectangleOrganizer search{{64, 64}};
+		RectangleOrganizer loaded{{64, 64}, options};
+		assertEqual("kind mismatch fails", false, search.load(state));
+		assertTrue("loaded", loaded.load(state2));
+		assertTrue("loaded slot", loaded.isClaimed(d.slot.index));
+		assertTrue("loaded consistent", loaded.verify(problems));
+		assertTrue("no problems", problems.str().empty());
+	});
+
+	test("BuddyOrganizer: verify after churn", []()
+	{
+		// Two roots side by side with a strip left over
+		BuddyOrganizer org{{130, 64}};
+		std::vector<uint64_t> slots;
+		std::ostringstream problems;
+		bool consistent = true;
+		bool inBounds = true;
+		for (unsigned i = 0; i < 400; i++)
+		{
+			auto claim = org.tryClaimSlot({ 1 + i * 7 % 40, 1 + i * 3 % 23 });
+			if (claim.isFound)
+			{
+				slots.push_back(claim.slot.index);
+				inBounds = inBounds && claim.slot.rect.endX() < 128;
+			}
+			if (i % 3 == 2 && !slots.empty())
+			{
+				auto victim = (i * 31) % slots.size();
+				org.releaseSlot(slots[victim]);
+				slots.erase(slots.begin() + victim);
+			}
+			consistent = consistent && org.verify(problems);
+		}
+		assertTrue("consistent", consistent);
+		assertTrue("in bounds", inBounds);
+
+		std::stringstream state;
+		org.save(state);
+		BuddyOrganizer loaded{{130, 64}};
+		assertTrue("loaded", loaded.load(state));
+		assertTrue("loaded consistent", loaded.verify(problems));
+		for (auto slot : slots)
+		{
+			loaded.releaseSlot(slot);
+		}
+		auto stats = loaded.stats();
+		assertEqual("strip left out", uint64_t{2 * 64 * 64}, stats.totalArea);
+		assertEqual("all released", uint64_t{0}, stats.reservedArea);
+		assertEqual("all joined", 64u, stats.largestFreeRect.height);
+		assertTrue("released consistent", loaded.verify(problems));
+		assertTrue("no problems", problems.str().empty());
+	});
+
+	test("BuddyOrganizer: strips get smaller roots", []()
+	{
+		// 512, 256, 128 and so on down to 8 cover all of it
+		BuddyOrganizer org{{1000, 600}};
+		std::ostringstream problems;
+		assertEqual("all covered", uint64_t{1000 * 600},
+			org.stats().totalArea);
+
+		// The strip's roots are used before the big one is split
+		auto a = org.tryClaimSlot({ 200, 200 });
+		auto b = org.tryClaimSlot({ 8, 8 });
+		assertEqual("strip root", Rect{ 512, 0, 200, 200 }, a.slot.rect);
+		assertEqual("smallest root", Rect{ 992, 0, 8, 8 }, b.slot.rect);
+		assertEqual("big root free", 512u, org.stats().largestFreeRect.width);
+		assertTrue("consistent", org.verify(problems));
+
+		// Quarters joined back up keep their generations
+		auto c = org.tryClaimSlot({ 4, 4 });
+		org.releaseSlot(c.slot.index);
+		auto e = org.tryClaimSlot({ 4, 4 });
+		assertEqual("same block", c.slot.rect, e.slot.rect);
+		assertEqual("stale after join", false, org.isClaimed(c.slot.index));
+
+		// A quad hung off a block that isn't split is rejected
+		std::stringstream state;
+		org.save(state);
+		auto bytes = state.str();
+		uint32_t nodeCount;
+		std::memcpy(&nodeCount, &bytes[8], sizeof(nodeCount));
+		uint32_t root = 1;
+		std::memcpy(&bytes[12 + nodeCount * 13], &root, sizeof(root));
+		std::stringstream corrupt(bytes);
+		BuddyOrganizer loaded{{1000, 600}};
+		assertEqual("corrupt fails", false, loaded.load(corrupt));
+		assertEqual("left empty", uint64_t{0}, loaded.stats().slotCount);
+		std::stringstream intact(state.str());
+		assertTrue("intact loads", loaded.load(intact));
+		assertTrue("loaded slot", loaded.isClaimed(e.slot));
+		assertTrue("no problems", problems.str().empty());
+	});
+
+	test("RectangleOrganizer: shelf indexes are checked on load", []()
+	{
+		OrganizerOptions options;
+		options.shelfMaxHeight = 16;
+		RectangleOrganizer org{{100, 100}, options};
+		org.tryClaimSlot({ 10, 8 });
+		auto released = org.tryClaimSlot({ 10, 8 });
+		org.releaseSlot(released.slot.index);
+
+		// The state ends with the item count, two items of 25 bytes and the
+		// free item list, whose one entry is the last four bytes
+		std::stringstream state;
+		org.save(state);
+		auto bytes = state.str();
+		auto corrupt = [&bytes, &options](size_t fromEnd, uint32_t value)
+		{
+			auto copy = bytes;
+			std::memcpy(&copy[copy.size() - fromEnd], &value, sizeof(value));
+			std::stringstream in(copy);
+			RectangleOrganizer loaded{{100, 100}, options};
+			auto isLoaded = loaded.load(in);
+			return isLoaded || loaded.stats().slotCount != 0;
+		};
+
+		assertEqual("intact", true, corrupt(4, 1));
+		assertEqual("free item past the end", false, corrupt(4, 2));
+		assertEqual("item on a missing shelf", false, corrupt(17, 7));
+		assertEqual("huge item count", false,
+			corrupt(12 + 2 * 25, 0xffffffffu));
+	});
+
+	test("RectangleOrganizer: shelves after churn", []()
+	{
+		OrganizerOptions options;
+		options.shelfMaxHeight = 12;
+		options.shelfWidth = 64;
+		RectangleOrganizer org{{200, 100}, options};
+		std::vector<uint64_t> slots;
+		std::ostringstream problems;
+		bool consistent = true;
+		for (unsigned i = 0; i < 400; i++)
+		{
+			auto claim = org.tryClaimSlot({ 3 + i * 7 % 40, 3 + i % 17 });
+			if (claim.isFound)
+			{
+				slots.push_back(claim.slot.index);
+			}
+			if (i % 3 == 2 && !slots.empty())
+			{
+				auto victim = (i * 31) % slots.size();
+				org.releaseSlot(slots[victim]);
+				slots.erase(slots.begin() + victim);
+			}
+			consistent = consistent && org.verify(problems);
+		}
+		assertTrue("consistent", consistent);
+		assertTrue("no problems", problems.str().empty());
+
+		std::stringstream state;
+		org.save(state);
+		RectangleOrganizer loaded{{200, 100}, options};
+		assertTrue("loaded", loaded.load(state));
+		assertTrue("loaded consistent", loaded.verify(problems));
+		for (auto slot : slots)
+		{
+			loaded.releaseSlot(slot);
+		}
+		assertEqual("all released", uint64_t{0}, loaded.stats().slotCount);
+		assertTrue("released consistent", loaded.verify(problems));
+	});
+
+	test("RectangleOrganizer: occupancy stats", []()
+	{
+		RectangleOrganizer org{{100, 100}};
+		auto stats = org.stats();
+		assertEqual("total", uint64_t{10000}, stats.totalArea);
+		assertEqual("empty free rect", 100u, stats.largestFreeRect.width);
+		assertEqual("empty fragmentation", 0.0, stats.fragmentation());
+
+		auto c1 = org.tryClaimSlot({ 50, 100 });
+		org.tryClaimSlot({ 200, 10 });
+		org.tryClaimSlot({ 10, 10 });
+		stats = org.stats();
+		assertEqual("used", uint64_t{5100}, stats.usedArea);
+		assertEqual("free", uint64_t{4900}, stats.freeArea());
+		assertEqual("slots", uint64_t{2}, stats.slotCount);
+		assertEqual("failed", uint64_t{1}, stats.failedClaims);
+		assertEqual("free width", 50u, stats.largestFreeRect.width);
+		assertEqual("free height", 90u, stats.largestFreeRect.height);
+		assertEqual("fragmentation", 1.0 - 4500.0 / 4900.0,
+			stats.fragmentation());
+		assertEqual("5000 bucket", uint64_t{1}, stats.slotSizes[12]);
+		assertEqual("100 bucket", uint64_t{1}, stats.slotSizes[6]);
+
+		org.releaseSlot(c1.slot.index);
+		stats = org.stats();
+		assertEqual("released used", uint64_t{100}, stats.usedArea);
+		assertEqual("released bucket", uint64_t{0}, stats.slotSizes[12]);
+		assertEqual("released free width", 100u, stats.largestFreeRect.width);
+		assertEqual("released free height", 90u,
+			stats.largestFreeRect.height);
+
+		std::stringstream state;
+		org.save(state);
+		RectangleOrganizer loaded{{100, 100}};
+		loaded.load(state);
+		assertEqual("loaded used", uint64_t{100}, loaded.stats().usedArea);
+
+		org.clear();
+		stats = org.stats();
+		assertEqual("cleared slots", uint64_t{0}, stats.slotCount);
+		assertEqual("failures kept", uint64_t{1}, stats.failedClaims);
+		assertEqual("cleared free rect", 100u, stats.largestFreeRect.height);
+
+		assertEqual("bucket of 1", 0u, OrganizerStats::sizeBucket(1));
+		assertEqual("last bucket", XT_SLOT_SIZE_BUCKETS - 1u,
+			OrganizerStats::sizeBucket(uint64_t{1} << 40));
+	});
+
+	test("RectangleOrganizer: free rect on a coarse grid", []()
+	{
+		RectangleOrganizer org{{1024, 1024}};
+		org.tryClaimSlot({ 1024, 500 });
+		org.tryClaimSlot({ 3, 3 });
+		auto stats = org.stats();
+
+		// Cells are 4x4 so the 3x3 slot at 0,500 takes a whole cell and the
+		// free rect next to it is 1020 wide rather than 1021
+		assertEqual("free width", 1020u, stats.largestFreeRect.width);
+		assertEqual("free height", 524u, stats.largestFreeRect.height);
+	});
+
+	// TextManager
+
+	test("TextManager: atlas stats per texture", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(2, { 100, 100 }));
+
+		FakeText::Block block(manager, L"aaaa", options);
+		FakeText::Block tooBig(manager, std::wstring(200, 'x'), options);
+
+		auto stats = manager.atlasStats();
+		assertEqual("textures", size_t{2}, stats.size());
+		assertEqual("used", uint64_t{400}, stats[0].usedArea);
+		assertEqual("slots", uint64_t{1}, stats[0].slotCount);
+		assertEqual("second empty", uint64_t{0}, stats[1].usedArea);
+		assertEqual("first failed", uint64_t{1}, stats[0].failedClaims);
+		assertEqual("second failed", uint64_t{1}, stats[1].failedClaims);
+	});
+
+	test("TextManager: keyed placements survive save and load", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		std::stringstream state;
+		Slot savedSlot;
+
+		{
+			FakeText::Manager manager(
+				{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+			FakeText::Block block(manager, "hello", L"hello", options);
+			savedSlot = block.slot();
+			manager.save(state);
+		}
+
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		assertTrue("loaded", manager.load(state));
+		auto &imageData = manager.textures()[0].imageData();
+		assertEqual("loaded pixels", uint8_t{0xff}, imageData.alphaAt(0, 0));
+
+		FakeText::Block other(manager, L"other", options);
+		assertTrue(
+			"reclaimable slot stays claimed",
+			!(other.slot().rect == savedSlot.rect));
+
+		auto renderedBefore = imageData.renderedChars;
+		FakeText::Block reclaimed(manager, "hello", L"hello", options);
+		assertEqual("reclaimed slot", savedSlot, reclaimed.slot());
+		assertEqual("no render", renderedBefore, imageData.renderedChars);
+		assertEqual("metrics", 50u, reclaimed.metrics().size.width);
+
+		FakeText::Block again(manager, "hello", L"hello", options);
+		assertTrue(
+			"already claimed key renders again",
+			!(again.slot().rect == savedSlot.rect));
+	});
+
+	test("TextManager: changed content is not reclaimed", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		std::stringstream state;
+
+		{
+			FakeText::Manager manager(
+				{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+			FakeText::Block block(manager, "label", L"hello", options);
+			manager.save(state);
+		}
+
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		assertTrue("loaded", manager.load(state));
+		auto &imageData = manager.textures()[0].imageData();
+		FakeText::Block changed(manager, "label", L"goodbye", options);
+		assertEqual("rendered", 7u, imageData.renderedChars);
+		assertEqual(
+			"stale slot reused", Rect{ 0, 0, 70, 10 }, changed.slot().rect);
+	});
+
+	test("TextManager: a changed font is not reclaimed", []()
+	{
+		FakeFont regular{ 1 };
+		FakeFont bold{ 2 };
+		auto style = FakeText::Style{ &regular, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		std::stringstream state;
+
+		{
+			FakeText::Manager manager(
+				{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+			FakeText::Block block(manager, "label", L"hello", options);
+			manager.save(state);
+		}
+
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		assertTrue("loaded", manager.load(state));
+		auto &imageData = manager.textures()[0].imageData();
+		auto boldOptions = options.withStyle(style.withFont(&bold));
+		FakeText::Block changed(manager, "label", L"hello", boldOptions);
+		assertEqual("rendered", 5u, imageData.renderedChars);
+	});
+
+	test("TextManager: a truncated state leaves textures empty", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		std::stringstream state;
+		{
+			FakeText::Manager manager(
+				{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+			FakeText::Block block(manager, "label", L"hello", options);
+			manager.save(state);
+		}
+
+		// Cut off in the middle of the pixels
+		auto bytes = state.str();
+		std::stringstream truncated(bytes.substr(0, bytes.size() - 5000));
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		FakeText::Block before(manager, L"hello", options);
+		assertEqual("fails", false, manager.load(truncated));
+
+		auto &imageData = manager.textures()[0].imageData();
+		assertEqual("pixels cleared", uint8_t{0}, imageData.alphaAt(0, 0));
+		assertEqual("nothing claimed", uint64_t{0},
+			manager.atlasStats()[0].slotCount);
+
+		// A string longer than any key fails before anything is allocated
+		std::stringstream huge;
+		writeBinary(huge, uint32_t{0xffffffff});
+		std::string key;
+		assertEqual("huge string", false, readBinary(huge, key));
+	});
+
+	test("TextManager: blocks from before a load keep off loaded slots", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		std::stringstream state;
+		{
+			FakeText::Manager manager(
+				{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+			FakeText::Block block(manager, "label", L"hello", options);
+			manager.save(state);
+		}
+
+		// The block before the load has the same handle as the loaded one
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		{
+			FakeText::Block before(manager, L"hello", options);
+			assertEqual("loads", true, manager.load(state));
+			before.setText(L"hello!");
+		}
+		assertEqual("loaded slot kept", uint64_t{1},
+			manager.atlasStats()[0].slotCount);
+
+		FakeText::Block after(manager, "label", L"hello", options);
+		assertEqual("reclaimed", true, after.texture() != nullptr);
+		assertEqual("one slot", uint64_t{1},
+			manager.atlasStats()[0].slotCount);
+	});
+
+	test("TextManager: a placement that isn't claimed is rejected", []()
+	{
+		auto style = FakeText::Style{ nullptr, 10.0f, { 0x000000ff } };
+		auto options = FakeText::Options::fromStyle(style);
+		std::stringstream state;
+		{
+			FakeText::Manager manager(
+				{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+			FakeText::Block block(manager, "label", L"hello", options);
+			manager.save(state);
+		}
+
+		// The placement's rect follows its key and texture index
+		auto bytes = state.str();
+		auto key = bytes.rfind("label");
+		uint32_t x = 20;
+		std::memcpy(&bytes[key + 5 + 4], &x, sizeof(x));
+		std::stringstream moved(bytes);
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		assertEqual("moved placement fails", false, manager.load(moved));
+		assertEqual("nothing claimed", uint64_t{0},
+			manager.atlasStats()[0].slotCount);
+	});
+
+	test("TextManager: mismatched state is rejected", []()
+	{
+		std::stringstream state;
+		{
+			FakeText::Manager manager(
+				{ { 100, 100 } }, fakeTextures(2, { 100, 100 }));
+			manager.save(state);
+		}
+
+		FakeText::Manager manager(
+			{ { 100, 100 } }, fakeTextures(1, { 100, 100 }));
+		assertEqual("texture count mismatch", false, manager.load(state));
+	});
+
+	// MmapWriter
+
+	test("MmapWriter: pixels visible through reader", []()
+	{
+		std::string path("./mmap_writer_test.xtim");
+		{
+			MmapWriter writer({ 64, 32 }, path);
+			assertTrue("writer open", writer.isOpen());
+			writer.setPixel(3, 5, 0x11, 0x22, 0x33, 0x44);
+			writer.write(
+				std::vector<uint8_t>(2 * 2 * 4, 0xff), { 62, 30, 2, 2 });
+			writer.write(
+				std::vector<uint8_t>(2 * 2 * 4, 0xee), { 63, 0, 2, 2 });
+			writer.write(std::vector<uint8_t>(4, 0xee), { 0, 1, 2, 2 });
+			writer.commit();
+
+			MmapReader reader(path);
+			assertTrue("reader open", reader.isOpen());
+			assertEqual("width", 64u, reader.size().width);
+			assertEqual("height", 32u, reader.size().height);
+			assertEqual("set pixel", 0x11223344u, reader.pixel(3, 5).rgba);
+			assertEqual(
+				"written pixel", 0xffffffffu, reader.pixel(63, 31).rgba);
+			assertEqual("untouched pixel", 0u, reader.pixel(0, 0).rgba);
+			assertEqual("out of range write", 0u, reader.pixel(63, 0).rgba);
+			assertEqual("short write", 0u, reader.pixel(0, 1).rgba);
+		}
+		std::remove(path.c_str());
+	});
+
+	test("MmapWriter: clear zeroes every pixel", []()
+	{
+		std::string path("./mmap_writer_clear.xtim");
+		{
+			MmapWriter writer({ 64, 32 }, path);
+			writer.write(
+				std::vector<uint8_t>(64 * 32 * 4, 0xff), { 0, 0, 64, 32 });
+			writer.commit();
+			writer.clear();
+			writer.commit();
+
+			MmapReader reader(path);
+			assertEqual("width kept", 64u, reader.size().width);
+			assertEqual("first pixel", 0u, reader.pixel(0, 0).rgba);
+			assertEqual("last pixel", 0u, reader.pixel(63, 31).rgba);
+		}
+		std::remove(path.c_str());
+	});
+
+	test("MmapWriter: loaded pixels keep the file sparse", []()
+	{
+		std::string path1("./mmap_writer_saved.xtim");
+		std::string path2("./mmap_writer_loaded.xtim");
+		std::string path3("./mmap_writer_overwritten.xtim");
+		{
+			std::stringstream state;
+			MmapWriter saved({ 256, 256 }, path1);
+			saved.write(std::vector<uint8_t>(8 * 8 * 4, 0xff), { 0, 0, 8, 8 });
+			saved.save(state);
+			auto bytes = state.str();
+
+			std::stringstream state2(bytes);
+			MmapWriter loaded({ 256, 256 }, path2);
+			assertTrue("loads", loaded.load(state2));
+			loaded.commit();
+
+			// A texture full of old pixels has them zeroed
+			std::stringstream state3(bytes);
+			MmapWriter overwritten({ 256, 256 }, path3);
+			overwritten.write(
+				std::vector<uint8_t>(256 * 256 * 4, 0xee),
+				{ 0, 0, 256, 256 });
+			assertTrue("loads over", overwritten.load(state3));
+			overwritten.commit();
+
+			struct stat info;
+			stat(path2.c_str(), &info);
+			auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+			assertTrue("sparse", info.st_blocks * 512 < 256 * 256 * 4 / 4);
+			MmapImageHeader header;
+			std::ifstream in(path2, std::ios::binary);
+			in.read(reinterpret_cast<char *>(&header), sizeof(header));
+			assertEqual("header is a page", size_t{0},
+				header.headerSize % pageSize);
+
+			MmapReader reader(path2);
+			assertEqual("loaded pixel", 0xffffffffu, reader.pixel(7, 7).rgba);
+			assertEqual("empty pixel", 0u, reader.pixel(255, 255).rgba);
+			MmapReader reader3(path3);
+			assertEqual("kept pixel", 0xffffffffu, reader3.pixel(0, 0).rgba);
+			assertEqual("zeroed pixel", 0u, reader3.pixel(255, 255).rgba);
+		}
+		std::remove(path1.c_str());
+		std::remove(path2.c_str());
+		std::remove(path3.c_str());
+	});
+
+	// BakedAtlas
+
+	test("BakedAtlas: lookups from a written file", []()
+	{
+		std::string path("./baked_atlas_test.xtbk");
+		std::vector<uint8_t> pixels(16 * 16 * 4, 0);
+		pixels[(16 * 2 + 3) * 4 + 3] = 0x7f;
+
+		BakedAtlasWriter writer({ 16, 16 });
+		writer.add(0, 12.0f, "b", 0, { 1, 2, 3, 4 }, { { 3, 4 }, { { 4 } } });
+		writer.add(0, 12.0f, "a", 0, { 5, 6, 7, 8 }, { { 7, 8 }, { { 8 } } });
+		writer.add(1, 12.0f, "a", 0, { 9, 9, 1, 1 }, { { 1, 1 }, {} });
+		writer.add(0, 20.0f, "ab", 0, { 0, 0, 9, 9 }, { { 9, 9 }, {} });
+		assertTrue("written", writer.write(path, { pixels.data() }));
+
+		BakedAtlas atlas(path);
+		assertTrue("open", atlas.isOpen());
+		assertEqual("entry count", 4u, atlas.entryCount());
+		assertEqual("texture count", 1u, atlas.textureCount());
+		auto alpha = atlas.texturePixels(0)[(16 * 2 + 3) * 4 + 3];
+		assertEqual("pixels", uint8_t{0x7f}, alpha);
+
+		auto a = atlas.find(0, 12.0f, "a");
+		assertTrue("a found", a.isFound);
+		assertEqual("a rect", { 5, 6, 7, 8 }, a.rect);
+		assertEqual("a lines", 1u, a.lineCount);
+		assertEqual("a line height", 8u, a.lines[0].height);
+
+		auto b = atlas.find(0, 12.0f, "b");
+		assertEqual("b rect", { 1, 2, 3, 4 }, b.rect);
+		auto otherFont = atlas.find(1, 12.0f, "a");
+		assertEqual("other font", { 9, 9, 1, 1 }, otherFont.rect);
+		auto otherSize = atlas.find(0, 20.0f, "ab");
+		assertEqual("other size", { 0, 0, 9, 9 }, otherSize.rect);
+		assertEqual("missing text", false, atlas.find(0, 12.0f, "c").isFound);
+		assertEqual("missing size", false, atlas.find(0, 13.0f, "a").isFound);
+		assertEqual("missing font", false, atlas.find(2, 12.0f, "a").isFound);
+		std::remove(path.c_str());
+	});
+
+	test("BakedAtlas: corrupt files are rejected", []()
+	{
+		std::string path("./baked_atlas_corrupt.xtbk");
+		std::vector<uint8_t> pixels(16 * 16 * 4, 0);
+		BakedAtlasWriter writer({ 16, 16 });
+		writer.add(0, 12.0f, "a", 0, { 5, 6, 7, 8 }, { { 7, 8 }, { { 8 } } });
+		writer.write(path, { pixels.data() });
+
+		std::string bytes;
+		{
+			std::ifstream in(path, std::ios::binary);
+			bytes.assign(std::istreambuf_iterator<char>(in), {});
+		}
+		auto rewrite = [&path](const std::string &contents)
+		{
+			std::ofstream out(path, std::ios::binary | std::ios::trunc);
+			out.write(contents.data(), contents.size());
+		};
+
+		// Cut short with a file size that claims to be cut short too
+		BakedAtlasHeader header;
+		std::memcpy(&header, bytes.data(), sizeof(header));
+		auto truncated = bytes.substr(0, header.pixelsOffset + 100);
+		header.fileSize = truncated.size();
+		std::memcpy(&truncated[0], &header, sizeof(header));
+		rewrite(truncated);
+		assertEqual("truncated pixels", false, BakedAtlas(path).isOpen());
+
+		// An entry pointing past the text
+		auto badEntry = bytes;
+		BakedAtlasEntry entry;
+		std::memcpy(&entry, &badEntry[header.entriesOffset], sizeof(entry));
+		entry.textOffset = 1 << 30;
+		std::memcpy(&badEntry[header.entriesOffset], &entry, sizeof(entry));
+		rewrite(badEntry);
+		assertEqual("entry out of range", false, BakedAtlas(path).isOpen());
+
+		rewrite(bytes);
+		assertTrue("intact", BakedAtlas(path).isOpen());
+		std::remove(path.c_str());
+	});
+
+	// MappedDocument
+
+	test("MappedDocument: finds newlines in and around vectors", []()
+	{
+		std::string bytes(70, 'x');
+		bytes[0] = '\n';
+		bytes[15] = '\n';
+		bytes[16] = '\n';
+		bytes[47] = '\n';
+		bytes[69] = '\n';
+
+		std::vector<uint64_t> starts;
+		findLineStarts(bytes.data(), bytes.size(), 100, starts);
+		assertEqual("count", size_t{5}, starts.size());
+		assertEqual("first", uint64_t{101}, starts.at(0));
+		assertEqual("end of vector", uint64_t{116}, starts.at(1));
+		assertEqual("start of vector", uint64_t{117}, starts.at(2));
+		assertEqual("middle", uint64_t{148}, starts.at(3));
+		assertEqual("tail", uint64_t{170}, starts.at(4));
+	});
+
+	test("MappedDocument: lines of a mapped file", []()
+	{
+		std::string path("./mapped_document_test.txt");
+		{
+			std::ofstream out(path, std::ios::binary);
+			out << "first\r\nsecond line\n\n";
+			for (unsigned i = 0; i < 1000; i++)
+			{
+				out << "line " << i << "\n";
+			}
+			out << "h\xc3\xa9llo";
+		}
+
+		{
+			MappedDocument document(path);
+			assertTrue("open", document.isOpen());
+
+			// Lines can be asked for before the index gets to them
+			auto far = document.line(503);
+			assertTrue("far line", std::string(far.data, far.size)
+				== "line 500");
+
+			document.waitForIndex();
+			assertTrue("indexed", document.isIndexed());
+			assertEqual("line count", uint64_t{1004}, document.indexedLines());
+
+			auto first = document.line(0);
+			assertTrue("carriage return dropped",
+				std::string(first.data, first.size) == "first");
+			assertEqual("empty line", size_t{0}, document.line(2).size);
+			auto same = document.line(503);
+			assertTrue("same far line", same.data == far.data);
+			assertEqual("past the end", size_t{0}, document.line(5000).size);
+
+			auto at = document.lineAt(10);
+			assertTrue("line at offset",
+				std::string(at.data, at.size) == "second line");
+
+			auto last = decodeText(document.line(1003));
+			assertTrue("decoded", last == L"h\u00e9llo");
+		}
+		std::remove(path.c_str());
+	});
+
+	test("MappedDocument: lines past the index are kept", []()
+	{
+		// Several chunks long so the index has to catch up with them
+		std::string path("./mapped_document_ahead.txt");
+		{
+			std::ofstream out(path, std::ios::binary);
+			for (unsigned i = 0; i < 200000; i++)
+			{
+				out << "line " << i << "\n";
+			}
+		}
+
+		{
+			MappedDocument document(path, false);
+			assertTrue("not indexed", !document.isIndexed());
+			assertEqual("nothing indexed", uint64_t{1},
+				document.indexedLines());
+
+			auto far = document.line(150000);
+			assertTrue("far line", std::string(far.data, far.size)
+				== "line 150000");
+			assertEqual("starts kept", uint64_t{150001},
+				document.knownLines());
+
+			auto near = document.line(1000);
+			assertTrue("near line", std::string(near.data, near.size)
+				== "line 1000");
+			assertEqual("no rescan", uint64_t{150001},
+				document.knownLines());
+
+			auto next = document.line(150001);
+			assertTrue("next line", std::string(next.data, next.size)
+				== "line 150001");
+			assertEqual("scanned on", uint64_t{150002},
+				document.knownLines());
+
+			assertEqual("past the end", size_t{0},
+				document.line(300000).size);
+			assertEqual("every start", uint64_t{200001},
+				document.knownLines());
+
+			document.waitForIndex();
+			assertEqual("line count", uint64_t{200001},
+				document.indexedLines());
+			assertEqual("merged into the index", uint64_t{200001},
+				document.knownLines());
+			assertTrue("same far line",
+				document.line(150000).data == far.data);
+			assertTrue("same near line",
+				document.line(1000).data == near.data);
+		}
+		std::remove(path.c_str());
+	});
+
+	test("MappedDocument: missing and empty files", []()
+	{
+		MappedDocument missing("./no_such_document.txt");
+		assertTrue("missing not open", !missing.isOpen());
+		assertEqual("missing line", size_t{0}, missing.line(3).size);
+
+		std::string path("./mapped_document_empty.txt");
+		std::ofstream(path).close();
+		{
+			MappedDocument empty(path);
+			empty.waitForIndex();
+			assertEqual("one empty line", uint64_t{1}, empty.indexedLines());
+			assertEqual("empty line", size_t{0}, empty.line(0).size);
+			assertEqual("line at", size_t{0}, empty.lineAt(5).size);
+		}
+		std::remove(path.c_str());
+	});
+
 	return summary();
 }
@@ -0,0 +1,248 @@
+#include <codecvt>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <locale>
+#include <memory>
+#include <string>
+#include <vector>
+#include "FreeType.hpp"
+#include "BakedAtlas.hpp"
+
+/*
+xtbake renders a fixed set of strings ahead of time and writes them to a
+baked atlas file that BakedAtlas can memory map at runtime.
+
+usage: xtbake <manifest> <output> [--texture-size N] [--textures N]
+
+The manifest is UTF-8 text with one directive per line:
+
+	# comment
+	font /usr/share/fonts/truetype/dejavu/DejaVuSans.ttf
+	size 12
+	size 20
+	text Hello world
+	charset 0123456789
+
+Every text line and every code point of every charset line is baked once
+for each font and each size. Fonts are numbered in the order they appear,
+which is the font number BakedAtlas::find expects.
+*/
+
+// Keeps pixels in memory only. Committing does nothing since the pixels
+// are written out all at once when baking is done.
+class BakeImageData
+{
+public:
+	BakeImageData(xt::Size size) :
+		_size(size), _bytes(size.width * size.height * 4, 0)
+	{ }
+
+	BakeImageData(const BakeImageData &) = delete;
+	BakeImageData(BakeImageData &&other) = default;
+
+	void commit() { }
+
+	void setPixel(
+		unsigned x,
+		unsigned y,
+		uint8_t r,
+		uint8_t g,
+		uint8_t b,
+		uint8_t a)
+	{
+		if (x >= _size.width || y >= _size.height)
+			return;
+
+		auto offset = (_size.width * y + x) * 4;
+		_bytes[offset + 0] = r;
+		_bytes[offset + 1] = g;
+		_bytes[offset + 2] = b;
+		_bytes[offset + 3] = a;
+	}
+
+	xt::Size size() const { return _size; }
+	const uint8_t *bytes() const { return _bytes.data(); }
+
+private:
+	xt::Size _size;
+	std::vector<uint8_t> _bytes;
+};
+
+using Text = xt::TextPlatform<xt::FreeType<BakeImageData>>;
+
+struct Manifest
+{
+	std::vector<std::string> fonts;
+	std::vector<float> sizes;
+	std::vector<std::string> strings;
+};
+
+bool readManifest(std::string path, Manifest &manifest)
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		std::cout << "failed to open manifest '" << path << "'" << std::endl;
+		return false;
+	}
+
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> utf8;
+	std::string line;
+	unsigned lineNumber = 0;
+	while (std::getline(in, line))
+	{
+		lineNumber++;
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		auto space = line.find(' ');
+		auto directive = line.substr(0, space);
+		auto value = space == std::string::npos ? "" : line.substr(space + 1);
+
+		if (directive == "font")
+		{
+			manifest.fonts.push_back(value);
+		}
+		else if (directive == "size")
+		{
+			manifest.sizes.push_back(std::strtof(value.c_str(), nullptr));
+		}
+		else if (directive == "text")
+		{
+			manifest.strings.push_back(value);
+		}
+		else if (directive == "charset")
+		{
+			for (auto ch : utf8.from_bytes(value))
+			{
+				manifest.strings.push_back(utf8.to_bytes(ch));
+			}
+		}
+		else
+		{
+			std::cout << path << ":" << lineNumber << ": unknown directive '"
+				<< directive << "'" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		std::cout << "usage: xtbake <manifest> <output> "
+			<< "[--texture-size N] [--textures N]" << std::endl;
+		return 1;
+	}
+
+	std::string manifestPath(argv[1]);
+	std::string outputPath(argv[2]);
+	unsigned textureSize = DEFAULT_TEXTURE_SIZE;
+	unsigned textureCount = DEFAULT_TEXTURE_COUT;
+
+	for (int i = 3; i + 1 < argc; i += 2)
+	{
+		std::string flag(argv[i]);
+		auto value = static_cast<unsigned>(
+			std::strtoul(argv[i + 1], nullptr, 10));
+		if (flag == "--texture-size")
+		{
+			textureSize = value;
+		}
+		else if (flag == "--textures")
+		{
+			textureCount = value;
+		}
+		else
+		{
+			std::cout << "unknown option '" << flag << "'" << std::endl;
+			return 1;
+		}
+	}
+
+	Manifest manifest;
+	if (!readManifest(manifestPath, manifest))
+	{
+		return 1;
+	}
+
+	xt::Size size{ textureSize, textureSize };
+	std::vector<BakeImageData> textures;
+	for (unsigned i = 0; i < textureCount; i++)
+	{
+		textures.push_back(BakeImageData(size));
+	}
+
+	Text::Manager manager({ size }, std::move(textures));
+
+	std::vector<std::unique_ptr<Text::Font>> fonts;
+	for (auto &path : manifest.fonts)
+	{
+		fonts.emplace_back(new Text::Font(manager.loadFont(path)));
+		if (!fonts.back()->isLoaded())
+		{
+			return 1;
+		}
+	}
+
+	// Blocks keep their slots claimed until the atlas has been written
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> utf8;
+	std::vector<Text::Block> blocks;
+	xt::BakedAtlasWriter writer(size);
+	unsigned failures = 0;
+
+	for (unsigned font = 0; font < fonts.size(); font++)
+	{
+		for (auto fontSize : manifest.sizes)
+		{
+			Text::Style style{ fonts[font].get(), fontSize, { 0xffffffff } };
+			auto options = Text::Options::fromStyle(style);
+
+			for (auto &str : manifest.strings)
+			{
+				blocks.push_back(
+					Text::Block(manager, utf8.from_bytes(str), options));
+				auto &block = blocks.back();
+				if (!block.texture())
+				{
+					std::cout << "no room for '" << str << "' at size "
+						<< fontSize << std::endl;
+					failures++;
+					continue;
+				}
+
+				auto textureIndex = static_cast<unsigned>(
+					block.texture() - &manager.textures()[0]);
+				writer.add(
+					font,
+					fontSize,
+					str,
+					textureIndex,
+					block.slot().rect,
+					block.metrics());
+			}
+		}
+	}
+
+	std::vector<const uint8_t *> pixels;
+	for (auto &texture : manager.textures())
+	{
+		pixels.push_back(texture.imageData().bytes());
+	}
+
+	if (!writer.write(outputPath, pixels))
+	{
+		return 1;
+	}
+
+	std::cout << "baked " << blocks.size() - failures << " blocks into "
+		<< outputPath << std::endl;
+
+	return failures == 0 ? 0 : 1;
+}